@@ -20,12 +20,16 @@
 #include "mtmd.h"
 #include "mtmd-helper.h"
 #include "sqlite-ai.h"
-#include "fp16/fp16.h"
+#include "vector.h"
 
+#include <ctype.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifndef SQLITE_CORE
 SQLITE_EXTENSION_INIT1
@@ -46,6 +50,7 @@ SQLITE_EXTENSION_INIT1
 #define MAX_TOKEN_TEXT_LEN                      128     // according to ChatGPT 32 would be safe for all common tokenizers
 #define MIN_ALLOC_MESSAGES                      64
 #define MAX_LORAS                               64      // max 2 or 3 LoRa adapters are used (usually just one)
+#define MAX_PREFIX_NAME_LEN                     128
 #define KEY_MATCHES(k, klen, constant)          ((klen) == (int)strlen(constant) && strncasecmp((k), (constant), (klen)) == 0)
 
 #define LOG_TABLE_DECLARATION                   "CREATE TEMP TABLE IF NOT EXISTS ai_log (id INTEGER PRIMARY KEY, stamp DATETIME DEFAULT CURRENT_TIMESTAMP, type TEXT, message TEXT);"
@@ -78,6 +83,7 @@ SQLITE_EXTENSION_INIT1
 #define OPTION_KEY_OP_OFFLOAD                   "op_offload"
 #define OPTION_KEY_SWA_FULL                     "swa_full"
 #define OPTION_KEY_TYPE_KV_UNIFIED              "kv_unified"
+#define OPTION_KEY_CONTEXT_POOL                 "context_pool"
 
 #define OPTION_KEY_GENERATE_EMBEDDING           "generate_embedding"
 #define OPTION_KEY_NORMALIZE_EMBEDDING          "normalize_embedding"
@@ -85,6 +91,16 @@ SQLITE_EXTENSION_INIT1
 #define OPTION_KEY_MAX_TOKENS                   "max_tokens"
 #define OPTION_KEY_N_PREDICT                    "n_predict"
 #define OPTION_KEY_EMBEDDING_TYPE               "embedding_type"
+#define OPTION_KEY_PREFIX                       "prefix"
+#define OPTION_KEY_PREFIX_CACHE_SIZE            "prefix_cache_size"
+#define OPTION_KEY_SPECULATIVE                  "speculative"
+#define OPTION_KEY_EMBEDDING_CACHE              "embedding_cache"
+#define OPTION_KEY_EMBEDDING_CACHE_TABLE        "embedding_cache_table"
+#define OPTION_KEY_LOOKUP_DECODING              "lookup_decoding"
+#define OPTION_KEY_LONG_INPUT                   "long_input"
+#define OPTION_KEY_WINDOW_OVERLAP               "window_overlap"
+#define OPTION_KEY_EMBEDDING_WORKERS            "embedding_workers"
+#define OPTION_KEY_JOB_THREADS                  "job_threads"
 
 
 // MODEL OPTIONS
@@ -119,6 +135,20 @@ SQLITE_EXTENSION_INIT1
 #define AI_DEFAULT_CONTEXT_EMBEDDING_OPTIONS    "generate_embedding=1,normalize_embedding=1,pooling_type=mean"
 #define AI_DEFAULT_CONTEXT_CHAT_OPTIONS         ""
 #define AI_DEFAULT_CONTEXT_TEXTGEN_OPTIONS      ""
+#define AI_DEFAULT_EMBEDDING_N_SEQ_MAX          32
+#define AI_MAX_EMBEDDING_WORKERS                64
+#define AI_DEFAULT_JOB_THREADS                  1
+#define AI_MAX_JOB_THREADS                      64
+#define AI_EMBED_COLUMN_BATCH                   256     // rows embedded and written with a single transaction
+#define AI_EMBED_COLUMN_POLL_MS                 200
+#define AI_EMBED_COLUMN_RETRY_MS                5000
+#define AI_EMBED_COLUMN_CLAIM_TIMEOUT           600     // seconds after which a batch claimed by a worker that never finished it can be claimed again
+#define AI_DEFAULT_PREFIX_CACHE_SIZE            256     // MB
+#define AI_MAX_SPECULATIVE                      32
+#define AI_DEFAULT_LOOKUP_DRAFT                 8
+#define AI_LOOKUP_NGRAM_MIN                     1
+#define AI_LOOKUP_NGRAM_MAX                     4
+#define AI_EMBED_CACHE_KEY_SIZE                 16
 
 typedef enum {
     EMBEDDING_TYPE_F32 = 1,
@@ -133,10 +163,21 @@ typedef struct {
     uint32_t                    context_size;           // set both n_ctx and n_batch (CONTEXT)
     int                         n_predict;              // number of tokens to predict (SAMPLER)
     int32_t                     max_tokens;             // to control max allowed tokens to generate (to control user's input size) (CUSTOM)
+    char                        prefix[MAX_PREFIX_NAME_LEN];    // named prefix restored before the prompt, valid for a single llm_text_generate call (CUSTOM)
+    uint32_t                    prefix_cache_size;      // memory budget (in MB) of the named prefixes snapshots (CUSTOM)
+    int                         speculative;            // number of tokens proposed by the draft model at each step, 0 disables speculative decoding (CUSTOM)
+    bool                        lookup_decoding;        // propose the tokens that followed the last n-gram in the prompt or in the output (CUSTOM)
+    int                         context_pool;           // max idle contexts kept by the shared pool of the context options, 0 disables pooling (CONTEXT)
+    int                         job_threads;            // background threads started by the first llm_job_submit, 0 means AI_DEFAULT_JOB_THREADS (CUSTOM)
     struct {
         embedding_type          type;
         bool                    normalize;              // if true, embeddings are normalized
         bool                    json_output;            // if true, embedding result is converted to JSON
+        uint32_t                cache_size;             // max number of embeddings kept in memory by llm_embed_generate, 0 disables the cache
+        bool                    cache_table;            // if true, embeddings are also cached in the ai_embed_cache table
+        bool                    window;                 // if true, inputs longer than the context are embedded as overlapping windows instead of being truncated
+        int32_t                 window_overlap;         // tokens shared by consecutive windows, -1 means window size / 8
+        int                     workers;                // threads (each one with its own context) used by the batched embedding functions
     } embedding;
 } llm_options;
 
@@ -146,6 +187,53 @@ typedef struct {
     size_t capacity;
 } ai_messages;
 
+typedef struct {
+    char                        *name;
+    char                        *text;              // prefix text, prepended to the prompt
+    llama_token                 *tokens;            // tokens stored in the snapshot
+    int32_t                     ntokens;
+    uint8_t                     *state;             // KV state of sequence 0 (llama_state_seq_get_data)
+    size_t                      state_size;
+    uint64_t                    last_used;
+} ai_prefix;
+
+typedef struct {
+    uint8_t                     key[AI_EMBED_CACHE_KEY_SIZE];
+    void                        *embedding;
+    int                         size;
+    int32_t                     next;               // next entry in the same bucket (-1 if none)
+    int32_t                     lru_prev;           // more recently used entry (-1 if head)
+    int32_t                     lru_next;           // less recently used entry (-1 if tail)
+} ai_embed_cache_entry;
+
+typedef struct {
+    char                        uuid[UUID_STR_MAXLEN];
+    llama_seq_id                seq_id;             // sequence owned by the session in the shared context
+    struct llama_sampler        *sampler;           // cloned from the context sampler (independent state)
+    
+    ai_messages                 messages;
+    size_t                      n_messages;         // messages before the current turn (restored if the turn fails)
+    buffer_t                    formatted;
+    buffer_t                    response;
+    int32_t                     prev_len;
+    int32_t                     n_past;             // tokens stored in seq_id
+    
+    // scheduler state
+    llama_token                 *tokens;            // pending prompt tokens
+    int32_t                     ntokens;
+    int32_t                     capacity;
+    llama_token                 token_id;           // last sampled token, decoded by the next step
+    int32_t                     n_generated;
+    int32_t                     logits_index;       // index of the logits in the last decoded batch (-1 if none)
+    bool                        is_active;
+} ai_chat_session;
+
+typedef struct ai_context_pool ai_context_pool;
+typedef struct ai_embed_workers ai_embed_workers;
+typedef struct ai_jobs ai_jobs;
+typedef struct ai_embed_column_worker ai_embed_column_worker;
+typedef struct ai_topk_pool ai_topk_pool;
+
 typedef struct {
     // sqlite
     sqlite3                     *db;
@@ -154,10 +242,19 @@ typedef struct {
     
     // llama
     struct llama_model          *model;
+    uint64_t                    model_fingerprint;  // hash of the metadata and a sample of the content of the model file
     struct llama_context        *ctx;
+    ai_context_pool             *pool;              // with context_pool=N ctx is checked out of the pool only while in use
+    bool                        ctx_pinned;         // ctx keeps state (chat, LoRA adapters) and stays checked out until llm_context_free
+    struct llama_context_params ctx_params;         // parameters used to create ctx (and the contexts of the embedding workers)
+    ai_embed_workers            *embed_workers;
+    ai_jobs                     *jobs;              // background jobs submitted by llm_job_submit
+    ai_embed_column_worker      *embed_columns;     // columns kept in sync by ai_embed_column
+    ai_topk_pool                *topk_pool;         // scoring threads of ai_vector_topk
     struct llama_sampler        *sampler;
     struct llama_adapter_lora   *lora[MAX_LORAS];
     float                       lora_scale[MAX_LORAS];
+    uint64_t                    lora_fingerprint[MAX_LORAS];
     
     llm_options                 options;
     
@@ -167,6 +264,49 @@ typedef struct {
     // vision (mtmd)
     mtmd_context                *vision;
     
+    // text generation (tokens whose KV cells are stored in sequence 0, reused as common prefix by the next call)
+    struct {
+        llama_token             *tokens;
+        int32_t                 ntokens;
+        int32_t                 capacity;
+    } text;
+    
+    // draft model for speculative decoding (tokens mirror the KV cache of the draft context)
+    struct {
+        struct llama_model      *model;
+        struct llama_context    *ctx;
+        llama_token             *tokens;
+        int32_t                 ntokens;
+        int32_t                 capacity;
+    } draft;
+    
+    // named prefixes (KV state snapshots restored by llm_text_generate, evicted in LRU order)
+    struct {
+        ai_prefix               *items;
+        int                     count;
+        int                     capacity;
+        size_t                  size;               // total size of the snapshots
+        uint64_t                clock;
+    } prefixes;
+    
+    // embedding cache (in-memory tier, hash buckets chained by index plus a LRU list)
+    struct {
+        ai_embed_cache_entry    *entries;
+        int32_t                 *buckets;
+        int32_t                 capacity;
+        int32_t                 count;
+        int32_t                 nbuckets;
+        int32_t                 head;               // most recently used entry
+        int32_t                 tail;               // least recently used entry
+    } embed_cache;
+    
+    // chat sessions (one sequence each, decoded together by llm_chat_sessions_run)
+    struct {
+        ai_chat_session         **items;
+        int                     count;
+        int                     capacity;
+    } sessions;
+    
     // chat
     struct {
         char                    uuid[UUID_STR_MAXLEN];
@@ -178,10 +318,19 @@ typedef struct {
         buffer_t                response;
         char                    *prompt;
         int32_t                 prev_len;
+        int32_t                 n_past;             // tokens of the conversation stored in sequence 0
         llama_token             *tokens;
         int32_t                 ntokens;
         llama_batch             batch;
         
+        // speculative decoding: tokens stored in sequence 0 (synced into the draft context) and tokens already verified
+        llama_token             *history;
+        int32_t                 nhistory;
+        int32_t                 history_capacity;
+        llama_token             queue[AI_MAX_SPECULATIVE + 1];
+        int32_t                 queue_count;
+        int32_t                 queue_index;
+        
         llama_token             token_id;
         char                    token_text[MAX_TOKEN_TEXT_LEN];
         int32_t                 token_len;
@@ -225,6 +374,16 @@ static void llm_text_run_vision(sqlite3_context *context, const char *text, int3
                                 sqlite3_value **images, int n_images);
 static void llm_chat_respond_vision(sqlite3_context *context, ai_context *ai,
                                     const char *user_prompt, sqlite3_value **images, int n_images);
+static void llm_prefix_cache_clear (ai_context *ai);
+static void llm_chat_sessions_clear (ai_context *ai);
+static void llm_draft_free (ai_context *ai);
+static void llm_embed_cache_clear (ai_context *ai);
+static void llm_embed_workers_free (ai_context *ai);
+static void llm_jobs_free (ai_context *ai);
+static void ai_embed_columns_free (ai_context *ai);
+static void ai_topk_pool_free (ai_context *ai);
+static void llm_context_checkin (ai_context *ai);
+static uint64_t llm_hash_fnv1a (uint64_t hash, const void *data, size_t len);
 
 const char *ROLE_SYSTEM    = "system";
 const char *ROLE_USER       = "user";
@@ -245,93 +404,6 @@ static bool role_is_static (const char *role) {
 
 void ai_logger (enum ggml_log_level level, const char *text, void *user_data);
 
-// MARK: - NUMERICS -
-// typedef uint16_t bfloat16_t;    // don't typedef to bfloat16_t to avoid mix with <arm_neon.h>’s native bfloat16_t
-
-// float <-> uint32_t bit casts
-static inline uint32_t f32_to_bits (float f) {
-    #if defined(HAVE_BUILTIN_BIT_CAST)
-    return __builtin_bit_cast(uint32_t, f);
-    #else
-    union { float f; uint32_t u; } v = { .f = f };
-    return v.u;
-    #endif
-}
-
-static inline float bits_to_f32 (uint32_t u) {
-    #if defined(HAVE_BUILTIN_BIT_CAST)
-    return __builtin_bit_cast(float, u);
-    #else
-    union { uint32_t u; float f; } v = { .u = u };
-    return v.f;
-    #endif
-}
-
-#if 0
-// bfloat16 (stored as uint16_t) -> float32, and back (RNE)
-static inline bool bfloat16_is_nan (uint16_t h) {      /* exp==0xFF && frac!=0 */
-    return ((h & 0x7F80u) == 0x7F80u) && ((h & 0x007Fu) != 0);
-}
-static inline bool bfloat16_is_inf (uint16_t h) {      /* exp==0xFF && frac==0 */
-    return ((h & 0x7F80u) == 0x7F80u) && ((h & 0x007Fu) == 0);
-}
-static inline bool bfloat16_is_zero (uint16_t h) {     /* ±0 */
-    return (h & 0x7FFFu) == 0;
-}
-static inline int bfloat16_sign (uint16_t h) {
-    return (h >> 15) & 1;
-}
-#endif
-
-static inline float bfloat16_to_float32 (uint16_t bf) {
-    return bits_to_f32((uint32_t)bf << 16);
-}
-static inline uint16_t float32_to_bfloat16 (float f) {
-    uint32_t x = f32_to_bits(f);
-    uint32_t lsb = (x >> 16) & 1u;      /* ties-to-even */
-    uint32_t rnd = 0x7FFFu + lsb;
-    return (uint16_t)((x + rnd) >> 16);
-}
-
-#if 0
-// ---- float16 (binary16) classifiers (work on raw uint16_t bits)
-static inline bool f16_is_nan (uint16_t h) {      /* exp==0x1F && frac!=0 */
-    return ( (h & 0x7C00u) == 0x7C00u ) && ((h & 0x03FFu) != 0);
-}
-static inline bool f16_is_inf (uint16_t h) {      /* exp==0x1F && frac==0 */
-    return ( (h & 0x7C00u) == 0x7C00u ) && ((h & 0x03FFu) == 0);
-}
-static inline int  f16_sign (uint16_t h) {
-    return (h >> 15) & 1;
-}
-static inline bool f16_is_zero (uint16_t h) {     /* ±0 */
-    return (h & 0x7FFFu) == 0;
-}
-#endif
-
-static inline uint16_t float32_to_float16 (float f) {
-    return fp16_ieee_from_fp32_value(f);
-}
-static inline float float16_to_float32 (uint16_t h) {
-    return fp16_ieee_to_fp32_value(h);
-}
-
-static inline uint8_t sat_u8_from_f32 (float x) {
-    if (!isfinite(x)) return x > 0 ? 255 : 0;
-    long v = lrintf(x);                   // round to nearest, ties-to-even
-    if (v < 0)   return 0;
-    if (v > 255) return 255;
-    return (uint8_t)v;
-}
-
-static inline int8_t sat_i8_from_f32 (float x) {
-    if (!isfinite(x)) return x > 0 ? 127 : -128;
-    long v = lrintf(x);
-    if (v < -128) return -128;
-    if (v > 127)  return 127;
-    return (int8_t)v;
-}
-
 static size_t embedding_type_to_size (embedding_type type) {
     switch (type) {
         case EMBEDDING_TYPE_F32: return sizeof(float);
@@ -369,7 +441,9 @@ static void llm_options_init (llm_options *options) {
     memset(options, 0, sizeof(llm_options));
     
     options->embedding.normalize = true;
+    options->embedding.window_overlap = -1;
     options->max_tokens = 0;    // no limits
+    options->prefix_cache_size = AI_DEFAULT_PREFIX_CACHE_SIZE;
     options->log_info = false;  // disable INFO messages logging
 }
 
@@ -488,6 +562,65 @@ static bool llm_context_options_callback (void *ctx, void *xdata, const char *ke
         return true;
     }
     
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_PREFIX)) {
+        snprintf(ai->options.prefix, sizeof(ai->options.prefix), "%s", buffer);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_PREFIX_CACHE_SIZE)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        if (value >= 0) ai->options.prefix_cache_size = (uint32_t)value;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_SPECULATIVE)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        if (value >= 0) ai->options.speculative = (value > AI_MAX_SPECULATIVE) ? AI_MAX_SPECULATIVE : value;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EMBEDDING_CACHE)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        if (value >= 0) ai->options.embedding.cache_size = (uint32_t)value;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EMBEDDING_CACHE_TABLE)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        ai->options.embedding.cache_table = (value != 0);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_LOOKUP_DECODING)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        ai->options.lookup_decoding = (value != 0);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_LONG_INPUT)) {
+        if (strcasecmp(buffer, "window") == 0) ai->options.embedding.window = true;
+        else if (strcasecmp(buffer, "truncate") == 0) ai->options.embedding.window = false;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_WINDOW_OVERLAP)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        if (value >= 0) ai->options.embedding.window_overlap = value;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_JOB_THREADS)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        if (value >= 0) ai->options.job_threads = (value > AI_MAX_JOB_THREADS) ? AI_MAX_JOB_THREADS : value;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EMBEDDING_WORKERS)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        if (value >= 0) ai->options.embedding.workers = (value > AI_MAX_EMBEDDING_WORKERS) ? AI_MAX_EMBEDDING_WORKERS : value;
+        return true;
+    }
+    
     // CONTEXT OPTIONS
     if (options == NULL) {
         char warn_buf[512];
@@ -555,7 +688,9 @@ static bool llm_context_options_callback (void *ctx, void *xdata, const char *ke
     
     if (KEY_MATCHES(key, key_len, OPTION_KEY_POOLING_TYPE)) {
         // pooling_type mean is not supported and so in this version we forced it to be really mean so ONE EMBEDDING will be generated
+        // token keeps the embeddings of every token (late chunking)
         if (strcasecmp(buffer, "none") == 0) options->pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        else if (strcasecmp(buffer, "token") == 0) options->pooling_type = LLAMA_POOLING_TYPE_NONE;
         else if (strcasecmp(buffer, "unspecified") == 0) options->pooling_type = LLAMA_POOLING_TYPE_MEAN;
         else if (strcasecmp(buffer, "mean") == 0) options->pooling_type = LLAMA_POOLING_TYPE_MEAN;
         else if (strcasecmp(buffer, "cls") == 0) options->pooling_type = LLAMA_POOLING_TYPE_CLS;
@@ -671,6 +806,12 @@ static bool llm_context_options_callback (void *ctx, void *xdata, const char *ke
         return true;
     }
     
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_CONTEXT_POOL)) {
+        int value = (int)strtol(buffer, NULL, 0);
+        if (value >= 0) ai->options.context_pool = value;
+        return true;
+    }
+    
     // means ignore unknown keys
     return true;
 }
@@ -688,11 +829,12 @@ struct llama_sampler *llm_sampler_check (ai_context *ai) {
     return sampler;
 }
 
-static int llm_lora_push (ai_context *ai, struct llama_adapter_lora *lora, float scale) {
+static int llm_lora_push (ai_context *ai, struct llama_adapter_lora *lora, float scale, uint64_t fingerprint) {
     for (int i=0; i<MAX_LORAS; ++i) {
         if (ai->lora[i] == NULL) {
             ai->lora[i] = lora;
             ai->lora_scale[i] = scale;
+            ai->lora_fingerprint[i] = fingerprint;
             return i;
         }
     }
@@ -805,6 +947,304 @@ static bool whisper_full_params_options_callback (void *ctx, void *xdata, const
     return true;
 }
 
+// MARK: - Shared Models -
+
+// models are shared by all the connections of the process: entries are keyed by path and model options and reference counted,
+// so a pool of connections loading the same file holds a single copy of the weights and pays a single load
+
+typedef struct ai_shared_model {
+    char                        *key;
+    struct llama_model          *model;
+    uint64_t                    fingerprint;        // computed once by the connection loading the weights
+    int                         refcount;
+    bool                        loading;            // the first caller is loading the weights, the others wait for it
+    struct ai_shared_model      *next;
+} ai_shared_model;
+
+static pthread_mutex_t ai_shared_models_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ai_shared_models_loaded = PTHREAD_COND_INITIALIZER;
+static ai_shared_model *ai_shared_models = NULL;
+
+static void llm_shared_model_unlink (ai_shared_model *entry) {
+    for (ai_shared_model **prev = &ai_shared_models; *prev; prev = &(*prev)->next) {
+        if (*prev != entry) continue;
+        *prev = entry->next;
+        break;
+    }
+}
+
+#define AI_FINGERPRINT_HEADER_SIZE              (64*1024)
+#define AI_FINGERPRINT_SAMPLES                  16
+#define AI_FINGERPRINT_SAMPLE_SIZE              4096
+
+// size, header and evenly spaced blocks of a file: files with the same name and metadata (fine-tunes, re-quantizations,
+// adapters) differ in their tensors, and a few samples are read instead of the whole file
+static uint64_t llm_file_fingerprint (const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    FILE *f = fopen(path, "rb");
+    if (!f) return hash;
+    
+    uint8_t *buffer = (uint8_t *)sqlite3_malloc(AI_FINGERPRINT_HEADER_SIZE);
+    long long size = (fseek(f, 0, SEEK_END) == 0) ? (long long)ftell(f) : -1;
+    hash = llm_hash_fnv1a(hash, &size, sizeof(size));
+    if (buffer && size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        size_t n = fread(buffer, 1, AI_FINGERPRINT_HEADER_SIZE, f);
+        hash = llm_hash_fnv1a(hash, buffer, n);
+        for (int i = 1; i <= AI_FINGERPRINT_SAMPLES && size > AI_FINGERPRINT_HEADER_SIZE; ++i) {
+            long offset = (long)((size - AI_FINGERPRINT_SAMPLE_SIZE) / AI_FINGERPRINT_SAMPLES * i);
+            if (fseek(f, offset, SEEK_SET) != 0) break;
+            n = fread(buffer, 1, AI_FINGERPRINT_SAMPLE_SIZE, f);
+            hash = llm_hash_fnv1a(hash, buffer, n);
+        }
+    }
+    if (buffer) sqlite3_free(buffer);
+    fclose(f);
+    return hash;
+}
+
+// GGUF metadata (general.name, architecture, tokenizer, quantization) and content of the model file
+static uint64_t llm_model_fingerprint (struct llama_model *model, const char *path) {
+    uint64_t hash = llm_file_fingerprint(path);
+    char key[256];
+    char small[256];
+    int32_t count = llama_model_meta_count(model);
+    for (int32_t i = 0; i < count; ++i) {
+        int32_t len = llama_model_meta_key_by_index(model, i, key, sizeof(key));
+        if (len < 0) continue;
+        hash = llm_hash_fnv1a(hash, key, strlen(key) + 1);
+        
+        // values longer than the stack buffer (tokenizer arrays) are read into a temporary allocation
+        char *value = small;
+        len = llama_model_meta_val_str_by_index(model, i, small, sizeof(small));
+        if (len >= (int32_t)sizeof(small)) {
+            value = (char *)sqlite3_malloc(len + 1);
+            if (value && llama_model_meta_val_str_by_index(model, i, value, (size_t)len + 1) < 0) value[0] = 0;
+        }
+        if (len >= 0 && value) hash = llm_hash_fnv1a(hash, value, strlen(value) + 1);
+        if (value && value != small) sqlite3_free(value);
+    }
+    return hash;
+}
+
+// returns the model loaded from path with params, loading it only if no connection is already using it
+// (entries are keyed by the canonical path, so relative paths and symbolic links to the same file share the weights)
+static struct llama_model *llm_model_acquire (const char *path, const struct llama_model_params *params, uint64_t *fingerprint) {
+    char *canonical = ai_path_canonical(path);
+    char *key = sqlite3_mprintf("%s;%d;%d;%d;%d;%d;%d;%d", (canonical) ? canonical : path, params->n_gpu_layers, params->main_gpu, (int)params->split_mode, (int)params->vocab_only, (int)params->use_mmap, (int)params->use_mlock, (int)params->check_tensors);
+    sqlite3_free(canonical);
+    if (!key) return NULL;
+    
+    pthread_mutex_lock(&ai_shared_models_mutex);
+    ai_shared_model *entry = ai_shared_models;
+    while (entry && strcmp(entry->key, key) != 0) entry = entry->next;
+    
+    // concurrent loads of the same model wait for the first one
+    if (entry) {
+        sqlite3_free(key);
+        entry->refcount++;
+        while (entry->loading) pthread_cond_wait(&ai_shared_models_loaded, &ai_shared_models_mutex);
+        struct llama_model *model = entry->model;
+        if (model && fingerprint) *fingerprint = entry->fingerprint;
+        if (!model && --entry->refcount == 0) {
+            // the load failed and the entry is already out of the list
+            sqlite3_free(entry->key);
+            sqlite3_free(entry);
+        }
+        pthread_mutex_unlock(&ai_shared_models_mutex);
+        return model;
+    }
+    
+    entry = (ai_shared_model *)sqlite3_malloc(sizeof(ai_shared_model));
+    if (!entry) {
+        pthread_mutex_unlock(&ai_shared_models_mutex);
+        sqlite3_free(key);
+        return NULL;
+    }
+    *entry = (ai_shared_model){.key = key, .refcount = 1, .loading = true, .next = ai_shared_models};
+    ai_shared_models = entry;
+    pthread_mutex_unlock(&ai_shared_models_mutex);
+    
+    // the weights are read without holding the lock, so loading or releasing other models isn't blocked meanwhile
+    struct llama_model *model = llama_model_load_from_file(path, *params);
+    uint64_t hash = (model) ? llm_model_fingerprint(model, path) : 0;
+    if (fingerprint) *fingerprint = hash;
+    
+    pthread_mutex_lock(&ai_shared_models_mutex);
+    entry->model = model;
+    entry->fingerprint = hash;
+    entry->loading = false;
+    if (!model) {
+        // later calls try to load the model again, the waiters release the failed entry
+        llm_shared_model_unlink(entry);
+        if (--entry->refcount == 0) {
+            sqlite3_free(entry->key);
+            sqlite3_free(entry);
+        }
+    }
+    pthread_cond_broadcast(&ai_shared_models_loaded);
+    pthread_mutex_unlock(&ai_shared_models_mutex);
+    return model;
+}
+
+static void llm_model_retain (struct llama_model *model) {
+    pthread_mutex_lock(&ai_shared_models_mutex);
+    for (ai_shared_model *entry = ai_shared_models; entry; entry = entry->next) {
+        if (entry->model == model) {
+            entry->refcount++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ai_shared_models_mutex);
+}
+
+// the model is freed when the last connection using it releases it
+static void llm_model_release (struct llama_model *model) {
+    if (!model) return;
+    
+    ai_shared_model *released = NULL;
+    pthread_mutex_lock(&ai_shared_models_mutex);
+    for (ai_shared_model *entry = ai_shared_models; entry; entry = entry->next) {
+        if (entry->model != model) continue;
+        if (--entry->refcount == 0) {
+            llm_shared_model_unlink(entry);
+            released = entry;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&ai_shared_models_mutex);
+    
+    // the weights are freed outside the lock as well
+    if (released) {
+        llama_model_free(released->model);
+        sqlite3_free(released->key);
+        sqlite3_free(released);
+    }
+}
+
+// MARK: - Context Pool -
+
+// contexts created with context_pool=N are shared by all the connections using the same model and context options:
+// a connection checks a context out only for the duration of a call and returns it afterwards, so idle connections hold no
+// KV cache or compute buffers and the number of live contexts follows the number of concurrent calls (at most N are kept idle)
+
+struct ai_context_pool {
+    char                        *key;
+    struct llama_model          *model;             // the pool holds its own reference to the shared model
+    struct llama_context_params params;
+    struct llama_context        **idle;
+    int                         n_idle;
+    int                         capacity;
+    int                         max_idle;
+    int                         refcount;
+    struct ai_context_pool      *next;
+};
+
+static pthread_mutex_t ai_context_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ai_context_pool *ai_context_pools = NULL;
+
+static ai_context_pool *llm_context_pool_acquire (struct llama_model *model, const struct llama_context_params *params, int max_idle) {
+    const struct llama_context_params *p = params;
+    char *key = sqlite3_mprintf("%p;%u;%u;%u;%u;%d;%d;%d;%d;%d;%d;%g;%g;%g;%g;%g;%g;%g;%u;%d;%d;%d;%d;%d;%d;%d", (void *)model, p->n_ctx, p->n_batch, p->n_ubatch, p->n_seq_max, p->n_threads, p->n_threads_batch, (int)p->pooling_type, (int)p->attention_type, (int)p->rope_scaling_type, (int)p->flash_attn_type, p->rope_freq_base, p->rope_freq_scale, p->yarn_ext_factor, p->yarn_attn_factor, p->yarn_beta_fast, p->yarn_beta_slow, p->defrag_thold, p->yarn_orig_ctx, (int)p->offload_kqv, (int)p->op_offload, (int)p->swa_full, (int)p->type_k, (int)p->type_v, (int)p->kv_unified, (int)p->embeddings);
+    if (!key) return NULL;
+    
+    pthread_mutex_lock(&ai_context_pools_mutex);
+    ai_context_pool *pool = ai_context_pools;
+    while (pool && strcmp(pool->key, key) != 0) pool = pool->next;
+    
+    if (pool) {
+        pool->refcount++;
+        if (max_idle > pool->max_idle) pool->max_idle = max_idle;
+        sqlite3_free(key);
+    } else {
+        pool = (ai_context_pool *)sqlite3_malloc(sizeof(ai_context_pool));
+        if (pool) {
+            memset(pool, 0, sizeof(ai_context_pool));
+            pool->key = key;
+            pool->model = model;
+            pool->params = *params;
+            pool->max_idle = max_idle;
+            pool->refcount = 1;
+            pool->next = ai_context_pools;
+            ai_context_pools = pool;
+            llm_model_retain(model);
+        } else {
+            sqlite3_free(key);
+        }
+    }
+    pthread_mutex_unlock(&ai_context_pools_mutex);
+    return pool;
+}
+
+static void llm_context_pool_release (ai_context_pool *pool) {
+    if (!pool) return;
+    
+    pthread_mutex_lock(&ai_context_pools_mutex);
+    bool destroy = (--pool->refcount == 0);
+    if (destroy) {
+        ai_context_pool **prev = &ai_context_pools;
+        while (*prev != pool) prev = &(*prev)->next;
+        *prev = pool->next;
+    }
+    pthread_mutex_unlock(&ai_context_pools_mutex);
+    if (!destroy) return;
+    
+    for (int i = 0; i < pool->n_idle; ++i) llama_free(pool->idle[i]);
+    llm_model_release(pool->model);
+    sqlite3_free(pool->idle);
+    sqlite3_free(pool->key);
+    sqlite3_free(pool);
+}
+
+// an idle context of the pool, or a new one when all of them are in use (contexts are created outside the lock)
+static struct llama_context *llm_context_pool_get (ai_context_pool *pool) {
+    struct llama_context *ctx = NULL;
+    pthread_mutex_lock(&ai_context_pools_mutex);
+    if (pool->n_idle > 0) ctx = pool->idle[--pool->n_idle];
+    pthread_mutex_unlock(&ai_context_pools_mutex);
+    
+    if (!ctx) ctx = llama_init_from_model(pool->model, pool->params);
+    return ctx;
+}
+
+// contexts are returned empty, the ones exceeding max_idle are freed
+static void llm_context_pool_put (ai_context_pool *pool, struct llama_context *ctx) {
+    llama_set_adapters_lora(ctx, NULL, 0, NULL);
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (memory) llama_memory_clear(memory, true);
+    
+    pthread_mutex_lock(&ai_context_pools_mutex);
+    if (pool->n_idle < pool->max_idle) {
+        if (pool->n_idle == pool->capacity) {
+            int capacity = (pool->capacity) ? pool->capacity * 2 : 4;
+            struct llama_context **idle = (struct llama_context **)sqlite3_realloc64(pool->idle, capacity * sizeof(struct llama_context *));
+            if (idle) {
+                pool->idle = idle;
+                pool->capacity = capacity;
+            }
+        }
+        if (pool->n_idle < pool->capacity) {
+            pool->idle[pool->n_idle++] = ctx;
+            ctx = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ai_context_pools_mutex);
+    
+    if (ctx) llama_free(ctx);
+}
+
+// a pooled context is returned to its pool (pinned or not), the others are freed
+static void llm_context_release (ai_context *ai) {
+    llm_embed_workers_free(ai);
+    if (ai->ctx) {
+        if (ai->pool) llm_context_pool_put(ai->pool, ai->ctx);
+        else llama_free(ai->ctx);
+    }
+    ai->ctx = NULL;
+    ai->ctx_pinned = false;
+    llm_context_pool_release(ai->pool);
+    ai->pool = NULL;
+}
+
 // MARK: -
 
 void *ai_create (sqlite3 *db) {
@@ -824,6 +1264,9 @@ static void ai_free (void *ctx, bool free_ai, bool free_llm, bool free_audio) {
     // disable logger first
     if (free_ai) {
         ai->db = NULL;
+        llm_jobs_free(ai);
+        ai_embed_columns_free(ai);
+        ai_topk_pool_free(ai);
         free_llm = true;
         free_audio = true;
     }
@@ -831,16 +1274,28 @@ static void ai_free (void *ctx, bool free_ai, bool free_llm, bool free_audio) {
     if (free_llm) {
         if (ai->vision) mtmd_free(ai->vision);
         ai->vision = NULL;
+        llm_chat_sessions_clear(ai);
+        if (ai->ctx) llama_set_adapters_lora(ai->ctx, NULL, 0, NULL);
+        llm_context_release(ai);
+        // the model can still be used by other connections, so the adapters loaded by this one are freed explicitly
+        for (int i = 0; i < MAX_LORAS; ++i) {
+            if (ai->lora[i]) llama_adapter_lora_free(ai->lora[i]);
+        }
         memset(ai->lora, 0, sizeof(struct llama_adapter_lora *)*MAX_LORAS);
         memset(ai->lora_scale, 0, sizeof(float)*MAX_LORAS);
-        if (ai->ctx) llama_set_adapters_lora(ai->ctx, NULL, 0, NULL);
-        if (ai->ctx) llama_free(ai->ctx);
-        if (ai->model) llama_model_free(ai->model);
+        memset(ai->lora_fingerprint, 0, sizeof(uint64_t)*MAX_LORAS);
+        llm_model_release(ai->model);
+        llm_draft_free(ai);
+        if (ai->text.tokens) sqlite3_free(ai->text.tokens);
+        memset(&ai->text, 0, sizeof(ai->text));
+        llm_prefix_cache_clear(ai);
+        llm_embed_cache_clear(ai);
         // sampler chain is freed explicitly via llm_sampler_free() or llm_sampler_create() SQL functions;
         // freeing it here causes a double-free crash when ai_destroy runs after explicit cleanup
         llm_options_init(&ai->options);
         
         ai->model = NULL;
+        ai->model_fingerprint = 0;
         ai->ctx = NULL;
         ai->sampler = NULL;
     }
@@ -908,6 +1363,14 @@ static bool llm_common_args_check (sqlite3_context *context, const char *functio
     return sqlite_context_result_error(context, SQLITE_ERROR, "Function '%s' expects 1 or 2 arguments, but %d were provided.", function_name, argc);
 }
 
+// functions that keep state in the context (chat, sessions, LoRA adapters) keep a pooled context checked out until
+// llm_context_free, while the stateless ones use llm_context_checkout for a single call
+static bool llm_context_pin (ai_context *ai) {
+    if (ai && !ai->ctx && ai->pool) ai->ctx = llm_context_pool_get(ai->pool);
+    if (ai && ai->ctx && ai->pool) ai->ctx_pinned = true;
+    return (ai && ai->ctx);
+}
+
 static bool llm_check_context (sqlite3_context *context) {
     ai_context *ai = (ai_context *)sqlite3_user_data(context);
     if (!ai || !ai->ctx) {
@@ -917,6 +1380,119 @@ static bool llm_check_context (sqlite3_context *context) {
     return true;
 }
 
+static bool llm_check_context_pinned (sqlite3_context *context) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!llm_context_pin(ai)) {
+        return sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create() before using this function.");
+    }
+    
+    return true;
+}
+
+// the table-valued functions check a pooled context out only while they use it: *checked_out tells if it must be
+// returned with llm_context_cursor_checkin (when the rows are computed, or when the cursor is reset for the lazy ones)
+static bool llm_context_cursor_checkout (ai_context *ai, bool *checked_out) {
+    *checked_out = false;
+    if (!ai->ctx && ai->pool) {
+        ai->ctx = llm_context_pool_get(ai->pool);
+        *checked_out = (ai->ctx != NULL);
+    }
+    return (ai->ctx != NULL);
+}
+
+// a context pinned meanwhile (a chat started while the cursor was open) stays with the connection
+static void llm_context_cursor_checkin (ai_context *ai, bool *checked_out) {
+    if (*checked_out && !ai->ctx_pinned) llm_context_checkin(ai);
+    *checked_out = false;
+}
+
+// model architecture, size, file fingerprint and the applied LoRA adapters with their scales
+// (KV state snapshots and cached embeddings are valid only for the same model and adapters)
+static void llm_model_identity (ai_context *ai, char *buffer, size_t size) {
+    char desc[256];
+    if (llama_model_desc(ai->model, desc, sizeof(desc)) < 0) desc[0] = 0;
+    int len = snprintf(buffer, size, "%s;%llu;%llu;%016llx", desc, (unsigned long long)llama_model_n_params(ai->model), (unsigned long long)llama_model_size(ai->model), (unsigned long long)ai->model_fingerprint);
+    for (int i = 0; i < MAX_LORAS && len >= 0 && (size_t)len < size; ++i) {
+        if (ai->lora[i] == NULL || ai->lora_scale[i] == 0.0) continue;
+        len += snprintf(buffer + len, size - (size_t)len, ";%016llx*%g", (unsigned long long)ai->lora_fingerprint[i], (double)ai->lora_scale[i]);
+    }
+}
+
+static bool llm_lora_active (ai_context *ai) {
+    for (int i = 0; i < MAX_LORAS; ++i) {
+        if (ai->lora[i]) return true;
+    }
+    return false;
+}
+
+// the adapters of the connection with a non zero scale are applied to ctx (the connection context or a worker context)
+static void llm_lora_apply (ai_context *ai, struct llama_context *ctx) {
+    struct llama_adapter_lora *adapters[MAX_LORAS];
+    float scales[MAX_LORAS];
+    size_t n = 0;
+    for (int i=0; i<MAX_LORAS; ++i) {
+        if (ai->lora[i] && ai->lora_scale[i] != 0.0) {
+            adapters[n] = ai->lora[i];
+            scales[n] = ai->lora_scale[i];
+            n++;
+        }
+    }
+    llama_set_adapters_lora(ctx, adapters, n, scales);
+}
+
+// options passed as a constant argument are parsed once per statement: the options produced by the first parse
+// are kept as auxdata of the argument and applied again when a later row starts from the same options
+typedef struct {
+    llm_options                 before;
+    llm_options                 after;
+} llm_options_memo;
+
+// field by field, the padding bytes of llm_options are not guaranteed to be equal (must be updated when a field is added)
+static bool llm_options_equal (const llm_options *a, const llm_options *b) {
+    return (a->log_info == b->log_info &&
+            a->context_size == b->context_size &&
+            a->n_predict == b->n_predict &&
+            a->max_tokens == b->max_tokens &&
+            strcmp(a->prefix, b->prefix) == 0 &&
+            a->prefix_cache_size == b->prefix_cache_size &&
+            a->speculative == b->speculative &&
+            a->lookup_decoding == b->lookup_decoding &&
+            a->context_pool == b->context_pool &&
+            a->job_threads == b->job_threads &&
+            a->embedding.type == b->embedding.type &&
+            a->embedding.normalize == b->embedding.normalize &&
+            a->embedding.json_output == b->embedding.json_output &&
+            a->embedding.cache_size == b->embedding.cache_size &&
+            a->embedding.cache_table == b->embedding.cache_table &&
+            a->embedding.window == b->embedding.window &&
+            a->embedding.window_overlap == b->embedding.window_overlap &&
+            a->embedding.workers == b->embedding.workers);
+}
+
+static bool llm_context_options_parse (sqlite3_context *context, ai_context *ai, int arg_index, const char *options) {
+    if (!options) return true;
+    
+    llm_options_memo *memo = (llm_options_memo *)sqlite3_get_auxdata(context, arg_index);
+    if (memo && llm_options_equal(&memo->before, &ai->options)) {
+        memcpy(&ai->options, &memo->after, sizeof(llm_options));
+        return true;
+    }
+    
+    llm_options before;
+    memcpy(&before, &ai->options, sizeof(llm_options));
+    
+    // passing NULL as xdata because context has been already created
+    if (parse_keyvalue_string(ai, options, llm_context_options_callback, NULL) == false) return false;
+    
+    memo = (llm_options_memo *)sqlite3_malloc(sizeof(llm_options_memo));
+    if (memo) {
+        memcpy(&memo->before, &before, sizeof(llm_options));
+        memcpy(&memo->after, &ai->options, sizeof(llm_options));
+        sqlite3_set_auxdata(context, arg_index, memo, sqlite3_free);
+    }
+    return true;
+}
+
 // MARK: - Chat Messages -
 
 bool llm_messages_append (ai_messages *list, const char *role, const char *content) {
@@ -981,21 +1557,20 @@ void llm_messages_free (ai_messages *list) {
     list->capacity = 0;
 }
 
+// drop the messages after the first count ones
+static void llm_messages_truncate (ai_messages *list, size_t count) {
+    while (list->count > count) {
+        llama_chat_message *item = &list->items[--list->count];
+        if (!role_is_static(item->role)) sqlite3_free((char *)item->role);
+        sqlite3_free((char *)item->content);
+    }
+}
+
 // MARK: - Text Embedding and Normalization -
 
 static inline float llm_common_f32_sum (const float *src, int dim) {
-    float sum = 0.0f;
-    
-    // compute L2 norm squared (loop unrolled by 4)
-    int i = 0;
-    for (; i + 3 < dim; i += 4) {
-        sum += src[i] * src[i] + src[i + 1] * src[i + 1] + src[i + 2] * src[i + 2] + src[i + 3] * src[i + 3];
-    }
-    for (; i < dim; ++i) {
-        sum += src[i] * src[i];
-    }
-    
-    return sum;
+    // compute L2 norm squared
+    return vector_f32_sumsq(src, dim);
 }
 
 static int llm_embed_normalize_f32 (const float *src, float *dest, int dim) {
@@ -1003,17 +1578,7 @@ static int llm_embed_normalize_f32 (const float *src, float *dest, int dim) {
     
     float norm = sqrtf(sum);
     if (norm > 0.0f) {
-        float inv = 1.0f / norm;
-        int i = 0;
-        for (; i + 3 < dim; i += 4) {
-            dest[i]     = src[i]     * inv;
-            dest[i + 1] = src[i + 1] * inv;
-            dest[i + 2] = src[i + 2] * inv;
-            dest[i + 3] = src[i + 3] * inv;
-        }
-        for (; i < dim; ++i) {
-            dest[i] = src[i] * inv;
-        }
+        vector_f32_scale(src, dest, dim, 1.0f / norm);
     } else {
         // if norm is zero, copy zeros
         for (int j = 0; j < dim; ++j) {
@@ -1028,17 +1593,7 @@ static int llm_embed_normalize_f16 (const float *src, uint16_t *dest, int dim) {
     float sum = llm_common_f32_sum(src, dim);
 
     if (sum > 0.0f) {
-        float inv = 1.0f / sqrtf(sum);
-        int i = 0;
-        for (; i + 3 < dim; i += 4) {
-            dest[i]     = float32_to_float16(src[i]     * inv);
-            dest[i + 1] = float32_to_float16(src[i + 1] * inv);
-            dest[i + 2] = float32_to_float16(src[i + 2] * inv);
-            dest[i + 3] = float32_to_float16(src[i + 3] * inv);
-        }
-        for (; i < dim; ++i) {
-            dest[i] = float32_to_float16(src[i] * inv);
-        }
+        vector_f32_to_f16(src, dest, dim, 1.0f / sqrtf(sum));
     } else {
         for (int j = 0; j < dim; ++j) dest[j] = 0; // +0.0
     }
@@ -1049,17 +1604,7 @@ static int llm_embed_normalize_bf16 (const float *src, uint16_t *dest, int dim)
     float sum = llm_common_f32_sum(src, dim);
 
     if (sum > 0.0f) {
-        float inv = 1.0f / sqrtf(sum);
-        int i = 0;
-        for (; i + 3 < dim; i += 4) {
-            dest[i]     = float32_to_bfloat16(src[i]     * inv);
-            dest[i + 1] = float32_to_bfloat16(src[i + 1] * inv);
-            dest[i + 2] = float32_to_bfloat16(src[i + 2] * inv);
-            dest[i + 3] = float32_to_bfloat16(src[i + 3] * inv);
-        }
-        for (; i < dim; ++i) {
-            dest[i] = float32_to_bfloat16(src[i] * inv);
-        }
+        vector_f32_to_bf16(src, dest, dim, 1.0f / sqrtf(sum));
     } else {
         for (int j = 0; j < dim; ++j) dest[j] = 0; // +0.0
     }
@@ -1070,27 +1615,8 @@ static int llm_embed_normalize_i8 (const float *src, int8_t *dest, int dim) {
     float sum = llm_common_f32_sum(src, dim);
 
     if (sum > 0.0f) {
-        float inv = 1.0f / sqrtf(sum);
-        int i = 0;
-        for (; i + 3 < dim; i += 4) {
-            int q0 = (int)lrintf(src[i]     * inv * 127.0f);
-            int q1 = (int)lrintf(src[i + 1] * inv * 127.0f);
-            int q2 = (int)lrintf(src[i + 2] * inv * 127.0f);
-            int q3 = (int)lrintf(src[i + 3] * inv * 127.0f);
-            if (q0 > 127) q0 = 127; else if (q0 < -127) q0 = -127;
-            if (q1 > 127) q1 = 127; else if (q1 < -127) q1 = -127;
-            if (q2 > 127) q2 = 127; else if (q2 < -127) q2 = -127;
-            if (q3 > 127) q3 = 127; else if (q3 < -127) q3 = -127;
-            dest[i]     = (int8_t)q0;
-            dest[i + 1] = (int8_t)q1;
-            dest[i + 2] = (int8_t)q2;
-            dest[i + 3] = (int8_t)q3;
-        }
-        for (; i < dim; ++i) {
-            int q = (int)lrintf(src[i] * inv * 127.0f);
-            if (q > 127) q = 127; else if (q < -127) q = -127;
-            dest[i] = (int8_t)q;
-        }
+        // symmetric range [-127, 127]
+        vector_f32_to_i8(src, dest, dim, 1.0f / sqrtf(sum), 127.0f, 0.0f, -127.0f, 127.0f);
     } else {
         for (int j = 0; j < dim; ++j) dest[j] = 0;
     }
@@ -1101,27 +1627,8 @@ static int llm_embed_normalize_u8 (const float *src, uint8_t *dest, int dim) {
     float sum = llm_common_f32_sum(src, dim);
 
     if (sum > 0.0f) {
-        float inv = 1.0f / sqrtf(sum);
-        int i = 0;
-        for (; i + 3 < dim; i += 4) {
-            int q0 = (int)lrintf(src[i]     * inv * 127.0f + 128.0f);
-            int q1 = (int)lrintf(src[i + 1] * inv * 127.0f + 128.0f);
-            int q2 = (int)lrintf(src[i + 2] * inv * 127.0f + 128.0f);
-            int q3 = (int)lrintf(src[i + 3] * inv * 127.0f + 128.0f);
-            if (q0 < 0) q0 = 0; else if (q0 > 255) q0 = 255;
-            if (q1 < 0) q1 = 0; else if (q1 > 255) q1 = 255;
-            if (q2 < 0) q2 = 0; else if (q2 > 255) q2 = 255;
-            if (q3 < 0) q3 = 0; else if (q3 > 255) q3 = 255;
-            dest[i]     = (uint8_t)q0;
-            dest[i + 1] = (uint8_t)q1;
-            dest[i + 2] = (uint8_t)q2;
-            dest[i + 3] = (uint8_t)q3;
-        }
-        for (; i < dim; ++i) {
-            int q = (int)lrintf(src[i] * inv * 127.0f + 128.0f);
-            if (q < 0) q = 0; else if (q > 255) q = 255;
-            dest[i] = (uint8_t)q;
-        }
+        // [-1, 1] mapped to [1, 255] with zero-point at 128
+        vector_f32_to_u8(src, dest, dim, 1.0f / sqrtf(sum), 127.0f, 128.0f, 0.0f, 255.0f);
     } else {
         // represent zero as the zero-point
         for (int j = 0; j < dim; ++j) dest[j] = 128;
@@ -1147,57 +1654,23 @@ static int llm_embed_copy (const float *src, void *dest, embedding_type type, in
             memcpy(dest, src, bsize);
             break;
             
-        case EMBEDDING_TYPE_F16: {
-            uint16_t *buffer = (uint16_t *)dest;
-            int i = 0;
-            for (; i + 3 < dim; i += 4) {
-                buffer[i+0] = float32_to_float16(src[i+0]);
-                buffer[i+1] = float32_to_float16(src[i+1]);
-                buffer[i+2] = float32_to_float16(src[i+2]);
-                buffer[i+3] = float32_to_float16(src[i+3]);
-            }
-            for (; i < dim; ++i) buffer[i] = float32_to_float16(src[i]);
+        case EMBEDDING_TYPE_F16:
+            vector_f32_to_f16(src, (uint16_t *)dest, dim, 1.0f);
             break;
-        }
             
-        case EMBEDDING_TYPE_BF16: {
-            uint16_t *buffer = (uint16_t *)dest;
-            int i = 0;
-            for (; i + 3 < dim; i += 4) {
-                buffer[i+0] = float32_to_bfloat16(src[i+0]);
-                buffer[i+1] = float32_to_bfloat16(src[i+1]);
-                buffer[i+2] = float32_to_bfloat16(src[i+2]);
-                buffer[i+3] = float32_to_bfloat16(src[i+3]);
-            }
-            for (; i < dim; ++i) buffer[i] = float32_to_bfloat16(src[i]);
+        case EMBEDDING_TYPE_BF16:
+            vector_f32_to_bf16(src, (uint16_t *)dest, dim, 1.0f);
             break;
-        }
             
-        case EMBEDDING_TYPE_U8: {
-            uint8_t *buffer = (uint8_t *)dest;
-            int i = 0;
-            for (; i + 3 < dim; i += 4) {
-                buffer[i+0] = sat_u8_from_f32(src[i+0]);
-                buffer[i+1] = sat_u8_from_f32(src[i+1]);
-                buffer[i+2] = sat_u8_from_f32(src[i+2]);
-                buffer[i+3] = sat_u8_from_f32(src[i+3]);
-            }
-            for (; i < dim; ++i) buffer[i] = sat_u8_from_f32(src[i]);
+        case EMBEDDING_TYPE_U8:
+            // saturate to [0, 255], round to nearest even
+            vector_f32_to_u8(src, (uint8_t *)dest, dim, 1.0f, 1.0f, 0.0f, 0.0f, 255.0f);
             break;
-        }
             
-        case EMBEDDING_TYPE_I8: {
-            int8_t *buffer = (int8_t *)dest;
-            int i = 0;
-            for (; i + 3 < dim; i += 4) {
-                buffer[i+0] = sat_i8_from_f32(src[i+0]);
-                buffer[i+1] = sat_i8_from_f32(src[i+1]);
-                buffer[i+2] = sat_i8_from_f32(src[i+2]);
-                buffer[i+3] = sat_i8_from_f32(src[i+3]);
-            }
-            for (; i < dim; ++i) buffer[i] = sat_i8_from_f32(src[i]);
+        case EMBEDDING_TYPE_I8:
+            // saturate to [-128, 127], round to nearest even
+            vector_f32_to_i8(src, (int8_t *)dest, dim, 1.0f, 1.0f, 0.0f, -128.0f, 127.0f);
             break;
-        }
     }
     
     return 0;
@@ -1244,93 +1717,562 @@ static void llm_embed_debug (const void *buf, embedding_type type, int n) {
 }
 #endif
 
-static void llm_embed_generate_run (sqlite3_context *context, const char *text, int32_t text_len) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    struct llama_model *model = ai->model;
+// MARK: - Embedding Cache -
 
-    // sanity check model (encoder-decoder models are not supported for embeddings)
-    if (llama_model_has_encoder(model) && llama_model_has_decoder(model)) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Computing embeddings in encoder-decoder models is not supported");
-        return;
-    }
+// llm_embed_generate results are cached by hash(model identity, embedding options, text) in a LRU in-memory tier
+// (embedding_cache=N entries) and optionally in the ai_embed_cache table (embedding_cache_table=1), a hit skips tokenization and decoding
 
-    // sanity check vocab
-    const struct llama_vocab *vocab = llama_model_get_vocab(model);
-    if (!vocab) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
-        return;
+#define EMBED_CACHE_TABLE_CREATE_STMT           "CREATE TABLE IF NOT EXISTS ai_embed_cache (key BLOB PRIMARY KEY, embedding BLOB NOT NULL, created_at DATETIME DEFAULT CURRENT_TIMESTAMP) WITHOUT ROWID;"
+#define EMBED_CACHE_TABLE_SELECT_STMT           "SELECT embedding FROM ai_embed_cache WHERE key = ?;"
+#define EMBED_CACHE_TABLE_INSERT_STMT           "INSERT OR REPLACE INTO ai_embed_cache (key, embedding) VALUES (?, ?);"
+
+static uint64_t llm_hash_fnv1a (uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
     }
+    return hash;
+}
 
-    // determine model architecture
-    bool has_encoder = llama_model_has_encoder(model);
-    bool has_decoder = llama_model_has_decoder(model);
-    bool is_encoder_only = has_encoder && !has_decoder;
+static uint64_t llm_hash_fnv1 (uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; ++i) {
+        hash *= 0x100000001b3ULL;
+        hash ^= p[i];
+    }
+    return hash;
+}
 
-    struct llama_context *ctx = ai->ctx;
-    llama_set_embeddings(ctx, true);
+static bool llm_embed_cache_enabled (ai_context *ai) {
+    return (ai->options.embedding.cache_size > 0 || ai->options.embedding.cache_table);
+}
 
-    // clamp effective context to model's training window to avoid position embedding overflow
-    // also clamp to n_batch since we submit all tokens in a single batch
-    const int n_ctx_train = llama_model_n_ctx_train(model);
-    const int n_ctx_raw = (int)llama_n_ctx(ctx);
-    const int n_batch = (int)llama_n_batch(ctx);
-    int n_ctx = (n_ctx_raw > n_ctx_train) ? n_ctx_train : n_ctx_raw;
-    if (n_ctx > n_batch) n_ctx = n_batch;
+// two independent 64-bit hashes (FNV-1a and FNV-1) of everything that determines the embedding
+static void llm_embed_cache_key (ai_context *ai, const char *text, int32_t text_len, uint8_t key[AI_EMBED_CACHE_KEY_SIZE]) {
+    char model[768];
+    char identity[896];
+    llm_model_identity(ai, model, sizeof(model));
+    
+    int len = snprintf(identity, sizeof(identity), "%s;%d;%d;%d;%d;%u;%u;%u;%d;%d", model, (int)llama_pooling_type(ai->ctx), (int)ai->options.embedding.normalize, (int)ai->options.embedding.type, ai->options.max_tokens, llama_n_ctx(ai->ctx), llama_n_batch(ai->ctx), llama_n_ubatch(ai->ctx), (int)ai->options.embedding.window, ai->options.embedding.window_overlap);
+    if (len < 0) len = 0;
+    if (len >= (int)sizeof(identity)) len = (int)sizeof(identity) - 1;
+    
+    uint64_t h1 = llm_hash_fnv1a(0xcbf29ce484222325ULL, identity, (size_t)len);
+    h1 = llm_hash_fnv1a(h1, text, (size_t)text_len);
+    uint64_t h2 = llm_hash_fnv1(0xcbf29ce484222325ULL, text, (size_t)text_len);
+    h2 = llm_hash_fnv1(h2, identity, (size_t)len);
+    
+    memcpy(key, &h1, sizeof(uint64_t));
+    memcpy(key + sizeof(uint64_t), &h2, sizeof(uint64_t));
+}
 
-    // pooling type sanity check
-    const enum llama_pooling_type pooling_type = llama_pooling_type(ctx);
-    if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Embedding generation requires pooling (pooling_type must not be NONE)");
-        return;
+static void llm_embed_cache_clear (ai_context *ai) {
+    for (int32_t i = 0; i < ai->embed_cache.count; ++i) {
+        sqlite3_free(ai->embed_cache.entries[i].embedding);
     }
+    if (ai->embed_cache.entries) sqlite3_free(ai->embed_cache.entries);
+    if (ai->embed_cache.buckets) sqlite3_free(ai->embed_cache.buckets);
+    memset(&ai->embed_cache, 0, sizeof(ai->embed_cache));
+    ai->embed_cache.head = ai->embed_cache.tail = -1;
+}
 
-    // allocate embedding buffer
-    int dimension = llama_model_n_embd(model);
-    embedding_type type = ai->options.embedding.type;
-    int embedding_size = (int)embedding_type_to_size(type) * dimension;
-    void *embedding = (void *)sqlite3_malloc64(embedding_size);
-    if (!embedding) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate embedding buffer of size %d", embedding_size);
-        return;
+// (re)allocate the in-memory tier when the embedding_cache option changes
+static bool llm_embed_cache_resize (ai_context *ai, int32_t capacity) {
+    if (ai->embed_cache.capacity == capacity) return true;
+    llm_embed_cache_clear(ai);
+    if (capacity == 0) return true;
+    
+    int32_t nbuckets = 16;
+    while (nbuckets < capacity * 2 && nbuckets < (1 << 30)) nbuckets <<= 1;
+    
+    ai->embed_cache.entries = (ai_embed_cache_entry *)sqlite3_malloc64(sizeof(ai_embed_cache_entry) * (sqlite3_uint64)capacity);
+    ai->embed_cache.buckets = (int32_t *)sqlite3_malloc64(sizeof(int32_t) * (sqlite3_uint64)nbuckets);
+    if (!ai->embed_cache.entries || !ai->embed_cache.buckets) {
+        llm_embed_cache_clear(ai);
+        return false;
     }
-
+    
+    for (int32_t i = 0; i < nbuckets; ++i) ai->embed_cache.buckets[i] = -1;
+    ai->embed_cache.capacity = capacity;
+    ai->embed_cache.nbuckets = nbuckets;
+    return true;
+}
+
+static int32_t llm_embed_cache_bucket (ai_context *ai, const uint8_t *key) {
+    uint64_t hash;
+    memcpy(&hash, key, sizeof(uint64_t));
+    return (int32_t)(hash & (uint64_t)(ai->embed_cache.nbuckets - 1));
+}
+
+static void llm_embed_cache_lru_unlink (ai_context *ai, int32_t index) {
+    ai_embed_cache_entry *entry = &ai->embed_cache.entries[index];
+    if (entry->lru_prev >= 0) ai->embed_cache.entries[entry->lru_prev].lru_next = entry->lru_next;
+    else ai->embed_cache.head = entry->lru_next;
+    if (entry->lru_next >= 0) ai->embed_cache.entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else ai->embed_cache.tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = -1;
+}
+
+static void llm_embed_cache_lru_push (ai_context *ai, int32_t index) {
+    ai_embed_cache_entry *entry = &ai->embed_cache.entries[index];
+    entry->lru_prev = -1;
+    entry->lru_next = ai->embed_cache.head;
+    if (ai->embed_cache.head >= 0) ai->embed_cache.entries[ai->embed_cache.head].lru_prev = index;
+    ai->embed_cache.head = index;
+    if (ai->embed_cache.tail < 0) ai->embed_cache.tail = index;
+}
+
+static int32_t llm_embed_cache_find (ai_context *ai, const uint8_t *key) {
+    if (ai->embed_cache.capacity == 0) return -1;
+    
+    int32_t index = ai->embed_cache.buckets[llm_embed_cache_bucket(ai, key)];
+    while (index >= 0) {
+        ai_embed_cache_entry *entry = &ai->embed_cache.entries[index];
+        if (memcmp(entry->key, key, AI_EMBED_CACHE_KEY_SIZE) == 0) {
+            llm_embed_cache_lru_unlink(ai, index);
+            llm_embed_cache_lru_push(ai, index);
+            return index;
+        }
+        index = entry->next;
+    }
+    return -1;
+}
+
+static void llm_embed_cache_insert (ai_context *ai, const uint8_t *key, const void *embedding, int size) {
+    if (ai->embed_cache.capacity == 0) return;
+    if (llm_embed_cache_find(ai, key) >= 0) return;
+    
+    void *copy = sqlite3_malloc64((sqlite3_uint64)size);
+    if (!copy) return;
+    memcpy(copy, embedding, (size_t)size);
+    
+    int32_t index;
+    if (ai->embed_cache.count < ai->embed_cache.capacity) {
+        index = ai->embed_cache.count++;
+    } else {
+        // evict the least recently used entry
+        index = ai->embed_cache.tail;
+        ai_embed_cache_entry *victim = &ai->embed_cache.entries[index];
+        int32_t *link = &ai->embed_cache.buckets[llm_embed_cache_bucket(ai, victim->key)];
+        while (*link != index) link = &ai->embed_cache.entries[*link].next;
+        *link = victim->next;
+        llm_embed_cache_lru_unlink(ai, index);
+        sqlite3_free(victim->embedding);
+    }
+    
+    ai_embed_cache_entry *entry = &ai->embed_cache.entries[index];
+    int32_t bucket = llm_embed_cache_bucket(ai, key);
+    memcpy(entry->key, key, AI_EMBED_CACHE_KEY_SIZE);
+    entry->embedding = copy;
+    entry->size = size;
+    entry->next = ai->embed_cache.buckets[bucket];
+    ai->embed_cache.buckets[bucket] = index;
+    llm_embed_cache_lru_push(ai, index);
+}
+
+// returns a copy of the cached embedding (to be freed with sqlite3_free), NULL on miss
+static void *llm_embed_cache_get (ai_context *ai, sqlite3 *db, const uint8_t *key, int *size) {
+    int32_t index = llm_embed_cache_find(ai, key);
+    if (index >= 0) {
+        ai_embed_cache_entry *entry = &ai->embed_cache.entries[index];
+        void *embedding = sqlite3_malloc64((sqlite3_uint64)entry->size);
+        if (!embedding) return NULL;
+        memcpy(embedding, entry->embedding, (size_t)entry->size);
+        *size = entry->size;
+        return embedding;
+    }
+    
+    if (ai->options.embedding.cache_table == false) return NULL;
+    
+    sqlite3_stmt *vm = NULL;
+    void *embedding = NULL;
+    if (sqlite3_prepare_v2(db, EMBED_CACHE_TABLE_SELECT_STMT, -1, &vm, NULL) != SQLITE_OK) goto cleanup;
+    if (sqlite3_bind_blob(vm, 1, key, AI_EMBED_CACHE_KEY_SIZE, SQLITE_STATIC) != SQLITE_OK) goto cleanup;
+    if (sqlite3_step(vm) != SQLITE_ROW) goto cleanup;
+    
+    const void *blob = sqlite3_column_blob(vm, 0);
+    int len = sqlite3_column_bytes(vm, 0);
+    if (!blob || len <= 0) goto cleanup;
+    
+    embedding = sqlite3_malloc64((sqlite3_uint64)len);
+    if (!embedding) goto cleanup;
+    memcpy(embedding, blob, (size_t)len);
+    *size = len;
+    
+    // promote to the in-memory tier
+    llm_embed_cache_insert(ai, key, embedding, len);
+    
+cleanup:
+    if (vm) sqlite3_finalize(vm);
+    return embedding;
+}
+
+// embedding of a constant text argument, kept as auxdata so that it is computed once per statement
+typedef struct {
+    uint8_t                     key[AI_EMBED_CACHE_KEY_SIZE];
+    int                         size;
+    uint8_t                     data[];
+} llm_embed_memo;
+
+static void *llm_embed_memo_get (sqlite3_context *context, const uint8_t *key, int *size) {
+    llm_embed_memo *memo = (llm_embed_memo *)sqlite3_get_auxdata(context, 0);
+    if (!memo || memcmp(memo->key, key, AI_EMBED_CACHE_KEY_SIZE) != 0) return NULL;
+    
+    void *embedding = sqlite3_malloc64((sqlite3_uint64)memo->size);
+    if (!embedding) return NULL;
+    memcpy(embedding, memo->data, (size_t)memo->size);
+    *size = memo->size;
+    return embedding;
+}
+
+static void llm_embed_memo_set (sqlite3_context *context, const uint8_t *key, const void *embedding, int size) {
+    llm_embed_memo *memo = (llm_embed_memo *)sqlite3_malloc64(sizeof(llm_embed_memo) + (sqlite3_uint64)size);
+    if (!memo) return;
+    memcpy(memo->key, key, AI_EMBED_CACHE_KEY_SIZE);
+    memo->size = size;
+    memcpy(memo->data, embedding, (size_t)size);
+    sqlite3_set_auxdata(context, 0, memo, sqlite3_free);
+}
+
+static bool llm_embed_cache_put (sqlite3_context *context, ai_context *ai, sqlite3 *db, const uint8_t *key, const void *embedding, int size) {
+    llm_embed_cache_insert(ai, key, embedding, size);
+    if (ai->options.embedding.cache_table == false) return true;
+    
+    const char *values[] = {(const char *)key, (const char *)embedding};
+    int types[] = {SQLITE_BLOB, SQLITE_BLOB};
+    int lens[] = {AI_EMBED_CACHE_KEY_SIZE, size};
+    return (sqlite_db_write(context, db, EMBED_CACHE_TABLE_INSERT_STMT, values, types, lens, 2) == SQLITE_OK);
+}
+
+// prepare the cache tiers requested by the current options
+static bool llm_embed_cache_check (sqlite3_context *context, ai_context *ai) {
+    if (llm_embed_cache_resize(ai, (int32_t)ai->options.embedding.cache_size) == false) {
+        return sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate an embedding cache of %u entries", ai->options.embedding.cache_size);
+    }
+    
+    if (ai->options.embedding.cache_table) {
+        if (sqlite_db_write_simple(context, sqlite3_context_db_handle(context), EMBED_CACHE_TABLE_CREATE_STMT) != SQLITE_OK) return false;
+    }
+    return true;
+}
+
+// MARK: - Batched Embedding -
+
+// tokens of a single input, truncated to the per-sequence limit of the engine
+// with long_input=window the tokens are not truncated (and have no special tokens): each window is embedded as its own sequence
+typedef struct {
+    llama_token                 *tokens;
+    int32_t                     n_tokens;           // 0 means NULL/empty input (no embedding)
+    int32_t                     n_windows;          // 0 means a single sequence with the special tokens already in place
+} llm_embed_input;
+
+// what each sequence of an embedding batch produces
+typedef enum {
+    EMBED_MODE_POOLED = 0,                          // one pooled embedding (pooling type MEAN, CLS, LAST)
+    EMBED_MODE_RANK,                                // one FLOAT32 score (pooling type RANK)
+    EMBED_MODE_TOKENS                               // one embedding per token (pooling type NONE), pooled by the caller
+} embed_mode;
+
+// state shared by all embedding paths: several inputs are packed into one llama_batch,
+// each one with its own seq_id, so that a single encode/decode call produces up to n_seq_max pooled embeddings
+typedef struct {
+    struct llama_context        *ctx;
+    const struct llama_vocab    *vocab;
+    llama_batch                 batch;
+    bool                        is_encoder_only;
+    int                         n_ctx;              // max tokens per sequence
+    int                         n_batch;            // max tokens per encode/decode call
+    int                         n_seq_max;          // max sequences per encode/decode call
+    llama_seq_id                *seq_ids;           // sequences not owned by chat sessions, the only ones used and cleared
+    int                         dimension;
+    embedding_type              type;
+    int                         embedding_size;     // size in bytes of one output embedding
+    bool                        normalize;
+    int32_t                     max_tokens;
+    
+    // reranking (pooling type RANK): each sequence is a (query, document) pair and its output is a single FLOAT32 score
+    bool                        is_rank;
+    const char                  *rerank_template;   // template of the model with {query} and {document} placeholders (NULL if none)
+    char                        *query;
+    int32_t                     query_len;
+    llama_token                 *query_tokens;      // query tokens without special tokens (used when there is no template)
+    int32_t                     query_n_tokens;
+    
+    // long_input=window: windows of window_size tokens (window_stride apart) wrapped in the special tokens of the model,
+    // the pooled windows of an input are combined in accumulator with a mean weighted by the number of tokens of each window
+    bool                        window;
+    int32_t                     window_size;
+    int32_t                     window_stride;
+    llama_token                 window_prefix[1];
+    int32_t                     n_window_prefix;
+    llama_token                 window_suffix[2];
+    int32_t                     n_window_suffix;
+    float                       *accumulator;
+    double                      weight;
+    int                         *units;             // (input, window) of each sequence of the current encode/decode call
+} llm_embed_batch;
+
+// checks that the model and the context can produce the outputs of mode
+// (also performed before looking up cached embeddings, so that a cache hit never hides a configuration error)
+static bool llm_embed_batch_check (ai_context *ai, sqlite3_context *context, sqlite3_vtab *vtab, embed_mode mode) {
+    struct llama_model *model = ai->model;
+
+    // sanity check model (encoder-decoder models are not supported for embeddings)
+    if (llama_model_has_encoder(model) && llama_model_has_decoder(model)) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Computing embeddings in encoder-decoder models is not supported");
+        return false;
+    }
+
+    // sanity check vocab
+    if (!llama_model_get_vocab(model)) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to extract vocabulary from the model");
+        return false;
+    }
+
+    // pooling type sanity check
+    enum llama_pooling_type pooling_type = llama_pooling_type(ai->ctx);
+    if (mode == EMBED_MODE_TOKENS) {
+        if (pooling_type != LLAMA_POOLING_TYPE_NONE) {
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Late chunking requires a context created with pooling_type=token");
+            return false;
+        }
+    } else if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Embedding generation requires pooling (pooling_type must not be token)");
+        return false;
+    }
+    bool rerank = (mode == EMBED_MODE_RANK);
+    if (rerank && pooling_type != LLAMA_POOLING_TYPE_RANK) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Reranking and classification heads require a context created with pooling_type=rank");
+        return false;
+    }
+    if (!rerank && pooling_type == LLAMA_POOLING_TYPE_RANK) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Embedding generation is not supported with pooling_type=rank (use llm_rerank)");
+        return false;
+    }
+    return true;
+}
+
+static bool llm_embed_batch_init (ai_context *ai, sqlite3_context *context, sqlite3_vtab *vtab, llm_embed_batch *eb, embed_mode mode) {
+    memset(eb, 0, sizeof(llm_embed_batch));
+    if (!llm_embed_batch_check(ai, context, vtab, mode)) return false;
+
+    struct llama_model *model = ai->model;
+    const struct llama_vocab *vocab = llama_model_get_vocab(model);
+    struct llama_context *ctx = ai->ctx;
+    llama_set_embeddings(ctx, true);
+    bool rerank = (mode == EMBED_MODE_RANK);
+
+    // clamp effective context to model's training window to avoid position embedding overflow
+    // also clamp to n_batch/n_ubatch since a sequence must never be split across two micro-batches
+    const int n_ctx_train = llama_model_n_ctx_train(model);
+    const int n_ctx_raw = (int)llama_n_ctx(ctx);
+    int n_batch = (int)llama_n_batch(ctx);
+    if ((int)llama_n_ubatch(ctx) < n_batch) n_batch = (int)llama_n_ubatch(ctx);
+    int n_ctx = (n_ctx_raw > n_ctx_train) ? n_ctx_train : n_ctx_raw;
+    if (n_ctx > n_batch) n_ctx = n_batch;
+
+    eb->batch = llama_batch_init(n_batch, 0, 1);
+    if (!eb->batch.token) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate embedding batch");
+        return false;
+    }
+
+    eb->ctx = ctx;
+    eb->vocab = vocab;
+    eb->is_encoder_only = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+    eb->n_ctx = n_ctx;
+    eb->n_batch = n_batch;
+    eb->dimension = llama_model_n_embd(model);
+    eb->type = ai->options.embedding.type;
+    eb->embedding_size = (int)embedding_type_to_size(eb->type) * eb->dimension;
+    eb->normalize = ai->options.embedding.normalize;
+    eb->max_tokens = ai->options.max_tokens;
+
+    if (rerank) {
+        eb->is_rank = true;
+        eb->rerank_template = llama_model_chat_template(model, "rerank");
+        eb->dimension = 1;
+        eb->type = EMBEDDING_TYPE_F32;
+        eb->embedding_size = (int)sizeof(float);
+        eb->normalize = false;
+    }
+
+    // the context can be shared with chat sessions, their sequences must survive the embedding calls
+    int n_seq_max = (int)llama_n_seq_max(ctx);
+    if (n_seq_max < 1) n_seq_max = 1;
+    eb->units = (int *)sqlite3_malloc64(2 * n_seq_max * sizeof(int));
+    eb->seq_ids = (llama_seq_id *)sqlite3_malloc64(n_seq_max * sizeof(llama_seq_id));
+    if (!eb->units || !eb->seq_ids) {
+        sqlite3_free(eb->units);
+        sqlite3_free(eb->seq_ids);
+        llama_batch_free(eb->batch);
+        memset(eb, 0, sizeof(llm_embed_batch));
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate embedding batch");
+        return false;
+    }
+    for (llama_seq_id seq_id = 0; seq_id < n_seq_max; ++seq_id) {
+        bool used = false;
+        for (int i = 0; i < ai->sessions.count; ++i) {
+            if (ai->sessions.items[i]->seq_id == seq_id) {used = true; break;}
+        }
+        if (!used) eb->seq_ids[eb->n_seq_max++] = seq_id;
+    }
+
+    if (mode == EMBED_MODE_POOLED && ai->options.embedding.window) {
+        if (llama_vocab_get_add_bos(vocab)) eb->window_prefix[eb->n_window_prefix++] = llama_vocab_bos(vocab);
+        if (llama_vocab_get_add_eos(vocab)) eb->window_suffix[eb->n_window_suffix++] = llama_vocab_eos(vocab);
+        if (llama_vocab_get_add_sep(vocab)) eb->window_suffix[eb->n_window_suffix++] = llama_vocab_sep(vocab);
+
+        eb->window_size = n_ctx - eb->n_window_prefix - eb->n_window_suffix;
+        int32_t overlap = ai->options.embedding.window_overlap;
+        if (overlap < 0) overlap = eb->window_size / 8;
+        if (overlap > eb->window_size / 2) overlap = eb->window_size / 2;
+        eb->window_stride = eb->window_size - overlap;
+
+        if (eb->window_size > 0 && eb->window_stride > 0) {
+            eb->accumulator = (float *)sqlite3_malloc64(eb->dimension * sizeof(float));
+            if (!eb->accumulator) {
+                sqlite3_free(eb->units);
+                sqlite3_free(eb->seq_ids);
+                llama_batch_free(eb->batch);
+                memset(eb, 0, sizeof(llm_embed_batch));
+                sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate embedding accumulator");
+                return false;
+            }
+            eb->window = true;
+        }
+    }
+    return true;
+}
+
+static void llm_embed_batch_free (llm_embed_batch *eb) {
+    if (eb->batch.token) llama_batch_free(eb->batch);
+    if (eb->query) sqlite3_free(eb->query);
+    if (eb->query_tokens) sqlite3_free(eb->query_tokens);
+    if (eb->accumulator) sqlite3_free(eb->accumulator);
+    if (eb->units) sqlite3_free(eb->units);
+    if (eb->seq_ids) sqlite3_free(eb->seq_ids);
+    memset(eb, 0, sizeof(llm_embed_batch));
+}
+
+static void llm_embed_input_reset (llm_embed_input *input) {
+    if (input->tokens) sqlite3_free(input->tokens);
+    input->tokens = NULL;
+    input->n_tokens = 0;
+    input->n_windows = 0;
+}
+
+// tokenize text into a new buffer (*tokens is NULL when text produces no tokens)
+static bool llm_tokenize_alloc (sqlite3_context *context, sqlite3_vtab *vtab, const struct llama_vocab *vocab, const char *text, int32_t text_len, bool add_special, bool parse_special, llama_token **tokens, int32_t *n_tokens) {
+    *tokens = NULL;
+    *n_tokens = 0;
+    
+    int32_t n = -llama_tokenize(vocab, text, text_len, NULL, 0, add_special, parse_special);
+    if (n <= 0) return true;
+    
+    llama_token *buffer = (llama_token *)sqlite3_malloc64(n * sizeof(llama_token));
+    if (!buffer) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate %d tokens", n);
+        return false;
+    }
+    if (llama_tokenize(vocab, text, text_len, buffer, n, add_special, parse_special) != n) {
+        sqlite3_free(buffer);
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Tokenization failed");
+        return false;
+    }
+    
+    *tokens = buffer;
+    *n_tokens = n;
+    return true;
+}
+
+// split the tokens of a long input into windows: consecutive windows share window_size - window_stride tokens
+// and the last one is aligned to the end of the input
+static bool llm_embed_batch_tokenize_windows (llm_embed_batch *eb, sqlite3_context *context, sqlite3_vtab *vtab, const char *text, int32_t text_len, llm_embed_input *input) {
+    llama_token *tokens = NULL;
+    int32_t n_tokens = 0;
+    if (!llm_tokenize_alloc(context, vtab, eb->vocab, text, text_len, false, true, &tokens, &n_tokens)) return false;
+    if (n_tokens == 0) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Tokenization produced no tokens");
+        return false;
+    }
+    
+    input->tokens = tokens;
+    input->n_tokens = n_tokens;
+    input->n_windows = 1;
+    if (n_tokens > eb->window_size) input->n_windows += (n_tokens - eb->window_size + eb->window_stride - 1) / eb->window_stride;
+    return true;
+}
+
+static int32_t llm_embed_window_start (llm_embed_batch *eb, const llm_embed_input *input, int32_t w) {
+    int32_t start = w * eb->window_stride;
+    if (start + eb->window_size > input->n_tokens) start = input->n_tokens - eb->window_size;
+    return (start < 0) ? 0 : start;
+}
+
+static int32_t llm_embed_window_length (llm_embed_batch *eb, const llm_embed_input *input, int32_t w) {
+    int32_t length = input->n_tokens - llm_embed_window_start(eb, input, w);
+    return (length > eb->window_size) ? eb->window_size : length;
+}
+
+// number of sequences and of batch tokens needed to embed input
+static int llm_embed_input_sequences (const llm_embed_input *input) {
+    if (input->n_tokens == 0) return 0;
+    return (input->n_windows > 0) ? input->n_windows : 1;
+}
+
+static int llm_embed_input_tokens (llm_embed_batch *eb, const llm_embed_input *input) {
+    if (input->n_windows == 0) return input->n_tokens;
+    int n = 0;
+    for (int32_t w = 0; w < input->n_windows; ++w) {
+        n += eb->n_window_prefix + llm_embed_window_length(eb, input, w) + eb->n_window_suffix;
+    }
+    return n;
+}
+
+static bool llm_embed_batch_tokenize (llm_embed_batch *eb, sqlite3_context *context, sqlite3_vtab *vtab, const char *text, int32_t text_len, llm_embed_input *input) {
+    int n_ctx = eb->n_ctx;
+
     // allocate token buffer sized to context limit
     llama_token *tokens = (llama_token *)sqlite3_malloc64(n_ctx * sizeof(llama_token));
     if (!tokens) {
-        sqlite3_free(embedding);
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate tokens buffer");
-        return;
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate tokens buffer");
+        return false;
     }
 
     // tokenize directly into the buffer
-    int32_t n_tokens = llama_tokenize(vocab, text, text_len, tokens, n_ctx, true, true);
+    int32_t n_tokens = llama_tokenize(eb->vocab, text, text_len, tokens, n_ctx, true, true);
     if (n_tokens < 0) {
         // negative return means input needs more tokens than n_ctx — truncate
         int32_t n_needed = -n_tokens;
 
         // check user-defined max_tokens limit
-        if (ai->options.max_tokens > 0 && n_needed > ai->options.max_tokens) {
+        if (eb->max_tokens > 0 && n_needed > eb->max_tokens) {
             sqlite3_free(tokens);
-            sqlite3_free(embedding);
-            sqlite_context_result_error(context, SQLITE_TOOBIG, "Input too large: %d tokens exceeds max allowed (%d)", n_needed, ai->options.max_tokens);
-            return;
+            sqlite_common_set_error(context, vtab, SQLITE_TOOBIG, "Input too large: %d tokens exceeds max allowed (%d)", n_needed, eb->max_tokens);
+            return false;
+        }
+
+        // long_input=window: keep all the tokens instead of truncating them
+        if (eb->window) {
+            sqlite3_free(tokens);
+            return llm_embed_batch_tokenize_windows(eb, context, vtab, text, text_len, input);
         }
 
         // allocate a temporary buffer large enough for the full tokenization, then truncate
         llama_token *full_tokens = (llama_token *)sqlite3_malloc64(n_needed * sizeof(llama_token));
         if (!full_tokens) {
             sqlite3_free(tokens);
-            sqlite3_free(embedding);
-            sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate tokens buffer");
-            return;
+            sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate tokens buffer");
+            return false;
         }
-        int32_t n_actual = llama_tokenize(vocab, text, text_len, full_tokens, n_needed, true, true);
+        int32_t n_actual = llama_tokenize(eb->vocab, text, text_len, full_tokens, n_needed, true, true);
         if (n_actual < 0 || n_actual != n_needed) {
             sqlite3_free(full_tokens);
             sqlite3_free(tokens);
-            sqlite3_free(embedding);
-            sqlite_context_result_error(context, SQLITE_ERROR, "Tokenization failed");
-            return;
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Tokenization failed");
+            return false;
         }
         // truncate to n_ctx
         memcpy(tokens, full_tokens, n_ctx * sizeof(llama_token));
@@ -1340,778 +2282,1485 @@ static void llm_embed_generate_run (sqlite3_context *context, const char *text,
 
     if (n_tokens == 0) {
         sqlite3_free(tokens);
-        sqlite3_free(embedding);
-        sqlite_context_result_error(context, SQLITE_ERROR, "Tokenization produced no tokens");
-        return;
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Tokenization produced no tokens");
+        return false;
     }
 
     // check user-defined max_tokens limit
-    if (ai->options.max_tokens > 0 && n_tokens > ai->options.max_tokens) {
+    if (eb->max_tokens > 0 && n_tokens > eb->max_tokens) {
         sqlite3_free(tokens);
-        sqlite3_free(embedding);
-        sqlite_context_result_error(context, SQLITE_TOOBIG, "Input too large: %d tokens exceeds max allowed (%d)", n_tokens, ai->options.max_tokens);
-        return;
+        sqlite_common_set_error(context, vtab, SQLITE_TOOBIG, "Input too large: %d tokens exceeds max allowed (%d)", n_tokens, eb->max_tokens);
+        return false;
     }
 
-    // prepare batch
-    llama_seq_id sequence_id = 0;
-    llama_memory_t memory = llama_get_memory(ctx);
+    input->tokens = tokens;
+    input->n_tokens = n_tokens;
+    return true;
+}
 
-    if (memory) {
-        llama_memory_clear(memory, true);
+// set the query of a reranking batch: with a rerank template the query is substituted in the prompt of each pair,
+// otherwise it is tokenized once and copied in front of each document
+static bool llm_rerank_batch_set_query (llm_embed_batch *eb, sqlite3_context *context, sqlite3_vtab *vtab, const char *text, int32_t text_len) {
+    eb->query = (char *)sqlite3_malloc64(text_len + 1);
+    if (!eb->query) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate query buffer");
+        return false;
     }
-
-    struct llama_batch batch = {
-        .n_tokens   = n_tokens,
-        .token      = tokens,
-        .embd       = NULL,
-        .pos        = NULL,
-        .n_seq_id   = NULL,
-        .seq_id     = NULL,
-        .logits     = NULL,
-    };
-
-    // encode or decode based on model architecture
-    // encoder-only models (BERT-style) use llama_encode
-    // decoder-only models use llama_decode (which also works for models without memory)
-    int32_t rc = is_encoder_only ? llama_encode(ctx, batch) : llama_decode(ctx, batch);
-    if (rc != 0) {
-        sqlite3_free(tokens);
-        sqlite3_free(embedding);
-        sqlite_context_result_error(context, SQLITE_ERROR, "Model %s failed during embedding generation (%d)", is_encoder_only ? "encode" : "decode", rc);
-        return;
+    memcpy(eb->query, text, text_len);
+    eb->query[text_len] = 0;
+    eb->query_len = text_len;
+    if (eb->rerank_template) return true;
+    
+    // leave room for the special tokens and at least one token of the document
+    int32_t n_tokens = -llama_tokenize(eb->vocab, text, text_len, NULL, 0, false, true);
+    if (n_tokens <= 0) return true;
+    if (n_tokens + 5 > eb->n_ctx) {
+        sqlite_common_set_error(context, vtab, SQLITE_TOOBIG, "Query too large: %d tokens exceeds max allowed (%d)", n_tokens, eb->n_ctx - 5);
+        return false;
+    }
+    
+    eb->query_tokens = (llama_token *)sqlite3_malloc64(n_tokens * sizeof(llama_token));
+    if (!eb->query_tokens) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate tokens buffer");
+        return false;
+    }
+    if (llama_tokenize(eb->vocab, text, text_len, eb->query_tokens, n_tokens, false, true) != n_tokens) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Tokenization failed");
+        return false;
     }
+    eb->query_n_tokens = n_tokens;
+    return true;
+}
 
-    // retrieve sentence embedding
-    const float *result = NULL;
-    if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
-        result = llama_get_embeddings_ith(ctx, n_tokens - 1);
-    } else {
-        result = llama_get_embeddings_seq(ctx, sequence_id);
+// build the input of a (query, document) pair: the rerank template of the model when available,
+// otherwise [BOS] query [EOS] [SEP] document [EOS] as expected by BERT-style cross-encoders (the document is truncated to fit)
+static bool llm_rerank_batch_tokenize (llm_embed_batch *eb, sqlite3_context *context, sqlite3_vtab *vtab, const char *text, int32_t text_len, llm_embed_input *input) {
+    if (eb->rerank_template) {
+        sqlite3_str *s = sqlite3_str_new(NULL);
+        const char *p = eb->rerank_template;
+        while (*p) {
+            const char *brace = strchr(p, '{');
+            if (!brace) {sqlite3_str_appendall(s, p); break;}
+            sqlite3_str_append(s, p, (int)(brace - p));
+            if (strncmp(brace, "{query}", 7) == 0) {sqlite3_str_append(s, eb->query, eb->query_len); p = brace + 7;}
+            else if (strncmp(brace, "{document}", 10) == 0) {sqlite3_str_append(s, text, text_len); p = brace + 10;}
+            else {sqlite3_str_appendchar(s, 1, '{'); p = brace + 1;}
+        }
+        int32_t prompt_len = (int32_t)sqlite3_str_length(s);
+        char *prompt = sqlite3_str_finish(s);
+        if (!prompt) {
+            sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate rerank prompt");
+            return false;
+        }
+        bool result = llm_embed_batch_tokenize(eb, context, vtab, prompt, prompt_len, input);
+        sqlite3_free(prompt);
+        return result;
+    }
+    
+    const struct llama_vocab *vocab = eb->vocab;
+    llama_token eos = llama_vocab_eos(vocab);
+    if (eos == LLAMA_TOKEN_NULL) eos = llama_vocab_sep(vocab);
+    bool add_eos = llama_vocab_get_add_eos(vocab);
+    
+    int n_ctx = eb->n_ctx;
+    llama_token *tokens = (llama_token *)sqlite3_malloc64(n_ctx * sizeof(llama_token));
+    if (!tokens) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate tokens buffer");
+        return false;
+    }
+    
+    int32_t n_tokens = 0;
+    if (llama_vocab_get_add_bos(vocab)) tokens[n_tokens++] = llama_vocab_bos(vocab);
+    if (eb->query_n_tokens > 0) memcpy(tokens + n_tokens, eb->query_tokens, eb->query_n_tokens * sizeof(llama_token));
+    n_tokens += eb->query_n_tokens;
+    if (add_eos) tokens[n_tokens++] = eos;
+    if (llama_vocab_get_add_sep(vocab)) tokens[n_tokens++] = llama_vocab_sep(vocab);
+    
+    // tokenize the document in the room left before the trailing EOS
+    int32_t room = n_ctx - n_tokens - (add_eos ? 1 : 0);
+    int32_t n_doc = llama_tokenize(vocab, text, text_len, tokens + n_tokens, room, false, true);
+    if (n_doc < 0) {
+        // the pair needs more tokens than n_ctx — truncate the document
+        int32_t n_needed = -n_doc;
+        if (eb->max_tokens > 0 && n_tokens + n_needed > eb->max_tokens) {
+            sqlite3_free(tokens);
+            sqlite_common_set_error(context, vtab, SQLITE_TOOBIG, "Input too large: %d tokens exceeds max allowed (%d)", n_tokens + n_needed, eb->max_tokens);
+            return false;
+        }
+        
+        llama_token *full_tokens = (llama_token *)sqlite3_malloc64(n_needed * sizeof(llama_token));
+        if (!full_tokens) {
+            sqlite3_free(tokens);
+            sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate tokens buffer");
+            return false;
+        }
+        int32_t n_actual = llama_tokenize(vocab, text, text_len, full_tokens, n_needed, false, true);
+        if (n_actual != n_needed) {
+            sqlite3_free(full_tokens);
+            sqlite3_free(tokens);
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Tokenization failed");
+            return false;
+        }
+        memcpy(tokens + n_tokens, full_tokens, room * sizeof(llama_token));
+        sqlite3_free(full_tokens);
+        n_doc = room;
     }
-    if (result == NULL) {
+    n_tokens += n_doc;
+    if (add_eos) tokens[n_tokens++] = eos;
+    
+    // check user-defined max_tokens limit
+    if (eb->max_tokens > 0 && n_tokens > eb->max_tokens) {
         sqlite3_free(tokens);
-        sqlite3_free(embedding);
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to retrieve embedding vector from model");
-        return;
+        sqlite_common_set_error(context, vtab, SQLITE_TOOBIG, "Input too large: %d tokens exceeds max allowed (%d)", n_tokens, eb->max_tokens);
+        return false;
     }
+    
+    input->tokens = tokens;
+    input->n_tokens = n_tokens;
+    return true;
+}
 
-    // normalize or copy embedding
-    if (ai->options.embedding.normalize) {
-        llm_embed_normalize(result, embedding, type, dimension);
-    } else {
-        llm_embed_copy(result, embedding, type, dimension, embedding_size);
-    }
+// returns true if input can be appended to a group that already holds n_seq sequences and n_tokens tokens
+static bool llm_embed_batch_fits (llm_embed_batch *eb, int n_seq, int n_tokens, const llm_embed_input *input) {
+    if (input->n_tokens == 0) return true;
+    if (n_seq == 0) return true;
+    if (n_seq + llm_embed_input_sequences(input) > eb->n_seq_max) return false;
+    return (n_tokens + llm_embed_input_tokens(eb, input) <= eb->n_batch);
+}
 
-    // clear memory so the next call starts clean
-    if (memory) {
-        llama_memory_seq_rm(memory, sequence_id, 0, -1);
-        llama_memory_clear(memory, true);
+static void llm_embed_batch_add (llama_batch *batch, const llama_token *tokens, int32_t n_tokens, llama_pos pos, llama_seq_id seq_id) {
+    for (int32_t j = 0; j < n_tokens; ++j) {
+        int32_t k = batch->n_tokens++;
+        batch->token[k] = tokens[j];
+        batch->pos[k] = pos + j;
+        batch->n_seq_id[k] = 1;
+        batch->seq_id[k][0] = seq_id;
+        batch->logits[k] = true;
     }
+}
 
-    // check if JSON output is set
-    if (ai->options.embedding.json_output) {
-        sqlite3_str *s = sqlite3_str_new(sqlite3_context_db_handle(context));
-        sqlite3_str_appendchar(s, 1, '[');
-        for (int i = 0; i < dimension; i++) {
-            if (i) sqlite3_str_appendchar(s, 1, ',');
-            float value = 0.0;
-
-            switch (type) {
-                case EMBEDDING_TYPE_F32:
-                    value = ((float *)embedding)[i];
-                    break;
+// embed a group of inputs (previously checked with llm_embed_batch_fits) with as few encode/decode calls as possible:
+// each input (or each window of a long input) is a sequence, a new call is started only when n_seq_max or n_batch is reached
+// output must be able to hold n_inputs * embedding_size bytes, slots of empty inputs are left untouched
+// drop the sequences used by the last encode/decode call (and only those, chat sessions can share the context)
+static void llm_embed_batch_clear (llm_embed_batch *eb, llama_memory_t memory, int n_seq) {
+    if (!memory) return;
+    for (int s = 0; s < n_seq; ++s) llama_memory_seq_rm(memory, eb->seq_ids[s], -1, -1);
+}
 
-                case EMBEDDING_TYPE_F16:
-                    value = float16_to_float32(((uint16_t *)embedding)[i]);
-                    break;
+static bool llm_embed_batch_decode (llm_embed_batch *eb, sqlite3_context *context, sqlite3_vtab *vtab, const llm_embed_input *inputs, int n_inputs, uint8_t *output) {
+    llama_batch *batch = &eb->batch;
+    llama_memory_t memory = llama_get_memory(eb->ctx);
 
-                case EMBEDDING_TYPE_BF16:
-                    value = bfloat16_to_float32(((uint16_t *)embedding)[i]);
-                    break;
+    // next sequence to pack: window w of input i
+    int i = 0;
+    int32_t w = 0;
+    while (i < n_inputs) {
+        // pack each input (or window) into its own sequence
+        batch->n_tokens = 0;
+        llama_seq_id n_seq = 0;
+        while (i < n_inputs) {
+            const llm_embed_input *input = &inputs[i];
+            if (input->n_tokens == 0) {++i; continue;}
+            if (n_seq == eb->n_seq_max) break;
+
+            if (input->n_windows == 0) {
+                if (batch->n_tokens + input->n_tokens > eb->n_batch) break;
+                llm_embed_batch_add(batch, input->tokens, input->n_tokens, 0, eb->seq_ids[n_seq]);
+            } else {
+                int32_t start = llm_embed_window_start(eb, input, w);
+                int32_t length = llm_embed_window_length(eb, input, w);
+                if (batch->n_tokens + eb->n_window_prefix + length + eb->n_window_suffix > eb->n_batch) break;
+                llm_embed_batch_add(batch, eb->window_prefix, eb->n_window_prefix, 0, eb->seq_ids[n_seq]);
+                llm_embed_batch_add(batch, input->tokens + start, length, eb->n_window_prefix, eb->seq_ids[n_seq]);
+                llm_embed_batch_add(batch, eb->window_suffix, eb->n_window_suffix, eb->n_window_prefix + length, eb->seq_ids[n_seq]);
+            }
+            eb->units[2 * n_seq] = i;
+            eb->units[2 * n_seq + 1] = w;
+            ++n_seq;
 
-                case EMBEDDING_TYPE_U8:
-                    value = (float)(((uint8_t *)embedding)[i]);
-                    break;
+            if (input->n_windows > 0 && ++w < input->n_windows) continue;
+            w = 0;
+            ++i;
+        }
+        if (n_seq == 0) break;
 
-                case EMBEDDING_TYPE_I8:
-                    value = (float)(((int8_t *)embedding)[i]);
-                    break;
+        llm_embed_batch_clear(eb, memory, n_seq);
+
+        // encode or decode based on model architecture
+        // encoder-only models (BERT-style) use llama_encode
+        // decoder-only models use llama_decode (which also works for models without memory)
+        int32_t rc = eb->is_encoder_only ? llama_encode(eb->ctx, *batch) : llama_decode(eb->ctx, *batch);
+        if (rc != 0) {
+            llm_embed_batch_clear(eb, memory, n_seq);
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Model %s failed during %s (%d)", eb->is_encoder_only ? "encode" : "decode", eb->is_rank ? "reranking" : "embedding generation", rc);
+            return false;
+        }
+
+        // retrieve pooled embedding of each sequence
+        for (llama_seq_id s = 0; s < n_seq; ++s) {
+            const float *result = llama_get_embeddings_seq(eb->ctx, eb->seq_ids[s]);
+            if (result == NULL) {
+                llm_embed_batch_clear(eb, memory, n_seq);
+                sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to retrieve embedding vector from model");
+                return false;
+            }
+
+            const llm_embed_input *input = &inputs[eb->units[2 * s]];
+            int32_t window = eb->units[2 * s + 1];
+            void *embedding = output + ((size_t)eb->units[2 * s] * eb->embedding_size);
+            if (input->n_windows > 0) {
+                // windows of the same input are always packed in order, so a single accumulator is enough
+                if (window == 0) {
+                    memset(eb->accumulator, 0, eb->dimension * sizeof(float));
+                    eb->weight = 0.0;
+                }
+                float length = (float)llm_embed_window_length(eb, input, window);
+                for (int d = 0; d < eb->dimension; ++d) eb->accumulator[d] += length * result[d];
+                eb->weight += length;
+                if (window < input->n_windows - 1) continue;
+
+                vector_f32_scale(eb->accumulator, eb->accumulator, eb->dimension, (float)(1.0 / eb->weight));
+                result = eb->accumulator;
             }
-            sqlite3_str_appendf(s, "%.6g", value);
+
+            if (eb->is_rank) memcpy(embedding, result, sizeof(float));
+            else if (eb->normalize) llm_embed_normalize(result, embedding, eb->type, eb->dimension);
+            else llm_embed_copy(result, embedding, eb->type, eb->dimension, eb->embedding_size);
         }
-        sqlite3_str_appendchar(s, 1, ']');
 
-        char *json = sqlite3_str_finish(s);
-        (json) ? sqlite3_result_text(context, json, -1, sqlite3_free) : sqlite3_result_null(context);
-        sqlite3_free(embedding);
-    } else {
-        sqlite3_result_blob(context, embedding, embedding_size, sqlite3_free);
+        // clear the sequences so the next call starts clean
+        llm_embed_batch_clear(eb, memory, n_seq);
     }
 
-    sqlite3_free(tokens);
+    return true;
 }
 
-static void llm_embed_generate (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (llm_check_context(context) == false) return;
-    if (llm_common_args_check(context, "llm_embed_generate", argc, argv, true) == false) return;
-    
-    const char *text = (const char *)sqlite3_value_text(argv[0]);
-    int32_t text_len = (int32_t)sqlite3_value_bytes(argv[0]);
-    const char *model_options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
-    
-    // handle NULL input
-    if (!text || text_len == 0) {
-        sqlite3_result_null(context);
-        return;
-    }
+static char *llm_embed_to_json (sqlite3 *db, const void *embedding, embedding_type type, int dimension) {
+    sqlite3_str *s = sqlite3_str_new(db);
+    sqlite3_str_appendchar(s, 1, '[');
+    for (int i = 0; i < dimension; i++) {
+        if (i) sqlite3_str_appendchar(s, 1, ',');
+        float value = 0.0;
         
-    // passing NULL as xdata because context has been already created
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (parse_keyvalue_string(ai, model_options, llm_context_options_callback, NULL) == false) return;
-    
-    // real processing
-    llm_embed_generate_run(context, text, text_len);
+        switch (type) {
+            case EMBEDDING_TYPE_F32:
+                value = ((float *)embedding)[i];
+                break;
+                
+            case EMBEDDING_TYPE_F16:
+                value = float16_to_float32(((uint16_t *)embedding)[i]);
+                break;
+                
+            case EMBEDDING_TYPE_BF16:
+                value = bfloat16_to_float32(((uint16_t *)embedding)[i]);
+                break;
+                
+            case EMBEDDING_TYPE_U8:
+                value = (float)(((uint8_t *)embedding)[i]);
+                break;
+                
+            case EMBEDDING_TYPE_I8:
+                value = (float)(((int8_t *)embedding)[i]);
+                break;
+        }
+        sqlite3_str_appendf(s, "%.6g", value);
+    }
+    sqlite3_str_appendchar(s, 1, ']');
+    return sqlite3_str_finish(s);
 }
 
-static void llm_token_count (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // sanity check args and context
-    if (llm_check_context(context) == false) return;
-    if (llm_common_args_check(context, "llm_token_count", argc, argv, true) == false) return;
+// set embedding as the result of context (as a BLOB or as a JSON array, according to the json_output option)
+static void llm_embed_result (sqlite3_context *context, ai_context *ai, void *embedding, int embedding_size, void(*destructor)(void*)) {
+    if (ai->options.embedding.json_output) {
+        embedding_type type = ai->options.embedding.type;
+        int dimension = embedding_size / (int)embedding_type_to_size(type);
+        char *json = llm_embed_to_json(sqlite3_context_db_handle(context), embedding, type, dimension);
+        (json) ? sqlite3_result_text(context, json, -1, sqlite3_free) : sqlite3_result_null(context);
+        if (destructor == sqlite3_free) sqlite3_free(embedding);
+    } else {
+        sqlite3_result_blob(context, embedding, embedding_size, destructor);
+    }
+}
+
+static void llm_embed_generate_run (sqlite3_context *context, const char *text, int32_t text_len) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    uint8_t key[AI_EMBED_CACHE_KEY_SIZE];
+    bool use_cache = llm_embed_cache_enabled(ai);
+    if (!llm_embed_batch_check(ai, context, NULL, EMBED_MODE_POOLED)) return;
+
+    llm_embed_cache_key(ai, text, text_len, key);
+
+    int size = 0;
+    void *cached = llm_embed_memo_get(context, key, &size);
+    if (!cached && use_cache) {
+        if (llm_embed_cache_check(context, ai) == false) return;
+        cached = llm_embed_cache_get(ai, db, key, &size);
+        if (cached) llm_embed_memo_set(context, key, cached, size);
+    }
+    if (cached) {
+        llm_embed_result(context, ai, cached, size, sqlite3_free);
+        return;
+    }
+
+    llm_embed_batch eb;
+    if (!llm_embed_batch_init(ai, context, NULL, &eb, EMBED_MODE_POOLED)) return;
+
+    llm_embed_input input = {0};
+    void *embedding = NULL;
+
+    if (!llm_embed_batch_tokenize(&eb, context, NULL, text, text_len, &input)) goto cleanup;
+
+    // allocate embedding buffer
+    embedding = sqlite3_malloc64(eb.embedding_size);
+    if (!embedding) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate embedding buffer of size %d", eb.embedding_size);
+        goto cleanup;
+    }
+
+    if (!llm_embed_batch_decode(&eb, context, NULL, &input, 1, (uint8_t *)embedding)) goto cleanup;
+    if (use_cache && !llm_embed_cache_put(context, ai, db, key, embedding, eb.embedding_size)) goto cleanup;
+    llm_embed_memo_set(context, key, embedding, eb.embedding_size);
+
+    llm_embed_result(context, ai, embedding, eb.embedding_size, sqlite3_free);
+    embedding = NULL;
+
+cleanup:
+    if (embedding) sqlite3_free(embedding);
+    llm_embed_input_reset(&input);
+    llm_embed_batch_free(&eb);
+}
+
+static void llm_embed_generate_exec (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context(context) == false) return;
+    if (llm_common_args_check(context, "llm_embed_generate", argc, argv, true) == false) return;
     
     const char *text = (const char *)sqlite3_value_text(argv[0]);
     int32_t text_len = (int32_t)sqlite3_value_bytes(argv[0]);
-    if (!text || text_len == 0) return;
+    const char *model_options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
     
-    // sanity check vocab
+    // handle NULL input
+    if (!text || text_len == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+        
     ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
-    if (!vocab) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
+    if (llm_context_options_parse(context, ai, 1, model_options) == false) return;
+    
+    // real processing
+    llm_embed_generate_run(context, text, text_len);
+}
+
+static void llm_rerank_exec (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context(context) == false) return;
+    if (argc != 2 && argc != 3) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Function 'llm_rerank' expects 2 or 3 arguments, but %d were provided.", argc);
         return;
     }
     
-    int32_t n_tokens = -llama_tokenize(vocab, text, text_len, NULL, 0, true, false);
-    sqlite3_result_int64(context, n_tokens);
+    // handle NULL input
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    int types[] = {SQLITE_TEXT, SQLITE_TEXT, SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "llm_rerank", argc, argv, argc, types, true, false) == false) return;
+    
+    const char *query = (const char *)sqlite3_value_text(argv[0]);
+    int32_t query_len = (int32_t)sqlite3_value_bytes(argv[0]);
+    const char *document = (const char *)sqlite3_value_text(argv[1]);
+    int32_t document_len = (int32_t)sqlite3_value_bytes(argv[1]);
+    const char *options = (argc == 3) ? (const char *)sqlite3_value_text(argv[2]) : NULL;
+    if (query_len == 0 || document_len == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (llm_context_options_parse(context, ai, 2, options) == false) return;
+    
+    llm_embed_batch eb;
+    if (!llm_embed_batch_init(ai, context, NULL, &eb, EMBED_MODE_RANK)) return;
+    
+    llm_embed_input input = {0};
+    float score = 0.0f;
+    if (!llm_rerank_batch_set_query(&eb, context, NULL, query, query_len)) goto cleanup;
+    if (!llm_rerank_batch_tokenize(&eb, context, NULL, document, document_len, &input)) goto cleanup;
+    if (!llm_embed_batch_decode(&eb, context, NULL, &input, 1, (uint8_t *)&score)) goto cleanup;
+    sqlite3_result_double(context, (double)score);
+    
+cleanup:
+    llm_embed_input_reset(&input);
+    llm_embed_batch_free(&eb);
 }
 
-// MARK: - Text Generation -
+typedef struct {
+    const struct llama_vocab    *vocab;
+    int32_t                     n_tokens;
+} llm_token_count_memo;
 
-static void llm_text_run (sqlite3_context *context, const char *text, int32_t text_len) {
+static void llm_token_count (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // sanity check args and context (only the vocabulary of the model is used, so a pooled context is not checked out)
     ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llama_token *tokens = NULL;
-    bool buffer_initialized = false;
-    buffer_t buffer = {0};
-    char *formatted_prompt = NULL;
-
+    if (!ai->ctx && !ai->pool) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create() before using this function.");
+        return;
+    }
+    if (llm_common_args_check(context, "llm_token_count", argc, argv, true) == false) return;
+    
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    int32_t text_len = (int32_t)sqlite3_value_bytes(argv[0]);
+    if (!text || text_len == 0) return;
+    
     // sanity check vocab
     const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
     if (!vocab) {
         sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
         return;
     }
-
-    struct llama_context *ctx = ai->ctx;
-    if (ctx == NULL) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "No context found. Please call llm_context_create() before using this function.");
+    
+    // constant text argument: count once per statement
+    llm_token_count_memo *memo = (llm_token_count_memo *)sqlite3_get_auxdata(context, 0);
+    if (memo && memo->vocab == vocab) {
+        sqlite3_result_int64(context, memo->n_tokens);
         return;
     }
-
-    // if the model has a chat template, wrap the prompt so the model emits EOG tokens
-    const char *chat_template = llama_model_chat_template(ai->model, NULL);
-    if (chat_template) {
-        llama_chat_message messages[] = {{ ROLE_USER, text }};
-        int32_t formatted_len = llama_chat_apply_template(chat_template, messages, 1, true, NULL, 0);
-        if (formatted_len > 0) {
-            formatted_prompt = (char *)sqlite3_malloc64(formatted_len + 1);
-            if (!formatted_prompt) {
-                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate formatted prompt");
-                return;
-            }
-            llama_chat_apply_template(chat_template, messages, 1, true, formatted_prompt, formatted_len + 1);
-            formatted_prompt[formatted_len] = '\0';
-            text = formatted_prompt;
-            text_len = formatted_len;
-        }
+    
+    int32_t n_tokens = -llama_tokenize(vocab, text, text_len, NULL, 0, true, false);
+    sqlite3_result_int64(context, n_tokens);
+    
+    memo = (llm_token_count_memo *)sqlite3_malloc(sizeof(llm_token_count_memo));
+    if (memo) {
+        memo->vocab = vocab;
+        memo->n_tokens = n_tokens;
+        sqlite3_set_auxdata(context, 0, memo, sqlite3_free);
     }
+}
 
-    // clear KV cache so each generation starts clean
-    llama_memory_t memory = llama_get_memory(ctx);
-    if (memory) llama_memory_clear(memory, true);
+// MARK: - Parallel Embedding Workers -
 
-    const int n_ctx = (int)llama_n_ctx(ctx);
-    const int n_batch = (int)llama_n_batch(ctx);
+// with embedding_workers=K the batched embedding functions hand their groups to K threads, each one with its own context
+// over the shared model: small embedding models stop scaling with the threads of a single context long before the cores run out,
+// while independent contexts decode in parallel. Groups go through a bounded queue and are consumed by the cursor in input order
 
-    // find the number of tokens in the prompt
-    int n_prompt = -llama_tokenize(vocab, text, text_len, NULL, 0, true, true);
-    if (n_prompt <= 0) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to extract number of tokens from prompt");
-        goto error;
-    }
+// rows embedded with a single encode/decode call (by the cursor itself or by one of the workers)
+typedef struct {
+    const llm_embed_batch       *eb;                // settings of the batch of the cursor
+    sqlite3_value               **ids;
+    llm_embed_input             *inputs;
+    uint8_t                     *output;
+    int                         n_rows;
+    
+    // set by the worker that embedded the group
+    bool                        done;
+    int                         rc;
+    char                        *error;
+} llm_embed_group;
 
-    // ensure prompt leaves room for at least one generated token
-    int max_prompt = n_ctx - 1;
-    if (max_prompt <= 0) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Context size too small for text generation (n_ctx=%d)", n_ctx);
-        goto error;
-    }
-    if (n_prompt > max_prompt) {
-        n_prompt = max_prompt;
-    }
+typedef struct {
+    ai_embed_workers            *owner;
+    pthread_t                   thread;
+    bool                        started;
+    struct llama_context        *ctx;
+    llm_embed_batch             eb;                 // buffers bound to ctx, settings copied from the group being embedded
+    sqlite3_vtab                errors;             // receives the error message of a failed group
+} ai_embed_worker;
+
+struct ai_embed_workers {
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;               // signaled when a group is queued or done, and on stop
+    ai_embed_worker             *items;
+    int                         count;
+    int                         users;              // cursors using the workers
+    bool                        stop;
+    
+    llm_embed_group             **queue;
+    int                         queue_capacity;
+    int                         queue_head;
+    int                         queue_count;
+};
 
-    // allocate space for the tokens and tokenize the prompt
-    tokens = (llama_token *)sqlite3_malloc(n_prompt * sizeof(llama_token));
-    if (!tokens) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate %d tokens", n_prompt);
-        goto error;
+// settings of src with the context and the buffers of dest
+static void llm_embed_batch_bind (llm_embed_batch *dest, const llm_embed_batch *src) {
+    struct llama_context *ctx = dest->ctx;
+    llama_batch batch = dest->batch;
+    float *accumulator = dest->accumulator;
+    int *units = dest->units;
+    
+    *dest = *src;
+    dest->ctx = ctx;
+    dest->batch = batch;
+    dest->accumulator = accumulator;
+    dest->units = units;
+    dest->query = NULL;
+    dest->query_tokens = NULL;
+}
+
+static void *llm_embed_worker_run (void *arg) {
+    ai_embed_worker *worker = (ai_embed_worker *)arg;
+    ai_embed_workers *workers = worker->owner;
+    
+    pthread_mutex_lock(&workers->mutex);
+    while (true) {
+        while (!workers->stop && workers->queue_count == 0) pthread_cond_wait(&workers->cond, &workers->mutex);
+        if (workers->stop) break;
+        
+        llm_embed_group *group = workers->queue[workers->queue_head];
+        workers->queue_head = (workers->queue_head + 1) % workers->queue_capacity;
+        workers->queue_count--;
+        pthread_cond_broadcast(&workers->cond);
+        pthread_mutex_unlock(&workers->mutex);
+        
+        llm_embed_batch_bind(&worker->eb, group->eb);
+        bool ok = llm_embed_batch_decode(&worker->eb, NULL, &worker->errors, group->inputs, group->n_rows, group->output);
+        
+        pthread_mutex_lock(&workers->mutex);
+        group->rc = (ok) ? SQLITE_OK : SQLITE_ERROR;
+        group->error = worker->errors.zErrMsg;
+        worker->errors.zErrMsg = NULL;
+        group->done = true;
+        pthread_cond_broadcast(&workers->cond);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+    return NULL;
+}
+
+static void llm_embed_workers_destroy (ai_embed_workers *workers) {
+    pthread_mutex_lock(&workers->mutex);
+    workers->stop = true;
+    pthread_cond_broadcast(&workers->cond);
+    pthread_mutex_unlock(&workers->mutex);
+    
+    for (int i = 0; i < workers->count; ++i) {
+        ai_embed_worker *worker = &workers->items[i];
+        if (worker->started) pthread_join(worker->thread, NULL);
+        if (worker->eb.batch.token) llama_batch_free(worker->eb.batch);
+        sqlite3_free(worker->eb.units);
+        sqlite3_free(worker->eb.accumulator);
+        sqlite3_free(worker->errors.zErrMsg);
+        if (worker->ctx) llama_free(worker->ctx);
+    }
+    pthread_cond_destroy(&workers->cond);
+    pthread_mutex_destroy(&workers->mutex);
+    sqlite3_free(workers->items);
+    sqlite3_free(workers->queue);
+    sqlite3_free(workers);
+}
+
+static void llm_embed_workers_free (ai_context *ai) {
+    if (ai->embed_workers) llm_embed_workers_destroy(ai->embed_workers);
+    ai->embed_workers = NULL;
+}
+
+// create the K workers of the connection for the batch eb (threads of the context are split among the workers)
+static ai_embed_workers *llm_embed_workers_create (ai_context *ai, sqlite3_vtab *vtab, const llm_embed_batch *eb, int count) {
+    ai_embed_workers *workers = (ai_embed_workers *)sqlite3_malloc(sizeof(ai_embed_workers));
+    if (!workers) {
+        sqlite_vtab_set_error(vtab, "Out of memory: failed to allocate embedding workers");
+        return NULL;
     }
-
-    int n_actual = llama_tokenize(vocab, text, text_len, tokens, n_prompt, true, true);
-    if (n_actual < 0) {
-        // input needs more tokens than n_prompt — tokenize fully then truncate
-        int n_full = -n_actual;
-        llama_token *full_tokens = (llama_token *)sqlite3_malloc(n_full * sizeof(llama_token));
-        if (!full_tokens) {
-            sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate %d tokens", n_full);
-            goto error;
+    memset(workers, 0, sizeof(ai_embed_workers));
+    pthread_mutex_init(&workers->mutex, NULL);
+    pthread_cond_init(&workers->cond, NULL);
+    
+    workers->queue_capacity = count * 2;
+    workers->items = (ai_embed_worker *)sqlite3_malloc64(count * sizeof(ai_embed_worker));
+    workers->queue = (llm_embed_group **)sqlite3_malloc64(workers->queue_capacity * sizeof(llm_embed_group *));
+    if (!workers->items || !workers->queue) {
+        llm_embed_workers_destroy(workers);
+        sqlite_vtab_set_error(vtab, "Out of memory: failed to allocate embedding workers");
+        return NULL;
+    }
+    memset(workers->items, 0, count * sizeof(ai_embed_worker));
+    workers->count = count;
+    
+    struct llama_context_params params = ai->ctx_params;
+    int n_threads = (int)params.n_threads_batch / count;
+    params.n_threads = params.n_threads_batch = (n_threads < 1) ? 1 : n_threads;
+    
+    for (int i = 0; i < count; ++i) {
+        ai_embed_worker *worker = &workers->items[i];
+        worker->owner = workers;
+        worker->ctx = llama_init_from_model(ai->model, params);
+        if (!worker->ctx) {
+            llm_embed_workers_destroy(workers);
+            sqlite_vtab_set_error(vtab, "Unable to create the context of embedding worker %d", i);
+            return NULL;
         }
-        int n_got = llama_tokenize(vocab, text, text_len, full_tokens, n_full, true, true);
-        if (n_got < 0 || n_got != n_full) {
-            sqlite3_free(full_tokens);
-            sqlite_context_result_error(context, SQLITE_ERROR, "Tokenization failed");
-            goto error;
+        llama_set_embeddings(worker->ctx, true);
+        llm_lora_apply(ai, worker->ctx);
+        
+        worker->eb.ctx = worker->ctx;
+        worker->eb.batch = llama_batch_init(eb->n_batch, 0, 1);
+        worker->eb.units = (int *)sqlite3_malloc64(2 * eb->n_seq_max * sizeof(int));
+        int32_t n_embd = llama_model_n_embd(ai->model);
+        worker->eb.accumulator = (float *)sqlite3_malloc64(((n_embd > eb->dimension) ? n_embd : eb->dimension) * sizeof(float));
+        if (!worker->eb.batch.token || !worker->eb.units || !worker->eb.accumulator) {
+            llm_embed_workers_destroy(workers);
+            sqlite_vtab_set_error(vtab, "Out of memory: failed to allocate embedding workers");
+            return NULL;
         }
-        memcpy(tokens, full_tokens, n_prompt * sizeof(llama_token));
-        sqlite3_free(full_tokens);
-    } else {
-        n_prompt = n_actual;
-    }
-
-    // when n_predict is not set, default to 4096 tokens (capped by remaining context space)
-    // and let the model stop naturally via EOG
-    int n_predict = (ai->options.n_predict > 0) ? ai->options.n_predict : 4096;
-    if (n_predict > n_ctx - n_prompt) n_predict = n_ctx - n_prompt;
-    if (n_predict <= 0) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Prompt fills entire context (%d tokens), no room for generation", n_prompt);
-        goto error;
-    }
-
-    // initialize the sampler
-    bool sampler_already_setup = (ai->sampler != NULL);
-    struct llama_sampler *sampler = llm_sampler_check(ai);
-    if (!sampler) goto error;
-    if (!sampler_already_setup) {
-        // no sampler was setup, so initialize it with some default values
-        llama_sampler_chain_add(sampler, llama_sampler_init_penalties(64, 1.1, 0, 0));
-        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
-    }
-
-    // allocate output buffer (starts small, grows dynamically via buffer_append)
-    if (!buffer_create(&buffer, 0)) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate buffer");
-        goto error_sampler;
+        
+        if (pthread_create(&worker->thread, NULL, llm_embed_worker_run, worker) != 0) {
+            llm_embed_workers_destroy(workers);
+            sqlite_vtab_set_error(vtab, "Unable to start embedding worker %d", i);
+            return NULL;
+        }
+        worker->started = true;
     }
-    buffer_initialized = true;
+    return workers;
+}
 
-    // feed prompt in batches of n_batch tokens
-    {
-        int prompt_pos = 0;
-        while (prompt_pos < n_prompt) {
-            int chunk = n_prompt - prompt_pos;
-            if (chunk > n_batch) chunk = n_batch;
-            struct llama_batch batch = llama_batch_get_one(tokens + prompt_pos, chunk);
-            if (llama_decode(ctx, batch)) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to execute the decoding function during prompt processing");
-                goto error_sampler;
-            }
-            prompt_pos += chunk;
-        }
+// workers of the connection according to the embedding_workers option, *workers is NULL when groups are embedded by the caller
+// (with a single worker the cursor tokenizes and reads the next rows while the worker decodes)
+static bool llm_embed_workers_check (ai_context *ai, sqlite3_vtab *vtab, const llm_embed_batch *eb, ai_embed_workers **workers) {
+    *workers = NULL;
+    int count = ai->options.embedding.workers;
+    if (count <= 0) return true;
+    
+    // workers in use by another cursor are kept even if the option changed
+    if (ai->embed_workers && (ai->embed_workers->count == count || ai->embed_workers->users > 0)) {
+        *workers = ai->embed_workers;
+    } else {
+        llm_embed_workers_free(ai);
+        ai->embed_workers = llm_embed_workers_create(ai, vtab, eb, count);
+        if (!ai->embed_workers) return false;
+        *workers = ai->embed_workers;
     }
+    (*workers)->users++;
+    return true;
+}
 
-    // generate tokens
-    {
-        llama_token new_token_id;
-        for (int i = 0; i < n_predict; i++) {
-            new_token_id = llama_sampler_sample(sampler, ctx, -1);
+static void llm_embed_workers_submit (ai_embed_workers *workers, llm_embed_group *group) {
+    pthread_mutex_lock(&workers->mutex);
+    while (workers->queue_count == workers->queue_capacity) pthread_cond_wait(&workers->cond, &workers->mutex);
+    group->done = false;
+    group->rc = SQLITE_OK;
+    workers->queue[(workers->queue_head + workers->queue_count) % workers->queue_capacity] = group;
+    workers->queue_count++;
+    pthread_cond_broadcast(&workers->cond);
+    pthread_mutex_unlock(&workers->mutex);
+}
 
-            if (llama_vocab_is_eog(vocab, new_token_id)) {
-                break;
-            }
+static void llm_embed_workers_wait (ai_embed_workers *workers, llm_embed_group *group) {
+    pthread_mutex_lock(&workers->mutex);
+    while (!group->done) pthread_cond_wait(&workers->cond, &workers->mutex);
+    pthread_mutex_unlock(&workers->mutex);
+}
 
-            char buf[MAX_TOKEN_TEXT_LEN];
-            int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
-            if (n < 0) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert token to piece (%d)", n);
-                goto error_sampler;
-            }
+// MARK: - Batched Embedding Virtual Table -
 
-            if (buffer_append(&buffer, buf, n, true) == false) {
-                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to append to buffer");
-                goto error_sampler;
-            }
+#define AI_EMBED_COLUMN_ID                      0
+#define AI_EMBED_COLUMN_EMBEDDING               1       // score in llm_rerank_batch
+#define AI_EMBED_COLUMN_INPUT                   2       // first argument (followed by the other arguments and by options)
 
-            // decode the sampled token to advance the KV cache
-            struct llama_batch batch = llama_batch_get_one(&new_token_id, 1);
-            if (llama_decode(ctx, batch)) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to execute the decoding function during generation");
-                goto error_sampler;
+typedef struct {
+    sqlite3_vtab_cursor         base;               // Base class - must be first
+    ai_vtab                     *vtab;
+    ai_context                  *ai;
+    
+    sqlite3_stmt                *source;            // rows are (id, text)
+    bool                        source_done;
+    llm_embed_batch             eb;
+    
+    // ring of groups in input order, groups[head] is the current one (a single group when embedding on the connection context)
+    llm_embed_group             *groups;
+    int                         n_groups;
+    int                         head;
+    int                         n_queued;           // groups read from source and not consumed yet, current one included
+    int                         capacity;           // rows of each group
+    int                         index;
+    ai_embed_workers            *workers;
+    bool                        checked_out;        // rows are embedded lazily, so a pooled context is kept until the cursor is reset
+    
+    // row read from source that did not fit in the previous group
+    sqlite3_value               *pending_id;
+    llm_embed_input             pending_input;
+    bool                        has_pending;
+    
+    sqlite_int64                rowid;
+    bool                        is_eof;
+} ai_embed_cursor;
+
+static void llm_embed_cursor_reset_group (llm_embed_group *group) {
+    for (int i = 0; i < group->n_rows; ++i) {
+        sqlite3_value_free(group->ids[i]);
+        group->ids[i] = NULL;
+        llm_embed_input_reset(&group->inputs[i]);
+    }
+    group->n_rows = 0;
+    sqlite3_free(group->error);
+    group->error = NULL;
+}
+
+static void llm_embed_cursor_reset (ai_embed_cursor *c) {
+    // groups still queued are used by the workers until they are done
+    for (int i = 0; c->workers && i < c->n_queued; ++i) {
+        llm_embed_workers_wait(c->workers, &c->groups[(c->head + i) % c->n_groups]);
+    }
+    if (c->workers) c->workers->users--;
+    c->workers = NULL;
+    
+    for (int i = 0; i < c->n_groups; ++i) {
+        llm_embed_group *group = &c->groups[i];
+        llm_embed_cursor_reset_group(group);
+        sqlite3_free(group->ids);
+        sqlite3_free(group->inputs);
+        sqlite3_free(group->output);
+    }
+    sqlite3_free(c->groups);
+    c->groups = NULL;
+    c->n_groups = 0;
+    c->head = 0;
+    c->n_queued = 0;
+    c->capacity = 0;
+    c->index = 0;
+    
+    if (c->has_pending) {
+        sqlite3_value_free(c->pending_id);
+        llm_embed_input_reset(&c->pending_input);
+        c->pending_id = NULL;
+        c->has_pending = false;
+    }
+    if (c->source) sqlite3_finalize(c->source);
+    c->source = NULL;
+    c->source_done = false;
+    
+    llm_embed_batch_free(&c->eb);
+    llm_context_cursor_checkin(c->ai, &c->checked_out);
+    c->rowid = 0;
+    c->is_eof = true;
+}
+
+// read rows from source until group is full (rows are only tokenized here, embedding is up to the caller)
+static int llm_embed_cursor_read (ai_embed_cursor *c, llm_embed_group *group) {
+    sqlite3_vtab *vtab = &c->vtab->base;
+    llm_embed_batch *eb = &c->eb;
+    llm_embed_cursor_reset_group(group);
+    
+    int n_seq = 0;
+    int n_tokens = 0;
+    if (c->has_pending) {
+        group->ids[0] = c->pending_id;
+        group->inputs[0] = c->pending_input;
+        c->pending_id = NULL;
+        c->pending_input = (llm_embed_input){0};
+        c->has_pending = false;
+        group->n_rows = 1;
+        n_seq = llm_embed_input_sequences(&group->inputs[0]);
+        n_tokens = llm_embed_input_tokens(eb, &group->inputs[0]);
+    }
+    
+    while (!c->source_done && group->n_rows < c->capacity) {
+        int rc = sqlite3_step(c->source);
+        if (rc == SQLITE_DONE) {c->source_done = true; break;}
+        if (rc != SQLITE_ROW) return sqlite_vtab_set_error(vtab, "%s", sqlite3_errmsg(sqlite3_db_handle(c->source)));
+        
+        sqlite3_value *id = sqlite3_value_dup(sqlite3_column_value(c->source, 0));
+        if (!id) return SQLITE_NOMEM;
+        
+        llm_embed_input input = {0};
+        const char *text = (const char *)sqlite3_column_text(c->source, 1);
+        int32_t text_len = (int32_t)sqlite3_column_bytes(c->source, 1);
+        if (text && text_len > 0) {
+            bool tokenized = (eb->is_rank) ? llm_rerank_batch_tokenize(eb, NULL, vtab, text, text_len, &input) : llm_embed_batch_tokenize(eb, NULL, vtab, text, text_len, &input);
+            if (!tokenized) {
+                sqlite3_value_free(id);
+                return SQLITE_ERROR;
             }
         }
+        
+        if (!llm_embed_batch_fits(eb, n_seq, n_tokens, &input)) {
+            c->pending_id = id;
+            c->pending_input = input;
+            c->has_pending = true;
+            break;
+        }
+        
+        group->ids[group->n_rows] = id;
+        group->inputs[group->n_rows] = input;
+        group->n_rows++;
+        n_seq += llm_embed_input_sequences(&input);
+        n_tokens += llm_embed_input_tokens(eb, &input);
     }
+    
+    return SQLITE_OK;
+}
 
-    // success — transfer buffer ownership to SQLite
-    sqlite3_result_text(context, buffer.data, buffer.length, sqlite3_free);
-    sqlite3_free(tokens);
-    sqlite3_free(formatted_prompt);
-    if (!sampler_already_setup) llama_sampler_free(sampler);
-    return;
-
-error_sampler:
-    if (!sampler_already_setup && ai->sampler) {
-        llama_sampler_free(ai->sampler);
-        ai->sampler = NULL;
+// move to the next group: read ahead until every free group is queued (embedded at once without workers), then wait for the head one
+static int llm_embed_cursor_fill (ai_embed_cursor *c) {
+    sqlite3_vtab *vtab = &c->vtab->base;
+    if (c->n_queued > 0) {
+        llm_embed_cursor_reset_group(&c->groups[c->head]);
+        c->head = (c->head + 1) % c->n_groups;
+        c->n_queued--;
     }
-error:
-    if (buffer_initialized) buffer_destroy(&buffer);
-    sqlite3_free(tokens);
-    sqlite3_free(formatted_prompt);
-}
-
-static void llm_text_generate (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (llm_check_context(context) == false) return;
-
-    if (argc < 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "llm_text_generate requires at least one TEXT argument (prompt)");
-        return;
+    c->index = 0;
+    
+    while (c->n_queued < c->n_groups && (!c->source_done || c->has_pending)) {
+        llm_embed_group *group = &c->groups[(c->head + c->n_queued) % c->n_groups];
+        int rc = llm_embed_cursor_read(c, group);
+        if (rc != SQLITE_OK) return rc;
+        if (group->n_rows == 0) break;
+        c->n_queued++;
+        
+        if (c->workers) {
+            llm_embed_workers_submit(c->workers, group);
+        } else {
+            if (!llm_embed_batch_decode(&c->eb, NULL, vtab, group->inputs, group->n_rows, group->output)) return SQLITE_ERROR;
+            group->done = true;
+        }
     }
-
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (!ai->model) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded");
-        return;
+    
+    if (c->n_queued == 0) {
+        c->is_eof = true;
+        return SQLITE_OK;
     }
+    
+    llm_embed_group *group = &c->groups[c->head];
+    if (c->workers) llm_embed_workers_wait(c->workers, group);
+    if (group->rc != SQLITE_OK) return sqlite_vtab_set_error(vtab, "%s", (group->error) ? group->error : "Embedding worker failed");
+    return SQLITE_OK;
+}
 
-    const char *text = (const char *)sqlite3_value_text(argv[0]);
-    int32_t text_len = (int32_t)sqlite3_value_bytes(argv[0]);
-    if (!text || text_len == 0) return;
-
-    // parse remaining args: TEXT with '=' is options, TEXT without '=' or BLOB is an image
-    const char *options = NULL;
-    sqlite3_value *image_args[64];
-    int n_images = 0;
+// take ownership of source (a statement returning (id, text) rows) and compute the first group
+// when query is not NULL each text is a document scored against query instead of being embedded
+static int llm_embed_cursor_start (ai_embed_cursor *c, sqlite3_stmt *source, const char *query, int32_t query_len) {
+    ai_context *ai = c->ai;
+    sqlite3_vtab *vtab = &c->vtab->base;
+    
+    c->source = source;
+    c->is_eof = false;
+    if (!llm_embed_batch_init(ai, NULL, vtab, &c->eb, (query != NULL) ? EMBED_MODE_RANK : EMBED_MODE_POOLED)) return SQLITE_ERROR;
+    if (query && !llm_rerank_batch_set_query(&c->eb, NULL, vtab, query, query_len)) return SQLITE_ERROR;
+    if (!llm_embed_workers_check(ai, vtab, &c->eb, &c->workers)) return SQLITE_ERROR;
+    
+    // two groups per worker keep every worker busy while the previous results are consumed
+    c->n_groups = (c->workers) ? c->workers->count * 2 : 1;
+    c->groups = (llm_embed_group *)sqlite3_malloc64(c->n_groups * sizeof(llm_embed_group));
+    if (!c->groups) {c->n_groups = 0; return SQLITE_NOMEM;}
+    memset(c->groups, 0, c->n_groups * sizeof(llm_embed_group));
+    
+    // a group holds at most n_seq_max rows with text, up to the same number of NULL rows is allowed in between
+    c->capacity = c->eb.n_seq_max * 2;
+    for (int i = 0; i < c->n_groups; ++i) {
+        llm_embed_group *group = &c->groups[i];
+        group->eb = &c->eb;
+        group->ids = (sqlite3_value **)sqlite3_malloc64(c->capacity * sizeof(sqlite3_value *));
+        group->inputs = (llm_embed_input *)sqlite3_malloc64(c->capacity * sizeof(llm_embed_input));
+        group->output = (uint8_t *)sqlite3_malloc64((sqlite3_uint64)c->capacity * c->eb.embedding_size);
+        if (!group->ids || !group->inputs || !group->output) return SQLITE_NOMEM;
+        memset(group->ids, 0, c->capacity * sizeof(sqlite3_value *));
+        memset(group->inputs, 0, c->capacity * sizeof(llm_embed_input));
+    }
+    
+    return llm_embed_cursor_fill(c);
+}
+
+static int llm_embed_connect_common (sqlite3 *db, void *pAux, const char *schema, sqlite3_vtab **ppVtab) {
+    int rc = sqlite3_declare_vtab(db, schema);
+    if (rc != SQLITE_OK) return rc;
+    
+    ai_vtab *vtab = (ai_vtab *)sqlite3_malloc(sizeof(ai_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    
+    memset(vtab, 0, sizeof(ai_vtab));
+    ai_context *ai = (ai_context *)pAux;
+    
+    vtab->ai = ai;
+    ai->db = db;
+    
+    *ppVtab = (sqlite3_vtab *)vtab;
+    return SQLITE_OK;
+}
 
-    for (int i = 1; i < argc; i++) {
-        int type = sqlite3_value_type(argv[i]);
-        if (type == SQLITE_NULL) continue;
-        if (type == SQLITE_TEXT && !options) {
-            const char *val = (const char *)sqlite3_value_text(argv[i]);
-            if (val && strchr(val, '=')) {
-                options = val;
-                continue;
-            }
-        }
-        if (n_images < 64) image_args[n_images++] = argv[i];
-    }
+static int llm_embed_generate_batch_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return llm_embed_connect_common(db, pAux, "CREATE TABLE x(id, embedding, texts hidden, options hidden);", ppVtab);
+}
 
-    // apply options if any
-    if (parse_keyvalue_string(ai, options, llm_context_options_callback, NULL) == false) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
-        return;
-    }
+static int llm_embed_each_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return llm_embed_connect_common(db, pAux, "CREATE TABLE x(id, embedding, sql hidden, options hidden);", ppVtab);
+}
 
-    if (n_images > 0) {
-        if (!ai->vision) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Images provided but no vision model loaded. Call llm_vision_load() first.");
-            return;
-        }
-        llm_text_run_vision(context, text, text_len, image_args, n_images);
-    } else {
-        llm_text_run(context, text, text_len);
-    }
+static int llm_rerank_batch_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return llm_embed_connect_common(db, pAux, "CREATE TABLE x(id, score, query hidden, documents hidden, options hidden);", ppVtab);
 }
 
-// MARK: - Chat -
+static int llm_embed_disconnect (sqlite3_vtab *pVtab) {
+    ai_vtab *vtab = (ai_vtab *)pVtab;
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
 
-static bool llm_chat_check_context (ai_context *ai) {
-    if (!ai || !ai->ctx) {
-        sqlite_common_set_error(ai ? ai->context : NULL, ai ? ai->vtab : NULL, SQLITE_MISUSE, "No context found. Please call llm_context_create() before llm_chat_create().");
-        return false;
-    }
+// hidden columns from first_column are the arguments: n_required mandatory ones followed by the optional options
+static int llm_embed_best_index_common (sqlite3_index_info *pIdxInfo, int first_column, int n_required) {
+    int indexes[4] = {-1, -1, -1, -1};
     
-    // check sampler
-    if (!ai->sampler) {
-        llm_sampler_check(ai);
-        if (ai->sampler == NULL) return false;
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_min_p(0.05, 1));
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_temp(0.8));
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_dist((uint32_t)LLAMA_DEFAULT_SEED));
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint *constraint = &pIdxInfo->aConstraint[i];
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        int arg = constraint->iColumn - first_column;
+        if (arg < 0 || arg > n_required) continue;
+        if (!constraint->usable) return SQLITE_CONSTRAINT;
+        indexes[arg] = i;
     }
     
-    // initialize the chat struct if already created
-    if (ai->chat.uuid[0] != '\0') return true;
-    
-    // create history structs
-    ai_uuid_v7_string(ai->chat.uuid, true);
+    // input arguments are mandatory
+    for (int i = 0; i < n_required; i++) {
+        if (indexes[i] < 0) return SQLITE_CONSTRAINT;
+    }
     
-    int n_ctx = llama_n_ctx(ai->ctx);
-    if (!buffer_create(&ai->chat.formatted, n_ctx) || !buffer_create(&ai->chat.response, MIN_ALLOC_RESPONSE)) {
-        sqlite_common_set_error(ai->context, ai->vtab, SQLITE_NOMEM, "Out of memory: failed to allocate chat buffers");
-        return false;
+    int n_args = (indexes[n_required] >= 0) ? n_required + 1 : n_required;
+    for (int i = 0; i < n_args; i++) {
+        pIdxInfo->aConstraintUsage[indexes[i]].argvIndex = i + 1;
+        pIdxInfo->aConstraintUsage[indexes[i]].omit = 1;
     }
+    pIdxInfo->idxNum = n_args;
+    pIdxInfo->estimatedCost = (double)1000;
+    
+    return SQLITE_OK;
+}
 
-    ai->chat.prompt = (char *)sqlite3_malloc(MIN_ALLOC_PROMPT);
-    ai->chat.tokens = (llama_token *)sqlite3_malloc(sizeof(llama_token) * MIN_ALLOC_TOKEN);
-    if (!ai->chat.prompt || !ai->chat.tokens) {
-        sqlite_common_set_error(ai->context, ai->vtab, SQLITE_NOMEM, "Out of memory: failed to allocate chat prompt/token buffers");
-        return false;
-    }
-    ai->chat.ntokens = MIN_ALLOC_TOKEN;
+static int llm_embed_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    return llm_embed_best_index_common(pIdxInfo, AI_EMBED_COLUMN_INPUT, 1);
+}
 
-    return true;
+static int llm_rerank_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    return llm_embed_best_index_common(pIdxInfo, AI_EMBED_COLUMN_INPUT, 2);
 }
 
-static bool llm_chat_save_response (ai_context *ai, ai_messages *messages, const char *template) {
-    char *response = ai->chat.response.data;
-    if (!response) return false;
-    
-    if (!llm_messages_append(messages, ROLE_ASSISTANT, response)) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to append response");
-        return false;
-    }
+static int llm_embed_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_embed_cursor *c = (ai_embed_cursor *)sqlite3_malloc(sizeof(ai_embed_cursor));
+    if (!c) return SQLITE_NOMEM;
     
-    ai->chat.prev_len = llama_chat_apply_template(template, messages->items, messages->count, false, NULL, 0);
-    if (ai->chat.prev_len < 0) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to finalize chat template");
-        return false;
-    }
+    memset(c, 0, sizeof(ai_embed_cursor));
+    ai_vtab *vtab = (ai_vtab *)pVtab;
+    c->vtab = vtab;
+    c->ai = vtab->ai;
+    c->is_eof = true;
     
-    return true;
+    *ppCursor = (sqlite3_vtab_cursor *)c;
+    return SQLITE_OK;
 }
 
-static bool llm_chat_generate_response (ai_context *ai, ai_cursor *c, bool *is_eog) {
-    struct llama_context *ctx = ai->ctx;
-    struct llama_sampler *sampler = ai->sampler;
-    const struct llama_vocab *vocab = ai->chat.vocab;
-    llama_batch batch = ai->chat.batch;
-    char *tok = ai->chat.token_text;
+static int llm_embed_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    llm_embed_cursor_reset(c);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
+
+static int llm_embed_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    c->rowid++;
+    if (++c->index < c->groups[c->head].n_rows) return SQLITE_OK;
+    return llm_embed_cursor_fill(c);
+}
+
+static int llm_embed_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    return (int)c->is_eof;
+}
+
+static int llm_embed_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    llm_embed_group *group = &c->groups[c->head];
+    int i = c->index;
     
-    // check context space
-    uint32_t n_ctx = llama_n_ctx(ctx);
-    int32_t n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(ctx), 0);
-    if (n_ctx_used + batch.n_tokens > n_ctx) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Context size exceeded (%d, %d)", n_ctx, n_ctx_used + batch.n_tokens);
-        return false;
+    if (iCol == AI_EMBED_COLUMN_ID) {
+        sqlite3_result_value(context, group->ids[i]);
+    } else if (iCol == AI_EMBED_COLUMN_EMBEDDING) {
+        if (group->inputs[i].n_tokens == 0) {
+            sqlite3_result_null(context);
+            return SQLITE_OK;
+        }
+        void *embedding = group->output + ((size_t)i * c->eb.embedding_size);
+        if (c->eb.is_rank) {
+            float score;
+            memcpy(&score, embedding, sizeof(float));
+            sqlite3_result_double(context, (double)score);
+            return SQLITE_OK;
+        }
+        llm_embed_result(context, c->ai, embedding, c->eb.embedding_size, SQLITE_TRANSIENT);
     }
+    return SQLITE_OK;
+}
+
+static int llm_embed_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    *pRowid = c->rowid;
+    return SQLITE_OK;
+}
+
+// common checks and options parsing for the model table-valued functions (n_args TEXT arguments followed by the optional options)
+static int llm_vtab_arguments_prepare (ai_vtab *vtab, const char *name, int n_args, int argc, sqlite3_value **argv) {
+    ai_context *ai = vtab->ai;
     
-    if (llama_decode(ctx, batch)) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to decode prompt batch");
-        return false;
+    if (!ai->model) {
+        return sqlite_vtab_set_error(&vtab->base, "No model is currently set. Please call llm_model_load() before using this function.");
     }
-    
-    // sample next token
-    ai->chat.token_id = llama_sampler_sample(sampler, ctx, -1);
-    
-    // DEBUG
-    // printf("%d ", ai->chat.token_id);
-    
-    if (llama_vocab_is_eog(vocab, ai->chat.token_id)) {
-        if (c) c->is_eog = true;
-        if (is_eog) *is_eog = true;
-        return true;
+    if (!ai->ctx && !ai->pool) {
+        return sqlite_vtab_set_error(&vtab->base, "No context found. Please call llm_context_create() before using this function.");
     }
-    
-    // convert token to string
-    int32_t n = llama_token_to_piece(vocab, ai->chat.token_id, tok, MAX_TOKEN_TEXT_LEN, 0, true);
-    if (n < 0) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to convert token to string");
-        return false;
+    if (argc < n_args || argc > n_args + 1) {
+        return sqlite_vtab_set_error(&vtab->base, "%s expects %d or %d arguments, but %d were provided.", name, n_args, n_args + 1, argc);
     }
-    ai->chat.token_len = n;
-    
-    // append converted token to response buffer
-    if (buffer_append(&ai->chat.response, tok, n, true) == false) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to grow response buffer");
-        return false;
+    for (int i = 0; i < argc; i++) {
+        if (sqlite3_value_type(argv[i]) != SQLITE_TEXT) {
+            return sqlite_vtab_set_error(&vtab->base, "%s arguments must be of type TEXT", name);
+        }
     }
     
-    // DEBUG
-    // fwrite(buf, 1, n, stdout);
-    // fflush(stdout);
+    // passing NULL as xdata because context has been already created
+    const char *options = (argc == n_args + 1) ? (const char *)sqlite3_value_text(argv[n_args]) : NULL;
+    if (parse_keyvalue_string(ai, options, llm_context_options_callback, NULL) == false) {
+        return sqlite_vtab_set_error(&vtab->base, "An error occurred while parsing options (%s)", options);
+    }
     
-    // prepare next batch
-    ai->chat.batch = llama_batch_get_one(&ai->chat.token_id, 1);
-    ai->chat.token_count++;
+    return SQLITE_OK;
+}
+
+static int llm_embed_cursor_prepare (ai_embed_cursor *c, const char *name, int n_args, int argc, sqlite3_value **argv) {
+    llm_embed_cursor_reset(c);
+    int rc = llm_vtab_arguments_prepare(c->vtab, name, n_args, argc, argv);
+    if (rc != SQLITE_OK) return rc;
     
-    return true;
+    if (!llm_context_cursor_checkout(c->ai, &c->checked_out)) {
+        return sqlite_vtab_set_error(&c->vtab->base, "Unable to create context from model");
+    }
+    return SQLITE_OK;
 }
 
-static bool llm_chat_tokenize_input (ai_context *ai, const char *prompt) {
-    struct llama_context *ctx = ai->ctx;
-    const struct llama_vocab *vocab = ai->chat.vocab;
+static int llm_embed_generate_batch_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    ai_vtab *vtab = c->vtab;
     
-    // check if first execution
-    bool is_first = (llama_memory_seq_pos_max(llama_get_memory(ctx), 0) == -1);
+    int rc = llm_embed_cursor_prepare(c, "llm_embed_generate_batch", 1, argc, argv);
+    if (rc != SQLITE_OK) return rc;
     
-    // count how many tokens prompt generates
-    int32_t prompt_len = (int32_t)strlen(prompt);
-    int32_t n_prompt_tokens = -llama_tokenize(vocab, prompt, prompt_len, NULL, 0, is_first, true);
-    if (n_prompt_tokens <= 0) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to determine prompt token count");
-        return false;
+    // json_each yields (key, value) so that id is the array index (or the object key)
+    sqlite3 *db = c->ai->db;
+    sqlite3_stmt *source = NULL;
+    rc = sqlite3_prepare_v2(db, "SELECT key, value FROM json_each(?1);", -1, &source, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_value(source, 1, argv[0]);
+    if (rc != SQLITE_OK) {
+        sqlite3_finalize(source);
+        return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
     }
     
-    // check if a new token allocation is required
-    if (ai->chat.ntokens < n_prompt_tokens) {
-        llama_token *prompt_tokens = sqlite3_malloc(sizeof(llama_token) * n_prompt_tokens);
-        if (!prompt_tokens) {
-            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_NOMEM, "Failed to allocate prompt token buffer");
-            return false;
-        }
-        if (ai->chat.tokens) sqlite3_free(ai->chat.tokens);
-        ai->chat.tokens = prompt_tokens;
-        ai->chat.ntokens = n_prompt_tokens;
-    }
+    return llm_embed_cursor_start(c, source, NULL, 0);
+}
+
+static sqlite3_module llm_embed_generate_batch = {
+  /* iVersion    */ 0,
+  /* xCreate     */ 0,
+  /* xConnect    */ llm_embed_generate_batch_connect,
+  /* xBestIndex  */ llm_embed_best_index,
+  /* xDisconnect */ llm_embed_disconnect,
+  /* xDestroy    */ 0,
+  /* xOpen       */ llm_embed_cursor_open,
+  /* xClose      */ llm_embed_cursor_close,
+  /* xFilter     */ llm_embed_generate_batch_filter,
+  /* xNext       */ llm_embed_cursor_next,
+  /* xEof        */ llm_embed_cursor_eof,
+  /* xColumn     */ llm_embed_cursor_column,
+  /* xRowid      */ llm_embed_cursor_rowid,
+  /* xUpdate     */ 0,
+  /* xBegin      */ 0,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ 0,
+  /* xFindMethod */ 0,
+  /* xRename     */ 0,
+  /* xSavepoint  */ 0,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ 0,
+  /* xShadowName */ 0,
+  /* xIntegrity  */ 0
+};
+
+static int llm_embed_each_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    ai_vtab *vtab = c->vtab;
     
-    // tokenize prompt
-    llama_token *prompt_tokens = ai->chat.tokens;
-    if (llama_tokenize(vocab, prompt, prompt_len, prompt_tokens, n_prompt_tokens, is_first, true) < 0) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to tokenize the prompt");
-        return false;
-    }
+    int rc = llm_embed_cursor_prepare(c, "llm_embed_each", 1, argc, argv);
+    if (rc != SQLITE_OK) return rc;
     
-    // create initial batch
-    ai->chat.batch = llama_batch_get_one(prompt_tokens, n_prompt_tokens);
+    // source query is executed lazily, rows are consumed one group at a time while the cursor advances
+    sqlite3 *db = c->ai->db;
+    sqlite3_stmt *source = NULL;
+    rc = sqlite3_prepare_v2(db, (const char *)sqlite3_value_text(argv[0]), -1, &source, NULL);
+    if (rc != SQLITE_OK) {
+        return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+    }
+    if (source == NULL || !sqlite3_stmt_readonly(source) || sqlite3_column_count(source) < 2) {
+        sqlite3_finalize(source);
+        return sqlite_vtab_set_error(&vtab->base, "llm_embed_each expects a read-only query returning (id, text) columns");
+    }
     
-    return true;
+    return llm_embed_cursor_start(c, source, NULL, 0);
 }
 
-static bool llm_chat_run (ai_context *ai, ai_cursor *c, const char *user_prompt) {
-    const char *template = llama_model_chat_template(ai->model, NULL);
-    if (!template) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Template not available");
-        return false;
-    }
-    
-    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
-    if (!vocab) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Model vocab not available");
-        return false;
-    }
-    
-    // setup context
-    ai->chat.vocab = vocab;
-    ai->chat.template = template;
-    ai_messages *messages = &ai->chat.messages;
-    buffer_t *formatted = &ai->chat.formatted;
-    
-    // save prompt input in history
-    if (!llm_messages_append(messages, ROLE_USER, user_prompt)) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to append message");
-        return false;
-    }
-    
-    // skip empty system message if present
-    size_t messages_count = messages->count;
-    const llama_chat_message *messages_items = messages->items;
-    if (messages->count > 0) {
-        const llama_chat_message first_message = messages->items[0];
-        if (first_message.role == ROLE_SYSTEM && first_message.content[0] == '\0') {
-            messages_items = messages->items + 1;
-            messages_count = messages->count - 1;
-        }
-    }
-    
-    // transform a list of messages (the context) into
-    // <|user|>What is AI?<|end|><|assistant|>AI stands for Artificial Intelligence...<|end|><|user|>Can you give an example?<|end|><|assistant|>...
-    int32_t new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
-    if (new_len > formatted->capacity) {
-        if (buffer_resize(formatted, new_len * 2) == false) return false;
-        new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
-    }
-    if ((new_len < 0) || (new_len > formatted->capacity)) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "failed to apply chat template");
-        return false;
-    }
-    
-    // check if there is enough space for the new formatted prompt
-    int32_t prompt_len = new_len - ai->chat.prev_len;
-    if (prompt_len <= 0) {
-        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Invalid prompt length (template state inconsistency)");
-        return false;
-    }
-    int32_t current_len = (int32_t)sqlite3_msize(ai->chat.prompt); // safe even if ai->chat.prompt is NULL
-    if (current_len < prompt_len + 1) {
-        char *buffer = (char *)sqlite3_malloc64(prompt_len + MIN_ALLOC_PROMPT);
-        if (!buffer) {
-            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_NOMEM, "Failed to allocate prompt buffer");
-            return false;
-        }
-        if (ai->chat.prompt) sqlite3_free(ai->chat.prompt);
-        ai->chat.prompt = buffer;
-    }
-    
-    // build templated version of the user prompt
-    memcpy(ai->chat.prompt, formatted->data + ai->chat.prev_len, prompt_len);
-    ai->chat.prompt[prompt_len] = 0;
+static sqlite3_module llm_embed_each = {
+  /* iVersion    */ 0,
+  /* xCreate     */ 0,
+  /* xConnect    */ llm_embed_each_connect,
+  /* xBestIndex  */ llm_embed_best_index,
+  /* xDisconnect */ llm_embed_disconnect,
+  /* xDestroy    */ 0,
+  /* xOpen       */ llm_embed_cursor_open,
+  /* xClose      */ llm_embed_cursor_close,
+  /* xFilter     */ llm_embed_each_filter,
+  /* xNext       */ llm_embed_cursor_next,
+  /* xEof        */ llm_embed_cursor_eof,
+  /* xColumn     */ llm_embed_cursor_column,
+  /* xRowid      */ llm_embed_cursor_rowid,
+  /* xUpdate     */ 0,
+  /* xBegin      */ 0,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ 0,
+  /* xFindMethod */ 0,
+  /* xRename     */ 0,
+  /* xSavepoint  */ 0,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ 0,
+  /* xShadowName */ 0,
+  /* xIntegrity  */ 0
+};
+
+static int llm_rerank_batch_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_embed_cursor *c = (ai_embed_cursor *)cur;
+    ai_vtab *vtab = c->vtab;
     
-    // tokenize input prompt
-    if (!llm_chat_tokenize_input(ai, ai->chat.prompt)) return false;
+    int rc = llm_embed_cursor_prepare(c, "llm_rerank_batch", 2, argc, argv);
+    if (rc != SQLITE_OK) return rc;
     
-    // if c is not NULL it means that reply must be streamed
-    if (c) return true;
+    const char *query = (const char *)sqlite3_value_text(argv[0]);
+    int32_t query_len = (int32_t)sqlite3_value_bytes(argv[0]);
+    if (query_len == 0) return sqlite_vtab_set_error(&vtab->base, "llm_rerank_batch expects a non empty query");
     
-    // do not stream response and incrementally build the buffer
-    bool is_eog = false;
-    while (1) {
-        if (!llm_chat_generate_response (ai, NULL, &is_eog)) return false;
-        if (is_eog) break;
+    // documents are a JSON array (id is the index) or a JSON object (id is the key)
+    sqlite3 *db = c->ai->db;
+    sqlite3_stmt *source = NULL;
+    rc = sqlite3_prepare_v2(db, "SELECT key, value FROM json_each(?1);", -1, &source, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_value(source, 1, argv[1]);
+    if (rc != SQLITE_OK) {
+        sqlite3_finalize(source);
+        return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
     }
     
-    // save response
-    if (llm_chat_save_response(ai, messages, template) == false) return false;
-    
-    // return full respond
-    char *response = ai->chat.response.data;
-    sqlite3_result_text(ai->context, response, -1, SQLITE_TRANSIENT);
-    return true;
+    return llm_embed_cursor_start(c, source, query, query_len);
 }
 
-// MARK: -
+static sqlite3_module llm_rerank_batch = {
+  /* iVersion    */ 0,
+  /* xCreate     */ 0,
+  /* xConnect    */ llm_rerank_batch_connect,
+  /* xBestIndex  */ llm_rerank_best_index,
+  /* xDisconnect */ llm_embed_disconnect,
+  /* xDestroy    */ 0,
+  /* xOpen       */ llm_embed_cursor_open,
+  /* xClose      */ llm_embed_cursor_close,
+  /* xFilter     */ llm_rerank_batch_filter,
+  /* xNext       */ llm_embed_cursor_next,
+  /* xEof        */ llm_embed_cursor_eof,
+  /* xColumn     */ llm_embed_cursor_column,
+  /* xRowid      */ llm_embed_cursor_rowid,
+  /* xUpdate     */ 0,
+  /* xBegin      */ 0,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ 0,
+  /* xFindMethod */ 0,
+  /* xRename     */ 0,
+  /* xSavepoint  */ 0,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ 0,
+  /* xShadowName */ 0,
+  /* xIntegrity  */ 0
+};
 
-static int llm_chat_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
-    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(reply, dummy hidden);");
-    if (rc != SQLITE_OK) return rc;
-    
-    ai_vtab *vtab = (ai_vtab *)sqlite3_malloc(sizeof(ai_vtab));
-    if (!vtab) return SQLITE_NOMEM;
-    
-    memset(vtab, 0, sizeof(ai_vtab));
-    ai_context *ai = (ai_context *)pAux;
-    
-    vtab->ai = ai;
-    ai->db = db;
-    ai->context = NULL;
-    ai->vtab = (sqlite3_vtab *)vtab;
-    
-    *ppVtab = (sqlite3_vtab *)vtab;
-    return SQLITE_OK;
-}
+// MARK: - Late Chunking Virtual Table -
 
-static int llm_chat_disconnect (sqlite3_vtab *pVtab) {
-    ai_vtab *vtab = (ai_vtab *)pVtab;
-    sqlite3_free(vtab);
-    return SQLITE_OK;
-}
+#define AI_CHUNKS_COLUMN_CHUNK                  0
+#define AI_CHUNKS_COLUMN_START_OFFSET           1
+#define AI_CHUNKS_COLUMN_END_OFFSET             2
+#define AI_CHUNKS_COLUMN_N_TOKENS               3
+#define AI_CHUNKS_COLUMN_EMBEDDING              4
+#define AI_CHUNKS_COLUMN_TEXT                   5       // first argument (followed by chunk_tokens, overlap and options)
 
-static int llm_chat_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
-    pIdxInfo->idxNum = 1;
-    pIdxInfo->orderByConsumed = 1;
-    pIdxInfo->estimatedCost = (double)1;
+typedef struct {
+    int32_t                     start_offset;       // byte offsets of the chunk in the text
+    int32_t                     end_offset;
+    int32_t                     n_tokens;
+} llm_chunk;
+
+typedef struct {
+    sqlite3_vtab_cursor         base;               // Base class - must be first
+    ai_vtab                     *vtab;
+    ai_context                  *ai;
     
-    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
-        if (pIdxInfo->aConstraint[i].usable && pIdxInfo->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ) {
-            // tell SQLite we'll use this argument
-            pIdxInfo->aConstraintUsage[i].argvIndex = 1;
-            pIdxInfo->aConstraintUsage[i].omit = 1;
-            pIdxInfo->idxNum = 1;
-            break;
+    llm_chunk                   *chunks;
+    uint8_t                     *embeddings;        // count * embedding_size bytes
+    int                         embedding_size;
+    int                         count;
+    int                         index;
+} ai_chunks_cursor;
+
+static void llm_chunks_cursor_reset (ai_chunks_cursor *c) {
+    sqlite3_free(c->chunks);
+    sqlite3_free(c->embeddings);
+    c->chunks = NULL;
+    c->embeddings = NULL;
+    c->embedding_size = 0;
+    c->count = 0;
+    c->index = 0;
+}
+
+// byte offsets of each token in text: pieces are matched against the text so that the space added in front of words
+// by SentencePiece/WordPiece vocabularies, spaces dropped by the tokenizer and special tokens (empty pieces) do not shift the offsets
+static void llm_token_offsets (const struct llama_vocab *vocab, const char *text, int32_t text_len, const llama_token *tokens, int32_t n_tokens, int32_t *starts, int32_t *ends) {
+    char piece[256];
+    int32_t pos = 0;
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        int32_t len = llama_token_to_piece(vocab, tokens[i], piece, sizeof(piece), 0, false);
+        const char *p = piece;
+        if (len > 0 && p[0] == ' ' && (pos >= text_len || text[pos] != ' ')) {++p; --len;}
+        if (len <= 0) {
+            starts[i] = ends[i] = pos;
+            continue;
         }
+        
+        int32_t start = pos;
+        while (start < text_len && isspace((unsigned char)text[start]) && !isspace((unsigned char)p[0])) ++start;
+        if (start + len > text_len || strncasecmp(text + start, p, len) != 0) start = pos;
+        pos = (start + len > text_len) ? text_len : start + len;
+        starts[i] = start;
+        ends[i] = pos;
     }
-    
-    return SQLITE_OK;
 }
 
-static int llm_chat_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
-    ai_cursor *c = (ai_cursor *)sqlite3_malloc(sizeof(ai_cursor));
+static int llm_embed_chunks_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return llm_embed_connect_common(db, pAux, "CREATE TABLE x(chunk, start_offset, end_offset, n_tokens, embedding, text hidden, chunk_tokens hidden, overlap hidden, options hidden);", ppVtab);
+}
+
+static int llm_embed_chunks_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    return llm_embed_best_index_common(pIdxInfo, AI_CHUNKS_COLUMN_TEXT, 3);
+}
+
+static int llm_chunks_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_chunks_cursor *c = (ai_chunks_cursor *)sqlite3_malloc(sizeof(ai_chunks_cursor));
     if (!c) return SQLITE_NOMEM;
     
-    memset(c, 0, sizeof(ai_cursor));
+    memset(c, 0, sizeof(ai_chunks_cursor));
     ai_vtab *vtab = (ai_vtab *)pVtab;
     c->vtab = vtab;
     c->ai = vtab->ai;
     
-    ai_context *ai = c->ai;
-    if (llm_chat_check_context(ai) == false) return SQLITE_ERROR;
-    
     *ppCursor = (sqlite3_vtab_cursor *)c;
     return SQLITE_OK;
 }
 
-static int llm_chat_cursor_close (sqlite3_vtab_cursor *cur) {
-    ai_cursor *c = (ai_cursor *)cur;
-    ai_context *ai = c->ai;
-
-    // save response before freeing the cursor
-    ai_messages *messages = &ai->chat.messages;
-    const char *template = ai->chat.template;
-    bool saved = llm_chat_save_response(ai, messages, template);
-
+static int llm_chunks_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_chunks_cursor *c = (ai_chunks_cursor *)cur;
+    llm_chunks_cursor_reset(c);
     sqlite3_free(c);
-
-    return saved ? SQLITE_OK : SQLITE_ERROR;
+    return SQLITE_OK;
 }
 
-static int llm_chat_cursor_next (sqlite3_vtab_cursor *cur) {
-    ai_cursor *c = (ai_cursor *)cur;
-    if (!llm_chat_generate_response (c->ai, c, NULL)) return SQLITE_ERROR;
-    c->rowid++;
+static int llm_chunks_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_chunks_cursor *c = (ai_chunks_cursor *)cur;
+    c->index++;
     return SQLITE_OK;
 }
 
-static int llm_chat_cursor_eof (sqlite3_vtab_cursor *cur) {
-    ai_cursor *c = (ai_cursor *)cur;
-    return (int)c->is_eog;
+static int llm_chunks_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_chunks_cursor *c = (ai_chunks_cursor *)cur;
+    return (c->index >= c->count);
 }
 
-static int llm_chat_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
-    ai_cursor *c = (ai_cursor *)cur;
-    if (iCol == AI_COLUMN_REPLY) {
-        sqlite3_result_text(context, c->ai->chat.token_text, c->ai->chat.token_len, SQLITE_TRANSIENT);
+static int llm_chunks_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_chunks_cursor *c = (ai_chunks_cursor *)cur;
+    const llm_chunk *chunk = &c->chunks[c->index];
+    
+    switch (iCol) {
+        case AI_CHUNKS_COLUMN_CHUNK:
+            sqlite3_result_int(context, c->index);
+            break;
+        case AI_CHUNKS_COLUMN_START_OFFSET:
+            sqlite3_result_int(context, chunk->start_offset);
+            break;
+        case AI_CHUNKS_COLUMN_END_OFFSET:
+            sqlite3_result_int(context, chunk->end_offset);
+            break;
+        case AI_CHUNKS_COLUMN_N_TOKENS:
+            sqlite3_result_int(context, chunk->n_tokens);
+            break;
+        case AI_CHUNKS_COLUMN_EMBEDDING:
+            llm_embed_result(context, c->ai, c->embeddings + ((size_t)c->index * c->embedding_size), c->embedding_size, SQLITE_TRANSIENT);
+            break;
     }
     return SQLITE_OK;
 }
 
-static int llm_chat_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
-    ai_cursor *c = (ai_cursor *)cur;
-    *pRowid = c->rowid;
+static int llm_chunks_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_chunks_cursor *c = (ai_chunks_cursor *)cur;
+    *pRowid = c->index;
     return SQLITE_OK;
 }
 
-static int llm_chat_cursor_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
-    ai_cursor *c = (ai_cursor *)cur;
-    ai_context *ai = c->ai;
+// late chunking: the whole text is decoded once with pooling type NONE, so every token embedding sees the full document,
+// then the token embeddings of each chunk (chunk_tokens tokens, overlap tokens shared with the previous chunk) are mean pooled
+static int llm_embed_chunks_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_chunks_cursor *c = (ai_chunks_cursor *)cur;
     ai_vtab *vtab = c->vtab;
+    ai_context *ai = c->ai;
+    llm_chunks_cursor_reset(c);
     
-    // sanity check arguments
-    if (argc != 1) {
-        return sqlite_vtab_set_error(&vtab->base, "llm_chat expects %d arguments, but %d were provided.", 1, argc);
+    if (!ai->model) {
+        return sqlite_vtab_set_error(&vtab->base, "No model is currently set. Please call llm_model_load() before using this function.");
     }
-    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
-        return sqlite_vtab_set_error(&vtab->base, "llm_chat argument must be of type TEXT");
+    if (!ai->ctx && !ai->pool) {
+        return sqlite_vtab_set_error(&vtab->base, "No context found. Please call llm_context_create() before using this function.");
+    }
+    if (argc < 3 || argc > 4) {
+        return sqlite_vtab_set_error(&vtab->base, "llm_embed_chunks expects 3 or 4 arguments, but %d were provided.", argc);
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || (argc == 4 && sqlite3_value_type(argv[3]) != SQLITE_TEXT)) {
+        return sqlite_vtab_set_error(&vtab->base, "llm_embed_chunks text and options must be of type TEXT");
+    }
+    if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER || sqlite3_value_type(argv[2]) != SQLITE_INTEGER) {
+        return sqlite_vtab_set_error(&vtab->base, "llm_embed_chunks chunk_tokens and overlap must be of type INTEGER");
     }
     
-    ai->chat.token_count = 0;
-    buffer_reset(&ai->chat.response);
-
-    const char *user_prompt = (const char *)sqlite3_value_text(argv[0]);
-    bool result = llm_chat_run(ai, c, user_prompt);
-    return (result) ? SQLITE_OK : SQLITE_ERROR;
+    int chunk_tokens = sqlite3_value_int(argv[1]);
+    int overlap = sqlite3_value_int(argv[2]);
+    if (chunk_tokens <= 0 || overlap < 0 || overlap >= chunk_tokens) {
+        return sqlite_vtab_set_error(&vtab->base, "llm_embed_chunks expects chunk_tokens > 0 and 0 <= overlap < chunk_tokens");
+    }
+    
+    // passing NULL as xdata because context has been already created
+    const char *options = (argc == 4) ? (const char *)sqlite3_value_text(argv[3]) : NULL;
+    if (parse_keyvalue_string(ai, options, llm_context_options_callback, NULL) == false) {
+        return sqlite_vtab_set_error(&vtab->base, "An error occurred while parsing options (%s)", options);
+    }
+    
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    int32_t text_len = (int32_t)sqlite3_value_bytes(argv[0]);
+    if (text_len == 0) return SQLITE_OK;
+    
+    // the chunks are computed here, so a pooled context is used only for the duration of the filter
+    bool checked_out = false;
+    if (!llm_context_cursor_checkout(ai, &checked_out)) {
+        return sqlite_vtab_set_error(&vtab->base, "Unable to create context from model");
+    }
+    
+    llm_embed_batch eb;
+    if (!llm_embed_batch_init(ai, NULL, &vtab->base, &eb, EMBED_MODE_TOKENS)) {
+        llm_context_cursor_checkin(ai, &checked_out);
+        return SQLITE_ERROR;
+    }
+    
+    int rc = SQLITE_OK;
+    llm_embed_input input = {0};
+    int32_t *offsets = NULL;
+    int32_t *content = NULL;
+    float *pooled = NULL;
+    llama_memory_t memory = llama_get_memory(eb.ctx);
+    
+    // text longer than the context is truncated like in llm_embed_generate
+    if (!llm_embed_batch_tokenize(&eb, NULL, &vtab->base, text, text_len, &input)) {rc = SQLITE_ERROR; goto cleanup;}
+    
+    eb.batch.n_tokens = 0;
+    llm_embed_batch_add(&eb.batch, input.tokens, input.n_tokens, 0, eb.seq_ids[0]);
+    llm_embed_batch_clear(&eb, memory, 1);
+    int32_t result = eb.is_encoder_only ? llama_encode(eb.ctx, eb.batch) : llama_decode(eb.ctx, eb.batch);
+    if (result != 0) {
+        rc = sqlite_vtab_set_error(&vtab->base, "Model %s failed during late chunking (%d)", eb.is_encoder_only ? "encode" : "decode", result);
+        goto cleanup;
+    }
+    
+    // chunks are made of content tokens only (special tokens are decoded, so they contribute to the context, but are not pooled)
+    offsets = (int32_t *)sqlite3_malloc64(2 * input.n_tokens * sizeof(int32_t));
+    content = (int32_t *)sqlite3_malloc64(input.n_tokens * sizeof(int32_t));
+    pooled = (float *)sqlite3_malloc64(eb.dimension * sizeof(float));
+    if (!offsets || !content || !pooled) {rc = SQLITE_NOMEM; goto cleanup;}
+    
+    int32_t *starts = offsets;
+    int32_t *ends = offsets + input.n_tokens;
+    llm_token_offsets(eb.vocab, text, text_len, input.tokens, input.n_tokens, starts, ends);
+    
+    int32_t n_content = 0;
+    for (int32_t i = 0; i < input.n_tokens; ++i) {
+        if (!llama_vocab_is_control(eb.vocab, input.tokens[i])) content[n_content++] = i;
+    }
+    if (n_content == 0) goto cleanup;
+    
+    int32_t stride = chunk_tokens - overlap;
+    int count = 1;
+    if (n_content > chunk_tokens) count += (n_content - chunk_tokens + stride - 1) / stride;
+    
+    c->chunks = (llm_chunk *)sqlite3_malloc64(count * sizeof(llm_chunk));
+    c->embeddings = (uint8_t *)sqlite3_malloc64((sqlite3_uint64)count * eb.embedding_size);
+    if (!c->chunks || !c->embeddings) {rc = SQLITE_NOMEM; goto cleanup;}
+    c->embedding_size = eb.embedding_size;
+    
+    for (int k = 0; k < count; ++k) {
+        int32_t first = k * stride;
+        int32_t last = (first + chunk_tokens > n_content) ? n_content : first + chunk_tokens;
+        
+        memset(pooled, 0, eb.dimension * sizeof(float));
+        for (int32_t t = first; t < last; ++t) {
+            const float *embedding = llama_get_embeddings_ith(eb.ctx, content[t]);
+            if (embedding == NULL) {
+                rc = sqlite_vtab_set_error(&vtab->base, "Failed to retrieve token embeddings from model");
+                goto cleanup;
+            }
+            for (int d = 0; d < eb.dimension; ++d) pooled[d] += embedding[d];
+        }
+        vector_f32_scale(pooled, pooled, eb.dimension, 1.0f / (float)(last - first));
+        
+        void *embedding = c->embeddings + ((size_t)k * eb.embedding_size);
+        if (eb.normalize) llm_embed_normalize(pooled, embedding, eb.type, eb.dimension);
+        else llm_embed_copy(pooled, embedding, eb.type, eb.dimension, eb.embedding_size);
+        
+        c->chunks[k].start_offset = starts[content[first]];
+        c->chunks[k].end_offset = ends[content[last - 1]];
+        c->chunks[k].n_tokens = last - first;
+    }
+    c->count = count;
+    
+cleanup:
+    llm_embed_batch_clear(&eb, memory, 1);
+    llm_embed_input_reset(&input);
+    llm_embed_batch_free(&eb);
+    llm_context_cursor_checkin(ai, &checked_out);
+    sqlite3_free(offsets);
+    sqlite3_free(content);
+    sqlite3_free(pooled);
+    if (rc != SQLITE_OK) llm_chunks_cursor_reset(c);
+    return rc;
 }
 
-static sqlite3_module llm_chat = {
+static sqlite3_module llm_embed_chunks = {
   /* iVersion    */ 0,
   /* xCreate     */ 0,
-  /* xConnect    */ llm_chat_connect,
-  /* xBestIndex  */ llm_chat_best_index,
-  /* xDisconnect */ llm_chat_disconnect,
+  /* xConnect    */ llm_embed_chunks_connect,
+  /* xBestIndex  */ llm_embed_chunks_best_index,
+  /* xDisconnect */ llm_embed_disconnect,
   /* xDestroy    */ 0,
-  /* xOpen       */ llm_chat_cursor_open,
-  /* xClose      */ llm_chat_cursor_close,
-  /* xFilter     */ llm_chat_cursor_filter,
-  /* xNext       */ llm_chat_cursor_next,
-  /* xEof        */ llm_chat_cursor_eof,
-  /* xColumn     */ llm_chat_cursor_column,
-  /* xRowid      */ llm_chat_cursor_rowid,
+  /* xOpen       */ llm_chunks_cursor_open,
+  /* xClose      */ llm_chunks_cursor_close,
+  /* xFilter     */ llm_embed_chunks_filter,
+  /* xNext       */ llm_chunks_cursor_next,
+  /* xEof        */ llm_chunks_cursor_eof,
+  /* xColumn     */ llm_chunks_cursor_column,
+  /* xRowid      */ llm_chunks_cursor_rowid,
   /* xUpdate     */ 0,
   /* xBegin      */ 0,
   /* xSync       */ 0,
@@ -2126,1548 +3775,8926 @@ static sqlite3_module llm_chat = {
   /* xIntegrity  */ 0
 };
 
-// MARK: -
+// MARK: - Text Generation -
 
-static void llm_chat_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-
-    // reset UUID and cleanup chat related memory
-    memset(ai->chat.uuid, 0, UUID_STR_MAXLEN);
+static void llm_text_cache_reset (ai_context *ai) {
+    ai->text.ntokens = 0;
+}
 
-    buffer_destroy(&ai->chat.response);
-    buffer_destroy(&ai->chat.formatted);
-    llm_messages_free(&ai->chat.messages);
+static bool llm_tokens_append (llama_token **tokens, int32_t *ntokens, int32_t *capacity, const llama_token *src, int32_t n) {
+    if (n <= 0) return true;
+    if (*ntokens + n > *capacity) {
+        int32_t new_cap = *capacity ? *capacity * 2 : MIN_ALLOC_TOKEN;
+        while (new_cap < *ntokens + n) new_cap *= 2;
+        llama_token *new_tokens = (llama_token *)sqlite3_realloc64(*tokens, new_cap * sizeof(llama_token));
+        if (!new_tokens) return false;
+        *tokens = new_tokens;
+        *capacity = new_cap;
+    }
+    
+    memcpy(*tokens + *ntokens, src, n * sizeof(llama_token));
+    *ntokens += n;
+    return true;
+}
 
-    if (ai->chat.tokens) sqlite3_free(ai->chat.tokens);
-    ai->chat.tokens = NULL;
-    ai->chat.ntokens = 0;
+static bool llm_text_cache_append (ai_context *ai, const llama_token *tokens, int32_t n) {
+    if (!llm_tokens_append(&ai->text.tokens, &ai->text.ntokens, &ai->text.capacity, tokens, n)) {
+        llm_text_cache_reset(ai);
+        return false;
+    }
+    return true;
+}
 
-    if (ai->chat.prompt) sqlite3_free(ai->chat.prompt);
-    ai->chat.prompt = NULL;
-    ai->chat.prev_len = 0;
+static int32_t llm_tokens_common_prefix (const llama_token *a, int32_t n_a, const llama_token *b, int32_t n_b) {
+    int32_t n_max = (n_a < n_b) ? n_a : n_b;
+    int32_t n = 0;
+    while (n < n_max && a[n] == b[n]) ++n;
+    return n;
+}
 
-    ai->chat.template = NULL;
-    ai->chat.vocab = NULL;
-    ai->chat.token_count = 0;
+// cached tokens are valid only if sequence 0 has not been touched by other functions in the meantime
+static bool llm_text_cache_is_valid (ai_context *ai, llama_memory_t memory) {
+    return (memory && ai->text.ntokens > 0 && llama_memory_seq_pos_max(memory, 0) == ai->text.ntokens - 1);
 }
 
-static void llm_chat_create (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (llm_check_context(context) == false) return;
+// keep the KV cells of the longest token prefix shared with the previous call (sequence 0) and drop the rest
+// returns the number of tokens that do not need to be decoded again
+static int32_t llm_text_cache_prefix (ai_context *ai, struct llama_context *ctx, const llama_token *tokens, int32_t n_tokens) {
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (!memory) {
+        llm_text_cache_reset(ai);
+        return 0;
+    }
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    // at least one prompt token must be decoded again to obtain fresh logits
+    int32_t n_common = 0;
+    if (llm_text_cache_is_valid(ai, memory)) {
+        n_common = llm_tokens_common_prefix(ai->text.tokens, ai->text.ntokens, tokens, n_tokens - 1);
+    }
     
-    // clean-up old chat (if any)
-    llm_chat_free(context, argc, argv);
-    if (llm_chat_check_context(ai) == false) return;
+    // with sliding-window attention old cells could have been pruned, the window before n_common must still be there
+    int32_t n_swa = llama_model_n_swa(ai->model);
+    if (n_common > 0 && n_swa > 0) {
+        llama_pos pos_min = llama_memory_seq_pos_min(memory, 0);
+        if (pos_min > ((n_common > n_swa) ? n_common - n_swa : 0)) n_common = 0;
+    }
     
-    // returns chat UUID
-    sqlite3_result_text(context, ai->chat.uuid, -1, SQLITE_TRANSIENT);
+    // partial removal can fail (for example with recurrent models), start from scratch in that case
+    if (n_common > 0 && !llama_memory_seq_rm(memory, 0, n_common, -1)) n_common = 0;
+    if (n_common == 0) llama_memory_seq_rm(memory, 0, -1, -1);
+    
+    ai->text.ntokens = n_common;
+    return n_common;
 }
 
-static bool llm_chat_check_tables (sqlite3_context *context) {
-    const char *sql = "CREATE TABLE IF NOT EXISTS ai_chat_history (id INTEGER PRIMARY KEY AUTOINCREMENT, uuid TEXT UNIQUE, title TEXT, metadata TEXT, created_at DATETIME DEFAULT CURRENT_TIMESTAMP);";
+// if the model has a chat template, wrap the prompt so the model emits EOG tokens
+// on success formatted is NULL when the model has no chat template
+static bool llm_text_apply_template (ai_context *ai, const char *text, char **formatted, int32_t *formatted_len) {
+    *formatted = NULL;
+    *formatted_len = 0;
     
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    int rc = sqlite_db_write_simple(context, db, sql);
-    if (rc != SQLITE_OK) return false;
+    const char *chat_template = llama_model_chat_template(ai->model, NULL);
+    if (!chat_template) return true;
     
-    sql = "CREATE TABLE IF NOT EXISTS ai_chat_messages (id INTEGER PRIMARY KEY AUTOINCREMENT, chat_id INTEGER NOT NULL, role TEXT NOT NULL, content TEXT NOT NULL);";
-    rc = sqlite_db_write_simple(context, db, sql);
-    if (rc != SQLITE_OK) return false;
+    llama_chat_message messages[] = {{ ROLE_USER, text }};
+    int32_t len = llama_chat_apply_template(chat_template, messages, 1, true, NULL, 0);
+    if (len <= 0) return true;
+    
+    char *buffer = (char *)sqlite3_malloc64(len + 1);
+    if (!buffer) return false;
+    llama_chat_apply_template(chat_template, messages, 1, true, buffer, len + 1);
+    buffer[len] = '\0';
     
+    *formatted = buffer;
+    *formatted_len = len;
     return true;
 }
 
-static void llm_chat_save (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (llm_chat_check_tables(context) == false) return;
+// MARK: - Speculative Decoding -
+
+static void llm_draft_free (ai_context *ai) {
+    if (ai->draft.ctx) llama_free(ai->draft.ctx);
+    llm_model_release(ai->draft.model);
+    sqlite3_free(ai->draft.tokens);
+    memset(&ai->draft, 0, sizeof(ai->draft));
+}
+
+// the draft context is (re)created on demand with the same size of the target context
+static bool llm_draft_check_context (ai_context *ai, struct llama_context *ctx) {
+    uint32_t n_ctx = llama_n_ctx(ctx);
+    if (ai->draft.ctx && llama_n_ctx(ai->draft.ctx) >= n_ctx) return true;
     
-    // sanity check if there is something to save
-    if (ai->chat.uuid[0] == 0) return;
-    if (ai->chat.messages.count == 0) return;
+    if (ai->draft.ctx) llama_free(ai->draft.ctx);
+    ai->draft.ctx = NULL;
+    ai->draft.ntokens = 0;
     
-    // title, metadata
-    const char *title = ((argc >= 1) && (sqlite3_value_type(argv[0]) == SQLITE3_TEXT)) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
-    const char *meta =  ((argc >= 2) && (sqlite3_value_type(argv[1]) == SQLITE3_TEXT)) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+    struct llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_ctx;
+    ctx_params.n_batch = llama_n_batch(ctx);
+    ctx_params.n_ubatch = llama_n_ubatch(ctx);
+    ctx_params.n_seq_max = 1;
+    ctx_params.n_threads = llama_n_threads(ctx);
+    ctx_params.n_threads_batch = llama_n_threads_batch(ctx);
+    ai->draft.ctx = llama_init_from_model(ai->draft.model, ctx_params);
+    return (ai->draft.ctx != NULL);
+}
+
+// propose up to n_draft tokens following history + id_last (greedy decoding on the draft model),
+// the draft KV cache keeps the longest prefix shared with history so only the new tokens are evaluated
+static int llm_draft_propose (ai_context *ai, struct llama_context *ctx, const llama_token *history, int32_t n_history, llama_token id_last, int n_draft, llama_token *draft) {
+    if (!ai->draft.model || n_draft <= 0) return 0;
+    if (!llm_draft_check_context(ai, ctx)) return 0;
+    
+    struct llama_context *dctx = ai->draft.ctx;
+    llama_memory_t memory = llama_get_memory(dctx);
+    
+    int32_t n_keep = llm_tokens_common_prefix(ai->draft.tokens, ai->draft.ntokens, history, n_history);
+    if (n_keep < ai->draft.ntokens && !llama_memory_seq_rm(memory, 0, n_keep, -1)) n_keep = 0;
+    if (n_keep == 0) llama_memory_seq_rm(memory, 0, -1, -1);
+    ai->draft.ntokens = n_keep;
+    
+    if (!llm_tokens_append(&ai->draft.tokens, &ai->draft.ntokens, &ai->draft.capacity, history + n_keep, n_history - n_keep) ||
+        !llm_tokens_append(&ai->draft.tokens, &ai->draft.ntokens, &ai->draft.capacity, &id_last, 1)) {
+        ai->draft.ntokens = n_keep;
+        return 0;
+    }
+    
+    // evaluate the missing part of history followed by id_last
+    int n_batch = (int)llama_n_batch(dctx);
+    for (int32_t pos = n_keep; pos < ai->draft.ntokens; pos += n_batch) {
+        int32_t chunk = (ai->draft.ntokens - pos < n_batch) ? ai->draft.ntokens - pos : n_batch;
+        if (llama_decode(dctx, llama_batch_get_one(ai->draft.tokens + pos, chunk))) goto reset;
+    }
+    
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->draft.model);
+    int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    int n = 0;
+    while (n < n_draft) {
+        const float *logits = llama_get_logits_ith(dctx, -1);
+        if (!logits) break;
+        
+        llama_token best = 0;
+        for (llama_token token = 1; token < n_vocab; ++token) {
+            if (logits[token] > logits[best]) best = token;
+        }
+        draft[n++] = best;
+        if (n == n_draft || llama_vocab_is_eog(vocab, best)) break;
+        
+        if (llama_decode(dctx, llama_batch_get_one(&draft[n-1], 1))) goto reset;
+        if (!llm_tokens_append(&ai->draft.tokens, &ai->draft.ntokens, &ai->draft.capacity, &draft[n-1], 1)) goto reset;
+    }
+    return n;
     
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    ai_messages *messages = &ai->chat.messages;
+reset:
+    llama_memory_seq_rm(memory, 0, -1, -1);
+    ai->draft.ntokens = 0;
+    return 0;
+}
+
+static inline llama_token llm_lookup_token (const llama_token *history, int32_t n_history, llama_token id_last, int32_t i) {
+    return (i < n_history) ? history[i] : id_last;
+}
+
+// prompt lookup: find the most recent earlier occurrence of the last n-gram of history + id_last and propose the tokens
+// that followed it, no model is involved (useful when the output copies long spans of the prompt)
+static int llm_lookup_propose (const llama_token *history, int32_t n_history, llama_token id_last, int n_draft, llama_token *draft) {
+    int32_t n = n_history + 1;
     
-    // start transaction
-    sqlite_db_write_simple(context, db, "BEGIN;");
+    for (int ngram = AI_LOOKUP_NGRAM_MAX; ngram >= AI_LOOKUP_NGRAM_MIN; --ngram) {
+        int32_t start = n - ngram;
+        if (start <= 0) continue;
+        
+        for (int32_t i = start - 1; i >= 0; --i) {
+            int j = 0;
+            while (j < ngram && llm_lookup_token(history, n_history, id_last, i + j) == llm_lookup_token(history, n_history, id_last, start + j)) ++j;
+            if (j < ngram) continue;
+            
+            int count = 0;
+            for (int32_t pos = i + ngram; pos < n && count < n_draft; ++pos) {
+                draft[count++] = llm_lookup_token(history, n_history, id_last, pos);
+            }
+            return count;
+        }
+    }
+    return 0;
+}
+
+// the state of recurrent and hybrid models can't be rolled back to a position, so the rejected draft tokens couldn't be removed
+static bool llm_speculative_supported (ai_context *ai) {
+    return (!llama_model_is_recurrent(ai->model) && !llama_model_is_hybrid(ai->model));
+}
+
+static bool llm_speculative_enabled (ai_context *ai) {
+    if (!ai->options.lookup_decoding && !(ai->draft.model && ai->options.speculative > 0)) return false;
+    return llm_speculative_supported(ai);
+}
+
+// decode id_last (at the end of sequence 0) together with the tokens proposed by prompt lookup or by the draft model and sample with
+// the target sampler at every position: sampled tokens are accepted up to the first one that differs from the draft,
+// so the output is exactly the same produced by decoding one token at a time.
+// returns the number k of sampled tokens (out[0..k-1], at most max_tokens) or -1 on error, on return
+// sequence 0 contains id_last and out[0..k-2] while out[k-1] still needs to be decoded
+static int llm_speculative_step (ai_context *ai, struct llama_context *ctx, struct llama_sampler *sampler, const llama_token *history, int32_t n_history, llama_token id_last, int max_tokens, llama_token *out) {
+    llama_memory_t memory = llama_get_memory(ctx);
+    llama_pos pos = llama_memory_seq_pos_max(memory, 0) + 1;
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
     
-    // save chat, the ON CONFLICT allows saving multiple times
-    const char *sql = "INSERT INTO ai_chat_history (uuid, title, metadata) VALUES (?, ?, ?) "
-                      "ON CONFLICT(uuid) DO UPDATE SET "
-                      "  title = excluded.title, "
-                      "  metadata = excluded.metadata, "
-                      "  created_at = CURRENT_TIMESTAMP;";
-    const char *values[] = {ai->chat.uuid, title, meta};
-    int types[] = {SQLITE_TEXT, SQLITE_TEXT, SQLITE_TEXT};
-    int lens[] = {-1, -1, -1};
+    llama_token draft[AI_MAX_SPECULATIVE];
+    int n_draft = (ai->options.speculative > 0) ? ai->options.speculative : (ai->options.lookup_decoding ? AI_DEFAULT_LOOKUP_DRAFT : 0);
+    if (n_draft > max_tokens - 1) n_draft = max_tokens - 1;
+    if (!llm_speculative_supported(ai)) n_draft = 0;
     
-    int rc = sqlite_db_write(context, db, sql, values, types, lens, 3);
-    if (rc != SQLITE_OK) goto abort_save;
+    int n = 0;
+    if (ai->options.lookup_decoding && n_draft > 0) n = llm_lookup_propose(history, n_history, id_last, n_draft, draft);
     
-    // get the rowid, cannot use sqlite3_last_insert_rowid for the CONFLICT case
-    char rowid_s[256];
-    sqlite3_stmt *pstmt = NULL;
-    sql = "SELECT id FROM ai_chat_history WHERE uuid = ?;";
-    rc = sqlite3_prepare_v2(db, sql, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) goto abort_save;
-    rc = sqlite3_bind_text(pstmt, 1, ai->chat.uuid, -1, SQLITE_STATIC);
-    rc = sqlite3_step(pstmt);
-    if (rc != SQLITE_ROW) {
-        sqlite3_finalize(pstmt);
-        goto abort_save;
+    // the draft context can be synced only when history contains exactly the tokens stored in sequence 0
+    if (n == 0 && ai->options.speculative > 0 && n_history == pos) n = llm_draft_propose(ai, ctx, history, n_history, id_last, n_draft, draft);
+    
+    if (n == 0) {
+        if (llama_decode(ctx, llama_batch_get_one(&id_last, 1))) return -1;
+        out[0] = llama_sampler_sample(sampler, ctx, -1);
+        return 1;
     }
-    sqlite3_int64 rowid = sqlite3_column_int64(pstmt, 0);
-    sqlite3_finalize(pstmt);
-    snprintf(rowid_s, sizeof(rowid_s), "%lld", (long long)rowid);
+    
+    llama_batch batch = llama_batch_init(n + 1, 0, 1);
+    for (int i = 0; i <= n; ++i) {
+        batch.token[i] = (i == 0) ? id_last : draft[i - 1];
+        batch.pos[i] = pos + i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = 0;
+        batch.logits[i] = true;
+    }
+    batch.n_tokens = n + 1;
+    int rc = llama_decode(ctx, batch);
+    llama_batch_free(batch);
+    if (rc) return -1;
+    
+    int k = 0;
+    for (int i = 0; i <= n; ++i) {
+        llama_token token = llama_sampler_sample(sampler, ctx, i);
+        out[k++] = token;
+        if (i == n || token != draft[i] || k == max_tokens || llama_vocab_is_eog(vocab, token)) break;
+    }
+    
+    // remove the rejected draft tokens
+    if (k <= n && !llama_memory_seq_rm(memory, 0, pos + k, -1)) return -1;
+    return k;
+}
 
-    // delete all messages for this chat id, if any
-    sql = "DELETE FROM ai_chat_messages WHERE chat_id = ?;";
-    const char *values3[] = {rowid_s};
-    int types3[] = {SQLITE_INTEGER};
-    int lens3[] = {-1};
-    rc = sqlite_db_write(context, db, sql, values3, types3, lens3, 1);
-    if (rc != SQLITE_OK) goto abort_save;
+static void llm_draft_model_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // sanity check arguments
+    if (llm_common_args_check(context, "llm_draft_model_load", argc, argv, false) == false) return;
     
-    // loop to save messages (the context)
-    sql = "INSERT INTO ai_chat_messages (chat_id, role, content) VALUES (?, ?, ?);";
-    int types2[] = {SQLITE_INTEGER, SQLITE_TEXT, SQLITE_TEXT};
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->model) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No model is currently set. Please call llm_model_load() before llm_draft_model_load().");
+        return;
+    }
     
-    for (int i=0; i < messages->count; i++) {
-        const char *role = messages->items[i].role;
-        const char *content = messages->items[i].content;
-        // skip empty system message placeholder
-        if (role == ROLE_SYSTEM && (!content || content[0] == '\0')) continue;
-        const char *values2[] = {rowid_s, role, content};
-        int rc = sqlite_db_write(context, db, sql, values2, types2, lens, 3);
-        if (rc != SQLITE_OK) goto abort_save;
+    const char *model_path = (const char *)sqlite3_value_text(argv[0]);
+    const char *model_options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+    if (model_options == NULL) model_options = AI_DEFAULT_MODEL_OPTIONS;
+    
+    struct llama_model_params model_params = llama_model_default_params();
+    if (parse_keyvalue_string(ai, model_options, llm_model_options_callback, &model_params) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", model_options);
+        return;
     }
     
-    // commit transaction and returns chat UUID
-    sqlite_db_write_simple(context, db, "COMMIT;");
-    sqlite3_result_text(context, ai->chat.uuid, -1, SQLITE_TRANSIENT);
-    return;
+    struct llama_model *model = llm_model_acquire(model_path, &model_params, NULL);
+    if (!model) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to load model from file %s", model_path);
+        return;
+    }
     
-abort_save:
-    sqlite_db_write_simple(context, db, "ROLLBACK;");
+    // draft tokens are verified by the target model, so both models must share the same vocabulary
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    const struct llama_vocab *draft_vocab = llama_model_get_vocab(model);
+    if (llama_vocab_n_tokens(vocab) != llama_vocab_n_tokens(draft_vocab) || llama_vocab_bos(vocab) != llama_vocab_bos(draft_vocab) || llama_vocab_eos(vocab) != llama_vocab_eos(draft_vocab)) {
+        llm_model_release(model);
+        sqlite_context_result_error(context, SQLITE_ERROR, "Draft model vocabulary is not compatible with the loaded model");
+        return;
+    }
+    
+    llm_draft_free(ai);
+    ai->draft.model = model;
 }
 
-static void llm_chat_restore (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // sanity check argument
-    int types[] = {SQLITE_TEXT};
-    if (sqlite_sanity_function(context, "llm_chat_restore", argc, argv, 1, types, false, false) == false) return;
-
-    // free old chat (if any)
-    llm_chat_free(context, 0, NULL);
-
+static void llm_draft_model_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
     ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_draft_free(ai);
+}
 
-    // re-initialize chat state (UUID, buffers, tokens)
-    if (llm_chat_check_context(ai) == false) return;
-
-    // UUID
-    const char *uuid = (const char *)sqlite3_value_text(argv[0]);
-    sqlite3 *db = sqlite3_context_db_handle(context);
+// MARK: - Prompt Prefixes -
 
-    const char *sql = "SELECT m.role, m.content FROM ai_chat_messages m JOIN ai_chat_history h ON m.chat_id = h.id WHERE h.uuid = ? ORDER BY m.id ASC;";
-    sqlite3_stmt *vm = NULL;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
-    if (rc != SQLITE_OK) goto abort_restore;
+static void llm_prefix_free_item (ai_prefix *prefix) {
+    sqlite3_free(prefix->name);
+    sqlite3_free(prefix->text);
+    sqlite3_free(prefix->tokens);
+    sqlite3_free(prefix->state);
+    memset(prefix, 0, sizeof(ai_prefix));
+}
 
-    rc = sqlite3_bind_text(vm, 1, uuid, -1, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto abort_restore;
+static void llm_prefix_remove (ai_context *ai, int index) {
+    ai->prefixes.size -= ai->prefixes.items[index].state_size;
+    llm_prefix_free_item(&ai->prefixes.items[index]);
+    if (index != ai->prefixes.count - 1) ai->prefixes.items[index] = ai->prefixes.items[ai->prefixes.count - 1];
+    ai->prefixes.count--;
+}
 
-    int counter = 0;
-    ai_messages *messages = &ai->chat.messages;
-    while (1) {
-        rc = sqlite3_step(vm);
-        if (rc == SQLITE_DONE) {rc = SQLITE_OK; break;}
-        if (rc != SQLITE_ROW) goto abort_restore;
+static void llm_prefix_cache_clear (ai_context *ai) {
+    for (int i = 0; i < ai->prefixes.count; ++i) {
+        llm_prefix_free_item(&ai->prefixes.items[i]);
+    }
+    sqlite3_free(ai->prefixes.items);
+    memset(&ai->prefixes, 0, sizeof(ai->prefixes));
+}
 
-        const char *role = (const char *)sqlite3_column_text(vm, 0);
-        const char *content = (const char *)sqlite3_column_text(vm, 1);
+static int llm_prefix_find (ai_context *ai, const char *name) {
+    for (int i = 0; i < ai->prefixes.count; ++i) {
+        if (strcmp(ai->prefixes.items[i].name, name) == 0) return i;
+    }
+    return -1;
+}
 
-        if (!llm_messages_append(messages, role, content)) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to append message during restore");
-            sqlite3_finalize(vm);
-            return;
+// evict least recently used snapshots (except keep) until the cache fits in the prefix_cache_size budget
+static void llm_prefix_evict (ai_context *ai, const char *keep) {
+    size_t budget = (size_t)ai->options.prefix_cache_size * 1024 * 1024;
+    while (ai->prefixes.size > budget) {
+        int lru = -1;
+        for (int i = 0; i < ai->prefixes.count; ++i) {
+            if (ai->prefixes.items[i].name == keep) continue;
+            if (lru == -1 || ai->prefixes.items[i].last_used < ai->prefixes.items[lru].last_used) lru = i;
         }
-        ++counter;
+        if (lru == -1) break;
+        llm_prefix_remove(ai, lru);
     }
-
-    sqlite3_result_int(context, counter);
-    if (vm) sqlite3_finalize(vm);
-    return;
-
-abort_restore:
-    sqlite3_result_error(context, sqlite3_errmsg(db), -1);
-    if (vm) sqlite3_finalize(vm);
 }
 
-static void llm_chat_respond (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (llm_check_context(context) == false) return;
-
-    if (argc < 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "llm_chat_respond requires at least one TEXT argument (prompt)");
+// restore the snapshot of prefix in sequence 0 when it shares more tokens with the prompt than the current KV cache
+static void llm_prefix_restore (ai_context *ai, struct llama_context *ctx, ai_prefix *prefix, const llama_token *tokens, int32_t n_tokens) {
+    prefix->last_used = ++ai->prefixes.clock;
+    
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (!memory) return;
+    
+    int32_t n_prefix = llm_tokens_common_prefix(prefix->tokens, prefix->ntokens, tokens, n_tokens);
+    int32_t n_cached = llm_text_cache_is_valid(ai, memory) ? llm_tokens_common_prefix(ai->text.tokens, ai->text.ntokens, tokens, n_tokens) : 0;
+    if (n_prefix <= n_cached) return;
+    
+    llama_memory_seq_rm(memory, 0, -1, -1);
+    llm_text_cache_reset(ai);
+    
+    // on failure the prompt is simply evaluated from scratch
+    if (llama_state_seq_set_data(ctx, prefix->state, prefix->state_size, 0) == 0) {
+        llama_memory_seq_rm(memory, 0, -1, -1);
         return;
     }
+    
+    // without the token list the restored cells could never be matched again
+    if (!llm_text_cache_append(ai, prefix->tokens, prefix->ntokens)) llama_memory_seq_rm(memory, 0, -1, -1);
+}
 
+static void llm_prefix_register (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    int types[] = {SQLITE_TEXT, SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "llm_prefix_register", argc, argv, 2, types, true, false) == false) return;
+    if (llm_check_context_pinned(context) == false) return;
+    
     ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (!ai->model) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded");
+    struct llama_context *ctx = ai->ctx;
+    const char *name = (const char *)sqlite3_value_text(argv[0]);
+    const char *text = (const char *)sqlite3_value_text(argv[1]);
+    if (!name || name[0] == '\0' || strlen(name) >= MAX_PREFIX_NAME_LEN) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Prefix name must be a non empty string shorter than %d characters", MAX_PREFIX_NAME_LEN);
         return;
     }
-    if (llm_chat_check_context(ai) == false) return;
-
-    const char *user_prompt = (const char *)sqlite3_value_text(argv[0]);
-    ai->context = context;
-    ai->vtab = NULL;
-
-    ai->chat.token_count = 0;
-    buffer_reset(&ai->chat.response);
-
-    // collect image args (argv[1..n], skip NULLs)
-    sqlite3_value *image_args[64];
-    int n_images = 0;
-    for (int i = 1; i < argc; i++) {
-        int type = sqlite3_value_type(argv[i]);
-        if (type == SQLITE_NULL) continue;
-        if (n_images < 64) image_args[n_images++] = argv[i];
+    
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
+        return;
     }
-
-    if (n_images > 0) {
-        if (!ai->vision) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Images provided but no vision model loaded. Call llm_vision_load() first.");
-            return;
-        }
-        llm_chat_respond_vision(context, ai, user_prompt, image_args, n_images);
-    } else {
-        llm_chat_run(ai, NULL, user_prompt);
-    }
-}
-
-static void llm_chat_system_prompt(sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (llm_check_context(context) == false)
-        return;
-
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (llm_chat_check_context(ai) == false)
-        return;
-
-    ai_messages *messages = &ai->chat.messages;
     
-    // get system role message
-    if (argc == 0) {
-        if (messages->count == 0) {
-            sqlite3_result_null(context);
-            return;
-        }
-
-        // only the first message is reserved to the system role
-        llama_chat_message *system_message = &messages->items[0];
-        const char *content = system_message->content;
-        if (system_message->role == ROLE_SYSTEM && content && content[0] != '\0') {
-            sqlite3_result_text(context, content, -1, SQLITE_TRANSIENT);
-        } else {
-            sqlite3_result_null(context);
-        }
-
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (!memory) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Prefix caching requires a model with memory");
         return;
     }
-
-    bool is_null_prompt = (sqlite3_value_type(argv[0]) == SQLITE_NULL);
-    int types[1];
-    types[0] = is_null_prompt ? SQLITE_NULL : SQLITE_TEXT;
-
-    if (sqlite_sanity_function(context, "llm_chat_system_prompt", argc, argv, 1, types, true, false) == false)
+    
+    // the prefix is the beginning of the templated prompt, up to the end of text
+    char *formatted = NULL;
+    int32_t formatted_len = 0;
+    if (!llm_text_apply_template(ai, text, &formatted, &formatted_len)) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate formatted prompt");
         return;
-
-    const unsigned char *prompt_text = sqlite3_value_text(argv[0]);
-    const char *system_prompt = prompt_text ? (const char *)prompt_text : "";
-    if (!llm_messages_set(messages, 0, ROLE_SYSTEM, system_prompt)) {
-        if (!llm_messages_append(messages, ROLE_SYSTEM, system_prompt)) {
-            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to set chat system prompt");
-            return;
-        }
     }
-}
-
-// MARK: - LLM Sampler -
-
-static void llm_sampler_init_greedy (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) llama_sampler_chain_add(ai->sampler, llama_sampler_init_greedy());
-}
-
-static void llm_sampler_init_dist (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (argc != 0) {
-        int types[] = {SQLITE_INTEGER};
-        if (sqlite_sanity_function(context, "llm_sampler_init_dist", argc, argv, 1, types, true, false) == false) return;
+    const char *prompt = text;
+    int32_t prompt_len = (int32_t)strlen(text);
+    if (formatted) {
+        const char *p = strstr(formatted, text);
+        if (p) {
+            prompt = formatted;
+            prompt_len = (int32_t)(p - formatted) + (int32_t)strlen(text);
+        }
     }
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        int32_t seed = (argc == 1) ? (int32_t)sqlite3_value_int64(argv[0]) : (int32_t)LLAMA_DEFAULT_SEED;
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_dist(seed));
+    ai_prefix prefix = {0};
+    int n_ctx = (int)llama_n_ctx(ctx);
+    int n_batch = (int)llama_n_batch(ctx);
+    int32_t n_tokens = -llama_tokenize(vocab, prompt, prompt_len, NULL, 0, true, true);
+    if (n_tokens <= 0 || n_tokens >= n_ctx) {
+        sqlite_context_result_error(context, SQLITE_TOOBIG, "Prefix must contain between 1 and %d tokens (%d)", n_ctx - 1, n_tokens);
+        goto cleanup;
+    }
+    
+    prefix.tokens = (llama_token *)sqlite3_malloc64(n_tokens * sizeof(llama_token));
+    prefix.name = sqlite_strdup(name);
+    prefix.text = sqlite_strdup(text);
+    if (!prefix.tokens || !prefix.name || !prefix.text) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate prefix");
+        goto cleanup;
+    }
+    prefix.ntokens = llama_tokenize(vocab, prompt, prompt_len, prefix.tokens, n_tokens, true, true);
+    if (prefix.ntokens != n_tokens) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Tokenization failed");
+        goto cleanup;
+    }
+    
+    // evaluate the prefix once in sequence 0
+    llama_memory_seq_rm(memory, 0, -1, -1);
+    llm_text_cache_reset(ai);
+    for (int pos = 0; pos < n_tokens; pos += n_batch) {
+        int chunk = (n_tokens - pos < n_batch) ? n_tokens - pos : n_batch;
+        if (llama_decode(ctx, llama_batch_get_one(prefix.tokens + pos, chunk))) {
+            llama_memory_seq_rm(memory, 0, -1, -1);
+            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to execute the decoding function during prefix processing");
+            goto cleanup;
+        }
     }
-}
-
-static void llm_sampler_init_top_k (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Top-K sampling described in academic paper "The Curious Case of Neural Text Degeneration" https://arxiv.org/abs/1904.09751
     
-    int types[] = {SQLITE_INTEGER};
-    if (sqlite_sanity_function(context, "llm_sampler_init_top_k", argc, argv, 1, types, true, false) == false) return;
-    
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        int32_t k = (int32_t)sqlite3_value_int64(argv[0]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_top_k(k));
+    // snapshot its KV state
+    prefix.state_size = llama_state_seq_get_size(ctx, 0);
+    prefix.state = (uint8_t *)sqlite3_malloc64(prefix.state_size);
+    if (!prefix.state) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate prefix state (%lld bytes)", (long long)prefix.state_size);
+        goto cleanup;
     }
-}
-
-static void llm_sampler_init_top_p (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Nucleus sampling described in academic paper "The Curious Case of Neural Text Degeneration" https://arxiv.org/abs/1904.09751
-    
-    int types[] = {SQLITE_FLOAT, SQLITE_INTEGER};
-    if (sqlite_sanity_function(context, "llm_sampler_init_top_p", argc, argv, 2, types, true, false) == false) return;
-    
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        float p = (float)sqlite3_value_double(argv[0]);
-        size_t min_keep = (size_t)sqlite3_value_int64(argv[1]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_top_p(p, min_keep));
+    if (llama_state_seq_get_data(ctx, prefix.state, prefix.state_size, 0) != prefix.state_size) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to copy prefix state");
+        goto cleanup;
     }
-}
-
-static void llm_sampler_init_min_p (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Minimum P sampling as described in https://github.com/ggml-org/llama.cpp/pull/3841
     
-    int types[] = {SQLITE_FLOAT, SQLITE_INTEGER};
-    if (sqlite_sanity_function(context, "llm_sampler_init_min_p", argc, argv, 2, types, true, false) == false) return;
+    // sequence 0 now contains exactly the prefix, so the next llm_text_generate can reuse it directly
+    if (!llm_text_cache_append(ai, prefix.tokens, prefix.ntokens)) llama_memory_seq_rm(memory, 0, -1, -1);
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        float p = (float)sqlite3_value_double(argv[0]);
-        size_t min_keep = (size_t)sqlite3_value_int64(argv[1]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_min_p(p, min_keep));
+    if ((size_t)ai->options.prefix_cache_size * 1024 * 1024 < prefix.state_size) {
+        sqlite_context_result_error(context, SQLITE_TOOBIG, "Prefix state (%lld bytes) exceeds prefix_cache_size (%u MB)", (long long)prefix.state_size, ai->options.prefix_cache_size);
+        goto cleanup;
     }
-}
-
-static void llm_sampler_init_typical (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Locally Typical Sampling implementation described in the paper https://arxiv.org/abs/2202.00666
-    
-    int types[] = {SQLITE_FLOAT, SQLITE_INTEGER};
-    if (sqlite_sanity_function(context, "llm_sampler_init_typical", argc, argv, 2, types, true, false) == false) return;
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        float p = (float)sqlite3_value_double(argv[0]);
-        size_t min_keep = (size_t)sqlite3_value_int64(argv[1]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_typical(p, min_keep));
-    }
-}
-
-static void llm_sampler_init_temp (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    int types[] = {SQLITE_FLOAT};
-    if (sqlite_sanity_function(context, "llm_sampler_init_temp", argc, argv, 1, types, true, false) == false) return;
+    // replace a previous prefix with the same name
+    int index = llm_prefix_find(ai, name);
+    if (index >= 0) llm_prefix_remove(ai, index);
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        float t = (float)sqlite3_value_double(argv[0]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_temp(t));
+    if (ai->prefixes.count == ai->prefixes.capacity) {
+        int new_cap = ai->prefixes.capacity ? ai->prefixes.capacity * 2 : 8;
+        ai_prefix *items = (ai_prefix *)sqlite3_realloc64(ai->prefixes.items, new_cap * sizeof(ai_prefix));
+        if (!items) {
+            sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate prefix");
+            goto cleanup;
+        }
+        ai->prefixes.items = items;
+        ai->prefixes.capacity = new_cap;
     }
-}
-
-static void llm_sampler_init_temp_ext (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Dynamic temperature implementation (a.k.a. entropy) described in the paper https://arxiv.org/abs/2309.02772
-    
-    int types[] = {SQLITE_FLOAT, SQLITE_FLOAT, SQLITE_FLOAT};
-    if (sqlite_sanity_function(context, "llm_sampler_init_temp_ext", argc, argv, 3, types, true, false) == false) return;
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        float t = (float)sqlite3_value_double(argv[0]);
-        float delta = (float)sqlite3_value_double(argv[1]);
-        float exponent = (float)sqlite3_value_double(argv[2]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_temp_ext(t, delta, exponent));
-    }
-}
-
-static void llm_sampler_init_xtc (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // XTC sampler as described in https://github.com/oobabooga/text-generation-webui/pull/6335
+    prefix.last_used = ++ai->prefixes.clock;
+    ai->prefixes.items[ai->prefixes.count++] = prefix;
+    ai->prefixes.size += prefix.state_size;
+    llm_prefix_evict(ai, prefix.name);
     
-    int types[] = {SQLITE_FLOAT, SQLITE_FLOAT, SQLITE_INTEGER, SQLITE_INTEGER};
-    if (sqlite_sanity_function(context, "llm_sampler_init_xtc", argc, argv, 4, types, true, false) == false) return;
+    sqlite3_free(formatted);
+    sqlite3_result_int(context, prefix.ntokens);
+    return;
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        float p = (float)sqlite3_value_double(argv[0]);
-        float t = (float)sqlite3_value_double(argv[1]);
-        size_t min_keep = (size_t)sqlite3_value_int64(argv[2]);
-        uint32_t seed = (uint32_t)sqlite3_value_int64(argv[3]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_xtc(p, t, min_keep, seed));
-    }
+cleanup:
+    llm_prefix_free_item(&prefix);
+    sqlite3_free(formatted);
 }
 
-static void llm_sampler_init_top_n_sigma (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Top n sigma sampling as described in academic paper "Top-nσ: Not All Logits Are You Need" https://arxiv.org/pdf/2411.07641
-    
-    int types[] = {SQLITE_FLOAT};
-    if (sqlite_sanity_function(context, "llm_sampler_init_top_n_sigma", argc, argv, 1, types, true, false) == false) return;
-    
+static void llm_prefix_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
     ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        float n = (float)sqlite3_value_double(argv[0]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_top_n_sigma(n));
-    }
-}
-
-static void llm_sampler_init_mirostat (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Mirostat 1.0 algorithm described in the paper https://arxiv.org/abs/2007.14966. Uses tokens instead of words.
-    
-    int types[] = {SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_FLOAT, SQLITE_INTEGER};
-    if (sqlite_sanity_function(context, "llm_sampler_init_mirostat", argc, argv, 4, types, true, false) == false) return;
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
-    if (!vocab) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to get vocab from current model.");
+    // no arguments means all the prefixes
+    if (argc == 0) {
+        llm_prefix_cache_clear(ai);
         return;
     }
     
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        uint32_t seed = (uint32_t)sqlite3_value_int64(argv[0]);
-        float tau = (float)sqlite3_value_double(argv[1]);
-        float eta = (float)sqlite3_value_double(argv[2]);
-        int32_t m = (int32_t)sqlite3_value_int64(argv[3]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_mirostat(llama_vocab_n_tokens(vocab), seed, tau, eta, m));
-    }
+    const char *name = (const char *)sqlite3_value_text(argv[0]);
+    int index = (name) ? llm_prefix_find(ai, name) : -1;
+    if (index >= 0) llm_prefix_remove(ai, index);
 }
 
-static void llm_sampler_init_mirostat_v2 (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Mirostat 2.0 algorithm described in the paper https://arxiv.org/abs/2007.14966. Uses tokens instead of words.
-    
-    int types[] = {SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_FLOAT};
-    if (sqlite_sanity_function(context, "llm_sampler_init_mirostat_v2", argc, argv, 3, types, true, false) == false) return;
-    
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        uint32_t seed = (uint32_t)sqlite3_value_int64(argv[0]);
-        float tau = (float)sqlite3_value_double(argv[1]);
-        float eta = (float)sqlite3_value_double(argv[2]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_mirostat_v2(seed, tau, eta));
-    }
-}
+// MARK: -
 
-static void llm_sampler_init_grammar (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    int types[] = {SQLITE_TEXT, SQLITE_TEXT};
-    if (sqlite_sanity_function(context, "llm_sampler_init_grammar", argc, argv, 2, types, true, false) == false) return;
-    
+static void llm_text_run (sqlite3_context *context, const char *text, int32_t text_len) {
     ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llama_token *tokens = NULL;
+    bool buffer_initialized = false;
+    buffer_t buffer = {0};
+    char *formatted_prompt = NULL;
+    char *prefixed_text = NULL;
+
+    // sanity check vocab
     const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
     if (!vocab) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to get vocab from current model.");
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
         return;
     }
-    
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        const char *grammar_str = (const char *)sqlite3_value_text(argv[0]);
-        const char *grammar_root = (const char *)sqlite3_value_text(argv[1]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_grammar(vocab, grammar_str, grammar_root));
+
+    struct llama_context *ctx = ai->ctx;
+    if (ctx == NULL) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No context found. Please call llm_context_create() before using this function.");
+        return;
     }
-}
 
-static void llm_sampler_init_infill (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
-    if (!vocab) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to get vocab from current model.");
+    // a named prefix is prepended to the prompt and its KV state is restored instead of being evaluated again
+    ai_prefix *prefix = NULL;
+    if (ai->options.prefix[0]) {
+        int index = llm_prefix_find(ai, ai->options.prefix);
+        if (index < 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Prefix '%s' not found. Please call llm_prefix_register() first.", ai->options.prefix);
+            return;
+        }
+        prefix = &ai->prefixes.items[index];
+        prefixed_text = sqlite3_mprintf("%s%.*s", prefix->text, text_len, text);
+        if (!prefixed_text) {
+            sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate prompt");
+            return;
+        }
+        text = prefixed_text;
+        text_len = (int32_t)strlen(prefixed_text);
+    }
+
+    // if the model has a chat template, wrap the prompt so the model emits EOG tokens
+    int32_t formatted_len = 0;
+    if (!llm_text_apply_template(ai, text, &formatted_prompt, &formatted_len)) {
+        sqlite3_free(prefixed_text);
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate formatted prompt");
         return;
     }
-    
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_infill(vocab));
+    if (formatted_prompt) {
+        text = formatted_prompt;
+        text_len = formatted_len;
     }
-}
+
+    const int n_ctx = (int)llama_n_ctx(ctx);
+    const int n_batch = (int)llama_n_batch(ctx);
+
+    // find the number of tokens in the prompt
+    int n_prompt = -llama_tokenize(vocab, text, text_len, NULL, 0, true, true);
+    if (n_prompt <= 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to extract number of tokens from prompt");
+        goto error;
+    }
+
+    // ensure prompt leaves room for at least one generated token
+    int max_prompt = n_ctx - 1;
+    if (max_prompt <= 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Context size too small for text generation (n_ctx=%d)", n_ctx);
+        goto error;
+    }
+    if (n_prompt > max_prompt) {
+        n_prompt = max_prompt;
+    }
+
+    // allocate space for the tokens and tokenize the prompt
+    tokens = (llama_token *)sqlite3_malloc(n_prompt * sizeof(llama_token));
+    if (!tokens) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate %d tokens", n_prompt);
+        goto error;
+    }
+
+    int n_actual = llama_tokenize(vocab, text, text_len, tokens, n_prompt, true, true);
+    if (n_actual < 0) {
+        // input needs more tokens than n_prompt — tokenize fully then truncate
+        int n_full = -n_actual;
+        llama_token *full_tokens = (llama_token *)sqlite3_malloc(n_full * sizeof(llama_token));
+        if (!full_tokens) {
+            sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate %d tokens", n_full);
+            goto error;
+        }
+        int n_got = llama_tokenize(vocab, text, text_len, full_tokens, n_full, true, true);
+        if (n_got < 0 || n_got != n_full) {
+            sqlite3_free(full_tokens);
+            sqlite_context_result_error(context, SQLITE_ERROR, "Tokenization failed");
+            goto error;
+        }
+        memcpy(tokens, full_tokens, n_prompt * sizeof(llama_token));
+        sqlite3_free(full_tokens);
+    } else {
+        n_prompt = n_actual;
+    }
+
+    // when n_predict is not set, default to 4096 tokens (capped by remaining context space)
+    // and let the model stop naturally via EOG
+    int n_predict = (ai->options.n_predict > 0) ? ai->options.n_predict : 4096;
+    if (n_predict > n_ctx - n_prompt) n_predict = n_ctx - n_prompt;
+    if (n_predict <= 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Prompt fills entire context (%d tokens), no room for generation", n_prompt);
+        goto error;
+    }
+
+    // reuse the KV cache of the prefix shared with the previous call (or with the named prefix), so that only the new suffix is decoded
+    if (prefix) llm_prefix_restore(ai, ctx, prefix, tokens, n_prompt);
+    int n_past = llm_text_cache_prefix(ai, ctx, tokens, n_prompt);
+
+    // initialize the sampler
+    bool sampler_already_setup = (ai->sampler != NULL);
+    struct llama_sampler *sampler = llm_sampler_check(ai);
+    if (!sampler) goto error;
+    if (!sampler_already_setup) {
+        // no sampler was setup, so initialize it with some default values
+        llama_sampler_chain_add(sampler, llama_sampler_init_penalties(64, 1.1, 0, 0));
+        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+    }
+
+    // allocate output buffer (starts small, grows dynamically via buffer_append)
+    if (!buffer_create(&buffer, 0)) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate buffer");
+        goto error_sampler;
+    }
+    buffer_initialized = true;
+
+    // feed prompt in batches of n_batch tokens
+    {
+        int prompt_pos = n_past;
+        while (prompt_pos < n_prompt) {
+            int chunk = n_prompt - prompt_pos;
+            if (chunk > n_batch) chunk = n_batch;
+            struct llama_batch batch = llama_batch_get_one(tokens + prompt_pos, chunk);
+            if (llama_decode(ctx, batch)) {
+                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to execute the decoding function during prompt processing");
+                goto error_sampler;
+            }
+            if (!llm_text_cache_append(ai, tokens + prompt_pos, chunk)) {
+                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to grow the token cache");
+                goto error_sampler;
+            }
+            prompt_pos += chunk;
+        }
+    }
+
+    // generate tokens, each step decodes the last sampled token (together with the tokens proposed by prompt lookup or by the draft model, if any)
+    {
+        llama_token accepted[AI_MAX_SPECULATIVE + 1];
+        int n_accepted = 0;
+        llama_token new_token_id = llama_sampler_sample(sampler, ctx, -1);
+        int n_sampled = 1;
+        
+        while (1) {
+            // accepted draft tokens are already stored in the KV cache, new_token_id is the last sampled one
+            for (int i = 0; i <= n_accepted; i++) {
+                llama_token token = (i < n_accepted) ? accepted[i] : new_token_id;
+                if (llama_vocab_is_eog(vocab, token)) goto generation_done;
+
+                char buf[MAX_TOKEN_TEXT_LEN];
+                int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+                if (n < 0) {
+                    sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert token to piece (%d)", n);
+                    goto error_sampler;
+                }
+
+                if (buffer_append(&buffer, buf, n, true) == false) {
+                    sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to append to buffer");
+                    goto error_sampler;
+                }
+            }
+            if (n_sampled >= n_predict) break;
+
+            // decode the sampled token to advance the KV cache
+            int k = llm_speculative_step(ai, ctx, sampler, ai->text.tokens, ai->text.ntokens, new_token_id, n_predict - n_sampled, accepted);
+            if (k < 0) {
+                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to execute the decoding function during generation");
+                goto error_sampler;
+            }
+            // the cached tokens are also the history used by lookup decoding and by the draft model, they must match sequence 0
+            if (!llm_text_cache_append(ai, &new_token_id, 1) || !llm_text_cache_append(ai, accepted, k - 1)) {
+                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to grow the token cache");
+                goto error_sampler;
+            }
+            
+            n_sampled += k;
+            n_accepted = k - 1;
+            new_token_id = accepted[k - 1];
+        }
+    }
+generation_done:
+
+    // success — transfer buffer ownership to SQLite
+    sqlite3_result_text(context, buffer.data, buffer.length, sqlite3_free);
+    sqlite3_free(tokens);
+    sqlite3_free(formatted_prompt);
+    sqlite3_free(prefixed_text);
+    if (!sampler_already_setup) llama_sampler_free(sampler);
+    return;
+
+error_sampler:
+    if (!sampler_already_setup && ai->sampler) {
+        llama_sampler_free(ai->sampler);
+        ai->sampler = NULL;
+    }
+error:
+    llm_text_cache_reset(ai);
+    if (buffer_initialized) buffer_destroy(&buffer);
+    sqlite3_free(tokens);
+    sqlite3_free(formatted_prompt);
+    sqlite3_free(prefixed_text);
+}
+
+static void llm_text_generate_exec (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context(context) == false) return;
+
+    if (argc < 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "llm_text_generate requires at least one TEXT argument (prompt)");
+        return;
+    }
+
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->model) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded");
+        return;
+    }
+
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    int32_t text_len = (int32_t)sqlite3_value_bytes(argv[0]);
+    if (!text || text_len == 0) return;
+
+    // parse remaining args: TEXT with '=' is options, TEXT without '=' or BLOB is an image
+    const char *options = NULL;
+    int options_index = 0;
+    sqlite3_value *image_args[64];
+    int n_images = 0;
+
+    for (int i = 1; i < argc; i++) {
+        int type = sqlite3_value_type(argv[i]);
+        if (type == SQLITE_NULL) continue;
+        if (type == SQLITE_TEXT && !options) {
+            const char *val = (const char *)sqlite3_value_text(argv[i]);
+            if (val && strchr(val, '=')) {
+                options = val;
+                options_index = i;
+                continue;
+            }
+        }
+        if (n_images < 64) image_args[n_images++] = argv[i];
+    }
+
+    // apply options if any (prefix is valid only for the current call)
+    ai->options.prefix[0] = 0;
+    if (llm_context_options_parse(context, ai, options_index, options) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
+        return;
+    }
+
+    if (n_images > 0) {
+        if (!ai->vision) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Images provided but no vision model loaded. Call llm_vision_load() first.");
+            return;
+        }
+        llm_text_run_vision(context, text, text_len, image_args, n_images);
+    } else {
+        llm_text_run(context, text, text_len);
+    }
+}
+
+// MARK: - Classification -
+
+// continuation scored after a shared prompt (a label of llm_classify): logprob is the sum of the log-probabilities of its
+// tokens and n_scored their number (the first token can't be scored when the prompt is empty, since there is nothing to
+// predict it from); if logprobs is not NULL it receives the log-probability of each token (NAN for a token not scored)
+typedef struct {
+    const llama_token           *tokens;
+    int32_t                     n_tokens;
+    float                       *logprobs;
+    double                      logprob;
+    int32_t                     n_scored;
+    
+    // scheduler state
+    llama_seq_id                seq_id;             // sequence holding the continuation while it is decoded (-1 if none)
+    int32_t                     n_fed;              // tokens already decoded (the last token is never decoded)
+} llm_score_item;
+
+// log of the softmax denominator of logits, so that the log-probability of token t is logits[t] - result
+static float llm_logits_log_sum_exp (const float *logits, int32_t n_vocab) {
+    float max = logits[0];
+    for (int32_t i = 1; i < n_vocab; ++i) {
+        if (logits[i] > max) max = logits[i];
+    }
+    double sum = 0.0;
+    for (int32_t i = 0; i < n_vocab; ++i) {
+        sum += expf(logits[i] - max);
+    }
+    return max + (float)log(sum);
+}
+
+static inline void llm_score_item_set (llm_score_item *item, int32_t index, float logprob) {
+    if (item->logprobs) item->logprobs[index] = logprob;
+    if (isnan(logprob)) return;
+    item->logprob += logprob;
+    item->n_scored++;
+}
+
+// score the continuations of a shared prompt (the labels of llm_classify, the continuations of llm_score) with logits enabled
+// only at their positions: the prompt is decoded once in sequence 0
+// (reusing the prefix cached by the previous call) and forked with llama_memory_seq_cp into the sequences not owned by chat sessions,
+// then the continuations are packed into the same batches, one sequence each (long continuations are split across batches)
+// without free sequences the continuations are decoded one after the other in sequence 0, truncated back to the prompt after each one
+static bool llm_score_run (sqlite3_context *context, sqlite3_vtab *vtab, ai_context *ai, const llama_token *prompt, int32_t n_prompt, llm_score_item *items, int n_items) {
+    struct llama_context *ctx = ai->ctx;
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (!vocab || !memory) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Scoring requires a generative model");
+        return false;
+    }
+    
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    const int n_ctx = (int)llama_n_ctx_seq(ctx);
+    const int n_batch = (int)llama_n_batch(ctx);
+    for (int i = 0; i < n_items; ++i) {
+        int n_total = n_prompt + items[i].n_tokens;
+        if (n_total - 1 > n_ctx) {
+            sqlite_common_set_error(context, vtab, SQLITE_TOOBIG, "Input too large: %d tokens exceeds the context size (%d)", n_total, n_ctx);
+            return false;
+        }
+        if (ai->options.max_tokens > 0 && n_total > ai->options.max_tokens) {
+            sqlite_common_set_error(context, vtab, SQLITE_TOOBIG, "Input too large: %d tokens exceeds max allowed (%d)", n_total, ai->options.max_tokens);
+            return false;
+        }
+        items[i].seq_id = -1;
+        items[i].n_fed = 0;
+        items[i].logprob = 0.0;
+        items[i].n_scored = 0;
+    }
+    
+    llama_seq_id *slots = NULL;
+    int32_t *owners = NULL;
+    llama_batch batch = {0};
+    bool result = false;
+    
+    // decode the part of the prompt not already stored in sequence 0, its last logits predict the first token of each continuation
+    if (n_prompt > 0) {
+        int32_t n_past = llm_text_cache_prefix(ai, ctx, prompt, n_prompt);
+        while (n_past < n_prompt) {
+            int32_t chunk = n_prompt - n_past;
+            if (chunk > n_batch) chunk = n_batch;
+            if (llama_decode(ctx, llama_batch_get_one((llama_token *)prompt + n_past, chunk))) {
+                sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to execute the decoding function during prompt processing");
+                goto error;
+            }
+            llm_text_cache_append(ai, prompt + n_past, chunk);
+            n_past += chunk;
+        }
+        
+        const float *logits = llama_get_logits_ith(ctx, -1);
+        if (!logits) {
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to retrieve logits (scoring requires a text generation context)");
+            goto error;
+        }
+        float lse = llm_logits_log_sum_exp(logits, n_vocab);
+        for (int i = 0; i < n_items; ++i) {
+            if (items[i].n_tokens > 0) llm_score_item_set(&items[i], 0, logits[items[i].tokens[0]] - lse);
+        }
+    } else {
+        llama_memory_seq_rm(memory, 0, -1, -1);
+        llm_text_cache_reset(ai);
+        for (int i = 0; i < n_items; ++i) {
+            if (items[i].n_tokens > 0) llm_score_item_set(&items[i], 0, NAN);
+        }
+    }
+    
+    int n_seq_max = (int)llama_n_seq_max(ctx);
+    slots = (llama_seq_id *)sqlite3_malloc64(n_seq_max * sizeof(llama_seq_id));
+    owners = (int32_t *)sqlite3_malloc64(n_batch * sizeof(int32_t));
+    batch = llama_batch_init(n_batch, 0, 1);
+    if (!slots || !owners || !batch.token) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Out of memory: failed to allocate scoring batch");
+        goto error;
+    }
+    
+    int n_free = 0;
+    for (llama_seq_id seq_id = n_seq_max - 1; seq_id > 0; --seq_id) {
+        bool used = false;
+        for (int i = 0; i < ai->sessions.count; ++i) {
+            if (ai->sessions.items[i]->seq_id == seq_id) {used = true; break;}
+        }
+        if (!used) slots[n_free++] = seq_id;
+    }
+    if (n_free == 0) slots[n_free++] = 0;
+    
+    while (1) {
+        // continuations in progress first, then the next ones while there are free sequences
+        batch.n_tokens = 0;
+        for (int i = 0; i < n_items && batch.n_tokens < n_batch; ++i) {
+            llm_score_item *item = &items[i];
+            int32_t n_feed = item->n_tokens - 1;
+            if (item->n_fed >= n_feed) continue;
+            if (item->seq_id < 0) {
+                if (n_free == 0) break;
+                item->seq_id = slots[--n_free];
+                if (item->seq_id != 0) llama_memory_seq_cp(memory, 0, item->seq_id, -1, -1);
+            }
+            
+            int32_t chunk = n_feed - item->n_fed;
+            if (chunk > n_batch - batch.n_tokens) chunk = n_batch - batch.n_tokens;
+            for (int32_t j = item->n_fed; j < item->n_fed + chunk; ++j) {
+                int32_t k = batch.n_tokens++;
+                batch.token[k] = item->tokens[j];
+                batch.pos[k] = n_prompt + j;
+                batch.n_seq_id[k] = 1;
+                batch.seq_id[k][0] = item->seq_id;
+                batch.logits[k] = true;
+                owners[k] = i;
+            }
+            item->n_fed += chunk;
+        }
+        if (batch.n_tokens == 0) break;
+        
+        int32_t rc = llama_decode(ctx, batch);
+        if (rc != 0) {
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to execute the decoding function during scoring (%d)", rc);
+            goto error;
+        }
+        
+        // each decoded token predicts the next token of its continuation
+        for (int32_t k = 0; k < batch.n_tokens; ++k) {
+            llm_score_item *item = &items[owners[k]];
+            int32_t j = batch.pos[k] - n_prompt + 1;
+            const float *logits = llama_get_logits_ith(ctx, k);
+            if (!logits) {
+                sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to retrieve logits (scoring requires a text generation context)");
+                goto error;
+            }
+            llm_score_item_set(item, j, logits[item->tokens[j]] - llm_logits_log_sum_exp(logits, n_vocab));
+        }
+        
+        // release the sequences of the completed continuations
+        for (int i = 0; i < n_items; ++i) {
+            llm_score_item *item = &items[i];
+            if (item->seq_id < 0 || item->n_fed < item->n_tokens - 1) continue;
+            if (item->seq_id != 0) llama_memory_seq_rm(memory, item->seq_id, -1, -1);
+            else if (!llama_memory_seq_rm(memory, 0, n_prompt, -1)) {
+                sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to remove the scored tokens from the context memory");
+                goto error;
+            }
+            slots[n_free++] = item->seq_id;
+            item->seq_id = -1;
+        }
+    }
+    
+    result = true;
+    goto cleanup;
+    
+error:
+    for (int i = 0; i < n_items; ++i) {
+        if (items[i].seq_id > 0) llama_memory_seq_rm(memory, items[i].seq_id, -1, -1);
+        items[i].seq_id = -1;
+    }
+    llama_memory_seq_rm(memory, 0, -1, -1);
+    llm_text_cache_reset(ai);
+cleanup:
+    if (batch.token) llama_batch_free(batch);
+    sqlite3_free(owners);
+    sqlite3_free(slots);
+    return result;
+}
+
+// labels of llm_classify, parsed and tokenized once per statement (auxdata of the labels argument)
+typedef struct {
+    const struct llama_vocab    *vocab;
+    int                         count;
+    char                        **names;
+    llama_token                 **tokens;           // tokens of each label (without special tokens)
+    int32_t                     *n_tokens;
+    int32_t                     max_tokens;         // tokens of the longest label
+} llm_classify_labels;
+
+static void llm_classify_labels_free (void *p) {
+    llm_classify_labels *labels = (llm_classify_labels *)p;
+    if (!labels) return;
+    for (int i = 0; i < labels->count; ++i) {
+        sqlite3_free(labels->names[i]);
+        sqlite3_free(labels->tokens[i]);
+    }
+    sqlite3_free(labels->names);
+    sqlite3_free(labels->tokens);
+    sqlite3_free(labels->n_tokens);
+    sqlite3_free(labels);
+}
+
+// labels must be a non empty JSON array of strings
+static llm_classify_labels *llm_classify_labels_create (sqlite3_context *context, sqlite3_value *value, const struct llama_vocab *vocab) {
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    llm_classify_labels *labels = NULL;
+    sqlite3_stmt *stmt = NULL;
+    
+    int rc = sqlite3_prepare_v2(db, "SELECT json_array_length(?1), value, type FROM json_each(?1);", -1, &stmt, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_value(stmt, 1, value);
+    if (rc != SQLITE_OK) {
+        sqlite_context_result_error(context, rc, "%s", sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    
+    labels = (llm_classify_labels *)sqlite3_malloc(sizeof(llm_classify_labels));
+    if (!labels) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate labels");
+        goto cleanup;
+    }
+    memset(labels, 0, sizeof(llm_classify_labels));
+    labels->vocab = vocab;
+    
+    int capacity = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (capacity == 0) {
+            capacity = sqlite3_column_int(stmt, 0);
+            if (capacity <= 0) break;
+            labels->names = (char **)sqlite3_malloc64(capacity * sizeof(char *));
+            labels->tokens = (llama_token **)sqlite3_malloc64(capacity * sizeof(llama_token *));
+            labels->n_tokens = (int32_t *)sqlite3_malloc64(capacity * sizeof(int32_t));
+            if (!labels->names || !labels->tokens || !labels->n_tokens) {
+                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate labels");
+                goto error;
+            }
+        }
+        
+        const char *name = (const char *)sqlite3_column_text(stmt, 1);
+        int32_t name_len = (int32_t)sqlite3_column_bytes(stmt, 1);
+        const char *type = (const char *)sqlite3_column_text(stmt, 2);
+        if (!type || strcmp(type, "text") != 0 || name_len == 0 || labels->count >= capacity) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "llm_classify labels must be a JSON array of non empty strings");
+            goto error;
+        }
+        
+        int32_t n_tokens = -llama_tokenize(vocab, name, name_len, NULL, 0, false, false);
+        llama_token *tokens = (n_tokens > 0) ? (llama_token *)sqlite3_malloc64(n_tokens * sizeof(llama_token)) : NULL;
+        char *copy = sqlite_strdup(name);
+        if (!tokens || !copy) {
+            sqlite3_free(tokens);
+            sqlite3_free(copy);
+            sqlite_context_result_error(context, (n_tokens > 0) ? SQLITE_NOMEM : SQLITE_ERROR, "Unable to tokenize label '%s'", name);
+            goto error;
+        }
+        llama_tokenize(vocab, name, name_len, tokens, n_tokens, false, false);
+        
+        int i = labels->count++;
+        labels->names[i] = copy;
+        labels->tokens[i] = tokens;
+        labels->n_tokens[i] = n_tokens;
+        if (n_tokens > labels->max_tokens) labels->max_tokens = n_tokens;
+    }
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        sqlite_context_result_error(context, rc, "%s", sqlite3_errmsg(db));
+        goto error;
+    }
+    if (labels->count == 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "llm_classify labels must be a JSON array of non empty strings");
+        goto error;
+    }
+    goto cleanup;
+    
+error:
+    llm_classify_labels_free(labels);
+    labels = NULL;
+cleanup:
+    if (stmt) sqlite3_finalize(stmt);
+    return labels;
+}
+
+// classification head (pooling type RANK): one logit per class, labels are matched by name (or by position if the model has no names)
+static int llm_classify_run_head (sqlite3_context *context, ai_context *ai, const char *text, int32_t text_len, llm_classify_labels *labels) {
+    struct llama_model *model = ai->model;
+    int n_cls_out = (int)llama_model_n_cls_out(model);
+    int best = -1;
+    
+    llm_embed_batch eb;
+    if (!llm_embed_batch_init(ai, context, NULL, &eb, EMBED_MODE_RANK)) return -1;
+    eb.dimension = n_cls_out;
+    eb.embedding_size = n_cls_out * (int)sizeof(float);
+    
+    llm_embed_input input = {0};
+    float *logits = (float *)sqlite3_malloc64(eb.embedding_size);
+    if (!logits) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate classification buffer");
+        goto cleanup;
+    }
+    if (!llm_embed_batch_tokenize(&eb, context, NULL, text, text_len, &input)) goto cleanup;
+    if (!llm_embed_batch_decode(&eb, context, NULL, &input, 1, (uint8_t *)logits)) goto cleanup;
+    
+    bool has_names = (llama_model_cls_label(model, 0) != NULL);
+    float best_logit = 0.0f;
+    for (int i = 0; i < labels->count; ++i) {
+        int index = -1;
+        if (has_names) {
+            for (int j = 0; j < n_cls_out; ++j) {
+                const char *name = llama_model_cls_label(model, j);
+                if (name && strcasecmp(name, labels->names[i]) == 0) {index = j; break;}
+            }
+        } else if (i < n_cls_out) {
+            index = i;
+        }
+        if (index < 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Label '%s' is not an output of the classification head of the model", labels->names[i]);
+            best = -1;
+            goto cleanup;
+        }
+        if (best < 0 || logits[index] > best_logit) {
+            best = i;
+            best_logit = logits[index];
+        }
+    }
+    
+cleanup:
+    sqlite3_free(logits);
+    llm_embed_input_reset(&input);
+    llm_embed_batch_free(&eb);
+    return best;
+}
+
+// tokens of the templated prompt, at most max_prompt: when it is longer the end of the user text is dropped, so that the
+// assistant turn that follows it in the template (and precedes the labels) is kept
+static bool llm_classify_prompt_tokenize (sqlite3_context *context, ai_context *ai, const struct llama_vocab *vocab, const char *text, int32_t text_len, int max_prompt, llama_token **tokens, int32_t *n_tokens) {
+    char *formatted = NULL;
+    int32_t formatted_len = 0;
+    if (!llm_text_apply_template(ai, text, &formatted, &formatted_len)) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate formatted prompt");
+        return false;
+    }
+    
+    const char *prompt = (formatted) ? formatted : text;
+    int32_t prompt_len = (formatted) ? formatted_len : text_len;
+    bool result = llm_tokenize_alloc(context, NULL, vocab, prompt, prompt_len, true, true, tokens, n_tokens);
+    if (!result || *n_tokens <= max_prompt) goto cleanup;
+    
+    // tokenize the template before and after the user text separately and fit the user text in the room left between them
+    const char *body = (formatted) ? strstr(formatted, text) : text;
+    if (!body) {
+        sqlite_context_result_error(context, SQLITE_TOOBIG, "Input too large: %d tokens exceeds the context size left by the labels (%d)", *n_tokens, max_prompt);
+        result = false;
+        goto cleanup;
+    }
+    int32_t head_len = (int32_t)(body - prompt);
+    const char *tail = body + text_len;
+    int32_t tail_len = prompt_len - head_len - text_len;
+    
+    llama_token *head_tokens = NULL, *body_tokens = NULL, *tail_tokens = NULL;
+    int32_t n_head = 0, n_body = 0, n_tail = 0;
+    result = llm_tokenize_alloc(context, NULL, vocab, prompt, head_len, true, true, &head_tokens, &n_head) &&
+             llm_tokenize_alloc(context, NULL, vocab, body, text_len, false, true, &body_tokens, &n_body) &&
+             llm_tokenize_alloc(context, NULL, vocab, tail, tail_len, false, true, &tail_tokens, &n_tail);
+    if (result && n_head + n_tail >= max_prompt) {
+        sqlite_context_result_error(context, SQLITE_TOOBIG, "Labels too large for the context (%d tokens)", (int)llama_n_ctx_seq(ai->ctx) - max_prompt);
+        result = false;
+    }
+    if (result) {
+        if (n_body > max_prompt - n_head - n_tail) n_body = max_prompt - n_head - n_tail;
+        llama_token *p = *tokens;
+        if (n_head > 0) memcpy(p, head_tokens, n_head * sizeof(llama_token));
+        if (n_body > 0) memcpy(p + n_head, body_tokens, n_body * sizeof(llama_token));
+        if (n_tail > 0) memcpy(p + n_head + n_body, tail_tokens, n_tail * sizeof(llama_token));
+        *n_tokens = n_head + n_body + n_tail;
+    }
+    sqlite3_free(head_tokens);
+    sqlite3_free(body_tokens);
+    sqlite3_free(tail_tokens);
+    
+cleanup:
+    if (!result) {
+        sqlite3_free(*tokens);
+        *tokens = NULL;
+        *n_tokens = 0;
+    }
+    sqlite3_free(formatted);
+    return result;
+}
+
+// generative model: the labels are scored as continuations of the prompt (see llm_score_run), all of them with a single decode
+// when there are enough free sequences, and ranked by the sum of the log-probabilities of their tokens (no sampling is involved)
+static int llm_classify_run_generative (sqlite3_context *context, ai_context *ai, const char *text, int32_t text_len, llm_classify_labels *labels) {
+    const struct llama_vocab *vocab = labels->vocab;
+    llama_token *tokens = NULL;
+    llm_score_item *items = NULL;
+    int best = -1;
+    
+    // the prompt leaves room for the longest label
+    int32_t n_prompt = 0;
+    int max_prompt = (int)llama_n_ctx_seq(ai->ctx) - labels->max_tokens;
+    if (max_prompt <= 0) {
+        sqlite_context_result_error(context, SQLITE_TOOBIG, "Labels too large for the context (%d tokens)", labels->max_tokens);
+        return -1;
+    }
+    if (!llm_classify_prompt_tokenize(context, ai, vocab, text, text_len, max_prompt, &tokens, &n_prompt)) return -1;
+    if (n_prompt == 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to extract number of tokens from prompt");
+        goto cleanup;
+    }
+    
+    items = (llm_score_item *)sqlite3_malloc64(labels->count * sizeof(llm_score_item));
+    if (!items) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate label scores");
+        goto cleanup;
+    }
+    memset(items, 0, labels->count * sizeof(llm_score_item));
+    for (int i = 0; i < labels->count; ++i) {
+        items[i].tokens = labels->tokens[i];
+        items[i].n_tokens = labels->n_tokens[i];
+    }
+    if (!llm_score_run(context, NULL, ai, tokens, n_prompt, items, labels->count)) goto cleanup;
+    
+    for (int i = 0; i < labels->count; ++i) {
+        if (best < 0 || items[i].logprob > items[best].logprob) best = i;
+    }
+    
+cleanup:
+    sqlite3_free(items);
+    sqlite3_free(tokens);
+    return best;
+}
+
+static void llm_classify_exec (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context(context) == false) return;
+    if (argc != 2 && argc != 3) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Function 'llm_classify' expects 2 or 3 arguments, but %d were provided.", argc);
+        return;
+    }
+    
+    // handle NULL input
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    int types[] = {SQLITE_TEXT, SQLITE_TEXT, SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "llm_classify", argc, argv, argc, types, true, false) == false) return;
+    
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    int32_t text_len = (int32_t)sqlite3_value_bytes(argv[0]);
+    const char *options = (argc == 3) ? (const char *)sqlite3_value_text(argv[2]) : NULL;
+    if (text_len == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (llm_context_options_parse(context, ai, 2, options) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
+        return;
+    }
+    
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
+        return;
+    }
+    
+    // constant labels argument: parsed and tokenized once per statement
+    llm_classify_labels *labels = (llm_classify_labels *)sqlite3_get_auxdata(context, 1);
+    bool is_new = (labels == NULL || labels->vocab != vocab);
+    if (is_new) {
+        labels = llm_classify_labels_create(context, argv[1], vocab);
+        if (!labels) return;
+    }
+    
+    // models with a classification head score all the labels with a single forward pass
+    int best = (llama_model_n_cls_out(ai->model) > 0) ? llm_classify_run_head(context, ai, text, text_len, labels) : llm_classify_run_generative(context, ai, text, text_len, labels);
+    if (best >= 0) sqlite3_result_text(context, labels->names[best], -1, SQLITE_TRANSIENT);
+    
+    // auxdata can be released by SQLite before sqlite3_set_auxdata returns, so it is set last
+    if (is_new) sqlite3_set_auxdata(context, 1, labels, llm_classify_labels_free);
+}
+
+// MARK: - Log-probability Scoring -
+
+// llm_score and llm_score_batch run arbitrary continuations through the label scheduler of llm_classify (llm_score_run),
+// the batched form also asks it for the log-probability of each token
+
+static void llm_score_exec (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context(context) == false) return;
+    if (argc != 2 && argc != 3) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Function 'llm_score' expects 2 or 3 arguments, but %d were provided.", argc);
+        return;
+    }
+    
+    // handle NULL input
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    int types[] = {SQLITE_TEXT, SQLITE_TEXT, SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "llm_score", argc, argv, argc, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    const char *options = (argc == 3) ? (const char *)sqlite3_value_text(argv[2]) : NULL;
+    if (llm_context_options_parse(context, ai, 2, options) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
+        return;
+    }
+    
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
+        return;
+    }
+    
+    llama_token *prompt = NULL;
+    int32_t n_prompt = 0;
+    llm_score_item item = {0};
+    llama_token *tokens = NULL;
+    
+    // the prompt gets the special tokens of the model (BOS), the continuation is scored as plain text
+    if (!llm_tokenize_alloc(context, NULL, vocab, (const char *)sqlite3_value_text(argv[0]), sqlite3_value_bytes(argv[0]), true, true, &prompt, &n_prompt)) goto cleanup;
+    if (!llm_tokenize_alloc(context, NULL, vocab, (const char *)sqlite3_value_text(argv[1]), sqlite3_value_bytes(argv[1]), false, false, &tokens, &item.n_tokens)) goto cleanup;
+    if (item.n_tokens == 0) {
+        sqlite3_result_null(context);
+        goto cleanup;
+    }
+    
+    // the scalar form returns the total only, so no per-token buffer is needed
+    item.tokens = tokens;
+    if (!llm_score_run(context, NULL, ai, prompt, n_prompt, &item, 1)) goto cleanup;
+    
+    (item.n_scored > 0) ? sqlite3_result_double(context, item.logprob) : sqlite3_result_null(context);
+    
+cleanup:
+    sqlite3_free(tokens);
+    sqlite3_free(prompt);
+}
+
+// MARK: - Log-probability Scoring Virtual Table -
+
+#define AI_SCORE_COLUMN_ID                      0
+#define AI_SCORE_COLUMN_LOGPROB                 1
+#define AI_SCORE_COLUMN_MEAN_LOGPROB            2
+#define AI_SCORE_COLUMN_N_TOKENS                3
+#define AI_SCORE_COLUMN_TOKEN_LOGPROBS          4
+#define AI_SCORE_COLUMN_PROMPT                  5       // first argument (followed by continuations and options)
+
+typedef struct {
+    sqlite3_vtab_cursor         base;               // Base class - must be first
+    ai_vtab                     *vtab;
+    ai_context                  *ai;
+    
+    sqlite3_value               **ids;
+    llm_score_item              *items;
+    float                       *logprobs;          // buffer shared by all the items
+    int                         count;
+    int                         capacity;
+    int                         index;
+} ai_score_cursor;
+
+static void llm_score_cursor_reset (ai_score_cursor *c) {
+    for (int i = 0; i < c->count; ++i) {
+        sqlite3_value_free(c->ids[i]);
+        sqlite3_free((void *)c->items[i].tokens);
+    }
+    sqlite3_free(c->ids);
+    sqlite3_free(c->items);
+    sqlite3_free(c->logprobs);
+    c->ids = NULL;
+    c->items = NULL;
+    c->logprobs = NULL;
+    c->count = 0;
+    c->capacity = 0;
+    c->index = 0;
+}
+
+static int llm_score_batch_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return llm_embed_connect_common(db, pAux, "CREATE TABLE x(id, logprob, mean_logprob, n_tokens, token_logprobs, prompt hidden, continuations hidden, options hidden);", ppVtab);
+}
+
+static int llm_score_batch_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    return llm_embed_best_index_common(pIdxInfo, AI_SCORE_COLUMN_PROMPT, 2);
+}
+
+static int llm_score_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_score_cursor *c = (ai_score_cursor *)sqlite3_malloc(sizeof(ai_score_cursor));
+    if (!c) return SQLITE_NOMEM;
+    
+    memset(c, 0, sizeof(ai_score_cursor));
+    ai_vtab *vtab = (ai_vtab *)pVtab;
+    c->vtab = vtab;
+    c->ai = vtab->ai;
+    
+    *ppCursor = (sqlite3_vtab_cursor *)c;
+    return SQLITE_OK;
+}
+
+static int llm_score_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_score_cursor *c = (ai_score_cursor *)cur;
+    llm_score_cursor_reset(c);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
+
+static int llm_score_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_score_cursor *c = (ai_score_cursor *)cur;
+    c->index++;
+    return SQLITE_OK;
+}
+
+static int llm_score_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_score_cursor *c = (ai_score_cursor *)cur;
+    return (c->index >= c->count);
+}
+
+static int llm_score_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_score_cursor *c = (ai_score_cursor *)cur;
+    const llm_score_item *item = &c->items[c->index];
+    
+    if (iCol == AI_SCORE_COLUMN_ID) {
+        sqlite3_result_value(context, c->ids[c->index]);
+        return SQLITE_OK;
+    }
+    if (item->n_tokens == 0) {
+        sqlite3_result_null(context);
+        return SQLITE_OK;
+    }
+    
+    switch (iCol) {
+        case AI_SCORE_COLUMN_LOGPROB:
+            (item->n_scored > 0) ? sqlite3_result_double(context, item->logprob) : sqlite3_result_null(context);
+            break;
+        case AI_SCORE_COLUMN_MEAN_LOGPROB:
+            (item->n_scored > 0) ? sqlite3_result_double(context, item->logprob / item->n_scored) : sqlite3_result_null(context);
+            break;
+        case AI_SCORE_COLUMN_N_TOKENS:
+            sqlite3_result_int(context, item->n_tokens);
+            break;
+        case AI_SCORE_COLUMN_TOKEN_LOGPROBS:
+            sqlite3_result_blob(context, item->logprobs, item->n_tokens * (int)sizeof(float), SQLITE_TRANSIENT);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int llm_score_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_score_cursor *c = (ai_score_cursor *)cur;
+    *pRowid = c->index;
+    return SQLITE_OK;
+}
+
+// read and tokenize all the continuations (a JSON array or object), then score them together
+static int llm_score_batch_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_score_cursor *c = (ai_score_cursor *)cur;
+    ai_vtab *vtab = c->vtab;
+    ai_context *ai = c->ai;
+    llm_score_cursor_reset(c);
+    
+    int rc = llm_vtab_arguments_prepare(vtab, "llm_score_batch", 2, argc, argv);
+    if (rc != SQLITE_OK) return rc;
+    
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) return sqlite_vtab_set_error(&vtab->base, "Failed to extract vocabulary from the model");
+    
+    sqlite3 *db = ai->db;
+    sqlite3_stmt *source = NULL;
+    llama_token *prompt = NULL;
+    int32_t n_prompt = 0;
+    size_t n_logprobs = 0;
+    
+    rc = sqlite3_prepare_v2(db, "SELECT key, value FROM json_each(?1);", -1, &source, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_value(source, 1, argv[1]);
+    if (rc != SQLITE_OK) {
+        rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    
+    while ((rc = sqlite3_step(source)) == SQLITE_ROW) {
+        if (c->count == c->capacity) {
+            int capacity = (c->capacity) ? c->capacity * 2 : 64;
+            sqlite3_value **ids = (sqlite3_value **)sqlite3_realloc64(c->ids, capacity * sizeof(sqlite3_value *));
+            if (ids) c->ids = ids;
+            llm_score_item *items = (llm_score_item *)sqlite3_realloc64(c->items, capacity * sizeof(llm_score_item));
+            if (items) c->items = items;
+            if (!ids || !items) {rc = SQLITE_NOMEM; goto cleanup;}
+            c->capacity = capacity;
+        }
+        
+        llm_score_item *item = &c->items[c->count];
+        memset(item, 0, sizeof(llm_score_item));
+        c->ids[c->count] = sqlite3_value_dup(sqlite3_column_value(source, 0));
+        if (!c->ids[c->count]) {rc = SQLITE_NOMEM; goto cleanup;}
+        c->count++;
+        
+        const char *text = (const char *)sqlite3_column_text(source, 1);
+        int32_t text_len = (int32_t)sqlite3_column_bytes(source, 1);
+        if (!text || text_len == 0) continue;
+        
+        llama_token *tokens = NULL;
+        if (!llm_tokenize_alloc(NULL, &vtab->base, vocab, text, text_len, false, false, &tokens, &item->n_tokens)) {rc = SQLITE_ERROR; goto cleanup;}
+        item->tokens = tokens;
+        n_logprobs += item->n_tokens;
+    }
+    if (rc != SQLITE_DONE) {
+        rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    rc = SQLITE_OK;
+    
+    c->logprobs = (float *)sqlite3_malloc64((n_logprobs + 1) * sizeof(float));
+    if (!c->logprobs) {rc = SQLITE_NOMEM; goto cleanup;}
+    float *logprobs = c->logprobs;
+    for (int i = 0; i < c->count; ++i) {
+        c->items[i].logprobs = logprobs;
+        logprobs += c->items[i].n_tokens;
+    }
+    
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    if (!llm_tokenize_alloc(NULL, &vtab->base, vocab, text, sqlite3_value_bytes(argv[0]), true, true, &prompt, &n_prompt)) {rc = SQLITE_ERROR; goto cleanup;}
+    
+    // all the rows are scored here, so a pooled context is used only for the duration of the filter
+    bool checked_out = false;
+    if (!llm_context_cursor_checkout(ai, &checked_out)) {
+        rc = sqlite_vtab_set_error(&vtab->base, "Unable to create context from model");
+        goto cleanup;
+    }
+    if (!llm_score_run(NULL, &vtab->base, ai, prompt, n_prompt, c->items, c->count)) rc = SQLITE_ERROR;
+    llm_context_cursor_checkin(ai, &checked_out);
+    
+cleanup:
+    if (source) sqlite3_finalize(source);
+    sqlite3_free(prompt);
+    if (rc != SQLITE_OK) llm_score_cursor_reset(c);
+    return rc;
+}
+
+static sqlite3_module llm_score_batch = {
+  /* iVersion    */ 0,
+  /* xCreate     */ 0,
+  /* xConnect    */ llm_score_batch_connect,
+  /* xBestIndex  */ llm_score_batch_best_index,
+  /* xDisconnect */ llm_embed_disconnect,
+  /* xDestroy    */ 0,
+  /* xOpen       */ llm_score_cursor_open,
+  /* xClose      */ llm_score_cursor_close,
+  /* xFilter     */ llm_score_batch_filter,
+  /* xNext       */ llm_score_cursor_next,
+  /* xEof        */ llm_score_cursor_eof,
+  /* xColumn     */ llm_score_cursor_column,
+  /* xRowid      */ llm_score_cursor_rowid,
+  /* xUpdate     */ 0,
+  /* xBegin      */ 0,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ 0,
+  /* xFindMethod */ 0,
+  /* xRename     */ 0,
+  /* xSavepoint  */ 0,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ 0,
+  /* xShadowName */ 0,
+  /* xIntegrity  */ 0
+};
+
+// MARK: - Chat -
+
+static bool llm_chat_sampler_check (ai_context *ai) {
+    if (ai->sampler) return true;
+    
+    llm_sampler_check(ai);
+    if (ai->sampler == NULL) return false;
+    llama_sampler_chain_add(ai->sampler, llama_sampler_init_min_p(0.05, 1));
+    llama_sampler_chain_add(ai->sampler, llama_sampler_init_temp(0.8));
+    llama_sampler_chain_add(ai->sampler, llama_sampler_init_dist((uint32_t)LLAMA_DEFAULT_SEED));
+    return true;
+}
+
+static bool llm_chat_check_context (ai_context *ai) {
+    if (!llm_context_pin(ai)) {
+        sqlite_common_set_error(ai ? ai->context : NULL, ai ? ai->vtab : NULL, SQLITE_MISUSE, "No context found. Please call llm_context_create() before llm_chat_create().");
+        return false;
+    }
+    
+    // check sampler
+    if (llm_chat_sampler_check(ai) == false) return false;
+    
+    // initialize the chat struct if already created
+    if (ai->chat.uuid[0] != '\0') return true;
+    
+    // create history structs
+    ai_uuid_v7_string(ai->chat.uuid, true);
+    
+    int n_ctx = llama_n_ctx(ai->ctx);
+    if (!buffer_create(&ai->chat.formatted, n_ctx) || !buffer_create(&ai->chat.response, MIN_ALLOC_RESPONSE)) {
+        sqlite_common_set_error(ai->context, ai->vtab, SQLITE_NOMEM, "Out of memory: failed to allocate chat buffers");
+        return false;
+    }
+
+    ai->chat.prompt = (char *)sqlite3_malloc(MIN_ALLOC_PROMPT);
+    ai->chat.tokens = (llama_token *)sqlite3_malloc(sizeof(llama_token) * MIN_ALLOC_TOKEN);
+    if (!ai->chat.prompt || !ai->chat.tokens) {
+        sqlite_common_set_error(ai->context, ai->vtab, SQLITE_NOMEM, "Out of memory: failed to allocate chat prompt/token buffers");
+        return false;
+    }
+    ai->chat.ntokens = MIN_ALLOC_TOKEN;
+
+    return true;
+}
+
+static bool llm_chat_save_response (ai_context *ai, ai_messages *messages, const char *template) {
+    char *response = ai->chat.response.data;
+    if (!response) return false;
+    
+    if (!llm_messages_append(messages, ROLE_ASSISTANT, response)) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to append response");
+        return false;
+    }
+    
+    ai->chat.prev_len = llama_chat_apply_template(template, messages->items, messages->count, false, NULL, 0);
+    if (ai->chat.prev_len < 0) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to finalize chat template");
+        return false;
+    }
+    
+    return true;
+}
+
+static bool llm_chat_generate_response (ai_context *ai, ai_cursor *c, bool *is_eog) {
+    struct llama_context *ctx = ai->ctx;
+    struct llama_sampler *sampler = ai->sampler;
+    const struct llama_vocab *vocab = ai->chat.vocab;
+    llama_batch batch = ai->chat.batch;
+    char *tok = ai->chat.token_text;
+    
+    // check context space
+    uint32_t n_ctx = llama_n_ctx(ctx);
+    int32_t n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(ctx), 0);
+    llm_text_cache_reset(ai);
+    
+    if (ai->chat.queue_index < ai->chat.queue_count) {
+        // token already verified by the last speculative step
+        ai->chat.token_id = ai->chat.queue[ai->chat.queue_index++];
+    } else if (llm_speculative_enabled(ai) && batch.token == &ai->chat.token_id) {
+        // decode the last sampled token together with the proposed tokens
+        int max_tokens = (int)n_ctx - (n_ctx_used + 1);
+        if (max_tokens <= 0) {
+            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Context size exceeded (%d, %d)", n_ctx, n_ctx_used + batch.n_tokens);
+            return false;
+        }
+        
+        llama_token id_last = ai->chat.token_id;
+        int k = llm_speculative_step(ai, ctx, sampler, ai->chat.history, ai->chat.nhistory, id_last, max_tokens, ai->chat.queue);
+        if (k < 0) {
+            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to decode generation batch");
+            return false;
+        }
+        llm_tokens_append(&ai->chat.history, &ai->chat.nhistory, &ai->chat.history_capacity, &id_last, 1);
+        llm_tokens_append(&ai->chat.history, &ai->chat.nhistory, &ai->chat.history_capacity, ai->chat.queue, k - 1);
+        ai->chat.n_past += k;
+        
+        ai->chat.queue_count = k;
+        ai->chat.queue_index = 1;
+        ai->chat.token_id = ai->chat.queue[0];
+    } else {
+        if (n_ctx_used + batch.n_tokens > n_ctx) {
+            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Context size exceeded (%d, %d)", n_ctx, n_ctx_used + batch.n_tokens);
+            return false;
+        }
+        
+        if (llama_decode(ctx, batch)) {
+            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to decode prompt batch");
+            return false;
+        }
+        llm_tokens_append(&ai->chat.history, &ai->chat.nhistory, &ai->chat.history_capacity, batch.token, batch.n_tokens);
+        ai->chat.n_past += batch.n_tokens;
+        
+        // sample next token
+        ai->chat.token_id = llama_sampler_sample(sampler, ctx, -1);
+    }
+    
+    // DEBUG
+    // printf("%d ", ai->chat.token_id);
+    
+    if (llama_vocab_is_eog(vocab, ai->chat.token_id)) {
+        if (c) c->is_eog = true;
+        if (is_eog) *is_eog = true;
+        return true;
+    }
+    
+    // convert token to string
+    int32_t n = llama_token_to_piece(vocab, ai->chat.token_id, tok, MAX_TOKEN_TEXT_LEN, 0, true);
+    if (n < 0) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to convert token to string");
+        return false;
+    }
+    ai->chat.token_len = n;
+    
+    // append converted token to response buffer
+    if (buffer_append(&ai->chat.response, tok, n, true) == false) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to grow response buffer");
+        return false;
+    }
+    
+    // DEBUG
+    // fwrite(buf, 1, n, stdout);
+    // fflush(stdout);
+    
+    // prepare next batch
+    ai->chat.batch = llama_batch_get_one(&ai->chat.token_id, 1);
+    ai->chat.token_count++;
+    
+    return true;
+}
+
+static bool llm_chat_tokenize_input (ai_context *ai, const char *prompt) {
+    struct llama_context *ctx = ai->ctx;
+    const struct llama_vocab *vocab = ai->chat.vocab;
+    
+    // check if first execution
+    bool is_first = (llama_memory_seq_pos_max(llama_get_memory(ctx), 0) == -1);
+    
+    // count how many tokens prompt generates
+    int32_t prompt_len = (int32_t)strlen(prompt);
+    int32_t n_prompt_tokens = -llama_tokenize(vocab, prompt, prompt_len, NULL, 0, is_first, true);
+    if (n_prompt_tokens <= 0) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to determine prompt token count");
+        return false;
+    }
+    
+    // check if a new token allocation is required
+    if (ai->chat.ntokens < n_prompt_tokens) {
+        llama_token *prompt_tokens = sqlite3_malloc(sizeof(llama_token) * n_prompt_tokens);
+        if (!prompt_tokens) {
+            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_NOMEM, "Failed to allocate prompt token buffer");
+            return false;
+        }
+        if (ai->chat.tokens) sqlite3_free(ai->chat.tokens);
+        ai->chat.tokens = prompt_tokens;
+        ai->chat.ntokens = n_prompt_tokens;
+    }
+    
+    // tokenize prompt
+    llama_token *prompt_tokens = ai->chat.tokens;
+    if (llama_tokenize(vocab, prompt, prompt_len, prompt_tokens, n_prompt_tokens, is_first, true) < 0) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to tokenize the prompt");
+        return false;
+    }
+    
+    // create initial batch
+    ai->chat.batch = llama_batch_get_one(prompt_tokens, n_prompt_tokens);
+    ai->chat.queue_count = 0;
+    ai->chat.queue_index = 0;
+    
+    return true;
+}
+
+static bool llm_chat_run (ai_context *ai, ai_cursor *c, const char *user_prompt) {
+    const char *template = llama_model_chat_template(ai->model, NULL);
+    if (!template) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Template not available");
+        return false;
+    }
+    
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Model vocab not available");
+        return false;
+    }
+    
+    // setup context
+    ai->chat.vocab = vocab;
+    ai->chat.template = template;
+    ai_messages *messages = &ai->chat.messages;
+    buffer_t *formatted = &ai->chat.formatted;
+    
+    // save prompt input in history
+    if (!llm_messages_append(messages, ROLE_USER, user_prompt)) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to append message");
+        return false;
+    }
+    
+    // skip empty system message if present
+    size_t messages_count = messages->count;
+    const llama_chat_message *messages_items = messages->items;
+    if (messages->count > 0) {
+        const llama_chat_message first_message = messages->items[0];
+        if (first_message.role == ROLE_SYSTEM && first_message.content[0] == '\0') {
+            messages_items = messages->items + 1;
+            messages_count = messages->count - 1;
+        }
+    }
+    
+    // transform a list of messages (the context) into
+    // <|user|>What is AI?<|end|><|assistant|>AI stands for Artificial Intelligence...<|end|><|user|>Can you give an example?<|end|><|assistant|>...
+    int32_t new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
+    if (new_len > formatted->capacity) {
+        if (buffer_resize(formatted, new_len * 2) == false) return false;
+        new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
+    }
+    if ((new_len < 0) || (new_len > formatted->capacity)) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "failed to apply chat template");
+        return false;
+    }
+    
+    // check if there is enough space for the new formatted prompt
+    int32_t prompt_len = new_len - ai->chat.prev_len;
+    if (prompt_len <= 0) {
+        sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Invalid prompt length (template state inconsistency)");
+        return false;
+    }
+    int32_t current_len = (int32_t)sqlite3_msize(ai->chat.prompt); // safe even if ai->chat.prompt is NULL
+    if (current_len < prompt_len + 1) {
+        char *buffer = (char *)sqlite3_malloc64(prompt_len + MIN_ALLOC_PROMPT);
+        if (!buffer) {
+            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_NOMEM, "Failed to allocate prompt buffer");
+            return false;
+        }
+        if (ai->chat.prompt) sqlite3_free(ai->chat.prompt);
+        ai->chat.prompt = buffer;
+    }
+    
+    // build templated version of the user prompt
+    memcpy(ai->chat.prompt, formatted->data + ai->chat.prev_len, prompt_len);
+    ai->chat.prompt[prompt_len] = 0;
+    
+    // tokenize input prompt
+    if (!llm_chat_tokenize_input(ai, ai->chat.prompt)) return false;
+    
+    // if c is not NULL it means that reply must be streamed
+    if (c) return true;
+    
+    // do not stream response and incrementally build the buffer
+    bool is_eog = false;
+    while (1) {
+        if (!llm_chat_generate_response (ai, NULL, &is_eog)) return false;
+        if (is_eog) break;
+    }
+    
+    // save response
+    if (llm_chat_save_response(ai, messages, template) == false) return false;
+    
+    // return full respond
+    char *response = ai->chat.response.data;
+    sqlite3_result_text(ai->context, response, -1, SQLITE_TRANSIENT);
+    return true;
+}
+
+// MARK: -
+
+static int llm_chat_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(reply, dummy hidden);");
+    if (rc != SQLITE_OK) return rc;
+    
+    ai_vtab *vtab = (ai_vtab *)sqlite3_malloc(sizeof(ai_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    
+    memset(vtab, 0, sizeof(ai_vtab));
+    ai_context *ai = (ai_context *)pAux;
+    
+    vtab->ai = ai;
+    ai->db = db;
+    ai->context = NULL;
+    ai->vtab = (sqlite3_vtab *)vtab;
+    
+    *ppVtab = (sqlite3_vtab *)vtab;
+    return SQLITE_OK;
+}
+
+static int llm_chat_disconnect (sqlite3_vtab *pVtab) {
+    ai_vtab *vtab = (ai_vtab *)pVtab;
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int llm_chat_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    pIdxInfo->idxNum = 1;
+    pIdxInfo->orderByConsumed = 1;
+    pIdxInfo->estimatedCost = (double)1;
+    
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+        if (pIdxInfo->aConstraint[i].usable && pIdxInfo->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            // tell SQLite we'll use this argument
+            pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+            pIdxInfo->aConstraintUsage[i].omit = 1;
+            pIdxInfo->idxNum = 1;
+            break;
+        }
+    }
+    
+    return SQLITE_OK;
+}
+
+static int llm_chat_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_cursor *c = (ai_cursor *)sqlite3_malloc(sizeof(ai_cursor));
+    if (!c) return SQLITE_NOMEM;
+    
+    memset(c, 0, sizeof(ai_cursor));
+    ai_vtab *vtab = (ai_vtab *)pVtab;
+    c->vtab = vtab;
+    c->ai = vtab->ai;
+    
+    ai_context *ai = c->ai;
+    if (llm_chat_check_context(ai) == false) return SQLITE_ERROR;
+    
+    *ppCursor = (sqlite3_vtab_cursor *)c;
+    return SQLITE_OK;
+}
+
+static int llm_chat_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_cursor *c = (ai_cursor *)cur;
+    ai_context *ai = c->ai;
+
+    // save response before freeing the cursor
+    ai_messages *messages = &ai->chat.messages;
+    const char *template = ai->chat.template;
+    bool saved = llm_chat_save_response(ai, messages, template);
+
+    sqlite3_free(c);
+
+    return saved ? SQLITE_OK : SQLITE_ERROR;
+}
+
+static int llm_chat_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_cursor *c = (ai_cursor *)cur;
+    if (!llm_chat_generate_response (c->ai, c, NULL)) return SQLITE_ERROR;
+    c->rowid++;
+    return SQLITE_OK;
+}
+
+static int llm_chat_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_cursor *c = (ai_cursor *)cur;
+    return (int)c->is_eog;
+}
+
+static int llm_chat_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_cursor *c = (ai_cursor *)cur;
+    if (iCol == AI_COLUMN_REPLY) {
+        sqlite3_result_text(context, c->ai->chat.token_text, c->ai->chat.token_len, SQLITE_TRANSIENT);
+    }
+    return SQLITE_OK;
+}
+
+static int llm_chat_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_cursor *c = (ai_cursor *)cur;
+    *pRowid = c->rowid;
+    return SQLITE_OK;
+}
+
+static int llm_chat_cursor_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_cursor *c = (ai_cursor *)cur;
+    ai_context *ai = c->ai;
+    ai_vtab *vtab = c->vtab;
+    
+    // sanity check arguments
+    if (argc != 1) {
+        return sqlite_vtab_set_error(&vtab->base, "llm_chat expects %d arguments, but %d were provided.", 1, argc);
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        return sqlite_vtab_set_error(&vtab->base, "llm_chat argument must be of type TEXT");
+    }
+    
+    ai->chat.token_count = 0;
+    buffer_reset(&ai->chat.response);
+
+    const char *user_prompt = (const char *)sqlite3_value_text(argv[0]);
+    bool result = llm_chat_run(ai, c, user_prompt);
+    return (result) ? SQLITE_OK : SQLITE_ERROR;
+}
+
+static sqlite3_module llm_chat = {
+  /* iVersion    */ 0,
+  /* xCreate     */ 0,
+  /* xConnect    */ llm_chat_connect,
+  /* xBestIndex  */ llm_chat_best_index,
+  /* xDisconnect */ llm_chat_disconnect,
+  /* xDestroy    */ 0,
+  /* xOpen       */ llm_chat_cursor_open,
+  /* xClose      */ llm_chat_cursor_close,
+  /* xFilter     */ llm_chat_cursor_filter,
+  /* xNext       */ llm_chat_cursor_next,
+  /* xEof        */ llm_chat_cursor_eof,
+  /* xColumn     */ llm_chat_cursor_column,
+  /* xRowid      */ llm_chat_cursor_rowid,
+  /* xUpdate     */ 0,
+  /* xBegin      */ 0,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ 0,
+  /* xFindMethod */ 0,
+  /* xRename     */ 0,
+  /* xSavepoint  */ 0,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ 0,
+  /* xShadowName */ 0,
+  /* xIntegrity  */ 0
+};
+
+// MARK: -
+
+static void llm_chat_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+
+    // reset UUID and cleanup chat related memory
+    memset(ai->chat.uuid, 0, UUID_STR_MAXLEN);
+
+    buffer_destroy(&ai->chat.response);
+    buffer_destroy(&ai->chat.formatted);
+    llm_messages_free(&ai->chat.messages);
+
+    if (ai->chat.tokens) sqlite3_free(ai->chat.tokens);
+    ai->chat.tokens = NULL;
+    ai->chat.ntokens = 0;
+
+    if (ai->chat.prompt) sqlite3_free(ai->chat.prompt);
+    ai->chat.prompt = NULL;
+    ai->chat.prev_len = 0;
+    ai->chat.n_past = 0;
+
+    if (ai->chat.history) sqlite3_free(ai->chat.history);
+    ai->chat.history = NULL;
+    ai->chat.nhistory = 0;
+    ai->chat.history_capacity = 0;
+    ai->chat.queue_count = 0;
+    ai->chat.queue_index = 0;
+
+    ai->chat.template = NULL;
+    ai->chat.vocab = NULL;
+    ai->chat.token_count = 0;
+}
+
+static void llm_chat_create (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context_pinned(context) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    
+    // clean-up old chat (if any)
+    llm_chat_free(context, argc, argv);
+    if (llm_chat_check_context(ai) == false) return;
+    
+    // returns chat UUID
+    sqlite3_result_text(context, ai->chat.uuid, -1, SQLITE_TRANSIENT);
+}
+
+static bool llm_chat_check_tables (sqlite3_context *context) {
+    const char *sql = "CREATE TABLE IF NOT EXISTS ai_chat_history (id INTEGER PRIMARY KEY AUTOINCREMENT, uuid TEXT UNIQUE, title TEXT, metadata TEXT, created_at DATETIME DEFAULT CURRENT_TIMESTAMP);";
+    
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    int rc = sqlite_db_write_simple(context, db, sql);
+    if (rc != SQLITE_OK) return false;
+    
+    sql = "CREATE TABLE IF NOT EXISTS ai_chat_messages (id INTEGER PRIMARY KEY AUTOINCREMENT, chat_id INTEGER NOT NULL, role TEXT NOT NULL, content TEXT NOT NULL);";
+    rc = sqlite_db_write_simple(context, db, sql);
+    if (rc != SQLITE_OK) return false;
+    
+    sql = "CREATE TABLE IF NOT EXISTS ai_chat_state (chat_id INTEGER PRIMARY KEY, model TEXT NOT NULL, n_tokens INTEGER NOT NULL, prev_len INTEGER NOT NULL, state BLOB NOT NULL);";
+    rc = sqlite_db_write_simple(context, db, sql);
+    if (rc != SQLITE_OK) return false;
+    
+    return true;
+}
+
+static int llm_chat_save_state (sqlite3_context *context, ai_context *ai, sqlite3 *db, sqlite3_int64 chat_id) {
+    // the snapshot is stored only if sequence 0 contains exactly the conversation
+    struct llama_context *ctx = ai->ctx;
+    if (!ctx || ai->chat.n_past == 0 || ai->text.ntokens > 0) return SQLITE_OK;
+    
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (!memory || llama_memory_seq_pos_max(memory, 0) + 1 != ai->chat.n_past) return SQLITE_OK;
+    
+    size_t state_size = llama_state_seq_get_size(ctx, 0);
+    if (state_size == 0) return SQLITE_OK;
+    
+    uint8_t *state = (uint8_t *)sqlite3_malloc64(state_size);
+    if (!state) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate chat state (%lld bytes)", (long long)state_size);
+        return SQLITE_NOMEM;
+    }
+    if (llama_state_seq_get_data(ctx, state, state_size, 0) != state_size) {
+        sqlite3_free(state);
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to copy chat state");
+        return SQLITE_ERROR;
+    }
+    
+    char model[768];
+    llm_model_identity(ai, model, sizeof(model));
+    
+    const char *sql = "INSERT INTO ai_chat_state (chat_id, model, n_tokens, prev_len, state) VALUES (?, ?, ?, ?, ?);";
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_free(state);
+        return rc;
+    }
+    
+    sqlite3_bind_int64(vm, 1, chat_id);
+    sqlite3_bind_text(vm, 2, model, -1, SQLITE_STATIC);
+    sqlite3_bind_int(vm, 3, ai->chat.n_past);
+    sqlite3_bind_int(vm, 4, ai->chat.prev_len);
+    rc = sqlite3_bind_blob64(vm, 5, state, (sqlite3_uint64)state_size, sqlite3_free);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    sqlite3_finalize(vm);
+    
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+// the snapshot is loaded only if it was saved with the same model file and LoRA adapters and it covers exactly the restored messages,
+// otherwise sequence 0 is left empty and the next llm_chat_respond prefills the restored messages again
+static bool llm_chat_restore_state (ai_context *ai, sqlite3 *db, const char *uuid) {
+    // the snapshot table is optional (created by llm_chat_save), a missing or incompatible snapshot is not an error
+    const char *sql = "SELECT s.model, s.n_tokens, s.prev_len, s.state FROM ai_chat_state s JOIN ai_chat_history h ON s.chat_id = h.id WHERE h.uuid = ?;";
+    sqlite3_stmt *vm = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &vm, NULL) != SQLITE_OK) return false;
+    
+    bool result = false;
+    sqlite3_bind_text(vm, 1, uuid, -1, SQLITE_STATIC);
+    if (sqlite3_step(vm) != SQLITE_ROW) goto cleanup;
+    
+    char model[768];
+    llm_model_identity(ai, model, sizeof(model));
+    const char *saved_model = (const char *)sqlite3_column_text(vm, 0);
+    if (!saved_model || strcmp(saved_model, model) != 0) goto cleanup;
+    
+    int32_t n_tokens = sqlite3_column_int(vm, 1);
+    int32_t prev_len = sqlite3_column_int(vm, 2);
+    if (n_tokens <= 0 || (uint32_t)n_tokens > llama_n_ctx(ai->ctx) || prev_len <= 0) goto cleanup;
+    
+    // prev_len is an offset in the formatted conversation, the template applied to the restored messages must give the same text length
+    const char *template = llama_model_chat_template(ai->model, NULL);
+    ai_messages *messages = &ai->chat.messages;
+    if (!template || llama_chat_apply_template(template, messages->items, messages->count, false, NULL, 0) != prev_len) goto cleanup;
+    
+    const uint8_t *state = (const uint8_t *)sqlite3_column_blob(vm, 3);
+    size_t state_size = (size_t)sqlite3_column_bytes(vm, 3);
+    if (!state || state_size == 0) goto cleanup;
+    
+    llama_memory_t memory = llama_get_memory(ai->ctx);
+    if (llama_state_seq_set_data(ai->ctx, state, state_size, 0) == 0 || llama_memory_seq_pos_max(memory, 0) + 1 != n_tokens) {
+        llama_memory_seq_rm(memory, 0, -1, -1);
+        goto cleanup;
+    }
+    
+    ai->chat.prev_len = prev_len;
+    ai->chat.n_past = n_tokens;
+    result = true;
+    
+cleanup:
+    sqlite3_finalize(vm);
+    return result;
+}
+
+static void llm_chat_save (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (llm_chat_check_tables(context) == false) return;
+    
+    // sanity check if there is something to save
+    if (ai->chat.uuid[0] == 0) return;
+    if (ai->chat.messages.count == 0) return;
+    
+    // title, metadata, kv_state
+    const char *title = ((argc >= 1) && (sqlite3_value_type(argv[0]) == SQLITE3_TEXT)) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
+    const char *meta =  ((argc >= 2) && (sqlite3_value_type(argv[1]) == SQLITE3_TEXT)) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+    bool save_state = ((argc >= 3) && (sqlite3_value_int(argv[2]) != 0));
+    
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    ai_messages *messages = &ai->chat.messages;
+    
+    // start transaction
+    sqlite_db_write_simple(context, db, "BEGIN;");
+    
+    // save chat, the ON CONFLICT allows saving multiple times
+    const char *sql = "INSERT INTO ai_chat_history (uuid, title, metadata) VALUES (?, ?, ?) "
+                      "ON CONFLICT(uuid) DO UPDATE SET "
+                      "  title = excluded.title, "
+                      "  metadata = excluded.metadata, "
+                      "  created_at = CURRENT_TIMESTAMP;";
+    const char *values[] = {ai->chat.uuid, title, meta};
+    int types[] = {SQLITE_TEXT, SQLITE_TEXT, SQLITE_TEXT};
+    int lens[] = {-1, -1, -1};
+    
+    int rc = sqlite_db_write(context, db, sql, values, types, lens, 3);
+    if (rc != SQLITE_OK) goto abort_save;
+    
+    // get the rowid, cannot use sqlite3_last_insert_rowid for the CONFLICT case
+    char rowid_s[256];
+    sqlite3_stmt *pstmt = NULL;
+    sql = "SELECT id FROM ai_chat_history WHERE uuid = ?;";
+    rc = sqlite3_prepare_v2(db, sql, -1, &pstmt, NULL);
+    if (rc != SQLITE_OK) goto abort_save;
+    rc = sqlite3_bind_text(pstmt, 1, ai->chat.uuid, -1, SQLITE_STATIC);
+    rc = sqlite3_step(pstmt);
+    if (rc != SQLITE_ROW) {
+        sqlite3_finalize(pstmt);
+        goto abort_save;
+    }
+    sqlite3_int64 rowid = sqlite3_column_int64(pstmt, 0);
+    sqlite3_finalize(pstmt);
+    snprintf(rowid_s, sizeof(rowid_s), "%lld", (long long)rowid);
+
+    // delete all messages for this chat id, if any
+    sql = "DELETE FROM ai_chat_messages WHERE chat_id = ?;";
+    const char *values3[] = {rowid_s};
+    int types3[] = {SQLITE_INTEGER};
+    int lens3[] = {-1};
+    rc = sqlite_db_write(context, db, sql, values3, types3, lens3, 1);
+    if (rc != SQLITE_OK) goto abort_save;
+    
+    // loop to save messages (the context)
+    sql = "INSERT INTO ai_chat_messages (chat_id, role, content) VALUES (?, ?, ?);";
+    int types2[] = {SQLITE_INTEGER, SQLITE_TEXT, SQLITE_TEXT};
+    
+    for (int i=0; i < messages->count; i++) {
+        const char *role = messages->items[i].role;
+        const char *content = messages->items[i].content;
+        // skip empty system message placeholder
+        if (role == ROLE_SYSTEM && (!content || content[0] == '\0')) continue;
+        const char *values2[] = {rowid_s, role, content};
+        int rc = sqlite_db_write(context, db, sql, values2, types2, lens, 3);
+        if (rc != SQLITE_OK) goto abort_save;
+    }
+    
+    // a previous KV state snapshot no longer matches the saved messages
+    sql = "DELETE FROM ai_chat_state WHERE chat_id = ?;";
+    rc = sqlite_db_write(context, db, sql, values3, types3, lens3, 1);
+    if (rc != SQLITE_OK) goto abort_save;
+    
+    if (save_state) {
+        rc = llm_chat_save_state(context, ai, db, rowid);
+        if (rc != SQLITE_OK) goto abort_save;
+    }
+    
+    // commit transaction and returns chat UUID
+    sqlite_db_write_simple(context, db, "COMMIT;");
+    sqlite3_result_text(context, ai->chat.uuid, -1, SQLITE_TRANSIENT);
+    return;
+    
+abort_save:
+    sqlite_db_write_simple(context, db, "ROLLBACK;");
+}
+
+static void llm_chat_restore (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // sanity check argument
+    int types[] = {SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "llm_chat_restore", argc, argv, 1, types, false, false) == false) return;
+
+    // free old chat (if any)
+    llm_chat_free(context, 0, NULL);
+
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+
+    // re-initialize chat state (UUID, buffers, tokens)
+    if (llm_chat_check_context(ai) == false) return;
+    
+    // the restored conversation starts from an empty sequence 0
+    llama_memory_t memory = llama_get_memory(ai->ctx);
+    if (memory) llama_memory_seq_rm(memory, 0, -1, -1);
+    llm_text_cache_reset(ai);
+
+    // UUID
+    const char *uuid = (const char *)sqlite3_value_text(argv[0]);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+
+    const char *sql = "SELECT m.role, m.content FROM ai_chat_messages m JOIN ai_chat_history h ON m.chat_id = h.id WHERE h.uuid = ? ORDER BY m.id ASC;";
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto abort_restore;
+
+    rc = sqlite3_bind_text(vm, 1, uuid, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto abort_restore;
+
+    int counter = 0;
+    ai_messages *messages = &ai->chat.messages;
+    while (1) {
+        rc = sqlite3_step(vm);
+        if (rc == SQLITE_DONE) {rc = SQLITE_OK; break;}
+        if (rc != SQLITE_ROW) goto abort_restore;
+
+        const char *role = (const char *)sqlite3_column_text(vm, 0);
+        const char *content = (const char *)sqlite3_column_text(vm, 1);
+
+        if (!llm_messages_append(messages, role, content)) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to append message during restore");
+            sqlite3_finalize(vm);
+            return;
+        }
+        ++counter;
+    }
+    
+    // keep the saved UUID so that the next llm_chat_save updates the same chat, the KV state snapshot (if any) replaces the prefill of the restored messages
+    if (counter > 0) {
+        snprintf(ai->chat.uuid, UUID_STR_MAXLEN, "%s", uuid);
+        if (llm_chat_restore_state(ai, db, uuid) == false) {
+            ai->chat.n_past = 0;
+            ai->chat.prev_len = 0;
+        }
+    }
+
+    sqlite3_result_int(context, counter);
+    if (vm) sqlite3_finalize(vm);
+    return;
+
+abort_restore:
+    sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    if (vm) sqlite3_finalize(vm);
+}
+
+static void llm_chat_respond (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context_pinned(context) == false) return;
+
+    if (argc < 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "llm_chat_respond requires at least one TEXT argument (prompt)");
+        return;
+    }
+
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->model) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded");
+        return;
+    }
+    if (llm_chat_check_context(ai) == false) return;
+
+    const char *user_prompt = (const char *)sqlite3_value_text(argv[0]);
+    ai->context = context;
+    ai->vtab = NULL;
+
+    ai->chat.token_count = 0;
+    buffer_reset(&ai->chat.response);
+
+    // collect image args (argv[1..n], skip NULLs)
+    sqlite3_value *image_args[64];
+    int n_images = 0;
+    for (int i = 1; i < argc; i++) {
+        int type = sqlite3_value_type(argv[i]);
+        if (type == SQLITE_NULL) continue;
+        if (n_images < 64) image_args[n_images++] = argv[i];
+    }
+
+    if (n_images > 0) {
+        if (!ai->vision) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Images provided but no vision model loaded. Call llm_vision_load() first.");
+            return;
+        }
+        llm_chat_respond_vision(context, ai, user_prompt, image_args, n_images);
+    } else {
+        llm_chat_run(ai, NULL, user_prompt);
+    }
+}
+
+static void llm_chat_system_prompt(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context_pinned(context) == false)
+        return;
+
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (llm_chat_check_context(ai) == false)
+        return;
+
+    ai_messages *messages = &ai->chat.messages;
+    
+    // get system role message
+    if (argc == 0) {
+        if (messages->count == 0) {
+            sqlite3_result_null(context);
+            return;
+        }
+
+        // only the first message is reserved to the system role
+        llama_chat_message *system_message = &messages->items[0];
+        const char *content = system_message->content;
+        if (system_message->role == ROLE_SYSTEM && content && content[0] != '\0') {
+            sqlite3_result_text(context, content, -1, SQLITE_TRANSIENT);
+        } else {
+            sqlite3_result_null(context);
+        }
+
+        return;
+    }
+
+    bool is_null_prompt = (sqlite3_value_type(argv[0]) == SQLITE_NULL);
+    int types[1];
+    types[0] = is_null_prompt ? SQLITE_NULL : SQLITE_TEXT;
+
+    if (sqlite_sanity_function(context, "llm_chat_system_prompt", argc, argv, 1, types, true, false) == false)
+        return;
+
+    const unsigned char *prompt_text = sqlite3_value_text(argv[0]);
+    const char *system_prompt = prompt_text ? (const char *)prompt_text : "";
+    if (!llm_messages_set(messages, 0, ROLE_SYSTEM, system_prompt)) {
+        if (!llm_messages_append(messages, ROLE_SYSTEM, system_prompt)) {
+            sqlite_common_set_error (ai->context, ai->vtab, SQLITE_ERROR, "Failed to set chat system prompt");
+            return;
+        }
+    }
+}
+
+// MARK: - Chat Sessions -
+
+// sequence 0 is reserved to llm_chat_* and llm_text_generate, each session owns one of the remaining sequences
+// and all the active sessions are decoded together (one llama_decode per generated token)
+
+static void llm_chat_session_free_item (ai_context *ai, ai_chat_session *session) {
+    if (ai->ctx) {
+        llama_memory_t memory = llama_get_memory(ai->ctx);
+        if (memory) llama_memory_seq_rm(memory, session->seq_id, -1, -1);
+    }
+    if (session->sampler) llama_sampler_free(session->sampler);
+    llm_messages_free(&session->messages);
+    buffer_destroy(&session->formatted);
+    buffer_destroy(&session->response);
+    sqlite3_free(session->tokens);
+    sqlite3_free(session);
+}
+
+static void llm_chat_sessions_clear (ai_context *ai) {
+    for (int i = 0; i < ai->sessions.count; ++i) {
+        llm_chat_session_free_item(ai, ai->sessions.items[i]);
+    }
+    sqlite3_free(ai->sessions.items);
+    memset(&ai->sessions, 0, sizeof(ai->sessions));
+}
+
+static int llm_chat_session_find (ai_context *ai, const char *uuid) {
+    for (int i = 0; i < ai->sessions.count; ++i) {
+        if (strcmp(ai->sessions.items[i]->uuid, uuid) == 0) return i;
+    }
+    return -1;
+}
+
+static llama_seq_id llm_chat_session_next_seq (ai_context *ai) {
+    int n_seq_max = (int)llama_n_seq_max(ai->ctx);
+    for (llama_seq_id seq_id = 1; seq_id < n_seq_max; ++seq_id) {
+        bool used = false;
+        for (int i = 0; i < ai->sessions.count; ++i) {
+            if (ai->sessions.items[i]->seq_id == seq_id) {used = true; break;}
+        }
+        if (!used) return seq_id;
+    }
+    return -1;
+}
+
+// format the whole conversation, the empty system message placeholder is skipped (as in llm_chat_run)
+static int32_t llm_chat_session_format (ai_chat_session *session, const char *template, bool add_ass) {
+    const llama_chat_message *items = session->messages.items;
+    size_t count = session->messages.count;
+    if (count > 0 && items[0].role == ROLE_SYSTEM && items[0].content[0] == '\0') {
+        ++items;
+        --count;
+    }
+    
+    buffer_t *formatted = &session->formatted;
+    int32_t len = llama_chat_apply_template(template, items, count, add_ass, formatted->data, formatted->capacity);
+    if (len > (int32_t)formatted->capacity) {
+        if (buffer_resize(formatted, len * 2) == false) return -1;
+        len = llama_chat_apply_template(template, items, count, add_ass, formatted->data, formatted->capacity);
+    }
+    return (len > (int32_t)formatted->capacity) ? -1 : len;
+}
+
+// append the user prompt and tokenize the part of the conversation not yet stored in the session sequence
+static bool llm_chat_session_prepare (ai_context *ai, sqlite3_context *context, sqlite3_vtab *vtab, ai_chat_session *session, const char *template, const struct llama_vocab *vocab, const char *prompt) {
+    buffer_reset(&session->response);
+    session->ntokens = 0;
+    session->n_generated = 0;
+    session->logits_index = -1;
+    session->is_active = false;
+    session->n_messages = session->messages.count;
+    
+    if (!llm_messages_append(&session->messages, ROLE_USER, prompt)) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Failed to append message");
+        return false;
+    }
+    
+    int32_t new_len = llm_chat_session_format(session, template, true);
+    if (new_len < 0) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to apply chat template");
+        return false;
+    }
+    int32_t prompt_len = new_len - session->prev_len;
+    if (prompt_len <= 0) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Invalid prompt length (template state inconsistency)");
+        return false;
+    }
+    
+    const char *text = session->formatted.data + session->prev_len;
+    bool add_special = (session->n_past == 0);
+    int32_t n_tokens = -llama_tokenize(vocab, text, prompt_len, NULL, 0, add_special, true);
+    if (n_tokens <= 0) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to determine prompt token count");
+        return false;
+    }
+    if (n_tokens > session->capacity) {
+        llama_token *tokens = (llama_token *)sqlite3_realloc64(session->tokens, n_tokens * sizeof(llama_token));
+        if (!tokens) {
+            sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Failed to allocate prompt token buffer");
+            return false;
+        }
+        session->tokens = tokens;
+        session->capacity = n_tokens;
+    }
+    if (llama_tokenize(vocab, text, prompt_len, session->tokens, n_tokens, add_special, true) < 0) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to tokenize the prompt");
+        return false;
+    }
+    
+    uint32_t n_ctx_seq = llama_n_ctx_seq(ai->ctx);
+    if ((uint32_t)(session->n_past + n_tokens) >= n_ctx_seq) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Context size exceeded (%u, %d)", n_ctx_seq, session->n_past + n_tokens);
+        return false;
+    }
+    
+    session->ntokens = n_tokens;
+    session->is_active = true;
+    return true;
+}
+
+// sample the next token of a session from the logits of the last decoded batch
+static bool llm_chat_session_sample (ai_context *ai, sqlite3_context *context, sqlite3_vtab *vtab, ai_chat_session *session, const struct llama_vocab *vocab, int n_predict, uint32_t n_ctx_seq) {
+    int32_t index = session->logits_index;
+    session->logits_index = -1;
+    
+    // every generated token has been decoded at this point, so the sequence matches the response
+    if (session->n_generated >= n_predict || (uint32_t)session->n_past >= n_ctx_seq) {
+        session->is_active = false;
+        return true;
+    }
+    
+    llama_token token_id = llama_sampler_sample(session->sampler, ai->ctx, index);
+    if (llama_vocab_is_eog(vocab, token_id)) {
+        session->is_active = false;
+        return true;
+    }
+    
+    char piece[MAX_TOKEN_TEXT_LEN];
+    int32_t n = llama_token_to_piece(vocab, token_id, piece, sizeof(piece), 0, true);
+    if (n < 0) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to convert token to string");
+        return false;
+    }
+    if (buffer_append(&session->response, piece, n, true) == false) {
+        sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Failed to grow response buffer");
+        return false;
+    }
+    
+    session->token_id = token_id;
+    session->n_generated++;
+    return true;
+}
+
+// undo the current turn of a session: the messages of the turn are removed and, if something was already decoded,
+// the sequence is dropped too, so the next turn evaluates the whole conversation again
+static void llm_chat_session_rollback (ai_context *ai, ai_chat_session *session, bool decoded) {
+    llm_messages_truncate(&session->messages, session->n_messages);
+    buffer_reset(&session->response);
+    session->ntokens = 0;
+    session->logits_index = -1;
+    session->is_active = false;
+    if (!decoded) return;
+    
+    llama_memory_t memory = llama_get_memory(ai->ctx);
+    if (memory) llama_memory_seq_rm(memory, session->seq_id, -1, -1);
+    session->n_past = 0;
+    session->prev_len = 0;
+}
+
+static bool llm_chat_sessions_run (ai_context *ai, sqlite3_context *context, sqlite3_vtab *vtab, ai_chat_session **sessions, const char **prompts, int n) {
+    const char *template = llama_model_chat_template(ai->model, NULL);
+    if (!template) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Template not available");
+        return false;
+    }
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Model vocab not available");
+        return false;
+    }
+    
+    struct llama_context *ctx = ai->ctx;
+    uint32_t n_ctx_seq = llama_n_ctx_seq(ctx);
+    int n_batch = (int)llama_n_batch(ctx);
+    int n_predict = (ai->options.n_predict > 0) ? ai->options.n_predict : 4096;
+    
+    // a failure leaves every session of the call as it was before (prepared sessions only hold the new user message)
+    for (int i = 0; i < n; ++i) {
+        if (!llm_chat_session_prepare(ai, context, vtab, sessions[i], template, vocab, prompts[i])) {
+            for (int j = 0; j <= i; ++j) llm_chat_session_rollback(ai, sessions[j], false);
+            return false;
+        }
+    }
+    
+    llama_batch batch = llama_batch_init((n_batch > n) ? n_batch : n, 0, 1);
+    bool result = false;
+    
+    // prompt processing: the prompts of all the sessions are packed together in n_batch sized chunks,
+    // a session is sampled right after the chunk that contains its last prompt token
+    int index = 0;
+    int32_t offset = 0;
+    while (index < n) {
+        batch.n_tokens = 0;
+        while (index < n && batch.n_tokens < n_batch) {
+            ai_chat_session *session = sessions[index];
+            int k = batch.n_tokens++;
+            batch.token[k] = session->tokens[offset];
+            batch.pos[k] = session->n_past++;
+            batch.n_seq_id[k] = 1;
+            batch.seq_id[k][0] = session->seq_id;
+            batch.logits[k] = (++offset == session->ntokens);
+            if (batch.logits[k]) {
+                session->logits_index = k;
+                offset = 0;
+                ++index;
+            }
+        }
+        
+        if (llama_decode(ctx, batch)) {
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to decode prompt batch");
+            goto cleanup;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (sessions[i]->logits_index < 0) continue;
+            if (!llm_chat_session_sample(ai, context, vtab, sessions[i], vocab, n_predict, n_ctx_seq)) goto cleanup;
+        }
+    }
+    
+    // generation: one token for each active session per decode
+    while (1) {
+        batch.n_tokens = 0;
+        for (int i = 0; i < n; ++i) {
+            ai_chat_session *session = sessions[i];
+            if (!session->is_active) continue;
+            int k = batch.n_tokens++;
+            batch.token[k] = session->token_id;
+            batch.pos[k] = session->n_past++;
+            batch.n_seq_id[k] = 1;
+            batch.seq_id[k][0] = session->seq_id;
+            batch.logits[k] = true;
+            session->logits_index = k;
+        }
+        if (batch.n_tokens == 0) break;
+        
+        if (llama_decode(ctx, batch)) {
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to decode generation batch");
+            goto cleanup;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (sessions[i]->logits_index < 0) continue;
+            if (!llm_chat_session_sample(ai, context, vtab, sessions[i], vocab, n_predict, n_ctx_seq)) goto cleanup;
+        }
+    }
+    
+    // save responses
+    for (int i = 0; i < n; ++i) {
+        ai_chat_session *session = sessions[i];
+        const char *response = (session->response.data) ? session->response.data : "";
+        if (!llm_messages_append(&session->messages, ROLE_ASSISTANT, response)) {
+            sqlite_common_set_error(context, vtab, SQLITE_NOMEM, "Failed to append response");
+            goto cleanup;
+        }
+        session->prev_len = llm_chat_session_format(session, template, false);
+        if (session->prev_len < 0) {
+            sqlite_common_set_error(context, vtab, SQLITE_ERROR, "Failed to finalize chat template");
+            goto cleanup;
+        }
+    }
+    result = true;
+    
+cleanup:
+    if (!result) {
+        for (int i = 0; i < n; ++i) llm_chat_session_rollback(ai, sessions[i], true);
+    }
+    llama_batch_free(batch);
+    return result;
+}
+
+static void llm_chat_session_create (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context_pinned(context) == false) return;
+    
+    if (argc == 1 && sqlite3_value_type(argv[0]) != SQLITE_TEXT && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "llm_chat_session_create expects a TEXT system prompt");
+        return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (llm_chat_sampler_check(ai) == false) return;
+    
+    llama_seq_id seq_id = llm_chat_session_next_seq(ai);
+    if (seq_id < 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No free sequence available for a new chat session, create the context with a larger n_seq_max (current %u)", llama_n_seq_max(ai->ctx));
+        return;
+    }
+    
+    if (ai->sessions.count == ai->sessions.capacity) {
+        int new_cap = ai->sessions.capacity ? ai->sessions.capacity * 2 : 8;
+        ai_chat_session **items = (ai_chat_session **)sqlite3_realloc64(ai->sessions.items, new_cap * sizeof(ai_chat_session *));
+        if (!items) {
+            sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate chat session");
+            return;
+        }
+        ai->sessions.items = items;
+        ai->sessions.capacity = new_cap;
+    }
+    
+    ai_chat_session *session = (ai_chat_session *)sqlite3_malloc(sizeof(ai_chat_session));
+    if (!session) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate chat session");
+        return;
+    }
+    memset(session, 0, sizeof(ai_chat_session));
+    session->seq_id = seq_id;
+    session->logits_index = -1;
+    ai_uuid_v7_string(session->uuid, true);
+    
+    // remove any stale cell left in the sequence
+    llama_memory_t memory = llama_get_memory(ai->ctx);
+    if (memory) llama_memory_seq_rm(memory, seq_id, -1, -1);
+    
+    const char *system_prompt = (argc == 1) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
+    session->sampler = llama_sampler_clone(ai->sampler);
+    if (!session->sampler || !buffer_create(&session->formatted, MIN_ALLOC_RESPONSE) || !buffer_create(&session->response, MIN_ALLOC_RESPONSE) ||
+        (system_prompt && system_prompt[0] && !llm_messages_append(&session->messages, ROLE_SYSTEM, system_prompt))) {
+        llm_chat_session_free_item(ai, session);
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate chat session");
+        return;
+    }
+    
+    ai->sessions.items[ai->sessions.count++] = session;
+    sqlite3_result_text(context, session->uuid, -1, SQLITE_TRANSIENT);
+}
+
+static void llm_chat_session_respond (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    int types[] = {SQLITE_TEXT, SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "llm_chat_session_respond", argc, argv, 2, types, true, false) == false) return;
+    if (llm_check_context_pinned(context) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    
+    const char *uuid = (const char *)sqlite3_value_text(argv[0]);
+    int index = llm_chat_session_find(ai, uuid);
+    if (index < 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Chat session '%s' not found", uuid);
+        return;
+    }
+    
+    ai_chat_session *session = ai->sessions.items[index];
+    const char *prompt = (const char *)sqlite3_value_text(argv[1]);
+    if (!llm_chat_sessions_run(ai, context, NULL, &session, &prompt, 1)) return;
+    
+    sqlite3_result_text(context, session->response.data ? session->response.data : "", -1, SQLITE_TRANSIENT);
+}
+
+static void llm_chat_session_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    
+    // no arguments means all the sessions
+    if (argc == 0) {
+        llm_chat_sessions_clear(ai);
+        return;
+    }
+    
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "llm_chat_session_free expects a TEXT UUID");
+        return;
+    }
+    
+    int index = llm_chat_session_find(ai, (const char *)sqlite3_value_text(argv[0]));
+    if (index < 0) return;
+    
+    llm_chat_session_free_item(ai, ai->sessions.items[index]);
+    ai->sessions.items[index] = ai->sessions.items[--ai->sessions.count];
+}
+
+// MARK: - Chat Sessions Virtual Table -
+
+#define AI_SESSION_COLUMN_UUID                  0
+#define AI_SESSION_COLUMN_RESPONSE              1
+#define AI_SESSION_COLUMN_PROMPTS               2
+
+typedef struct {
+    sqlite3_vtab_cursor         base;               // Base class - must be first
+    ai_vtab                     *vtab;
+    ai_context                  *ai;
+    
+    char                        **uuids;
+    char                        **responses;
+    int                         count;
+    int                         index;
+} ai_session_cursor;
+
+static void llm_chat_session_cursor_reset (ai_session_cursor *c) {
+    for (int i = 0; i < c->count; ++i) {
+        sqlite3_free(c->uuids[i]);
+        sqlite3_free(c->responses[i]);
+    }
+    sqlite3_free(c->uuids);
+    sqlite3_free(c->responses);
+    c->uuids = NULL;
+    c->responses = NULL;
+    c->count = 0;
+    c->index = 0;
+}
+
+static int llm_chat_session_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(uuid, response, prompts hidden);");
+    if (rc != SQLITE_OK) return rc;
+    
+    ai_vtab *vtab = (ai_vtab *)sqlite3_malloc(sizeof(ai_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    
+    memset(vtab, 0, sizeof(ai_vtab));
+    ai_context *ai = (ai_context *)pAux;
+    
+    vtab->ai = ai;
+    ai->db = db;
+    
+    *ppVtab = (sqlite3_vtab *)vtab;
+    return SQLITE_OK;
+}
+
+static int llm_chat_session_disconnect (sqlite3_vtab *pVtab) {
+    ai_vtab *vtab = (ai_vtab *)pVtab;
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int llm_chat_session_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint *constraint = &pIdxInfo->aConstraint[i];
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ || constraint->iColumn != AI_SESSION_COLUMN_PROMPTS) continue;
+        if (!constraint->usable) return SQLITE_CONSTRAINT;
+        
+        pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[i].omit = 1;
+        pIdxInfo->idxNum = 1;
+        pIdxInfo->estimatedCost = (double)1000;
+        return SQLITE_OK;
+    }
+    
+    // prompts argument is mandatory
+    return SQLITE_CONSTRAINT;
+}
+
+static int llm_chat_session_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_session_cursor *c = (ai_session_cursor *)sqlite3_malloc(sizeof(ai_session_cursor));
+    if (!c) return SQLITE_NOMEM;
+    
+    memset(c, 0, sizeof(ai_session_cursor));
+    ai_vtab *vtab = (ai_vtab *)pVtab;
+    c->vtab = vtab;
+    c->ai = vtab->ai;
+    
+    *ppCursor = (sqlite3_vtab_cursor *)c;
+    return SQLITE_OK;
+}
+
+static int llm_chat_session_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_session_cursor *c = (ai_session_cursor *)cur;
+    llm_chat_session_cursor_reset(c);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
+
+static int llm_chat_session_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_session_cursor *c = (ai_session_cursor *)cur;
+    c->index++;
+    return SQLITE_OK;
+}
+
+static int llm_chat_session_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_session_cursor *c = (ai_session_cursor *)cur;
+    return (c->index >= c->count);
+}
+
+static int llm_chat_session_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_session_cursor *c = (ai_session_cursor *)cur;
+    if (iCol == AI_SESSION_COLUMN_UUID) {
+        sqlite3_result_text(context, c->uuids[c->index], -1, SQLITE_TRANSIENT);
+    } else if (iCol == AI_SESSION_COLUMN_RESPONSE) {
+        sqlite3_result_text(context, c->responses[c->index], -1, SQLITE_TRANSIENT);
+    }
+    return SQLITE_OK;
+}
+
+static int llm_chat_session_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_session_cursor *c = (ai_session_cursor *)cur;
+    *pRowid = c->index;
+    return SQLITE_OK;
+}
+
+static int llm_chat_session_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_session_cursor *c = (ai_session_cursor *)cur;
+    ai_vtab *vtab = c->vtab;
+    ai_context *ai = c->ai;
+    llm_chat_session_cursor_reset(c);
+    
+    if (!ai->model) {
+        return sqlite_vtab_set_error(&vtab->base, "No model is currently set. Please call llm_model_load() before using this function.");
+    }
+    if (!llm_context_pin(ai)) {
+        return sqlite_vtab_set_error(&vtab->base, "No context found. Please call llm_context_create() before using this function.");
+    }
+    if (argc != 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        return sqlite_vtab_set_error(&vtab->base, "llm_chat_session_respond_batch expects a JSON object of TEXT prompts keyed by session UUID");
+    }
+    
+    // json_each yields (key, value) = (session UUID, prompt)
+    sqlite3 *db = ai->db;
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, "SELECT key, value, type FROM json_each(?1);", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_value(vm, 1, argv[0]);
+    if (rc != SQLITE_OK) {
+        sqlite3_finalize(vm);
+        return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+    }
+    
+    int capacity = ai->sessions.count;
+    ai_chat_session **sessions = (ai_chat_session **)sqlite3_malloc64((capacity + 1) * sizeof(ai_chat_session *));
+    char **prompts = (char **)sqlite3_malloc64((capacity + 1) * sizeof(char *));
+    c->uuids = (char **)sqlite3_malloc64((capacity + 1) * sizeof(char *));
+    c->responses = (char **)sqlite3_malloc64((capacity + 1) * sizeof(char *));
+    int n = 0;
+    if (!sessions || !prompts || !c->uuids || !c->responses) {
+        rc = sqlite_vtab_set_error(&vtab->base, "Out of memory: failed to allocate chat sessions batch");
+        goto cleanup;
+    }
+    
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        const char *uuid = (const char *)sqlite3_column_text(vm, 0);
+        const char *type = (const char *)sqlite3_column_text(vm, 2);
+        int index = (uuid) ? llm_chat_session_find(ai, uuid) : -1;
+        if (index < 0) {
+            rc = sqlite_vtab_set_error(&vtab->base, "Chat session '%s' not found", uuid ? uuid : "");
+            goto cleanup;
+        }
+        if (!type || strcmp(type, "text") != 0) {
+            rc = sqlite_vtab_set_error(&vtab->base, "Prompt for chat session '%s' must be a string", uuid);
+            goto cleanup;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (sessions[i] == ai->sessions.items[index]) {
+                rc = sqlite_vtab_set_error(&vtab->base, "Chat session '%s' specified more than once", uuid);
+                goto cleanup;
+            }
+        }
+        
+        sessions[n] = ai->sessions.items[index];
+        prompts[n] = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(vm, 1));
+        if (!prompts[n]) {
+            rc = sqlite_vtab_set_error(&vtab->base, "Out of memory: failed to allocate prompt");
+            goto cleanup;
+        }
+        ++n;
+    }
+    if (rc != SQLITE_DONE) {
+        rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    
+    rc = SQLITE_OK;
+    if (n > 0) {
+        if (!llm_chat_sessions_run(ai, NULL, &vtab->base, sessions, (const char **)prompts, n)) {
+            rc = SQLITE_ERROR;
+            goto cleanup;
+        }
+    }
+    
+    for (int i = 0; i < n; ++i) {
+        c->uuids[i] = sqlite3_mprintf("%s", sessions[i]->uuid);
+        c->responses[i] = sqlite3_mprintf("%s", sessions[i]->response.data ? sessions[i]->response.data : "");
+        c->count = i + 1;
+        if (!c->uuids[i] || !c->responses[i]) {
+            rc = sqlite_vtab_set_error(&vtab->base, "Out of memory: failed to allocate chat session response");
+            goto cleanup;
+        }
+    }
+    
+cleanup:
+    if (prompts) {
+        for (int i = 0; i < n; ++i) sqlite3_free(prompts[i]);
+    }
+    sqlite3_free(prompts);
+    sqlite3_free(sessions);
+    sqlite3_finalize(vm);
+    if (rc != SQLITE_OK) llm_chat_session_cursor_reset(c);
+    return rc;
+}
+
+static sqlite3_module llm_chat_session_respond_batch = {
+  /* iVersion    */ 0,
+  /* xCreate     */ 0,
+  /* xConnect    */ llm_chat_session_connect,
+  /* xBestIndex  */ llm_chat_session_best_index,
+  /* xDisconnect */ llm_chat_session_disconnect,
+  /* xDestroy    */ 0,
+  /* xOpen       */ llm_chat_session_cursor_open,
+  /* xClose      */ llm_chat_session_cursor_close,
+  /* xFilter     */ llm_chat_session_filter,
+  /* xNext       */ llm_chat_session_cursor_next,
+  /* xEof        */ llm_chat_session_cursor_eof,
+  /* xColumn     */ llm_chat_session_cursor_column,
+  /* xRowid      */ llm_chat_session_cursor_rowid,
+  /* xUpdate     */ 0,
+  /* xBegin      */ 0,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ 0,
+  /* xFindMethod */ 0,
+  /* xRename     */ 0,
+  /* xSavepoint  */ 0,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ 0,
+  /* xShadowName */ 0,
+  /* xIntegrity  */ 0
+};
+
+// MARK: - LLM Sampler -
+
+static void llm_sampler_init_greedy (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) llama_sampler_chain_add(ai->sampler, llama_sampler_init_greedy());
+}
+
+static void llm_sampler_init_dist (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (argc != 0) {
+        int types[] = {SQLITE_INTEGER};
+        if (sqlite_sanity_function(context, "llm_sampler_init_dist", argc, argv, 1, types, true, false) == false) return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        int32_t seed = (argc == 1) ? (int32_t)sqlite3_value_int64(argv[0]) : (int32_t)LLAMA_DEFAULT_SEED;
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_dist(seed));
+    }
+}
+
+static void llm_sampler_init_top_k (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Top-K sampling described in academic paper "The Curious Case of Neural Text Degeneration" https://arxiv.org/abs/1904.09751
+    
+    int types[] = {SQLITE_INTEGER};
+    if (sqlite_sanity_function(context, "llm_sampler_init_top_k", argc, argv, 1, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        int32_t k = (int32_t)sqlite3_value_int64(argv[0]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_top_k(k));
+    }
+}
+
+static void llm_sampler_init_top_p (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Nucleus sampling described in academic paper "The Curious Case of Neural Text Degeneration" https://arxiv.org/abs/1904.09751
+    
+    int types[] = {SQLITE_FLOAT, SQLITE_INTEGER};
+    if (sqlite_sanity_function(context, "llm_sampler_init_top_p", argc, argv, 2, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        float p = (float)sqlite3_value_double(argv[0]);
+        size_t min_keep = (size_t)sqlite3_value_int64(argv[1]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_top_p(p, min_keep));
+    }
+}
+
+static void llm_sampler_init_min_p (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Minimum P sampling as described in https://github.com/ggml-org/llama.cpp/pull/3841
+    
+    int types[] = {SQLITE_FLOAT, SQLITE_INTEGER};
+    if (sqlite_sanity_function(context, "llm_sampler_init_min_p", argc, argv, 2, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        float p = (float)sqlite3_value_double(argv[0]);
+        size_t min_keep = (size_t)sqlite3_value_int64(argv[1]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_min_p(p, min_keep));
+    }
+}
+
+static void llm_sampler_init_typical (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Locally Typical Sampling implementation described in the paper https://arxiv.org/abs/2202.00666
+    
+    int types[] = {SQLITE_FLOAT, SQLITE_INTEGER};
+    if (sqlite_sanity_function(context, "llm_sampler_init_typical", argc, argv, 2, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        float p = (float)sqlite3_value_double(argv[0]);
+        size_t min_keep = (size_t)sqlite3_value_int64(argv[1]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_typical(p, min_keep));
+    }
+}
+
+static void llm_sampler_init_temp (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    int types[] = {SQLITE_FLOAT};
+    if (sqlite_sanity_function(context, "llm_sampler_init_temp", argc, argv, 1, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        float t = (float)sqlite3_value_double(argv[0]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_temp(t));
+    }
+}
+
+static void llm_sampler_init_temp_ext (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Dynamic temperature implementation (a.k.a. entropy) described in the paper https://arxiv.org/abs/2309.02772
+    
+    int types[] = {SQLITE_FLOAT, SQLITE_FLOAT, SQLITE_FLOAT};
+    if (sqlite_sanity_function(context, "llm_sampler_init_temp_ext", argc, argv, 3, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        float t = (float)sqlite3_value_double(argv[0]);
+        float delta = (float)sqlite3_value_double(argv[1]);
+        float exponent = (float)sqlite3_value_double(argv[2]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_temp_ext(t, delta, exponent));
+    }
+}
+
+static void llm_sampler_init_xtc (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // XTC sampler as described in https://github.com/oobabooga/text-generation-webui/pull/6335
+    
+    int types[] = {SQLITE_FLOAT, SQLITE_FLOAT, SQLITE_INTEGER, SQLITE_INTEGER};
+    if (sqlite_sanity_function(context, "llm_sampler_init_xtc", argc, argv, 4, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        float p = (float)sqlite3_value_double(argv[0]);
+        float t = (float)sqlite3_value_double(argv[1]);
+        size_t min_keep = (size_t)sqlite3_value_int64(argv[2]);
+        uint32_t seed = (uint32_t)sqlite3_value_int64(argv[3]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_xtc(p, t, min_keep, seed));
+    }
+}
+
+static void llm_sampler_init_top_n_sigma (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Top n sigma sampling as described in academic paper "Top-nσ: Not All Logits Are You Need" https://arxiv.org/pdf/2411.07641
+    
+    int types[] = {SQLITE_FLOAT};
+    if (sqlite_sanity_function(context, "llm_sampler_init_top_n_sigma", argc, argv, 1, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        float n = (float)sqlite3_value_double(argv[0]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_top_n_sigma(n));
+    }
+}
+
+static void llm_sampler_init_mirostat (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Mirostat 1.0 algorithm described in the paper https://arxiv.org/abs/2007.14966. Uses tokens instead of words.
+    
+    int types[] = {SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_FLOAT, SQLITE_INTEGER};
+    if (sqlite_sanity_function(context, "llm_sampler_init_mirostat", argc, argv, 4, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to get vocab from current model.");
+        return;
+    }
+    
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        uint32_t seed = (uint32_t)sqlite3_value_int64(argv[0]);
+        float tau = (float)sqlite3_value_double(argv[1]);
+        float eta = (float)sqlite3_value_double(argv[2]);
+        int32_t m = (int32_t)sqlite3_value_int64(argv[3]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_mirostat(llama_vocab_n_tokens(vocab), seed, tau, eta, m));
+    }
+}
+
+static void llm_sampler_init_mirostat_v2 (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Mirostat 2.0 algorithm described in the paper https://arxiv.org/abs/2007.14966. Uses tokens instead of words.
+    
+    int types[] = {SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_FLOAT};
+    if (sqlite_sanity_function(context, "llm_sampler_init_mirostat_v2", argc, argv, 3, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        uint32_t seed = (uint32_t)sqlite3_value_int64(argv[0]);
+        float tau = (float)sqlite3_value_double(argv[1]);
+        float eta = (float)sqlite3_value_double(argv[2]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_mirostat_v2(seed, tau, eta));
+    }
+}
+
+static void llm_sampler_init_grammar (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    int types[] = {SQLITE_TEXT, SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "llm_sampler_init_grammar", argc, argv, 2, types, true, false) == false) return;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to get vocab from current model.");
+        return;
+    }
+    
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        const char *grammar_str = (const char *)sqlite3_value_text(argv[0]);
+        const char *grammar_root = (const char *)sqlite3_value_text(argv[1]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_grammar(vocab, grammar_str, grammar_root));
+    }
+}
+
+static void llm_sampler_init_infill (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to get vocab from current model.");
+        return;
+    }
+    
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_infill(vocab));
+    }
+}
 
 static void llm_sampler_init_penalties (sqlite3_context *context, int argc, sqlite3_value **argv) {
     int types[] = {SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_FLOAT, SQLITE_FLOAT};
     if (sqlite_sanity_function(context, "llm_sampler_init_penalties", argc, argv, 4, types, true, false) == false) return;
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_sampler_check(ai);
-    if (ai->sampler) {
-        int32_t penalty_last_n = (int32_t)sqlite3_value_int64(argv[0]);
-        float penalty_repeat = (float)sqlite3_value_double(argv[1]);
-        float penalty_freq = (float)sqlite3_value_double(argv[2]);
-        float penalty_present = (float)sqlite3_value_double(argv[3]);
-        llama_sampler_chain_add(ai->sampler, llama_sampler_init_penalties(penalty_last_n, penalty_repeat, penalty_freq, penalty_present));
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_sampler_check(ai);
+    if (ai->sampler) {
+        int32_t penalty_last_n = (int32_t)sqlite3_value_int64(argv[0]);
+        float penalty_repeat = (float)sqlite3_value_double(argv[1]);
+        float penalty_freq = (float)sqlite3_value_double(argv[2]);
+        float penalty_present = (float)sqlite3_value_double(argv[3]);
+        llama_sampler_chain_add(ai->sampler, llama_sampler_init_penalties(penalty_last_n, penalty_repeat, penalty_freq, penalty_present));
+    }
+}
+
+// MARK: - LLM General -
+
+static void llm_lora_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (ai->embed_workers && ai->embed_workers->users > 0) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "LoRA adapters can't be freed while embedding workers are in use");
+        return;
+    }
+    llm_embed_workers_free(ai);
+    if (ai->ctx) llama_set_adapters_lora(ai->ctx, NULL, 0, NULL);
+    for (int i=0; i<MAX_LORAS; ++i) {
+        if (ai->lora[i]) {
+            llama_adapter_lora_free(ai->lora[i]);
+            ai->lora[i] = NULL;
+            ai->lora_scale[i] = 0.0f;
+            ai->lora_fingerprint[i] = 0;
+        }
+    }
+}
+
+static void llm_lora_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_check_context_pinned(context) == false) return;
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (ai->embed_workers && ai->embed_workers->users > 0) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "LoRA adapters can't be loaded while embedding workers are in use");
+        return;
+    }
+    if (ai->embed_columns) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "LoRA adapters can't be loaded while ai_embed_column workers are running");
+        return;
+    }
+    
+    // sanity check arguments
+    int types[] = {SQLITE_TEXT, SQLITE_FLOAT};
+    if (sqlite_sanity_function(context, "llm_lora_load", argc, argv, 2, types, true, false) == false) return;
+    
+    const char *lora_path = (const char *)sqlite3_value_text(argv[0]);
+    float scale = (float)sqlite3_value_double(argv[1]);
+    
+    struct llama_adapter_lora *lora = llama_adapter_lora_init(ai->model, lora_path);
+    if (!lora) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to load LoRA model from file %s", lora_path);
+        return;
+    }
+    
+    // adapters are part of the identity used by the embedding cache, so embeddings computed with them are cached apart
+    int index = llm_lora_push(ai, lora, scale, llm_file_fingerprint(lora_path));
+    if (index == -1) {
+        llama_adapter_lora_free(lora);
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to save LoRA model (%d maximum allowed models reached)", MAX_LORAS);
+        return;
+    }
+    
+    llm_lora_apply(ai, ai->ctx);
+    
+    // embedding workers are created again with the new adapters
+    llm_embed_workers_free(ai);
+    sqlite3_result_int(context, index);
+}
+
+static void llm_sampler_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (ai->sampler) llama_sampler_free(ai->sampler);
+    ai->sampler = NULL;
+}
+
+static void llm_sampler_create (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (ai->sampler) llama_sampler_free(ai->sampler);
+    ai->sampler = NULL;
+    llm_sampler_check(ai);
+}
+
+static void llm_context_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_chat_sessions_clear(ai);
+    llm_context_release(ai);
+    llm_text_cache_reset(ai);
+    llm_prefix_cache_clear(ai);
+}
+
+// check a context out of the pool of the connection for the duration of a single call, *checked_out tells
+// if it must be returned with llm_context_checkin (connections without a pool, or with a pinned context, keep their own)
+static bool llm_context_checkout (sqlite3_context *context, ai_context *ai, bool *checked_out) {
+    *checked_out = false;
+    if (ai && !ai->ctx && ai->pool) {
+        ai->ctx = llm_context_pool_get(ai->pool);
+        if (!ai->ctx) return sqlite_context_result_error(context, SQLITE_ERROR, "Unable to create context from model");
+        *checked_out = true;
+    }
+    return llm_check_context(context);
+}
+
+// the KV cache is not kept across calls, so the text cache of the connection is reset too
+static void llm_context_checkin (ai_context *ai) {
+    llm_context_pool_put(ai->pool, ai->ctx);
+    ai->ctx = NULL;
+    llm_text_cache_reset(ai);
+}
+
+static void llm_context_pooled_call (sqlite3_context *context, int argc, sqlite3_value **argv, void (*fn)(sqlite3_context *, int, sqlite3_value **)) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    bool checked_out = false;
+    if (llm_context_checkout(context, ai, &checked_out) == false) return;
+    fn(context, argc, argv);
+    if (checked_out) llm_context_checkin(ai);
+}
+
+static void llm_embed_generate (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    llm_context_pooled_call(context, argc, argv, llm_embed_generate_exec);
+}
+
+static void llm_rerank (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    llm_context_pooled_call(context, argc, argv, llm_rerank_exec);
+}
+
+static void llm_text_generate (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    llm_context_pooled_call(context, argc, argv, llm_text_generate_exec);
+}
+
+static void llm_score (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    llm_context_pooled_call(context, argc, argv, llm_score_exec);
+}
+
+static void llm_classify (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    llm_context_pooled_call(context, argc, argv, llm_classify_exec);
+}
+
+static bool llm_context_create_with_options (sqlite3_context *context, ai_context *ai, const char *options1, const char *options2) {
+    struct llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_seq_max = 0; // resolved after parsing (see below)
+    ai->options.context_pool = 0;
+    if (parse_keyvalue_string(ai, options1, llm_context_options_callback, &ctx_params) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options1);
+        return false;
+    }
+    
+    if (options2) {
+        if (parse_keyvalue_string(ai, options2, llm_context_options_callback, &ctx_params) == false) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options2);
+            return false;
+        }
+    }
+    
+    // sanity check embedding_type
+    if (ctx_params.embeddings && ai->options.embedding.type == 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Embedding type (embedding_type) must be specified in the create context funtion");
+        return false;
+    }
+
+    // auto-size n_ctx to the model's training window when no explicit context_size was set
+    // llama_context_default_params() sets n_ctx=512; setting n_ctx=0 tells llama.cpp to use n_ctx_train
+    struct llama_context_params defaults = llama_context_default_params();
+    if (ai->model && ctx_params.n_ctx == defaults.n_ctx) {
+        ctx_params.n_ctx = 0;
+    }
+
+    // embedding contexts pack several inputs in the same batch (one sequence each),
+    // so when n_seq_max is not explicitly set allow more sequences sharing a unified KV cache
+    if (ctx_params.n_seq_max == 0) {
+        ctx_params.n_seq_max = defaults.n_seq_max;
+        if (ctx_params.embeddings) {
+            ctx_params.n_seq_max = AI_DEFAULT_EMBEDDING_N_SEQ_MAX;
+            ctx_params.kv_unified = true;
+        }
+    }
+
+    // for embedding contexts, clamp n_ctx to n_ctx_train to avoid position overflow
+    if (ctx_params.embeddings && ai->model) {
+        int n_ctx_train = llama_model_n_ctx_train(ai->model);
+        if ((int)ctx_params.n_ctx > n_ctx_train) {
+            ctx_params.n_ctx = n_ctx_train;
+        }
+        if ((int)ctx_params.n_batch > (int)ctx_params.n_ctx && ctx_params.n_ctx > 0) {
+            ctx_params.n_batch = ctx_params.n_ctx;
+        }
+        if ((int)ctx_params.n_ubatch > (int)ctx_params.n_batch) {
+            ctx_params.n_ubatch = ctx_params.n_batch;
+        }
+    }
+
+    // pooled contexts: a first context is created now, so that invalid options are reported here, and returned to the pool
+    if (ai->options.context_pool > 0) {
+        ai_context_pool *pool = llm_context_pool_acquire(ai->model, &ctx_params, ai->options.context_pool);
+        if (!pool) {
+            sqlite_common_set_error(ai->context, ai->vtab, SQLITE_NOMEM, "Out of memory: failed to allocate context pool");
+            return false;
+        }
+        struct llama_context *ctx = llm_context_pool_get(pool);
+        if (!ctx) {
+            llm_context_pool_release(pool);
+            sqlite_common_set_error(ai->context, ai->vtab, SQLITE_ERROR, "Unable to create context from model");
+            return false;
+        }
+        llm_context_pool_put(pool, ctx);
+        
+        if (ai->ctx || ai->pool) llm_context_free(context, 0, NULL);
+        ai->pool = pool;
+        ai->ctx_params = ctx_params;
+        llm_text_cache_reset(ai);
+        return true;
+    }
+    
+    struct llama_context *ctx = llama_init_from_model(ai->model, ctx_params);
+    if (!ctx) {
+        sqlite_common_set_error(ai->context, ai->vtab, SQLITE_ERROR, "Unable to create context from model");
+        return false;
+    }
+    
+    if (ai->ctx || ai->pool) llm_context_free(context, 0, NULL);
+    ai->ctx = ctx;
+    ai->ctx_params = ctx_params;
+    llm_text_cache_reset(ai);
+    
+    return true;
+}
+
+static void llm_context_create (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // sanity check arguments
+    if (llm_common_args_check(context, "llm_context_create", argc, argv, true) == false) return;
+    const char *options = (const char *)sqlite3_value_text(argv[0]);
+    if ((options == NULL) || (strlen(options) == 0)) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Non empty options must be specified when calling llm_context_create");
+        return;
+    }
+        
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_context_create_with_options(context, ai, options, NULL);
+}
+
+static void llm_context_create_embedding (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    const char *options = AI_DEFAULT_CONTEXT_EMBEDDING_OPTIONS;
+    const char *options2 = (argc > 0) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_context_create_with_options(context, ai, options, options2);
+}
+
+static void llm_context_create_chat (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    const char *options = AI_DEFAULT_CONTEXT_CHAT_OPTIONS;
+    const char *options2 = (argc > 0) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_context_create_with_options(context, ai, options, options2);
+}
+
+static void llm_context_create_textgen (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    const char *options = AI_DEFAULT_CONTEXT_TEXTGEN_OPTIONS;
+    const char *options2 = (argc > 0) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    llm_context_create_with_options(context, ai, options, options2);
+}
+
+static void llm_context_size (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->ctx && !ai->pool) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create() before using this function.");
+        return;
+    }
+    
+    // a pooled context is not checked out just to read its size, the options it was created with are used instead
+    uint32_t n_ctx = (ai->ctx) ? llama_n_ctx(ai->ctx) : ai->ctx_params.n_ctx;
+    if (n_ctx == 0) n_ctx = (uint32_t)llama_model_n_ctx_train(ai->model);
+    sqlite3_result_int(context, n_ctx);
+}
+
+static void llm_context_used (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->ctx && ai->pool) {
+        // no context is checked out between calls
+        sqlite3_result_int(context, 0);
+        return;
+    }
+    if (!ai->ctx) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create() before using this function.");
+        return;
+    }
+    int32_t n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(ai->ctx), 0) + 1;
+    if (n_ctx_used < 0) n_ctx_used = 0;
+    sqlite3_result_int(context, n_ctx_used);
+}
+
+static void llm_model_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    ai_cleanup((void *)ai, true, false);
+}
+
+static void llm_model_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // sanity check arguments
+    if (llm_common_args_check(context, "llm_model_load", argc, argv, false) == false) return;
+    
+    const char *model_path = (const char *)sqlite3_value_text(argv[0]);
+    const char *model_options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+    if (model_options == NULL) model_options = AI_DEFAULT_MODEL_OPTIONS;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    struct llama_model_params model_params = llama_model_default_params();
+    if (parse_keyvalue_string(ai, model_options, llm_model_options_callback, &model_params) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", model_options);
+        return;
+    }
+    
+    // the previous model is released after acquiring the new one, so reloading the same model does not read it again
+    uint64_t fingerprint = 0;
+    struct llama_model *model = llm_model_acquire(model_path, &model_params, &fingerprint);
+    if (!model) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to load model from file %s", model_path);
+        return;
+    }
+    
+    ai_cleanup((void *)ai, true, false);
+    ai->model = model;
+    ai->model_fingerprint = fingerprint;
+}
+
+// MARK: - Background Jobs -
+
+// llm_job_submit returns as soon as the job is queued: background threads run it on a private in-memory connection whose
+// AI context checks contexts out of a pool shared with the submitting connection. Workers never write to the database, so they
+// can't make the writes of the application fail with SQLITE_BUSY: results are kept in memory and written to ai_jobs by the next
+// llm_job_* call of the connection, and when the connection is closed (queued jobs are then marked as cancelled).
+// Jobs use the model, context settings, options and sampler of the connection, but not its state: LoRA adapters and
+// registered prefixes are rejected at submission, and the draft model is not used (speculative decoding doesn't change the output)
+
+#define AI_JOBS_CLOSE_TIMEOUT                   2000    // ms waited for the write lock when ai_jobs is updated on close
+#define JOBS_TABLE_CREATE_STMT                  "CREATE TABLE IF NOT EXISTS ai_jobs (id INTEGER PRIMARY KEY AUTOINCREMENT, kind TEXT NOT NULL, input TEXT, options TEXT, status TEXT NOT NULL DEFAULT 'queued', result, error TEXT, created_at DATETIME DEFAULT CURRENT_TIMESTAMP, finished_at DATETIME);"
+#define JOBS_UPDATE_STMT                        "UPDATE ai_jobs SET status = ?2, result = ?3, error = ?4, finished_at = CURRENT_TIMESTAMP WHERE id = ?1;"
+#define JOBS_RUNNING_STMT                       "UPDATE ai_jobs SET status = 'running' WHERE id = ?1 AND status = 'queued';"
+
+typedef enum {
+    AI_JOB_QUEUED = 0,
+    AI_JOB_RUNNING,
+    AI_JOB_DONE,
+    AI_JOB_FAILED,
+    AI_JOB_CANCELLED
+} ai_job_status;
+
+// each kind is a single function call on the private connection of the worker
+static const struct {
+    const char                  *name;
+    const char                  *sql;
+    const char                  *sql_options;
+} ai_job_kinds[] = {
+    {"embed",    "SELECT llm_embed_generate(?1);", "SELECT llm_embed_generate(?1, ?2);"},
+    {"generate", "SELECT llm_text_generate(?1);",  "SELECT llm_text_generate(?1, ?2);"}
+};
+
+typedef struct ai_job {
+    sqlite3_int64               id;
+    int                         kind;
+    char                        *input;
+    char                        *options;
+    llm_options                 settings;           // options of the connection when the job was submitted
+    struct llama_sampler        *sampler;           // clone of the sampler of the connection (NULL for the default one)
+    
+    ai_job_status               status;
+    sqlite3_value               *result;
+    char                        *error;
+    bool                        persisted;          // result already written to ai_jobs
+    bool                        started;            // status 'running' already written to ai_jobs
+    struct ai_job               *next;
+} ai_job;
+
+typedef struct {
+    ai_jobs                     *owner;
+    pthread_t                   thread;
+    bool                        started;
+    sqlite3                     *db;
+    ai_context                  *ai;
+} ai_job_worker;
+
+struct ai_jobs {
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;               // signaled when a job is queued or finished, and on stop
+    ai_job_worker               *workers;
+    int                         count;
+    bool                        stop;
+    char                        *filename;          // database file of ai_jobs, updated with a private connection on close (NULL when in-memory)
+    
+    ai_job                      *head;              // jobs in submission order, until their result is in ai_jobs
+    ai_job                      *tail;
+};
+
+static const char *llm_job_status_name (ai_job_status status) {
+    switch (status) {
+        case AI_JOB_QUEUED: return "queued";
+        case AI_JOB_RUNNING: return "running";
+        case AI_JOB_DONE: return "done";
+        case AI_JOB_FAILED: return "failed";
+        case AI_JOB_CANCELLED: return "cancelled";
+    }
+    return "unknown";
+}
+
+static void llm_job_free (ai_job *job) {
+    sqlite3_free(job->input);
+    sqlite3_free(job->options);
+    if (job->sampler) llama_sampler_free(job->sampler);
+    if (job->result) sqlite3_value_free(job->result);
+    sqlite3_free(job->error);
+    sqlite3_free(job);
+}
+
+static int llm_job_persist (sqlite3 *db, ai_job *job, ai_job_status status) {
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, JOBS_UPDATE_STMT, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int64(vm, 1, job->id);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_text(vm, 2, llm_job_status_name(status), -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = (job->result) ? sqlite3_bind_value(vm, 3, job->result) : sqlite3_bind_null(vm, 3);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = (job->error) ? sqlite3_bind_text(vm, 4, job->error, -1, SQLITE_STATIC) : sqlite3_bind_null(vm, 4);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    if (vm) sqlite3_finalize(vm);
+    return rc;
+}
+
+static void llm_job_execute (ai_job_worker *worker, ai_job *job) {
+    ai_context *ai = worker->ai;
+    ai->options = job->settings;
+    ai->sampler = job->sampler;
+    job->sampler = NULL;
+    
+    sqlite3_stmt *vm = NULL;
+    const char *sql = (job->options) ? ai_job_kinds[job->kind].sql_options : ai_job_kinds[job->kind].sql;
+    int rc = sqlite3_prepare_v2(worker->db, sql, -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 1, job->input, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK && job->options) rc = sqlite3_bind_text(vm, 2, job->options, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    
+    if (rc == SQLITE_ROW) job->result = sqlite3_value_dup(sqlite3_column_value(vm, 0));
+    if (!job->result) job->error = sqlite3_mprintf("%s", (rc == SQLITE_ROW) ? "Out of memory" : sqlite3_errmsg(worker->db));
+    if (vm) sqlite3_finalize(vm);
+    
+    if (ai->sampler) llama_sampler_free(ai->sampler);
+    ai->sampler = NULL;
+}
+
+static void *llm_job_worker_run (void *arg) {
+    ai_job_worker *worker = (ai_job_worker *)arg;
+    ai_jobs *jobs = worker->owner;
+    
+    pthread_mutex_lock(&jobs->mutex);
+    while (!jobs->stop) {
+        ai_job *job = jobs->head;
+        while (job && job->status != AI_JOB_QUEUED) job = job->next;
+        if (!job) {
+            pthread_cond_wait(&jobs->cond, &jobs->mutex);
+            continue;
+        }
+        job->status = AI_JOB_RUNNING;
+        pthread_mutex_unlock(&jobs->mutex);
+        
+        llm_job_execute(worker, job);
+        
+        pthread_mutex_lock(&jobs->mutex);
+        job->status = (job->result) ? AI_JOB_DONE : AI_JOB_FAILED;
+        pthread_cond_broadcast(&jobs->cond);
+    }
+    pthread_mutex_unlock(&jobs->mutex);
+    return NULL;
+}
+
+static int llm_job_persist_running (sqlite3 *db, ai_job *job) {
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, JOBS_RUNNING_STMT, -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 1, job->id);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    if (vm) sqlite3_finalize(vm);
+    return rc;
+}
+
+// write the status of the started jobs and the results of the finished ones to ai_jobs (on the connection that submitted them),
+// then forget the finished jobs. Nothing is written inside a transaction of the application: a rollback would discard results
+// that are no longer in memory, so they are written by the first call in autocommit mode
+static void llm_jobs_sync (ai_context *ai) {
+    ai_jobs *jobs = ai->jobs;
+    if (!jobs || !sqlite3_get_autocommit(ai->db)) return;
+    
+    pthread_mutex_lock(&jobs->mutex);
+    ai_job **prev = &jobs->head;
+    ai_job *last = NULL;
+    while (*prev) {
+        ai_job *job = *prev;
+        bool finished = (job->status == AI_JOB_DONE || job->status == AI_JOB_FAILED);
+        
+        if (job->status == AI_JOB_RUNNING && !job->started && llm_job_persist_running(ai->db, job) == SQLITE_OK) job->started = true;
+        
+        // without a transaction open the row is committed, a missing row was rolled back (or deleted) together with the submission
+        bool missing = false;
+        if (finished && !job->persisted && llm_job_persist(ai->db, job, job->status) == SQLITE_OK) {
+            job->persisted = (sqlite3_changes(ai->db) == 1);
+            missing = !job->persisted;
+        }
+        if ((finished && job->persisted) || missing) {
+            *prev = job->next;
+            llm_job_free(job);
+            continue;
+        }
+        last = job;
+        prev = &job->next;
+    }
+    jobs->tail = last;
+    pthread_mutex_unlock(&jobs->mutex);
+}
+
+// on close the connection of ai_jobs can't run statements anymore: the results not written yet are stored, and the jobs
+// still queued are marked as cancelled, with a private connection to the database file
+static void llm_jobs_finalize (ai_jobs *jobs) {
+    if (!jobs->filename || !jobs->head) return;
+    
+    sqlite3 *db = NULL;
+    int rc = sqlite3_open_v2(jobs->filename, &db, SQLITE_OPEN_READWRITE, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_busy_timeout(db, AI_JOBS_CLOSE_TIMEOUT);
+        rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+    }
+    for (ai_job *job = jobs->head; job && rc == SQLITE_OK; job = job->next) {
+        if (job->persisted) continue;
+        if (job->status == AI_JOB_QUEUED) {
+            job->error = sqlite3_mprintf("Connection closed before the job started");
+            job->status = AI_JOB_CANCELLED;
+        }
+        rc = llm_job_persist(db, job, job->status);
+    }
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK && db && !sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    sqlite3_close(db);
+}
+
+static void llm_jobs_free (ai_context *ai) {
+    ai_jobs *jobs = ai->jobs;
+    if (!jobs) return;
+    
+    // running jobs are completed, queued ones are cancelled
+    pthread_mutex_lock(&jobs->mutex);
+    jobs->stop = true;
+    pthread_cond_broadcast(&jobs->cond);
+    pthread_mutex_unlock(&jobs->mutex);
+    
+    for (int i = 0; i < jobs->count; ++i) {
+        ai_job_worker *worker = &jobs->workers[i];
+        if (worker->started) pthread_join(worker->thread, NULL);
+        if (worker->db) sqlite3_close(worker->db);
+        if (worker->ai) ai_free(worker->ai, true, true, true);
+    }
+    llm_jobs_finalize(jobs);
+    
+    ai_job *job = jobs->head;
+    while (job) {
+        ai_job *next = job->next;
+        llm_job_free(job);
+        job = next;
+    }
+    
+    pthread_cond_destroy(&jobs->cond);
+    pthread_mutex_destroy(&jobs->mutex);
+    sqlite3_free(jobs->workers);
+    sqlite3_free(jobs->filename);
+    sqlite3_free(jobs);
+    ai->jobs = NULL;
+}
+
+// private connection (the database file, or an in-memory one) and AI context of a background thread: same model and context
+// settings of the connection, contexts come from the shared pool
+static ai_context *llm_worker_open (sqlite3_context *context, ai_context *ai, const char *filename, int max_idle, sqlite3 **db) {
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX | ((filename) ? 0 : SQLITE_OPEN_CREATE);
+    int rc = sqlite3_open_v2((filename) ? filename : ":memory:", db, flags, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite_context_result_error(context, rc, "Unable to open the connection of a background worker: %s", sqlite3_errmsg(*db));
+        return NULL;
+    }
+    sqlite3_busy_timeout(*db, 5000);
+    
+    ai_context *worker = (ai_context *)ai_create(*db);
+    if (!worker) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate background worker");
+        return NULL;
+    }
+    
+    rc = sqlite3_create_function(*db, "llm_embed_generate", 1, SQLITE_UTF8, worker, llm_embed_generate, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function(*db, "llm_embed_generate", 2, SQLITE_UTF8, worker, llm_embed_generate, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function(*db, "llm_text_generate", -1, SQLITE_UTF8, worker, llm_text_generate, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_module(*db, "llm_embed_each", &llm_embed_each, worker);
+    if (rc != SQLITE_OK) {
+        ai_free(worker, true, true, true);
+        sqlite_context_result_error(context, rc, "Unable to register the functions of a background worker");
+        return NULL;
+    }
+    
+    llm_model_retain(ai->model);
+    worker->model = ai->model;
+    worker->model_fingerprint = ai->model_fingerprint;
+    worker->options = ai->options;
+    worker->ctx_params = ai->ctx_params;
+    worker->pool = llm_context_pool_acquire(ai->model, &ai->ctx_params, max_idle);
+    if (!worker->pool) {
+        ai_free(worker, true, true, true);
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate context pool");
+        return NULL;
+    }
+    return worker;
+}
+
+static bool llm_job_worker_init (sqlite3_context *context, ai_context *ai, ai_job_worker *worker) {
+    worker->ai = llm_worker_open(context, ai, NULL, worker->owner->count, &worker->db);
+    if (!worker->ai) return false;
+    
+    if (pthread_create(&worker->thread, NULL, llm_job_worker_run, worker) != 0) return sqlite_context_result_error(context, SQLITE_ERROR, "Unable to start job worker");
+    worker->started = true;
+    return true;
+}
+
+// start the job threads of the connection (job_threads, when the first job is submitted)
+static bool llm_jobs_start (sqlite3_context *context, ai_context *ai) {
+    if (ai->jobs) return true;
+    
+    ai_jobs *jobs = (ai_jobs *)sqlite3_malloc(sizeof(ai_jobs));
+    if (!jobs) return sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate job threads");
+    memset(jobs, 0, sizeof(ai_jobs));
+    pthread_mutex_init(&jobs->mutex, NULL);
+    pthread_cond_init(&jobs->cond, NULL);
+    ai->jobs = jobs;
+    
+    int count = (ai->options.job_threads > 0) ? ai->options.job_threads : AI_DEFAULT_JOB_THREADS;
+    jobs->workers = (ai_job_worker *)sqlite3_malloc64(count * sizeof(ai_job_worker));
+    if (!jobs->workers) {
+        llm_jobs_free(ai);
+        return sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate job threads");
+    }
+    memset(jobs->workers, 0, count * sizeof(ai_job_worker));
+    jobs->count = count;
+    
+    const char *filename = sqlite3_db_filename(ai->db, "main");
+    if (filename && filename[0]) {
+        jobs->filename = sqlite_strdup(filename);
+        if (!jobs->filename) {
+            llm_jobs_free(ai);
+            return sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to allocate job threads");
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        jobs->workers[i].owner = jobs;
+        if (!llm_job_worker_init(context, ai, &jobs->workers[i])) {
+            llm_jobs_free(ai);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool llm_job_prefix_callback (void *ctx, void *xdata, const char *key, int key_len, const char *value, int value_len) {
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_PREFIX) && value_len > 0) *(bool *)xdata = true;
+    return true;
+}
+
+static void llm_job_submit (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || sqlite3_value_type(argv[1]) != SQLITE_TEXT || (argc == 3 && sqlite3_value_type(argv[2]) != SQLITE_TEXT && sqlite3_value_type(argv[2]) != SQLITE_NULL)) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "llm_job_submit expects a TEXT kind, a TEXT input and optional TEXT options");
+        return;
+    }
+    
+    const char *name = (const char *)sqlite3_value_text(argv[0]);
+    int kind = -1;
+    for (int i = 0; i < (int)(sizeof(ai_job_kinds) / sizeof(ai_job_kinds[0])); ++i) {
+        if (strcasecmp(name, ai_job_kinds[i].name) == 0) kind = i;
+    }
+    if (kind < 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unknown job kind '%s' (expected embed or generate)", name);
+        return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->model) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded");
+        return;
+    }
+    if (!ai->ctx && !ai->pool) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create() before using this function.");
+        return;
+    }
+    
+    // the state of the connection is not available to the threads
+    const char *options = (argc == 3) ? (const char *)sqlite3_value_text(argv[2]) : NULL;
+    bool has_prefix = (ai->options.prefix[0] != 0);
+    if (options && !has_prefix) parse_keyvalue_string(NULL, options, llm_job_prefix_callback, &has_prefix);
+    if (llm_lora_active(ai)) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "Background jobs can't use LoRA adapters, call llm_lora_free() first");
+        return;
+    }
+    if (has_prefix) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "Background jobs can't use registered prefixes (prefix option)");
+        return;
+    }
+    
+    int rc = sqlite3_exec(ai->db, JOBS_TABLE_CREATE_STMT, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite_context_result_error(context, rc, "Unable to create the ai_jobs table: %s", sqlite3_errmsg(ai->db));
+        return;
+    }
+    if (!llm_jobs_start(context, ai)) return;
+    llm_jobs_sync(ai);
+    
+    const char *input = (const char *)sqlite3_value_text(argv[1]);
+    ai_job *job = (ai_job *)sqlite3_malloc(sizeof(ai_job));
+    if (!job) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    memset(job, 0, sizeof(ai_job));
+    job->kind = kind;
+    job->input = sqlite_strdup(input);
+    job->options = (options) ? sqlite_strdup(options) : NULL;
+    job->settings = ai->options;
+    if (ai->sampler) job->sampler = llama_sampler_clone(ai->sampler);
+    if (!job->input || (options && !job->options)) {
+        llm_job_free(job);
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    
+    sqlite3_stmt *vm = NULL;
+    rc = sqlite3_prepare_v2(ai->db, "INSERT INTO ai_jobs (kind, input, options) VALUES (?1, ?2, ?3);", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 1, ai_job_kinds[kind].name, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 2, job->input, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = (job->options) ? sqlite3_bind_text(vm, 3, job->options, -1, SQLITE_STATIC) : sqlite3_bind_null(vm, 3);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    if (vm) sqlite3_finalize(vm);
+    if (rc != SQLITE_DONE) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to insert the job in ai_jobs: %s", sqlite3_errmsg(ai->db));
+        llm_job_free(job);
+        return;
+    }
+    job->id = sqlite3_last_insert_rowid(ai->db);
+    
+    ai_jobs *jobs = ai->jobs;
+    pthread_mutex_lock(&jobs->mutex);
+    if (jobs->tail) jobs->tail->next = job;
+    else jobs->head = job;
+    jobs->tail = job;
+    pthread_cond_broadcast(&jobs->cond);
+    pthread_mutex_unlock(&jobs->mutex);
+    
+    sqlite3_result_int64(context, job->id);
+}
+
+static void llm_job_result (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_INTEGER) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "llm_job_result expects an INTEGER job id");
+        return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    sqlite3_int64 id = sqlite3_value_int64(argv[0]);
+    llm_jobs_sync(ai);
+    
+    // jobs still running (or whose result could not be written yet) are answered from memory
+    ai_jobs *jobs = ai->jobs;
+    if (jobs) {
+        pthread_mutex_lock(&jobs->mutex);
+        ai_job *job = jobs->head;
+        while (job && job->id != id) job = job->next;
+        if (job) {
+            if (job->status == AI_JOB_DONE) sqlite3_result_value(context, job->result);
+            else if (job->status == AI_JOB_FAILED) sqlite_context_result_error(context, SQLITE_ERROR, "Job %lld failed: %s", (long long)id, (job->error) ? job->error : "unknown error");
+            else sqlite3_result_null(context);
+        }
+        pthread_mutex_unlock(&jobs->mutex);
+        if (job) return;
+    }
+    
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(ai->db, "SELECT status, result, error FROM ai_jobs WHERE id = ?1;", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 1, id);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    
+    if (rc == SQLITE_ROW) {
+        const char *status = (const char *)sqlite3_column_text(vm, 0);
+        const char *error = (const char *)sqlite3_column_text(vm, 2);
+        if (status && strcmp(status, "done") == 0) sqlite3_result_value(context, sqlite3_column_value(vm, 1));
+        else if (status && strcmp(status, "failed") == 0) sqlite_context_result_error(context, SQLITE_ERROR, "Job %lld failed: %s", (long long)id, (error) ? error : "unknown error");
+        else if (status && strcmp(status, "cancelled") == 0) sqlite_context_result_error(context, SQLITE_ERROR, "Job %lld was cancelled: %s", (long long)id, (error) ? error : "unknown reason");
+        else sqlite3_result_null(context);
+    } else if (rc == SQLITE_DONE || rc == SQLITE_ERROR) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Job %lld not found", (long long)id);
+    } else {
+        sqlite_context_result_error(context, rc, "%s", sqlite3_errmsg(ai->db));
+    }
+    if (vm) sqlite3_finalize(vm);
+}
+
+// MARK: - Embedding Columns -
+
+// ai_embed_column keeps a vector column in sync with a text column without embedding inside the writer transaction:
+// triggers only queue the changed rowids in ai_embed_queue, and a background thread with a private connection to the same
+// database file embeds the queued rows with llm_embed_each (outside of any write transaction), then stores the embeddings and
+// dequeues the rows with a single short transaction per batch. A row changed again while it is embedded gets a newer queue id
+// (and loses the claim), so its stale embedding is not stored and it is embedded again by the next batch. Batches are claimed
+// first, so the workers of several connections or processes registered for the same column embed different rows
+
+#define EMBED_COLUMNS_TABLE_CREATE_STMT         "CREATE TABLE IF NOT EXISTS ai_embed_columns (tbl TEXT NOT NULL, text_col TEXT NOT NULL, vec_col TEXT NOT NULL, options TEXT, error TEXT, PRIMARY KEY (tbl, vec_col));"
+#define EMBED_QUEUE_TABLE_CREATE_STMT           "CREATE TABLE IF NOT EXISTS ai_embed_queue (id INTEGER PRIMARY KEY AUTOINCREMENT, tbl TEXT NOT NULL, col TEXT NOT NULL, row INTEGER NOT NULL, claimed_by INTEGER, claimed_at INTEGER, UNIQUE (tbl, col, row));"
+
+struct ai_embed_column_worker {
+    char                        *table;
+    char                        *text_column;
+    char                        *vec_column;
+    char                        *options;
+    
+    pthread_t                   thread;
+    bool                        started;
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;               // signaled on stop
+    bool                        stop;
+    
+    sqlite3                     *db;
+    ai_context                  *ai;
+    sqlite3_int64               claim_id;           // claimed_by of the queue entries of the batch of this worker
+    bool                        has_error;          // error column of ai_embed_columns is set
+    struct ai_embed_column_worker *next;
+};
+
+static void ai_embed_column_set_error (ai_embed_column_worker *worker, const char *error) {
+    if (!error && !worker->has_error) return;
+    
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(worker->db, "UPDATE ai_embed_columns SET error = ?1 WHERE tbl = ?2 AND vec_col = ?3;", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = (error) ? sqlite3_bind_text(vm, 1, error, -1, SQLITE_TRANSIENT) : sqlite3_bind_null(vm, 1);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 2, worker->table, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 3, worker->vec_column, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    if (vm) sqlite3_finalize(vm);
+    if (rc == SQLITE_DONE) worker->has_error = (error != NULL);
+}
+
+// embed and store the oldest queued rows, returns the number of queue entries processed (-1 on error)
+static int ai_embed_column_step (ai_embed_column_worker *worker) {
+    sqlite3 *db = worker->db;
+    sqlite3_stmt *vm = NULL;
+    char *sql = NULL;
+    sqlite3_int64 *rowids = NULL;
+    sqlite3_value **embeddings = NULL;
+    bool in_transaction = false;
+    int count = 0;
+    int n = 0;
+    
+    // the oldest entries not claimed by another worker (its own ones are left by a failed batch) are claimed with a short write,
+    // taken only when there is something to claim so that an idle worker never holds the write lock
+    sqlite3_int64 now = (sqlite3_int64)time(NULL);
+    int rc = sqlite3_prepare_v2(db, "SELECT count(*) FROM (SELECT 1 FROM ai_embed_queue WHERE tbl = ?1 AND col = ?2 AND (claimed_by IS NULL OR claimed_by = ?3 OR claimed_at < ?4 - ?5) LIMIT 1);", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 1, worker->table, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 2, worker->vec_column, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 3, worker->claim_id);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 4, now);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int(vm, 5, AI_EMBED_COLUMN_CLAIM_TIMEOUT);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    if (rc != SQLITE_ROW) goto cleanup;
+    bool claimable = (sqlite3_column_int(vm, 0) > 0);
+    sqlite3_finalize(vm);
+    vm = NULL;
+    rc = SQLITE_OK;
+    if (!claimable) goto cleanup;
+    
+    rc = sqlite3_prepare_v2(db, "UPDATE ai_embed_queue SET claimed_by = ?3, claimed_at = ?4 WHERE id IN (SELECT id FROM ai_embed_queue WHERE tbl = ?1 AND col = ?2 AND (claimed_by IS NULL OR claimed_by = ?3 OR claimed_at < ?4 - ?5) ORDER BY id LIMIT ?6);", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 1, worker->table, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 2, worker->vec_column, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 3, worker->claim_id);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 4, now);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int(vm, 5, AI_EMBED_COLUMN_CLAIM_TIMEOUT);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int(vm, 6, AI_EMBED_COLUMN_BATCH);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    if (rc != SQLITE_DONE) goto cleanup;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    
+    // the batch is every claimed entry up to max_id (entries queued later, or queued again, get a larger id and no claim)
+    sqlite3_int64 max_id = 0;
+    rc = sqlite3_prepare_v2(db, "SELECT max(id), count(*) FROM ai_embed_queue WHERE tbl = ?1 AND col = ?2 AND claimed_by = ?3;", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 1, worker->table, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 2, worker->vec_column, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 3, worker->claim_id);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    if (rc != SQLITE_ROW) goto cleanup;
+    max_id = sqlite3_column_int64(vm, 0);
+    count = sqlite3_column_int(vm, 1);
+    sqlite3_finalize(vm);
+    vm = NULL;
+    rc = SQLITE_OK;
+    if (count == 0) goto cleanup;
+    
+    rowids = (sqlite3_int64 *)sqlite3_malloc64(count * sizeof(sqlite3_int64));
+    embeddings = (sqlite3_value **)sqlite3_malloc64(count * sizeof(sqlite3_value *));
+    sql = sqlite3_mprintf("SELECT t.rowid, t.\"%w\" FROM ai_embed_queue q JOIN \"%w\" t ON t.rowid = q.row WHERE q.tbl = '%q' AND q.col = '%q' AND q.claimed_by = %lld AND q.id <= %lld ORDER BY q.id;", worker->text_column, worker->table, worker->table, worker->vec_column, (long long)worker->claim_id, (long long)max_id);
+    if (!rowids || !embeddings || !sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    
+    // rows are embedded with the multi-sequence path, outside of any write transaction
+    rc = sqlite3_prepare_v2(db, (worker->options) ? "SELECT id, embedding FROM llm_embed_each(?1, ?2);" : "SELECT id, embedding FROM llm_embed_each(?1);", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 1, sql, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK && worker->options) rc = sqlite3_bind_text(vm, 2, worker->options, -1, SQLITE_STATIC);
+    while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+        rc = sqlite3_step(vm);
+        if (rc != SQLITE_ROW || n == count) continue;
+        rowids[n] = sqlite3_column_int64(vm, 0);
+        embeddings[n] = sqlite3_value_dup(sqlite3_column_value(vm, 1));
+        if (!embeddings[n]) {rc = SQLITE_NOMEM; break;}
+        n++;
+    }
+    if (rc != SQLITE_DONE) goto cleanup;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    
+    // embeddings are stored and the batch is dequeued (deleted rows included) with a single transaction: a row is updated only
+    // if its queue entry is still the claimed one, the text changed meanwhile otherwise (and the row was queued again)
+    rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    in_transaction = true;
+    
+    sqlite3_free(sql);
+    sql = sqlite3_mprintf("UPDATE \"%w\" SET \"%w\" = ?1 WHERE rowid = ?2 AND EXISTS (SELECT 1 FROM ai_embed_queue WHERE tbl = ?3 AND col = ?4 AND row = ?2 AND claimed_by = ?5 AND id <= ?6);", worker->table, worker->vec_column);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 3, worker->table, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 4, worker->vec_column, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 5, worker->claim_id);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 6, max_id);
+    for (int i = 0; i < n && rc == SQLITE_OK; ++i) {
+        rc = sqlite3_bind_value(vm, 1, embeddings[i]);
+        if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 2, rowids[i]);
+        if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+        if (rc == SQLITE_DONE) rc = sqlite3_reset(vm);
+    }
+    if (rc != SQLITE_OK) goto cleanup;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    
+    rc = sqlite3_prepare_v2(db, "DELETE FROM ai_embed_queue WHERE tbl = ?1 AND col = ?2 AND claimed_by = ?3 AND id <= ?4;", -1, &vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 1, worker->table, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 2, worker->vec_column, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 3, worker->claim_id);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 4, max_id);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    if (rc != SQLITE_DONE) goto cleanup;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    
+    rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) in_transaction = false;
+    
+cleanup:
+    if (rc != SQLITE_OK) {
+        char *error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        if (vm) sqlite3_finalize(vm);
+        vm = NULL;
+        if (in_transaction) sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        ai_embed_column_set_error(worker, (error) ? error : "Out of memory");
+        sqlite3_free(error);
+    } else if (count > 0) {
+        ai_embed_column_set_error(worker, NULL);
+    }
+    if (vm) sqlite3_finalize(vm);
+    for (int i = 0; i < n; ++i) sqlite3_value_free(embeddings[i]);
+    sqlite3_free(embeddings);
+    sqlite3_free(rowids);
+    sqlite3_free(sql);
+    return (rc == SQLITE_OK) ? count : -1;
+}
+
+// data_version changes when another connection commits, so an idle worker looks at the queue only after a commit
+static sqlite3_int64 ai_embed_column_data_version (sqlite3 *db) {
+    sqlite3_stmt *vm = NULL;
+    sqlite3_int64 version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &vm, NULL) == SQLITE_OK && sqlite3_step(vm) == SQLITE_ROW) {
+        version = sqlite3_column_int64(vm, 0);
+    }
+    if (vm) sqlite3_finalize(vm);
+    return version;
+}
+
+static void *ai_embed_column_run (void *arg) {
+    ai_embed_column_worker *worker = (ai_embed_column_worker *)arg;
+    sqlite3_int64 idle_version = -1;
+    
+    pthread_mutex_lock(&worker->mutex);
+    while (!worker->stop) {
+        pthread_mutex_unlock(&worker->mutex);
+        
+        int n = 0;
+        sqlite3_int64 version = ai_embed_column_data_version(worker->db);
+        if (version < 0 || version != idle_version) {
+            n = ai_embed_column_step(worker);
+            if (n == 0) idle_version = version;
+        }
+        
+        pthread_mutex_lock(&worker->mutex);
+        if (n > 0) continue;
+        
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long ms = (n < 0) ? AI_EMBED_COLUMN_RETRY_MS : AI_EMBED_COLUMN_POLL_MS;
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += (ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!worker->stop) pthread_cond_timedwait(&worker->cond, &worker->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    return NULL;
+}
+
+static void ai_embed_column_worker_free (ai_embed_column_worker *worker) {
+    if (worker->started) {
+        pthread_mutex_lock(&worker->mutex);
+        worker->stop = true;
+        pthread_cond_broadcast(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+        pthread_join(worker->thread, NULL);
+        
+        // the rows of an unfinished batch can be claimed at once by the other workers
+        sqlite3_stmt *vm = NULL;
+        if (sqlite3_prepare_v2(worker->db, "UPDATE ai_embed_queue SET claimed_by = NULL, claimed_at = NULL WHERE claimed_by = ?1;", -1, &vm, NULL) == SQLITE_OK) {
+            sqlite3_bind_int64(vm, 1, worker->claim_id);
+            sqlite3_step(vm);
+        }
+        if (vm) sqlite3_finalize(vm);
+    }
+    if (worker->db) sqlite3_close(worker->db);
+    if (worker->ai) ai_free(worker->ai, true, true, true);
+    
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    sqlite3_free(worker->table);
+    sqlite3_free(worker->text_column);
+    sqlite3_free(worker->vec_column);
+    sqlite3_free(worker->options);
+    sqlite3_free(worker);
+}
+
+static void ai_embed_columns_free (ai_context *ai) {
+    ai_embed_column_worker *worker = ai->embed_columns;
+    while (worker) {
+        ai_embed_column_worker *next = worker->next;
+        ai_embed_column_worker_free(worker);
+        worker = next;
+    }
+    ai->embed_columns = NULL;
+}
+
+// triggers, registration and backfill of the rows without an embedding, in a single savepoint
+static bool ai_embed_column_register (sqlite3_context *context, ai_context *ai, const char *table, const char *text_column, const char *vec_column, const char *options, int *queued) {
+    sqlite3 *db = ai->db;
+    char *sql = sqlite3_mprintf("SAVEPOINT ai_embed_column;"
+                                EMBED_COLUMNS_TABLE_CREATE_STMT
+                                EMBED_QUEUE_TABLE_CREATE_STMT
+                                "CREATE TRIGGER IF NOT EXISTS \"ai_embed_%w_%w_insert\" AFTER INSERT ON \"%w\" BEGIN INSERT OR REPLACE INTO ai_embed_queue (tbl, col, row) VALUES ('%q', '%q', NEW.rowid); END;"
+                                "CREATE TRIGGER IF NOT EXISTS \"ai_embed_%w_%w_update\" AFTER UPDATE OF \"%w\" ON \"%w\" BEGIN INSERT OR REPLACE INTO ai_embed_queue (tbl, col, row) VALUES ('%q', '%q', NEW.rowid); END;"
+                                "INSERT OR REPLACE INTO ai_embed_columns (tbl, text_col, vec_col, options) VALUES ('%q', '%q', '%q', %Q);"
+                                "INSERT OR IGNORE INTO ai_embed_queue (tbl, col, row) SELECT '%q', '%q', rowid FROM \"%w\" WHERE \"%w\" IS NULL AND \"%w\" IS NOT NULL;",
+                                table, vec_column, table, table, vec_column,
+                                table, vec_column, text_column, table, table, vec_column,
+                                table, text_column, vec_column, options,
+                                table, vec_column, table, vec_column, text_column);
+    if (!sql) return sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory: failed to register column");
+    
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        sqlite_context_result_error(context, rc, "Unable to register %s.%s: %s", table, vec_column, sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK TO ai_embed_column; RELEASE ai_embed_column;", NULL, NULL, NULL);
+        return false;
+    }
+    *queued = sqlite3_changes(db);
+    sqlite3_exec(db, "RELEASE ai_embed_column;", NULL, NULL, NULL);
+    return true;
+}
+
+static void ai_embed_column (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    for (int i = 0; i < argc; ++i) {
+        if (sqlite3_value_type(argv[i]) == SQLITE_TEXT || (i == 3 && sqlite3_value_type(argv[i]) == SQLITE_NULL)) continue;
+        sqlite_context_result_error(context, SQLITE_ERROR, "ai_embed_column expects TEXT table, text column and vector column names, and optional TEXT options");
+        return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->model) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded");
+        return;
+    }
+    if (!ai->ctx && !ai->pool) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create_embedding() before using this function.");
+        return;
+    }
+    if (!ai->ctx_params.embeddings) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "ai_embed_column requires an embedding context (llm_context_create_embedding)");
+        return;
+    }
+    
+    // the worker embeds with pooled contexts, without the adapters of the connection: the stored vectors would not match
+    // the embeddings of the queries generated with them
+    if (llm_lora_active(ai)) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "ai_embed_column can't be used while LoRA adapters are loaded, call llm_lora_free() first");
+        return;
+    }
+    
+    // the worker must see the rows written by the application
+    const char *filename = sqlite3_db_filename(ai->db, "main");
+    if (!filename || filename[0] == 0) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "ai_embed_column requires a database stored in a file");
+        return;
+    }
+    
+    const char *table = (const char *)sqlite3_value_text(argv[0]);
+    const char *text_column = (const char *)sqlite3_value_text(argv[1]);
+    const char *vec_column = (const char *)sqlite3_value_text(argv[2]);
+    const char *options = (argc == 4) ? (const char *)sqlite3_value_text(argv[3]) : NULL;
+    
+    char *sql = sqlite3_mprintf("SELECT rowid, \"%w\", \"%w\" FROM \"%w\" LIMIT 0;", text_column, vec_column, table);
+    sqlite3_stmt *vm = NULL;
+    int rc = (sql) ? sqlite3_prepare_v2(ai->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (vm) sqlite3_finalize(vm);
+    if (rc != SQLITE_OK) {
+        sqlite_context_result_error(context, rc, "Unable to register %s.%s: %s", table, vec_column, sqlite3_errmsg(ai->db));
+        return;
+    }
+    
+    int queued = 0;
+    if (!ai_embed_column_register(context, ai, table, text_column, vec_column, options, &queued)) return;
+    
+    // a single worker per column and connection, the options of a running worker are replaced
+    ai_embed_column_worker *worker = ai->embed_columns;
+    while (worker && (strcmp(worker->table, table) != 0 || strcmp(worker->vec_column, vec_column) != 0)) worker = worker->next;
+    if (worker) {
+        ai_embed_column_worker **prev = &ai->embed_columns;
+        while (*prev != worker) prev = &(*prev)->next;
+        *prev = worker->next;
+        ai_embed_column_worker_free(worker);
+    }
+    
+    worker = (ai_embed_column_worker *)sqlite3_malloc(sizeof(ai_embed_column_worker));
+    if (!worker) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    memset(worker, 0, sizeof(ai_embed_column_worker));
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    worker->table = sqlite_strdup(table);
+    worker->text_column = sqlite_strdup(text_column);
+    worker->vec_column = sqlite_strdup(vec_column);
+    worker->options = (options) ? sqlite_strdup(options) : NULL;
+    if (!worker->table || !worker->text_column || !worker->vec_column || (options && !worker->options)) {
+        ai_embed_column_worker_free(worker);
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    sqlite3_randomness(sizeof(worker->claim_id), &worker->claim_id);
+    worker->claim_id &= LLONG_MAX;
+    
+    worker->ai = llm_worker_open(context, ai, filename, 1, &worker->db);
+    if (!worker->ai) {
+        ai_embed_column_worker_free(worker);
+        return;
+    }
+    if (pthread_create(&worker->thread, NULL, ai_embed_column_run, worker) != 0) {
+        ai_embed_column_worker_free(worker);
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to start the worker of %s.%s", table, vec_column);
+        return;
+    }
+    worker->started = true;
+    worker->next = ai->embed_columns;
+    ai->embed_columns = worker;
+    
+    sqlite3_result_int(context, queued);
+}
+
+// MARK: - LLM Model -
+
+static void llm_model_get_setting (sqlite3_context *context, int argc, sqlite3_value **argv, ai_model_setting setting) {
+    // sanity check model
+    if (ai_model_check(context, true, false) == false) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No model is currently set. Please call llm_model_load() before using this function.");
+        return;
+    }
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    uint64_t n = 0;
+    
+    switch (setting) {
+        case AI_MODEL_SETTING_N_PARAMS: n = llama_model_n_params(ai->model); break;
+        case AI_MODEL_SIZE: n = llama_model_size(ai->model); break;
+        case AI_MODEL_N_CTX_TRAIN: n = llama_model_n_ctx_train(ai->model); break;
+        case AI_MODEL_N_EMBED: n = llama_model_n_embd(ai->model); break;
+        case AI_MODEL_N_LAYER: n = llama_model_n_layer(ai->model); break;
+        case AI_MODEL_N_HEAD: n = llama_model_n_head(ai->model); break;
+        case AI_MODEL_N_HEAD_KV: n = llama_model_n_head_kv(ai->model); break;
+        case AI_MODEL_N_SWA: n = llama_model_n_swa(ai->model); break;
+        case AI_MODEL_N_CLS_OUT: n = llama_model_n_cls_out(ai->model); break;
+        case AI_MODEL_HAS_ENCODER: n = llama_model_has_encoder(ai->model); break;
+        case AI_MODEL_HAS_DECODER: n = llama_model_has_decoder(ai->model); break;
+        case AI_MODEL_IS_RECURRENT: n = llama_model_is_recurrent(ai->model); break;
+            
+        case AI_MODEL_CHAT_TEMPLATE: {
+            const char *template = llama_model_chat_template(ai->model, NULL);
+            sqlite3_result_text(context, template, -1, SQLITE_STATIC);
+            return;
+        }
+            
+        case AI_MODEL_FREQ_SCALE_TRAIN: {
+            float n = llama_model_rope_freq_scale_train(ai->model);
+            sqlite3_result_double(context, n);
+            return;
+        }
+            
+    }
+    sqlite3_result_int64(context, (sqlite3_int64)n);
+}
+
+static void llm_model_n_params (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns the total number of parameters in the model
+    llm_model_get_setting(context, argc, argv, AI_MODEL_SETTING_N_PARAMS);
+}
+
+static void llm_model_size (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns the total size of all the tensors in the model in bytes
+    llm_model_get_setting(context, argc, argv, AI_MODEL_SIZE);
+}
+
+static void llm_model_n_ctx_train (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    llm_model_get_setting(context, argc, argv, AI_MODEL_N_CTX_TRAIN);
+}
+
+static void llm_model_n_embd (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    llm_model_get_setting(context, argc, argv, AI_MODEL_N_EMBED);
+}
+
+static void llm_model_n_layer (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns the total size of all the tensors in the model in bytes
+    llm_model_get_setting(context, argc, argv, AI_MODEL_N_LAYER);
+}
+
+static void llm_model_n_head (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns the total size of all the tensors in the model in bytes
+    llm_model_get_setting(context, argc, argv, AI_MODEL_N_HEAD);
+}
+
+static void llm_model_n_head_kv (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns the total size of all the tensors in the model in bytes
+    llm_model_get_setting(context, argc, argv, AI_MODEL_N_HEAD_KV);
+}
+
+static void llm_model_n_swa (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns the total size of all the tensors in the model in bytes
+    llm_model_get_setting(context, argc, argv, AI_MODEL_N_SWA);
+}
+
+static void llm_model_rope_freq_scale_train (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Get the model's RoPE frequency scaling factor
+    llm_model_get_setting(context, argc, argv, AI_MODEL_FREQ_SCALE_TRAIN);
+}
+
+static void llm_model_n_cls_out (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns the number of classifier outputs (only valid for classifier models)
+    // Undefined behavior for non-classifier models
+    llm_model_get_setting(context, argc, argv, AI_MODEL_N_CLS_OUT);
+}
+
+static void llm_model_cls_label (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns label of classifier output by index (<n_cls_out). Returns nullptr if no label provided
+    
+    int types[] = {SQLITE_INTEGER};
+    if (sqlite_sanity_function(context, "llm_model_cls_label", argc, argv, 1, types, true, false) == false) return;
+    
+    int i = sqlite3_value_int(argv[0]);
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    const char *label = llama_model_cls_label(ai->model, i);
+
+    if (label) sqlite3_result_text(context, label, -1, SQLITE_STATIC);
+    else sqlite3_result_null(context);
+}
+
+static void llm_model_desc (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Get a string describing the model type
+    
+    if (ai_model_check(context, true, false) == false) {
+        sqlite_context_result_error(context, SQLITE_MISUSE, "No model is currently set. Please call llm_model_load() before using this function.");
+        return;
+    }
+    
+    char buffer[4096];
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    int32_t n = llama_model_desc(ai->model, buffer, sizeof(buffer));
+    (n > 0) ? sqlite3_result_text(context, buffer, n, SQLITE_TRANSIENT) : sqlite3_result_null(context);
+}
+
+static void llm_model_has_encoder (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns true if the model contains an encoder that requires llama_encode() call
+    llm_model_get_setting(context, argc, argv, AI_MODEL_HAS_ENCODER);
+}
+
+static void llm_model_has_decoder (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns true if the model contains a decoder that requires llama_decode() call
+    llm_model_get_setting(context, argc, argv, AI_MODEL_HAS_DECODER);
+}
+
+static void llm_model_is_recurrent (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Returns true if the model is recurrent (like Mamba, RWKV, etc.)
+    llm_model_get_setting(context, argc, argv, AI_MODEL_IS_RECURRENT);
+}
+
+static void llm_model_chat_template (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // Get the default chat template. Returns nullptr if not available
+    // If name is NULL, returns the default chat template
+    llm_model_get_setting(context, argc, argv, AI_MODEL_CHAT_TEMPLATE);
+}
+
+// MARK: - Vision -
+
+#define OPTION_KEY_VISION_USE_GPU           "use_gpu"
+#define OPTION_KEY_VISION_N_THREADS         "n_threads"
+#define OPTION_KEY_VISION_WARMUP            "warmup"
+#define OPTION_KEY_VISION_IMAGE_MIN_TOKENS  "image_min_tokens"
+#define OPTION_KEY_VISION_IMAGE_MAX_TOKENS  "image_max_tokens"
+
+static bool llm_vision_options_callback (void *ctx, void *xdata, const char *key, int key_len, const char *value, int value_len) {
+    struct mtmd_context_params *params = (struct mtmd_context_params *)xdata;
+    char buffer[256];
+    int len = (value_len < (int)sizeof(buffer) - 1) ? value_len : (int)sizeof(buffer) - 1;
+    memcpy(buffer, value, len);
+    buffer[len] = '\0';
+
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_USE_GPU)) params->use_gpu = (atoi(value) != 0);
+    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_N_THREADS)) params->n_threads = atoi(value);
+    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_WARMUP)) params->warmup = (atoi(value) != 0);
+    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_IMAGE_MIN_TOKENS)) params->image_min_tokens = atoi(value);
+    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_IMAGE_MAX_TOKENS)) params->image_max_tokens = atoi(value);
+    else if (KEY_MATCHES(key, key_len, OPTION_KEY_FLASH_ATTN_TYPE)) {
+        if (strcasecmp(buffer, "auto") == 0) params->flash_attn_type = LLAMA_FLASH_ATTN_TYPE_AUTO;
+        else if (strcasecmp(buffer, "disabled") == 0) params->flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        else if (strcasecmp(buffer, "enabled") == 0) params->flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+    return true;
+}
+
+static void llm_vision_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (llm_common_args_check(context, "llm_vision_load", argc, argv, false) == false) return;
+
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (!ai->model) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded. Call llm_model_load() before llm_vision_load().");
+        return;
+    }
+
+    const char *path = (const char *)sqlite3_value_text(argv[0]);
+    const char *options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+
+    struct mtmd_context_params params = mtmd_context_params_default();
+    params.use_gpu = true;
+    params.n_threads = 4;
+    params.warmup = true;
+
+    if (parse_keyvalue_string(ai, options, llm_vision_options_callback, &params) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
+        return;
+    }
+
+    if (ai->vision) {
+        mtmd_free(ai->vision);
+        ai->vision = NULL;
+    }
+
+    ai->vision = mtmd_init_from_file(path, ai->model, params);
+    if (!ai->vision) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to load vision model from: %s", path);
+        return;
+    }
+}
+
+static void llm_vision_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    if (ai->vision) {
+        mtmd_free(ai->vision);
+        ai->vision = NULL;
+    }
+}
+
+// Helper: load bitmaps from sqlite3_value args (TEXT = file path, BLOB = raw data)
+static mtmd_bitmap **llm_vision_load_bitmaps (ai_context *ai, sqlite3_context *context,
+                                               sqlite3_value **images, int n_images) {
+    mtmd_bitmap **bitmaps = (mtmd_bitmap **)sqlite3_malloc64(sizeof(mtmd_bitmap *) * n_images);
+    if (!bitmaps) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+        return NULL;
+    }
+    memset(bitmaps, 0, sizeof(mtmd_bitmap *) * n_images);
+
+    for (int i = 0; i < n_images; i++) {
+        int type = sqlite3_value_type(images[i]);
+        if (type == SQLITE_TEXT) {
+            const char *path = (const char *)sqlite3_value_text(images[i]);
+            bitmaps[i] = mtmd_helper_bitmap_init_from_file(ai->vision, path);
+        } else if (type == SQLITE_BLOB) {
+            const void *data = sqlite3_value_blob(images[i]);
+            int len = sqlite3_value_bytes(images[i]);
+            bitmaps[i] = mtmd_helper_bitmap_init_from_buf(ai->vision, (const unsigned char *)data, len);
+        }
+        if (!bitmaps[i]) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to load image (argument %d)", i + 2);
+            for (int j = 0; j < i; j++) mtmd_bitmap_free(bitmaps[j]);
+            sqlite3_free(bitmaps);
+            return NULL;
+        }
+    }
+    return bitmaps;
+}
+
+// Helper: build prompt text with <__media__> markers prepended for each image
+static char *llm_vision_build_prompt (const char *text, int32_t text_len, int n_images, int32_t *out_len) {
+    const char *marker = mtmd_default_marker();
+    size_t marker_len = strlen(marker);
+    size_t total = text_len + (marker_len + 1) * n_images + 1;
+    char *prompt = (char *)sqlite3_malloc64(total);
+    if (!prompt) return NULL;
+
+    char *p = prompt;
+    for (int i = 0; i < n_images; i++) {
+        memcpy(p, marker, marker_len);
+        p += marker_len;
+        *p++ = '\n';
+    }
+    memcpy(p, text, text_len);
+    p += text_len;
+    *p = '\0';
+    *out_len = (int32_t)(p - prompt);
+    return prompt;
+}
+
+static void llm_text_run_vision (sqlite3_context *context, const char *text, int32_t text_len,
+                                  sqlite3_value **images, int n_images) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    buffer_t buffer = {0};
+    bool buffer_initialized = false;
+    char *prompt_with_markers = NULL;
+    char *formatted_prompt = NULL;
+    mtmd_bitmap **bitmaps = NULL;
+    mtmd_input_chunks *chunks = NULL;
+
+    struct llama_context *ctx = ai->ctx;
+    if (!ctx) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "No context found. Please call llm_context_create() before using this function.");
+        return;
+    }
+
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
+        return;
+    }
+
+    // clear KV cache (sequence 0 only, chat sessions keep their own sequences)
+    llama_memory_t memory = llama_get_memory(ctx);
+    if (memory) llama_memory_seq_rm(memory, 0, -1, -1);
+    llm_text_cache_reset(ai);
+
+    // build prompt with media markers
+    int32_t prompt_total_len;
+    prompt_with_markers = llm_vision_build_prompt(text, text_len, n_images, &prompt_total_len);
+    if (!prompt_with_markers) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+        return;
+    }
+
+    // wrap with chat template if available
+    const char *final_text = prompt_with_markers;
+    const char *chat_template = llama_model_chat_template(ai->model, NULL);
+    if (chat_template) {
+        llama_chat_message messages[] = {{ ROLE_USER, prompt_with_markers }};
+        int32_t formatted_len = llama_chat_apply_template(chat_template, messages, 1, true, NULL, 0);
+        if (formatted_len > 0) {
+            formatted_prompt = (char *)sqlite3_malloc64(formatted_len + 1);
+            if (formatted_prompt) {
+                llama_chat_apply_template(chat_template, messages, 1, true, formatted_prompt, formatted_len + 1);
+                formatted_prompt[formatted_len] = '\0';
+                final_text = formatted_prompt;
+            }
+        }
+    }
+
+    // load bitmaps
+    bitmaps = llm_vision_load_bitmaps(ai, context, images, n_images);
+    if (!bitmaps) goto error;
+
+    // tokenize with mtmd
+    chunks = mtmd_input_chunks_init();
+    if (!chunks) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+        goto error;
+    }
+
+    mtmd_input_text input_text = { final_text, true, true };
+    int32_t rc = mtmd_tokenize(ai->vision, chunks, &input_text, (const mtmd_bitmap **)bitmaps, n_images);
+    if (rc != 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to tokenize multimodal input (error %d)", rc);
+        goto error;
+    }
+
+    // eval chunks (vision encoder + text)
+    {
+        llama_pos n_past = 0;
+        int n_batch = (int)llama_n_batch(ctx);
+        rc = mtmd_helper_eval_chunks(ai->vision, ctx, chunks, n_past, 0, n_batch, true, &n_past);
+        if (rc != 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to evaluate multimodal prompt (error %d)", rc);
+            goto error;
+        }
+    }
+
+    // initialize sampler
+    bool sampler_already_setup = (ai->sampler != NULL);
+    struct llama_sampler *sampler = llm_sampler_check(ai);
+    if (!sampler) goto error;
+    if (!sampler_already_setup) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_penalties(64, 1.1, 0, 0));
+        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+    }
+
+    // allocate output buffer
+    if (!buffer_create(&buffer, 0)) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+        goto error_sampler;
+    }
+    buffer_initialized = true;
+
+    // generate tokens
+    {
+        int n_predict = (ai->options.n_predict > 0) ? ai->options.n_predict : 4096;
+        for (int i = 0; i < n_predict; i++) {
+            llama_token new_token_id = llama_sampler_sample(sampler, ctx, -1);
+            if (llama_vocab_is_eog(vocab, new_token_id)) break;
+
+            char buf[MAX_TOKEN_TEXT_LEN];
+            int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
+            if (n < 0) {
+                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert token to piece");
+                goto error_sampler;
+            }
+
+            if (!buffer_append(&buffer, buf, n, true)) {
+                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+                goto error_sampler;
+            }
+
+            struct llama_batch batch = llama_batch_get_one(&new_token_id, 1);
+            if (llama_decode(ctx, batch)) {
+                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to decode during generation");
+                goto error_sampler;
+            }
+        }
+    }
+
+    // success
+    sqlite3_result_text(context, buffer.data, buffer.length, sqlite3_free);
+    for (int i = 0; i < n_images; i++) mtmd_bitmap_free(bitmaps[i]);
+    sqlite3_free(bitmaps);
+    mtmd_input_chunks_free(chunks);
+    sqlite3_free(prompt_with_markers);
+    sqlite3_free(formatted_prompt);
+    if (!sampler_already_setup) llama_sampler_free(sampler);
+    return;
+
+error_sampler:
+    if (!sampler_already_setup && ai->sampler) {
+        llama_sampler_free(ai->sampler);
+        ai->sampler = NULL;
+    }
+error:
+    if (buffer_initialized) buffer_destroy(&buffer);
+    if (bitmaps) {
+        for (int i = 0; i < n_images; i++) if (bitmaps[i]) mtmd_bitmap_free(bitmaps[i]);
+        sqlite3_free(bitmaps);
+    }
+    if (chunks) mtmd_input_chunks_free(chunks);
+    sqlite3_free(prompt_with_markers);
+    sqlite3_free(formatted_prompt);
+}
+
+// Vision-aware chat: non-streaming only
+static void llm_chat_respond_vision (sqlite3_context *context, ai_context *ai,
+                                      const char *user_prompt,
+                                      sqlite3_value **images, int n_images) {
+    mtmd_bitmap **bitmaps = NULL;
+    mtmd_input_chunks *chunks = NULL;
+    char *prompt_with_markers = NULL;
+
+    const char *template = llama_model_chat_template(ai->model, NULL);
+    if (!template) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Template not available");
+        return;
+    }
+
+    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
+    if (!vocab) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Model vocab not available");
+        return;
+    }
+
+    ai->chat.vocab = vocab;
+    ai->chat.template = template;
+    ai_messages *messages = &ai->chat.messages;
+    buffer_t *formatted = &ai->chat.formatted;
+
+    // build user prompt with markers
+    int32_t prompt_total_len;
+    prompt_with_markers = llm_vision_build_prompt(user_prompt, (int32_t)strlen(user_prompt), n_images, &prompt_total_len);
+    if (!prompt_with_markers) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+        return;
+    }
+
+    // append to message history (with markers in the text)
+    if (!llm_messages_append(messages, ROLE_USER, prompt_with_markers)) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to append message");
+        goto error;
+    }
+
+    // skip empty system message if present
+    size_t messages_count = messages->count;
+    const llama_chat_message *messages_items = messages->items;
+    if (messages->count > 0) {
+        const llama_chat_message first = messages->items[0];
+        if (first.role == ROLE_SYSTEM && first.content[0] == '\0') {
+            messages_items = messages->items + 1;
+            messages_count = messages->count - 1;
+        }
+    }
+
+    // apply chat template
+    int32_t new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
+    if (new_len > formatted->capacity) {
+        if (!buffer_resize(formatted, new_len * 2)) goto error;
+        new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
+    }
+    if (new_len < 0 || new_len > formatted->capacity) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to apply chat template");
+        goto error;
+    }
+
+    // extract new prompt text
+    {
+        int32_t prompt_len = new_len - ai->chat.prev_len;
+        if (prompt_len <= 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Invalid prompt length");
+            goto error;
+        }
+        int32_t current_len = (int32_t)sqlite3_msize(ai->chat.prompt);
+        if (current_len < prompt_len + 1) {
+            char *buf = (char *)sqlite3_malloc64(prompt_len + MIN_ALLOC_PROMPT);
+            if (!buf) {
+                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+                goto error;
+            }
+            if (ai->chat.prompt) sqlite3_free(ai->chat.prompt);
+            ai->chat.prompt = buf;
+        }
+        memcpy(ai->chat.prompt, formatted->data + ai->chat.prev_len, prompt_len);
+        ai->chat.prompt[prompt_len] = 0;
+    }
+
+    // load bitmaps
+    bitmaps = llm_vision_load_bitmaps(ai, context, images, n_images);
+    if (!bitmaps) goto error;
+
+    // tokenize the new prompt with mtmd
+    chunks = mtmd_input_chunks_init();
+    if (!chunks) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+        goto error;
+    }
+
+    {
+        struct llama_context *ctx = ai->ctx;
+        bool is_first = (llama_memory_seq_pos_max(llama_get_memory(ctx), 0) == -1);
+        llm_text_cache_reset(ai);
+
+        mtmd_input_text input_text = { ai->chat.prompt, is_first, true };
+        int32_t rc = mtmd_tokenize(ai->vision, chunks, &input_text, (const mtmd_bitmap **)bitmaps, n_images);
+        if (rc != 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to tokenize multimodal input (error %d)", rc);
+            goto error;
+        }
+
+        llama_pos n_past = is_first ? 0 : llama_memory_seq_pos_max(llama_get_memory(ctx), 0) + 1;
+        int n_batch = (int)llama_n_batch(ctx);
+        rc = mtmd_helper_eval_chunks(ai->vision, ctx, chunks, n_past, 0, n_batch, true, &n_past);
+        if (rc != 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to evaluate multimodal prompt (error %d)", rc);
+            goto error;
+        }
+
+        // sample tokens
+        struct llama_sampler *sampler = ai->sampler;
+        if (!sampler) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Sampler not initialized");
+            goto error;
+        }
+
+        bool is_eog = false;
+        while (!is_eog) {
+            llama_token token_id = llama_sampler_sample(sampler, ctx, -1);
+            if (llama_vocab_is_eog(vocab, token_id)) break;
+
+            char tok[MAX_TOKEN_TEXT_LEN];
+            int32_t n = llama_token_to_piece(vocab, token_id, tok, MAX_TOKEN_TEXT_LEN, 0, true);
+            if (n < 0) {
+                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert token to string");
+                goto error;
+            }
+
+            if (!buffer_append(&ai->chat.response, tok, n, true)) {
+                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to grow response buffer");
+                goto error;
+            }
+
+            struct llama_batch batch = llama_batch_get_one(&token_id, 1);
+            if (llama_decode(ctx, batch)) {
+                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to decode during generation");
+                goto error;
+            }
+        }
+    }
+
+    // save response
+    if (!llm_chat_save_response(ai, messages, template)) goto error;
+
+    // return full response
+    sqlite3_result_text(context, ai->chat.response.data, -1, SQLITE_TRANSIENT);
+
+    // cleanup
+    for (int i = 0; i < n_images; i++) mtmd_bitmap_free(bitmaps[i]);
+    sqlite3_free(bitmaps);
+    mtmd_input_chunks_free(chunks);
+    sqlite3_free(prompt_with_markers);
+    return;
+
+error:
+    if (bitmaps) {
+        for (int i = 0; i < n_images; i++) if (bitmaps[i]) mtmd_bitmap_free(bitmaps[i]);
+        sqlite3_free(bitmaps);
+    }
+    if (chunks) mtmd_input_chunks_free(chunks);
+    sqlite3_free(prompt_with_markers);
+}
+
+// MARK: - Audio -
+
+static bool audio_process_check_arguments (sqlite3_context *context, const char *function_name, int argc, sqlite3_value **argv, bool check_audio_model) {
+    // sanity check arguments
+    if (argc == 1) {
+        int type = sqlite3_value_type(argv[0]);
+        if (type != SQLITE_TEXT && type != SQLITE_BLOB) {
+            return sqlite_context_result_error(context, SQLITE_ERROR, "Function '%s' expects the first argument to be TEXT or BLOB.", function_name);
+        }
+        
+        int types[] = {type};
+        return sqlite_sanity_function(context, function_name, argc, argv, 1, types, false, check_audio_model);
+    } else if (argc == 2) {
+        int type = sqlite3_value_type(argv[0]);
+        if (type != SQLITE_TEXT && type != SQLITE_BLOB) {
+            return sqlite_context_result_error(context, SQLITE_ERROR, "Function '%s' expects the first argument to be TEXT or BLOB.", function_name);
+        }
+        
+        int types[] = {type, SQLITE_TEXT};
+        return sqlite_sanity_function(context, function_name, argc, argv, 2, types, false, check_audio_model);
+    }
+    
+    return sqlite_context_result_error(context, SQLITE_ERROR, "Function '%s' expects 1 or 2 arguments, but %d were provided.", function_name, argc);
+}
+
+// detect audio format from file extension
+static int audio_detect_format_from_path (const char *path) {
+    if (!path) return 0;
+    const char *dot = strrchr(path, '.');
+    if (!dot) return 0;
+    if (strcasecmp(dot, ".wav") == 0) return 1;
+    if (strcasecmp(dot, ".mp3") == 0) return 2;
+    if (strcasecmp(dot, ".flac") == 0) return 3;
+    return 0;
+}
+
+// detect audio format from blob header (magic bytes)
+static int audio_detect_format_from_blob (const void *data, size_t size) {
+    if (!data || size < 4) return 0;
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    // WAV: starts with "RIFF"
+    if (bytes[0] == 'R' && bytes[1] == 'I' && bytes[2] == 'F' && bytes[3] == 'F') return 1;
+
+    // MP3: starts with ID3 tag or MPEG sync word
+    if (bytes[0] == 'I' && bytes[1] == 'D' && bytes[2] == '3') return 2;
+    if (bytes[0] == 0xFF && (bytes[1] & 0xE0) == 0xE0) return 2;
+
+    // FLAC: starts with "fLaC"
+    if (bytes[0] == 'f' && bytes[1] == 'L' && bytes[2] == 'a' && bytes[3] == 'C') return 3;
+
+    return 0;
+}
+
+// convert multi-channel audio to mono by averaging channels, then resample to target_rate
+static float *audio_convert_to_mono_16khz (const float *src, uint64_t num_samples, uint32_t sample_rate, uint32_t channels, int *out_samples) {
+    // step 1: downmix to mono
+    uint64_t mono_count = num_samples; // num_samples is per-channel frame count
+    float *mono = NULL;
+
+    if (channels == 1) {
+        // already mono — just reference (we'll copy during resampling)
+        mono = (float *)src;
+    } else {
+        mono = (float *)sqlite3_malloc64(mono_count * sizeof(float));
+        if (!mono) return NULL;
+        for (uint64_t i = 0; i < mono_count; i++) {
+            float sum = 0.0f;
+            for (uint32_t c = 0; c < channels; c++) {
+                sum += src[i * channels + c];
+            }
+            mono[i] = sum / channels;
+        }
+    }
+
+    // step 2: resample to WHISPER_SAMPLE_RATE (16000 Hz) if needed
+    if (sample_rate == WHISPER_SAMPLE_RATE) {
+        if (mono == src) {
+            // need to copy so caller can free
+            float *copy = (float *)sqlite3_malloc64(mono_count * sizeof(float));
+            if (!copy) return NULL;
+            memcpy(copy, src, mono_count * sizeof(float));
+            mono = copy;
+        }
+        *out_samples = (int)mono_count;
+        return mono;
+    }
+
+    // linear interpolation resampling
+    double ratio = (double)WHISPER_SAMPLE_RATE / (double)sample_rate;
+    int64_t out_count = (int64_t)(mono_count * ratio) + 1;
+    float *resampled = (float *)sqlite3_malloc64(out_count * sizeof(float));
+    if (!resampled) {
+        if (mono != src) sqlite3_free(mono);
+        return NULL;
+    }
+
+    for (int64_t i = 0; i < out_count; i++) {
+        double src_idx = i / ratio;
+        int64_t idx0 = (int64_t)src_idx;
+        double frac = src_idx - idx0;
+        if (idx0 >= (int64_t)mono_count - 1) {
+            resampled[i] = mono[mono_count - 1];
+        } else {
+            resampled[i] = (float)(mono[idx0] * (1.0 - frac) + mono[idx0 + 1] * frac);
+        }
+    }
+
+    if (mono != src) sqlite3_free(mono);
+    *out_samples = (int)out_count;
+    return resampled;
+}
+
+static void audio_model_transcribe (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (audio_process_check_arguments(context, "audio_model_transcribe", argc, argv, true) == false) return;
+
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    float *pcm_buffer = NULL;
+    uint64_t num_samples = 0;
+    uint32_t sample_rate = 0;
+    uint32_t channels = 0;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_TEXT) {
+        const char *path = (const char *)sqlite3_value_text(argv[0]);
+        int format = audio_detect_format_from_path(path);
+        switch (format) {
+            case 1: pcm_buffer = audio_wav_file2pcm(path, &num_samples, &sample_rate, &channels); break;
+            case 2: pcm_buffer = audio_mp3_file2pcm(path, &num_samples, &sample_rate, &channels); break;
+            case 3: pcm_buffer = audio_flac_file2pcm(path, &num_samples, &sample_rate, &channels); break;
+            default:
+                sqlite_context_result_error(context, SQLITE_ERROR, "Unsupported audio format for file '%s'. Supported: .wav, .mp3, .flac", path);
+                return;
+        }
+        if (!pcm_buffer) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Unable to decode audio file '%s'", path);
+            return;
+        }
+    } else {
+        const void *data = sqlite3_value_blob(argv[0]);
+        size_t data_size = (size_t)sqlite3_value_bytes(argv[0]);
+        int format = audio_detect_format_from_blob(data, data_size);
+        switch (format) {
+            case 1: pcm_buffer = audio_wav_mem2pcm(data, data_size, &num_samples, &sample_rate, &channels); break;
+            case 2: pcm_buffer = audio_mp3_mem2pcm(data, data_size, &num_samples, &sample_rate, &channels); break;
+            case 3: pcm_buffer = audio_flac_mem2pcm(data, data_size, &num_samples, &sample_rate, &channels); break;
+            default:
+                sqlite_context_result_error(context, SQLITE_ERROR, "Unsupported audio format in BLOB. Supported: WAV, MP3, FLAC");
+                return;
+        }
+        if (!pcm_buffer) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Unable to decode audio BLOB");
+            return;
+        }
+    }
+
+    // convert to mono 16kHz as required by whisper
+    int whisper_samples = 0;
+    float *whisper_pcm = audio_convert_to_mono_16khz(pcm_buffer, num_samples, sample_rate, channels, &whisper_samples);
+    sqlite3_free(pcm_buffer); // allocated via miniaudio's sqlite3_malloc wrapper
+
+    if (!whisper_pcm || whisper_samples <= 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert audio to mono 16kHz PCM");
+        return;
+    }
+
+    // parse transcription options
+    struct whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    params.print_special = false;
+    params.print_progress = false;
+    params.print_realtime = false;
+    params.print_timestamps = false;
+
+    // save default pointers so we can tell which ones we allocated
+    const char *default_language = params.language;
+    const char *default_initial_prompt = params.initial_prompt;
+    const char *default_suppress_regex = params.suppress_regex;
+
+    const char *options = (argc >= 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+    if (parse_keyvalue_string(ai, options, whisper_full_params_options_callback, &params) == false) {
+        sqlite3_free(whisper_pcm);
+        if (params.language != default_language) sqlite3_free((void *)params.language);
+        if (params.initial_prompt != default_initial_prompt) sqlite3_free((void *)params.initial_prompt);
+        if (params.suppress_regex != default_suppress_regex) sqlite3_free((void *)params.suppress_regex);
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
+        return;
+    }
+
+    // run whisper inference
+    int rc = whisper_full(ai->whisper, params, whisper_pcm, whisper_samples);
+    sqlite3_free(whisper_pcm);
+
+    // free allocated option strings (only those we allocated via sqlite_strdup)
+    if (params.language != default_language) sqlite3_free((void *)params.language);
+    if (params.initial_prompt != default_initial_prompt) sqlite3_free((void *)params.initial_prompt);
+    if (params.suppress_regex != default_suppress_regex) sqlite3_free((void *)params.suppress_regex);
+
+    if (rc != 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Whisper transcription failed (error code %d)", rc);
+        return;
+    }
+
+    // collect all segments into a single result
+    int n_segments = whisper_full_n_segments(ai->whisper);
+    if (n_segments == 0) {
+        sqlite3_result_text(context, "", 0, SQLITE_STATIC);
+        return;
+    }
+
+    if (n_segments == 1) {
+        const char *text = whisper_full_get_segment_text(ai->whisper, 0);
+        sqlite3_result_text(context, text, -1, SQLITE_TRANSIENT);
+        return;
+    }
+
+    // multiple segments — concatenate
+    buffer_t result = {0};
+    if (!buffer_create(&result, 4096)) {
+        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
+        return;
+    }
+
+    for (int i = 0; i < n_segments; i++) {
+        const char *seg_text = whisper_full_get_segment_text(ai->whisper, i);
+        if (seg_text) {
+            buffer_append(&result, seg_text, (uint32_t)strlen(seg_text), false);
+        }
+    }
+
+    sqlite3_result_text(context, result.data, result.length, sqlite3_free);
+}
+
+static void audio_model_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // sanity check arguments
+    if (llm_common_args_check(context, "audio_model_load", argc, argv, false) == false) return;
+    
+    const char *model_path = (const char *)sqlite3_value_text(argv[0]);
+    const char *model_options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+    
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    struct whisper_context_params ctx_params = whisper_context_default_params();
+    if (parse_keyvalue_string(ai, model_options, whisper_model_options_callback, &ctx_params) == false) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", model_options);
+        return;
+    }
+    
+    struct whisper_context *whisper = whisper_init_from_file_with_params(model_path, ctx_params);
+    if (!whisper) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to load audio model from file %s", model_path);
+        return;
+    }
+    
+    ai_cleanup((void *)ai, false, true);
+    ai->whisper = whisper;
+}
+
+static void audio_model_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    ai_context *ai = (ai_context *)sqlite3_user_data(context);
+    ai_cleanup((void *)ai, false, true);
+}
+
+// MARK: - Vector Distance -
+
+static vector_metric vector_name_to_metric (const char *name) {
+    if (strcasecmp(name, "cosine") == 0) return VECTOR_METRIC_COSINE;
+    if (strcasecmp(name, "dot") == 0) return VECTOR_METRIC_DOT;
+    if (strcasecmp(name, "l2") == 0) return VECTOR_METRIC_L2;
+    return 0;
+}
+
+// number of elements of two vectors of the given type, 0 if they are not compatible: vectors of different size are
+// scored asymmetrically when the larger one is a FLOAT32 vector with the same number of elements
+static int vector_resolve_dimension (int a_bytes, int b_bytes, vector_type type, vector_type *ta, vector_type *tb) {
+    int type_size = (int)vector_type_size(type);
+    *ta = *tb = type;
+    if (a_bytes <= 0 || b_bytes <= 0) return 0;
+    
+    if (a_bytes == b_bytes) {
+        return (b_bytes % type_size == 0) ? b_bytes / type_size : 0;
+    }
+    if (b_bytes % type_size == 0 && a_bytes == b_bytes / type_size * (int)sizeof(float)) {
+        *ta = VECTOR_TYPE_F32;
+        return b_bytes / type_size;
+    }
+    if (a_bytes % type_size == 0 && b_bytes == a_bytes / type_size * (int)sizeof(float)) {
+        *tb = VECTOR_TYPE_F32;
+        return a_bytes / type_size;
+    }
+    return 0;
+}
+
+static void ai_vector_distance (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // NULL vectors have no distance
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    int types[] = {SQLITE_BLOB, SQLITE_BLOB, SQLITE_TEXT, SQLITE_TEXT};
+    if (sqlite_sanity_function(context, "ai_vector_distance", argc, argv, argc, types, false, false) == false) return;
+    
+    vector_metric metric = VECTOR_METRIC_COSINE;
+    if (argc >= 3) {
+        const char *name = (const char *)sqlite3_value_text(argv[2]);
+        metric = vector_name_to_metric(name);
+        if (metric == 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Invalid distance '%s' (expected cosine, dot or l2)", name);
+            return;
+        }
+    }
+    
+    vector_type type = VECTOR_TYPE_F32;
+    if (argc == 4) {
+        const char *name = (const char *)sqlite3_value_text(argv[3]);
+        type = (vector_type)embedding_name_to_type(name);
+        if (type == 0) {
+            sqlite_context_result_error(context, SQLITE_ERROR, "Invalid vector type '%s'", name);
+            return;
+        }
+    }
+    
+    const void *a = sqlite3_value_blob(argv[0]);
+    const void *b = sqlite3_value_blob(argv[1]);
+    int a_bytes = sqlite3_value_bytes(argv[0]);
+    int b_bytes = sqlite3_value_bytes(argv[1]);
+    vector_type ta, tb;
+    int n = vector_resolve_dimension(a_bytes, b_bytes, type, &ta, &tb);
+    
+    if (n == 0) {
+        sqlite_context_result_error(context, SQLITE_ERROR, "Vectors of %d and %d bytes are not compatible with type %s", a_bytes, b_bytes, embedding_type_to_name((embedding_type)type));
+        return;
+    }
+    
+    sqlite3_result_double(context, (double)vector_distance(a, ta, b, tb, n, metric));
+}
+
+// MARK: - Vector Top-K Virtual Table -
+
+// exact k-nearest neighbors: the calling thread streams the vectors with incremental blob I/O (a connection
+// can't be shared across threads) into batches that the worker threads score, each one into its own bounded heap
+
+#define AI_TOPK_COLUMN_ID                       0
+#define AI_TOPK_COLUMN_DISTANCE                 1
+#define AI_TOPK_COLUMN_TABLE                    2
+#define AI_TOPK_COLUMN_COLUMN                   3
+#define AI_TOPK_COLUMN_QUERY                    4
+#define AI_TOPK_COLUMN_K                        5
+#define AI_TOPK_COLUMN_OPTIONS                  6
+
+#define AI_TOPK_BATCH_SIZE                      4096
+#define AI_TOPK_MAX_THREADS                     64
+#define AI_TOPK_MAX_K                           100000
+
+#define OPTION_KEY_DISTANCE                     "distance"
+#define OPTION_KEY_THREADS                      "threads"
+#define OPTION_KEY_SCHEMA                       "schema"
+
+typedef struct {
+    sqlite3_int64               rowid;
+    float                       distance;
+} ai_topk_item;
+
+// bounded max-heap, the root is the farthest of the k nearest vectors seen so far
+// with limit > 0 the items are allocated on demand (up to limit), otherwise capacity items are preallocated
+typedef struct {
+    ai_topk_item                *items;
+    int                         count;
+    int                         capacity;
+    int                         limit;
+    bool                        failed;             // the items could not be grown (out of memory)
+} ai_topk_heap;
+
+typedef struct {
+    vector_metric               metric;
+    vector_type                 type;
+    int                         threads;
+    char                        schema[128];
+} ai_topk_options;
+
+typedef struct ai_topk_scan ai_topk_scan;
+
+typedef struct {
+    ai_topk_pool                *pool;
+    pthread_t                   thread;
+    int                         index;
+} ai_topk_thread;
+
+// threads of the connection that score the batches of ai_vector_topk: started by the first multi-threaded scan,
+// they wait for the next batch (of this scan or of a later one) until the connection is closed
+struct ai_topk_pool {
+    pthread_mutex_t             mutex;
+    pthread_cond_t              start;
+    pthread_cond_t              done;
+    uint64_t                    generation;
+    int                         pending;
+    bool                        quit;
+    bool                        in_use;
+    ai_topk_scan                *scan;              // scan whose current batch is scored
+    
+    ai_topk_thread              *threads;
+    int                         nthreads;           // started threads
+};
+
+struct ai_topk_scan {
+    const void                  *query;
+    vector_type                 query_type;
+    vector_type                 type;
+    vector_metric               metric;
+    int                         dimension;
+    int                         row_bytes;
+    
+    // double buffered batches: one is filled by the calling thread while the workers score the other
+    uint8_t                     *data[2];
+    sqlite3_int64               *rowids[2];
+    int                         count[2];
+    int                         current;
+    
+    ai_topk_pool                *pool;              // NULL when the batches are scored inline
+    ai_topk_heap                *heaps;             // one for each worker
+    int                         nworkers;
+};
+
+typedef struct {
+    sqlite3_vtab                base;               // Base class - must be first
+    ai_context                  *ai;
+    char                        *schema;
+} ai_topk_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor         base;               // Base class - must be first
+    ai_topk_vtab                *vtab;
+    
+    ai_topk_item                *items;
+    int                         count;
+    int                         index;
+} ai_topk_cursor;
+
+// ties are broken by rowid so that the result doesn't depend on how rows are split across threads
+static inline bool ai_topk_item_worse (const ai_topk_item *a, const ai_topk_item *b) {
+    return (a->distance > b->distance) || (a->distance == b->distance && a->rowid > b->rowid);
+}
+
+static void ai_topk_heap_sift_down (ai_topk_heap *heap, int i) {
+    ai_topk_item *items = heap->items;
+    for (;;) {
+        int largest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap->count && ai_topk_item_worse(&items[l], &items[largest])) largest = l;
+        if (r < heap->count && ai_topk_item_worse(&items[r], &items[largest])) largest = r;
+        if (largest == i) return;
+        ai_topk_item tmp = items[i]; items[i] = items[largest]; items[largest] = tmp;
+        i = largest;
+    }
+}
+
+static bool ai_topk_heap_grow (ai_topk_heap *heap) {
+    int capacity = (heap->capacity) ? heap->capacity * 2 : 64;
+    if (capacity > heap->limit) capacity = heap->limit;
+    ai_topk_item *items = (ai_topk_item *)sqlite3_realloc64(heap->items, sizeof(ai_topk_item) * (sqlite3_uint64)capacity);
+    if (!items) {
+        heap->failed = true;
+        return false;
+    }
+    heap->items = items;
+    heap->capacity = capacity;
+    return true;
+}
+
+static void ai_topk_heap_push (ai_topk_heap *heap, sqlite3_int64 rowid, float distance) {
+    // NaN distances are never kept
+    if (isnan(distance)) return;
+    if (heap->count == heap->capacity && heap->capacity < heap->limit && !ai_topk_heap_grow(heap)) return;
+    
+    ai_topk_item *items = heap->items;
+    ai_topk_item item = {.rowid = rowid, .distance = distance};
+    if (heap->count == heap->capacity) {
+        // replace the root only if the new vector is nearer
+        if (!ai_topk_item_worse(&items[0], &item)) return;
+        items[0] = item;
+        ai_topk_heap_sift_down(heap, 0);
+        return;
+    }
+    
+    int i = heap->count++;
+    items[i] = item;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ai_topk_item_worse(&items[i], &items[parent])) break;
+        ai_topk_item tmp = items[i]; items[i] = items[parent]; items[parent] = tmp;
+        i = parent;
+    }
+}
+
+static int ai_topk_item_compare (const void *a, const void *b) {
+    const ai_topk_item *x = (const ai_topk_item *)a;
+    const ai_topk_item *y = (const ai_topk_item *)b;
+    if (x->distance < y->distance) return -1;
+    if (x->distance > y->distance) return 1;
+    return (x->rowid < y->rowid) ? -1 : (x->rowid > y->rowid);
+}
+
+static bool ai_topk_options_callback (void *ctx, void *xdata, const char *key, int key_len, const char *value, int value_len) {
+    ai_topk_options *options = (ai_topk_options *)xdata;
+    
+    // sanity check (ignore malformed key/value)
+    if (!key || key_len == 0) return true;
+    if (!value || value_len == 0) return true;
+    
+    // convert value to c-string
+    char buffer[256] = {0};
+    size_t len = (value_len > (int)sizeof(buffer)-1) ? sizeof(buffer)-1 : (size_t)value_len;
+    memcpy(buffer, value, len);
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_DISTANCE)) {
+        vector_metric metric = vector_name_to_metric(buffer);
+        if (metric > 0) options->metric = metric;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EMBEDDING_TYPE)) {
+        int type = embedding_name_to_type(buffer);
+        if (type > 0) options->type = (vector_type)type;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_THREADS)) {
+        int threads = (int)strtol(buffer, NULL, 0);
+        if (threads > 0) options->threads = (threads > AI_TOPK_MAX_THREADS) ? AI_TOPK_MAX_THREADS : threads;
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_SCHEMA)) {
+        snprintf(options->schema, sizeof(options->schema), "%s", buffer);
+        return true;
     }
+    
+    return true;
 }
 
-// MARK: - LLM General -
-
-static void llm_lora_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (ai->ctx) llama_set_adapters_lora(ai->ctx, NULL, 0, NULL);
-    for (int i=0; i<MAX_LORAS; ++i) {
-        if (ai->lora[i]) {
-            llama_adapter_lora_free(ai->lora[i]);
-            ai->lora[i] = NULL;
-        }
+// score the slice of the current batch assigned to the worker index
+static void ai_topk_score (ai_topk_scan *scan, int index) {
+    int buffer = scan->current;
+    int count = scan->count[buffer];
+    int slice = (count + scan->nworkers - 1) / scan->nworkers;
+    int start = index * slice;
+    int end = (start + slice < count) ? start + slice : count;
+    
+    const uint8_t *data = scan->data[buffer];
+    const sqlite3_int64 *rowids = scan->rowids[buffer];
+    ai_topk_heap *heap = &scan->heaps[index];
+    for (int i = start; i < end; ++i) {
+        float distance = vector_distance(scan->query, scan->query_type, data + (size_t)i * scan->row_bytes, scan->type, scan->dimension, scan->metric);
+        ai_topk_heap_push(heap, rowids[i], distance);
     }
 }
 
-static void llm_lora_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (llm_check_context(context) == false) return;
-    
-    // sanity check arguments
-    int types[] = {SQLITE_TEXT, SQLITE_FLOAT};
-    if (sqlite_sanity_function(context, "llm_lora_load", argc, argv, 2, types, true, false) == false) return;
+static void *ai_topk_thread_run (void *arg) {
+    ai_topk_thread *thread = (ai_topk_thread *)arg;
+    ai_topk_pool *pool = thread->pool;
+    uint64_t generation = 0;
     
-    const char *lora_path = (const char *)sqlite3_value_text(argv[0]);
-    float scale = (float)sqlite3_value_double(argv[1]);
-    
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    struct llama_adapter_lora *lora = llama_adapter_lora_init(ai->model, lora_path);
-    if (!lora) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to load LoRA model from file %s", lora_path);
-        return;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->quit && pool->generation == generation) pthread_cond_wait(&pool->start, &pool->mutex);
+        if (pool->quit) break;
+        generation = pool->generation;
+        ai_topk_scan *scan = pool->scan;
+        pthread_mutex_unlock(&pool->mutex);
+        
+        ai_topk_score(scan, thread->index);
+        
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void ai_topk_pool_destroy (ai_topk_pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->nthreads; ++i) pthread_join(pool->threads[i].thread, NULL);
+    
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    sqlite3_free(pool->threads);
+    sqlite3_free(pool);
+}
+
+static ai_topk_pool *ai_topk_pool_create (int nthreads) {
+    ai_topk_pool *pool = (ai_topk_pool *)sqlite3_malloc(sizeof(ai_topk_pool));
+    if (!pool) return NULL;
+    memset(pool, 0, sizeof(ai_topk_pool));
+    pool->threads = (ai_topk_thread *)sqlite3_malloc64(sizeof(ai_topk_thread) * (sqlite3_uint64)nthreads);
+    if (!pool->threads) {
+        sqlite3_free(pool);
+        return NULL;
     }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
     
-    int index = llm_lora_push(ai, lora, scale);
-    if (index == -1) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to save LoRA model (%d maximum allowed models reached)", MAX_LORAS);
-        return;
+    for (int i = 0; i < nthreads; ++i) {
+        // score with the threads that could be started
+        pool->threads[i].pool = pool;
+        pool->threads[i].index = i;
+        if (pthread_create(&pool->threads[i].thread, NULL, ai_topk_thread_run, &pool->threads[i]) != 0) break;
+        pool->nthreads++;
     }
     
-    {
-        struct llama_adapter_lora *adapters[MAX_LORAS];
-        float scales[MAX_LORAS];
-        size_t n = 0;
-        for (int i=0; i<MAX_LORAS; ++i) {
-            if (ai->lora[i] && ai->lora_scale[i] != 0.0) {
-                adapters[n] = ai->lora[i];
-                scales[n] = ai->lora_scale[i];
-                n++;
-            }
-        }
-        llama_set_adapters_lora(ai->ctx, adapters, n, scales);
+    // a single thread would only add synchronization, the batches are scored inline
+    if (pool->nthreads < 2) {
+        ai_topk_pool_destroy(pool);
+        return NULL;
     }
-    
-    sqlite3_result_int(context, index);
+    return pool;
 }
 
-static void llm_sampler_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (ai->sampler) llama_sampler_free(ai->sampler);
-    ai->sampler = NULL;
+static void ai_topk_pool_free (ai_context *ai) {
+    if (ai->topk_pool) ai_topk_pool_destroy(ai->topk_pool);
+    ai->topk_pool = NULL;
 }
 
-static void llm_sampler_create (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (ai->sampler) llama_sampler_free(ai->sampler);
-    ai->sampler = NULL;
-    llm_sampler_check(ai);
+// pool of nthreads threads reused across the scans of the connection (NULL when the batches must be scored inline)
+static ai_topk_pool *ai_topk_pool_acquire (ai_context *ai, int nthreads) {
+    if (nthreads < 2) return NULL;
+    
+    // a scan running in the same connection (for example from the SQL of the table) keeps the pool, this one is scored inline
+    ai_topk_pool *pool = ai->topk_pool;
+    if (pool && pool->in_use) return NULL;
+    if (!pool || pool->nthreads != nthreads) {
+        ai_topk_pool_free(ai);
+        ai->topk_pool = pool = ai_topk_pool_create(nthreads);
+        if (!pool) return NULL;
+    }
+    pool->in_use = true;
+    return pool;
 }
 
-static void llm_context_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (ai->ctx) llama_free(ai->ctx);
-    ai->ctx = NULL;
+static void ai_topk_scan_wait (ai_topk_scan *scan) {
+    ai_topk_pool *pool = scan->pool;
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0) pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
 }
 
-static bool llm_context_create_with_options (sqlite3_context *context, ai_context *ai, const char *options1, const char *options2) {
-    struct llama_context_params ctx_params = llama_context_default_params();
-    if (parse_keyvalue_string(ai, options1, llm_context_options_callback, &ctx_params) == false) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options1);
-        return false;
+static void ai_topk_scan_dispatch (ai_topk_scan *scan, int buffer) {
+    scan->current = buffer;
+    ai_topk_pool *pool = scan->pool;
+    if (!pool) {
+        ai_topk_score(scan, 0);
+        return;
     }
     
-    if (options2) {
-        if (parse_keyvalue_string(ai, options2, llm_context_options_callback, &ctx_params) == false) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options2);
-            return false;
-        }
+    pthread_mutex_lock(&pool->mutex);
+    pool->scan = scan;
+    pool->pending = pool->nthreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// each heap keeps at most k items and is grown on demand, so it never holds more than the rows scored by its worker
+static bool ai_topk_scan_init (ai_topk_scan *scan, ai_context *ai, int nthreads, int k) {
+    scan->pool = ai_topk_pool_acquire(ai, nthreads);
+    scan->nworkers = (scan->pool) ? scan->pool->nthreads : 1;
+    scan->heaps = (ai_topk_heap *)sqlite3_malloc64(sizeof(ai_topk_heap) * (sqlite3_uint64)scan->nworkers);
+    if (!scan->heaps) return false;
+    memset(scan->heaps, 0, sizeof(ai_topk_heap) * (size_t)scan->nworkers);
+    for (int i = 0; i < scan->nworkers; ++i) scan->heaps[i].limit = k;
+    return true;
+}
+
+static void ai_topk_scan_free (ai_topk_scan *scan) {
+    if (scan->pool) scan->pool->in_use = false;
+    if (scan->heaps) {
+        for (int i = 0; i < scan->nworkers; ++i) sqlite3_free(scan->heaps[i].items);
+        sqlite3_free(scan->heaps);
+    }
+    for (int i = 0; i < 2; ++i) {
+        sqlite3_free(scan->data[i]);
+        sqlite3_free(scan->rowids[i]);
+    }
+}
+
+// merge the per-thread heaps into the k nearest vectors sorted by distance
+static int ai_topk_scan_merge (ai_topk_scan *scan, ai_topk_cursor *c, int k) {
+    int total = 0;
+    for (int i = 0; i < scan->nworkers; ++i) {
+        if (scan->heaps[i].failed) return SQLITE_NOMEM;
+        total += scan->heaps[i].count;
     }
+    if (total == 0) return SQLITE_OK;
     
-    // sanity check embedding_type
-    if (ctx_params.embeddings && ai->options.embedding.type == 0) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Embedding type (embedding_type) must be specified in the create context funtion");
-        return false;
+    c->items = (ai_topk_item *)sqlite3_malloc64(sizeof(ai_topk_item) * (sqlite3_uint64)total);
+    if (!c->items) return SQLITE_NOMEM;
+    
+    int n = 0;
+    for (int i = 0; i < scan->nworkers; ++i) {
+        memcpy(c->items + n, scan->heaps[i].items, sizeof(ai_topk_item) * (size_t)scan->heaps[i].count);
+        n += scan->heaps[i].count;
     }
+    qsort(c->items, (size_t)n, sizeof(ai_topk_item), ai_topk_item_compare);
+    c->count = (n < k) ? n : k;
+    return SQLITE_OK;
+}
 
-    // auto-size n_ctx to the model's training window when no explicit context_size was set
-    // llama_context_default_params() sets n_ctx=512; setting n_ctx=0 tells llama.cpp to use n_ctx_train
-    struct llama_context_params defaults = llama_context_default_params();
-    if (ai->model && ctx_params.n_ctx == defaults.n_ctx) {
-        ctx_params.n_ctx = 0;
+static int ai_vector_topk_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id, distance, tbl hidden, col hidden, query hidden, k hidden, options hidden);");
+    if (rc != SQLITE_OK) return rc;
+    
+    ai_topk_vtab *vtab = (ai_topk_vtab *)sqlite3_malloc(sizeof(ai_topk_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    
+    memset(vtab, 0, sizeof(ai_topk_vtab));
+    ai_context *ai = (ai_context *)pAux;
+    
+    vtab->ai = ai;
+    vtab->schema = sqlite_strdup(argv[1]);
+    if (!vtab->schema) {
+        sqlite3_free(vtab);
+        return SQLITE_NOMEM;
     }
+    ai->db = db;
+    
+    *ppVtab = (sqlite3_vtab *)vtab;
+    return SQLITE_OK;
+}
 
-    // for embedding contexts, clamp n_ctx to n_ctx_train to avoid position overflow
-    if (ctx_params.embeddings && ai->model) {
-        int n_ctx_train = llama_model_n_ctx_train(ai->model);
-        if ((int)ctx_params.n_ctx > n_ctx_train) {
-            ctx_params.n_ctx = n_ctx_train;
-        }
-        if ((int)ctx_params.n_batch > (int)ctx_params.n_ctx && ctx_params.n_ctx > 0) {
-            ctx_params.n_batch = ctx_params.n_ctx;
-        }
-        if ((int)ctx_params.n_ubatch > (int)ctx_params.n_batch) {
-            ctx_params.n_ubatch = ctx_params.n_batch;
+static int ai_vector_topk_disconnect (sqlite3_vtab *pVtab) {
+    ai_topk_vtab *vtab = (ai_topk_vtab *)pVtab;
+    sqlite3_free(vtab->schema);
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int ai_vector_topk_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    int indexes[AI_TOPK_COLUMN_OPTIONS + 1] = {-1, -1, -1, -1, -1, -1, -1};
+    
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint *constraint = &pIdxInfo->aConstraint[i];
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (constraint->iColumn < AI_TOPK_COLUMN_TABLE) continue;
+        if (!constraint->usable) return SQLITE_CONSTRAINT;
+        indexes[constraint->iColumn] = i;
+    }
+    
+    // table, column, query and k are mandatory, options are optional
+    int argc = 0;
+    for (int col = AI_TOPK_COLUMN_TABLE; col <= AI_TOPK_COLUMN_OPTIONS; ++col) {
+        if (indexes[col] < 0) {
+            if (col == AI_TOPK_COLUMN_OPTIONS) break;
+            return SQLITE_CONSTRAINT;
         }
+        pIdxInfo->aConstraintUsage[indexes[col]].argvIndex = ++argc;
+        pIdxInfo->aConstraintUsage[indexes[col]].omit = 1;
     }
-
-    struct llama_context *ctx = llama_init_from_model(ai->model, ctx_params);
-    if (!ctx) {
-        sqlite_common_set_error(ai->context, ai->vtab, SQLITE_ERROR, "Unable to create context from model");
-        return false;
+    
+    // rows are returned sorted by distance
+    if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == AI_TOPK_COLUMN_DISTANCE && !pIdxInfo->aOrderBy[0].desc) {
+        pIdxInfo->orderByConsumed = 1;
     }
+    pIdxInfo->idxNum = argc;
+    pIdxInfo->estimatedCost = (double)1000000;
     
-    if (ai->ctx) llm_context_free(context, 0, NULL);
-    ai->ctx = ctx;
+    return SQLITE_OK;
+}
+
+static int ai_vector_topk_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_topk_cursor *c = (ai_topk_cursor *)sqlite3_malloc(sizeof(ai_topk_cursor));
+    if (!c) return SQLITE_NOMEM;
     
-    return true;
+    memset(c, 0, sizeof(ai_topk_cursor));
+    c->vtab = (ai_topk_vtab *)pVtab;
+    
+    *ppCursor = (sqlite3_vtab_cursor *)c;
+    return SQLITE_OK;
 }
 
-static void llm_context_create (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // sanity check arguments
-    if (llm_common_args_check(context, "llm_context_create", argc, argv, true) == false) return;
-    const char *options = (const char *)sqlite3_value_text(argv[0]);
-    if ((options == NULL) || (strlen(options) == 0)) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Non empty options must be specified when calling llm_context_create");
-        return;
-    }
-        
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_context_create_with_options(context, ai, options, NULL);
+static void ai_vector_topk_cursor_reset (ai_topk_cursor *c) {
+    sqlite3_free(c->items);
+    c->items = NULL;
+    c->count = 0;
+    c->index = 0;
 }
 
-static void llm_context_create_embedding (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    const char *options = AI_DEFAULT_CONTEXT_EMBEDDING_OPTIONS;
-    const char *options2 = (argc > 0) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_context_create_with_options(context, ai, options, options2);
+static int ai_vector_topk_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_topk_cursor *c = (ai_topk_cursor *)cur;
+    ai_vector_topk_cursor_reset(c);
+    sqlite3_free(c);
+    return SQLITE_OK;
 }
 
-static void llm_context_create_chat (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    const char *options = AI_DEFAULT_CONTEXT_CHAT_OPTIONS;
-    const char *options2 = (argc > 0) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_context_create_with_options(context, ai, options, options2);
+static int ai_vector_topk_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_topk_cursor *c = (ai_topk_cursor *)cur;
+    c->index++;
+    return SQLITE_OK;
 }
 
-static void llm_context_create_textgen (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    const char *options = AI_DEFAULT_CONTEXT_TEXTGEN_OPTIONS;
-    const char *options2 = (argc > 0) ? (const char *)sqlite3_value_text(argv[0]) : NULL;
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    llm_context_create_with_options(context, ai, options, options2);
+static int ai_vector_topk_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_topk_cursor *c = (ai_topk_cursor *)cur;
+    return (c->index >= c->count);
 }
 
-static void llm_context_size (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (!ai->ctx) {
-        sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create() before using this function.");
-        return;
+static int ai_vector_topk_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_topk_cursor *c = (ai_topk_cursor *)cur;
+    if (iCol == AI_TOPK_COLUMN_ID) {
+        sqlite3_result_int64(context, c->items[c->index].rowid);
+    } else if (iCol == AI_TOPK_COLUMN_DISTANCE) {
+        sqlite3_result_double(context, (double)c->items[c->index].distance);
     }
-    uint32_t n_ctx = llama_n_ctx(ai->ctx);
-    sqlite3_result_int(context, n_ctx);
+    return SQLITE_OK;
 }
 
-static void llm_context_used (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (!ai->ctx) {
-        sqlite_context_result_error(context, SQLITE_MISUSE, "No context found. Please call llm_context_create() before using this function.");
-        return;
+static int ai_vector_topk_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_topk_cursor *c = (ai_topk_cursor *)cur;
+    *pRowid = c->index;
+    return SQLITE_OK;
+}
+
+static int ai_vector_topk_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_topk_cursor *c = (ai_topk_cursor *)cur;
+    ai_topk_vtab *vtab = c->vtab;
+    sqlite3 *db = vtab->ai->db;
+    ai_vector_topk_cursor_reset(c);
+    
+    if (argc < 4 || sqlite3_value_type(argv[0]) != SQLITE_TEXT || sqlite3_value_type(argv[1]) != SQLITE_TEXT) {
+        return sqlite_vtab_set_error(&vtab->base, "ai_vector_topk expects a table name, a column name, a query vector and k");
     }
-    int32_t n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(ai->ctx), 0) + 1;
-    if (n_ctx_used < 0) n_ctx_used = 0;
-    sqlite3_result_int(context, n_ctx_used);
+    if (sqlite3_value_type(argv[2]) != SQLITE_BLOB) {
+        return sqlite_vtab_set_error(&vtab->base, "ai_vector_topk query must be a BLOB vector");
+    }
+    if (sqlite3_value_type(argv[3]) != SQLITE_INTEGER || sqlite3_value_int64(argv[3]) <= 0 || sqlite3_value_int64(argv[3]) > AI_TOPK_MAX_K) {
+        return sqlite_vtab_set_error(&vtab->base, "ai_vector_topk k must be an INTEGER between 1 and %d", AI_TOPK_MAX_K);
+    }
+    
+    const char *table = (const char *)sqlite3_value_text(argv[0]);
+    const char *column = (const char *)sqlite3_value_text(argv[1]);
+    int k = sqlite3_value_int(argv[3]);
+    
+    ai_topk_options options = {.metric = VECTOR_METRIC_COSINE, .type = VECTOR_TYPE_F32, .threads = ai_cpu_count()};
+    if (options.threads > AI_TOPK_MAX_THREADS) options.threads = AI_TOPK_MAX_THREADS;
+    snprintf(options.schema, sizeof(options.schema), "%s", vtab->schema);
+    const char *options_text = (argc == 5 && sqlite3_value_type(argv[4]) == SQLITE_TEXT) ? (const char *)sqlite3_value_text(argv[4]) : NULL;
+    if (parse_keyvalue_string(vtab->ai, options_text, ai_topk_options_callback, &options) == false) {
+        return sqlite_vtab_set_error(&vtab->base, "An error occurred while parsing options (%s)", options_text);
+    }
+    
+    ai_topk_scan scan = {0};
+    scan.query = sqlite3_value_blob(argv[2]);
+    scan.type = options.type;
+    scan.metric = options.metric;
+    int query_bytes = sqlite3_value_bytes(argv[2]);
+    
+    // rows are enumerated by rowid, typeof() reads only the record header
+    sqlite3_blob *blob = NULL;
+    sqlite3_stmt *vm = NULL;
+    char *sql = sqlite3_mprintf("SELECT rowid FROM \"%w\".\"%w\" WHERE typeof(\"%w\") = 'blob';", options.schema, table, column);
+    int rc = (sql) ? sqlite3_prepare_v2(db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    
+    int fill = 0;
+    bool busy = false;
+    bool eof = false;
+    while (!eof) {
+        // read the next batch while the workers score the previous one
+        int count = 0;
+        while (count < AI_TOPK_BATCH_SIZE) {
+            rc = sqlite3_step(vm);
+            if (rc == SQLITE_DONE) {
+                eof = true;
+                break;
+            }
+            if (rc != SQLITE_ROW) {
+                rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+                goto cleanup;
+            }
+            
+            sqlite3_int64 rowid = sqlite3_column_int64(vm, 0);
+            rc = (blob) ? sqlite3_blob_reopen(blob, rowid) : sqlite3_blob_open(db, options.schema, table, column, rowid, 0, &blob);
+            if (rc != SQLITE_OK) {
+                rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+                goto cleanup;
+            }
+            
+            int bytes = sqlite3_blob_bytes(blob);
+            if (scan.row_bytes == 0) {
+                // the first vector sets the dimension, the query can be a FLOAT32 vector of the same dimension
+                vector_type query_type, row_type;
+                scan.dimension = vector_resolve_dimension(query_bytes, bytes, scan.type, &query_type, &row_type);
+                if (scan.dimension == 0 || row_type != scan.type) {
+                    rc = sqlite_vtab_set_error(&vtab->base, "Query vector of %d bytes is not compatible with vectors of %d bytes and type %s", query_bytes, bytes, embedding_type_to_name((embedding_type)scan.type));
+                    goto cleanup;
+                }
+                scan.query_type = query_type;
+                scan.row_bytes = bytes;
+                
+                for (int i = 0; i < 2; ++i) {
+                    scan.data[i] = (uint8_t *)sqlite3_malloc64((sqlite3_uint64)AI_TOPK_BATCH_SIZE * (sqlite3_uint64)bytes);
+                    scan.rowids[i] = (sqlite3_int64 *)sqlite3_malloc64(sizeof(sqlite3_int64) * AI_TOPK_BATCH_SIZE);
+                    if (!scan.data[i] || !scan.rowids[i]) {
+                        rc = sqlite_vtab_set_error(&vtab->base, "Out of memory: failed to allocate vector batch");
+                        goto cleanup;
+                    }
+                }
+                if (!ai_topk_scan_init(&scan, vtab->ai, options.threads, k)) {
+                    rc = sqlite_vtab_set_error(&vtab->base, "Out of memory: failed to allocate top-k heaps");
+                    goto cleanup;
+                }
+            } else if (bytes != scan.row_bytes) {
+                rc = sqlite_vtab_set_error(&vtab->base, "Vector at rowid %lld has %d bytes, expected %d", (long long)rowid, bytes, scan.row_bytes);
+                goto cleanup;
+            }
+            
+            rc = sqlite3_blob_read(blob, scan.data[fill] + (size_t)count * scan.row_bytes, scan.row_bytes, 0);
+            if (rc != SQLITE_OK) {
+                rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(db));
+                goto cleanup;
+            }
+            scan.rowids[fill][count++] = rowid;
+        }
+        
+        if (busy) ai_topk_scan_wait(&scan);
+        busy = false;
+        if (count == 0) break;
+        
+        scan.count[fill] = count;
+        ai_topk_scan_dispatch(&scan, fill);
+        busy = true;
+        fill ^= 1;
+    }
+    if (busy) ai_topk_scan_wait(&scan);
+    busy = false;
+    
+    rc = (scan.heaps) ? ai_topk_scan_merge(&scan, c, k) : SQLITE_OK;
+    
+cleanup:
+    if (busy) ai_topk_scan_wait(&scan);
+    if (blob) sqlite3_blob_close(blob);
+    if (vm) sqlite3_finalize(vm);
+    ai_topk_scan_free(&scan);
+    return rc;
 }
 
-static void llm_model_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    ai_cleanup((void *)ai, true, false);
+static sqlite3_module ai_vector_topk = {
+  /* iVersion    */ 0,
+  /* xCreate     */ 0,
+  /* xConnect    */ ai_vector_topk_connect,
+  /* xBestIndex  */ ai_vector_topk_best_index,
+  /* xDisconnect */ ai_vector_topk_disconnect,
+  /* xDestroy    */ 0,
+  /* xOpen       */ ai_vector_topk_cursor_open,
+  /* xClose      */ ai_vector_topk_cursor_close,
+  /* xFilter     */ ai_vector_topk_filter,
+  /* xNext       */ ai_vector_topk_cursor_next,
+  /* xEof        */ ai_vector_topk_cursor_eof,
+  /* xColumn     */ ai_vector_topk_cursor_column,
+  /* xRowid      */ ai_vector_topk_cursor_rowid,
+  /* xUpdate     */ 0,
+  /* xBegin      */ 0,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ 0,
+  /* xFindMethod */ 0,
+  /* xRename     */ 0,
+  /* xSavepoint  */ 0,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ 0,
+  /* xShadowName */ 0,
+  /* xIntegrity  */ 0
+};
+
+// MARK: - HNSW Index Virtual Table -
+
+// approximate k-nearest neighbors over a hierarchical navigable small world graph persisted in three shadow tables:
+// <name>_nodes stores one row per vector (its level, the vector and the neighbor lists of all its levels), <name>_refs the
+// reverse links (the nodes whose lists contain a node, at any level) and <name>_config the parameters and the entry point. Nodes are loaded lazily into a per-connection LRU cache bounded by
+// cache_size, writes go through to the shadow tables and a version counter invalidates the cache when another
+// connection changes the index
+
+#define AI_HNSW_COLUMN_EMBEDDING                0
+#define AI_HNSW_COLUMN_DISTANCE                 1
+#define AI_HNSW_COLUMN_K                        2
+
+#define AI_HNSW_IDXNUM_SCAN                     0
+#define AI_HNSW_IDXNUM_ROWID                    1
+#define AI_HNSW_IDXNUM_MATCH                    2
+
+#define AI_HNSW_DEFAULT_M                       16
+#define AI_HNSW_DEFAULT_EF_CONSTRUCTION         200
+#define AI_HNSW_DEFAULT_EF_SEARCH               64
+#define AI_HNSW_DEFAULT_K                       10
+#define AI_HNSW_MAX_M                           128
+#define AI_HNSW_MAX_EF                          4096
+#define AI_HNSW_MAX_LEVEL                       16
+#define AI_HNSW_MAX_DIMENSION                   65536
+#define AI_HNSW_DEFAULT_CACHE_SIZE              64          // MB
+
+#define OPTION_KEY_DIMENSION                    "dimension"
+#define OPTION_KEY_M                            "m"
+#define OPTION_KEY_EF_CONSTRUCTION              "ef_construction"
+#define OPTION_KEY_EF_SEARCH                    "ef_search"
+#define OPTION_KEY_CACHE_SIZE                   "cache_size"
+
+typedef struct {
+    int                         dimension;
+    vector_type                 type;
+    vector_metric               metric;
+    int                         m;
+    int                         ef_construction;
+    int                         ef_search;
+    int                         cache_size;         // memory budget (in MB) of the node cache
+} ai_hnsw_options;
+
+typedef struct ai_hnsw_node {
+    sqlite3_int64               id;
+    int                         level;
+    size_t                      size;               // allocated bytes, charged to the cache budget
+    struct ai_hnsw_node         *prev;              // LRU list, the head is the most recently used node
+    struct ai_hnsw_node         *next;
+    uint32_t                    visited;            // epoch of the last search that reached the node
+    bool                        dirty;
+    bool                        inserted;           // not yet written to the nodes table
+    int32_t                     *counts;            // number of neighbors at each level
+    sqlite3_int64               *links;             // 2*m slots at level 0, m slots at each upper level
+    uint8_t                     *vector;
+} ai_hnsw_node;
+
+typedef struct {
+    float                       distance;
+    ai_hnsw_node                *node;
+} ai_hnsw_candidate;
+
+// binary heap of candidates, the root is the nearest one (or the farthest one for a max-heap)
+typedef struct {
+    ai_hnsw_candidate           *items;
+    int                         count;
+    int                         capacity;
+    bool                        max;
+} ai_hnsw_heap;
+
+typedef struct {
+    sqlite3_vtab                base;               // Base class - must be first
+    sqlite3                     *db;
+    char                        *schema;
+    char                        *name;
+    
+    ai_hnsw_options             options;
+    int                         row_bytes;
+    double                      level_mult;
+    
+    // graph state, mirrored in the config table
+    sqlite3_int64               entry;
+    int                         max_level;
+    bool                        has_entry;
+    sqlite3_int64               version;
+    
+    // node cache (open addressing with linear probing)
+    ai_hnsw_node                **slots;
+    uint32_t                    nslots;
+    uint32_t                    nnodes;
+    uint32_t                    epoch;
+    ai_hnsw_node                *lru_head;
+    ai_hnsw_node                *lru_tail;
+    size_t                      cache_bytes;
+    
+    // nodes changed by the current write
+    ai_hnsw_node                **dirty;
+    int                         ndirty;
+    int                         dirty_capacity;
+    
+    sqlite3_stmt                *stmt_load;
+    sqlite3_stmt                *stmt_insert;
+    sqlite3_stmt                *stmt_update;
+    sqlite3_stmt                *stmt_delete;
+    sqlite3_stmt                *stmt_config;
+    sqlite3_stmt                *stmt_version;
+    sqlite3_stmt                *stmt_refs;
+    sqlite3_stmt                *stmt_neighbors;
+    sqlite3_stmt                *stmt_ref_insert;
+    sqlite3_stmt                *stmt_ref_delete;
+    bool                        has_refs;           // false for indexes created before the refs table, which is built by the first write
+    int                         rc;                 // first error hit while loading nodes
+} ai_hnsw_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor         base;               // Base class - must be first
+    ai_hnsw_vtab                *vtab;
+    
+    sqlite3_int64               *ids;
+    float                       *distances;
+    int                         count;
+    int                         index;
+    sqlite3_stmt                *scan;              // full scans read the nodes table directly
+    bool                        eof;
+} ai_hnsw_cursor;
+
+// integer option values must be entirely numeric
+static bool ai_hnsw_option_int (const char *buffer, int *value) {
+    char *end = NULL;
+    long v = strtol(buffer, &end, 0);
+    if (end == buffer || *end != 0 || v < INT_MIN || v > INT_MAX) return false;
+    *value = (int)v;
+    return true;
 }
 
-static void llm_model_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // sanity check arguments
-    if (llm_common_args_check(context, "llm_model_load", argc, argv, false) == false) return;
+// returns false for malformed pairs, unknown keys and values that are not numbers where a number is expected
+static bool ai_hnsw_options_callback (void *ctx, void *xdata, const char *key, int key_len, const char *value, int value_len) {
+    ai_hnsw_options *options = (ai_hnsw_options *)xdata;
+    
+    // sanity check
+    if (!key || key_len == 0) return false;
+    if (!value || value_len == 0) return false;
     
-    const char *model_path = (const char *)sqlite3_value_text(argv[0]);
-    const char *model_options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
-    if (model_options == NULL) model_options = AI_DEFAULT_MODEL_OPTIONS;
+    // convert value to c-string
+    char buffer[256] = {0};
+    size_t len = (value_len > (int)sizeof(buffer)-1) ? sizeof(buffer)-1 : (size_t)value_len;
+    memcpy(buffer, value, len);
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    struct llama_model_params model_params = llama_model_default_params();
-    if (parse_keyvalue_string(ai, model_options, llm_model_options_callback, &model_params) == false) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", model_options);
-        return;
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_DIMENSION)) {
+        return ai_hnsw_option_int(buffer, &options->dimension);
     }
     
-    struct llama_model *model = llama_model_load_from_file(model_path, model_params);
-    if (!model) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to load model from file %s", model_path);
-        return;
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EMBEDDING_TYPE)) {
+        options->type = (vector_type)embedding_name_to_type(buffer);
+        return true;
     }
     
-    ai_cleanup((void *)ai, true, false);
-    ai->model = model;
-}
-
-// MARK: - LLM Model -
-
-static void llm_model_get_setting (sqlite3_context *context, int argc, sqlite3_value **argv, ai_model_setting setting) {
-    // sanity check model
-    if (ai_model_check(context, true, false) == false) {
-        sqlite_context_result_error(context, SQLITE_MISUSE, "No model is currently set. Please call llm_model_load() before using this function.");
-        return;
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_DISTANCE)) {
+        options->metric = vector_name_to_metric(buffer);
+        return true;
     }
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    uint64_t n = 0;
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_M)) {
+        return ai_hnsw_option_int(buffer, &options->m);
+    }
     
-    switch (setting) {
-        case AI_MODEL_SETTING_N_PARAMS: n = llama_model_n_params(ai->model); break;
-        case AI_MODEL_SIZE: n = llama_model_size(ai->model); break;
-        case AI_MODEL_N_CTX_TRAIN: n = llama_model_n_ctx_train(ai->model); break;
-        case AI_MODEL_N_EMBED: n = llama_model_n_embd(ai->model); break;
-        case AI_MODEL_N_LAYER: n = llama_model_n_layer(ai->model); break;
-        case AI_MODEL_N_HEAD: n = llama_model_n_head(ai->model); break;
-        case AI_MODEL_N_HEAD_KV: n = llama_model_n_head_kv(ai->model); break;
-        case AI_MODEL_N_SWA: n = llama_model_n_swa(ai->model); break;
-        case AI_MODEL_N_CLS_OUT: n = llama_model_n_cls_out(ai->model); break;
-        case AI_MODEL_HAS_ENCODER: n = llama_model_has_encoder(ai->model); break;
-        case AI_MODEL_HAS_DECODER: n = llama_model_has_decoder(ai->model); break;
-        case AI_MODEL_IS_RECURRENT: n = llama_model_is_recurrent(ai->model); break;
-            
-        case AI_MODEL_CHAT_TEMPLATE: {
-            const char *template = llama_model_chat_template(ai->model, NULL);
-            sqlite3_result_text(context, template, -1, SQLITE_STATIC);
-            return;
-        }
-            
-        case AI_MODEL_FREQ_SCALE_TRAIN: {
-            float n = llama_model_rope_freq_scale_train(ai->model);
-            sqlite3_result_double(context, n);
-            return;
-        }
-            
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EF_CONSTRUCTION)) {
+        return ai_hnsw_option_int(buffer, &options->ef_construction);
     }
-    sqlite3_result_int64(context, (sqlite3_int64)n);
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EF_SEARCH)) {
+        return ai_hnsw_option_int(buffer, &options->ef_search);
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_CACHE_SIZE)) {
+        return ai_hnsw_option_int(buffer, &options->cache_size);
+    }
+    
+    return false;
 }
 
-static void llm_model_n_params (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns the total number of parameters in the model
-    llm_model_get_setting(context, argc, argv, AI_MODEL_SETTING_N_PARAMS);
+static inline int ai_hnsw_capacity (ai_hnsw_vtab *vtab, int level) {
+    return (level == 0) ? vtab->options.m * 2 : vtab->options.m;
 }
 
-static void llm_model_size (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns the total size of all the tensors in the model in bytes
-    llm_model_get_setting(context, argc, argv, AI_MODEL_SIZE);
+static inline sqlite3_int64 *ai_hnsw_links (ai_hnsw_vtab *vtab, ai_hnsw_node *node, int level) {
+    return (level == 0) ? node->links : node->links + vtab->options.m * 2 + (level - 1) * vtab->options.m;
 }
 
-static void llm_model_n_ctx_train (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    llm_model_get_setting(context, argc, argv, AI_MODEL_N_CTX_TRAIN);
+static inline uint64_t ai_hnsw_mix (uint64_t x) {
+    // splitmix64 finalizer
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
 }
 
-static void llm_model_n_embd (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    llm_model_get_setting(context, argc, argv, AI_MODEL_N_EMBED);
+// the level of a node is derived from its id, so that rebuilding an index produces the same graph
+static int ai_hnsw_random_level (ai_hnsw_vtab *vtab, sqlite3_int64 id) {
+    double u = (double)((ai_hnsw_mix((uint64_t)id) >> 11) + 1) * (1.0 / 9007199254740993.0);
+    int level = (int)floor(-log(u) * vtab->level_mult);
+    return (level > AI_HNSW_MAX_LEVEL) ? AI_HNSW_MAX_LEVEL : level;
 }
 
-static void llm_model_n_layer (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns the total size of all the tensors in the model in bytes
-    llm_model_get_setting(context, argc, argv, AI_MODEL_N_LAYER);
+static inline float ai_hnsw_distance (ai_hnsw_vtab *vtab, ai_hnsw_node *a, ai_hnsw_node *b) {
+    return vector_distance(a->vector, vtab->options.type, b->vector, vtab->options.type, vtab->options.dimension, vtab->options.metric);
 }
 
-static void llm_model_n_head (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns the total size of all the tensors in the model in bytes
-    llm_model_get_setting(context, argc, argv, AI_MODEL_N_HEAD);
+static inline float ai_hnsw_query_distance (ai_hnsw_vtab *vtab, const void *query, vector_type query_type, ai_hnsw_node *node) {
+    return vector_distance(query, query_type, node->vector, vtab->options.type, vtab->options.dimension, vtab->options.metric);
 }
 
-static void llm_model_n_head_kv (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns the total size of all the tensors in the model in bytes
-    llm_model_get_setting(context, argc, argv, AI_MODEL_N_HEAD_KV);
+// MARK: Heap
+
+static inline bool ai_hnsw_heap_before (ai_hnsw_heap *heap, const ai_hnsw_candidate *a, const ai_hnsw_candidate *b) {
+    return (heap->max) ? (a->distance > b->distance) : (a->distance < b->distance);
 }
 
-static void llm_model_n_swa (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns the total size of all the tensors in the model in bytes
-    llm_model_get_setting(context, argc, argv, AI_MODEL_N_SWA);
+static bool ai_hnsw_heap_push (ai_hnsw_heap *heap, float distance, ai_hnsw_node *node) {
+    if (heap->count == heap->capacity) {
+        int capacity = (heap->capacity) ? heap->capacity * 2 : 64;
+        ai_hnsw_candidate *items = (ai_hnsw_candidate *)sqlite3_realloc64(heap->items, sizeof(ai_hnsw_candidate) * capacity);
+        if (!items) return false;
+        heap->items = items;
+        heap->capacity = capacity;
+    }
+    
+    ai_hnsw_candidate *items = heap->items;
+    int i = heap->count++;
+    items[i] = (ai_hnsw_candidate){.distance = distance, .node = node};
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ai_hnsw_heap_before(heap, &items[i], &items[parent])) break;
+        ai_hnsw_candidate tmp = items[i]; items[i] = items[parent]; items[parent] = tmp;
+        i = parent;
+    }
+    return true;
 }
 
-static void llm_model_rope_freq_scale_train (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Get the model's RoPE frequency scaling factor
-    llm_model_get_setting(context, argc, argv, AI_MODEL_FREQ_SCALE_TRAIN);
+static ai_hnsw_candidate ai_hnsw_heap_pop (ai_hnsw_heap *heap) {
+    ai_hnsw_candidate *items = heap->items;
+    ai_hnsw_candidate top = items[0];
+    items[0] = items[--heap->count];
+    
+    int i = 0;
+    for (;;) {
+        int first = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap->count && ai_hnsw_heap_before(heap, &items[l], &items[first])) first = l;
+        if (r < heap->count && ai_hnsw_heap_before(heap, &items[r], &items[first])) first = r;
+        if (first == i) break;
+        ai_hnsw_candidate tmp = items[i]; items[i] = items[first]; items[first] = tmp;
+        i = first;
+    }
+    return top;
 }
 
-static void llm_model_n_cls_out (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns the number of classifier outputs (only valid for classifier models)
-    // Undefined behavior for non-classifier models
-    llm_model_get_setting(context, argc, argv, AI_MODEL_N_CLS_OUT);
+static int ai_hnsw_candidate_compare (const void *a, const void *b) {
+    const ai_hnsw_candidate *x = (const ai_hnsw_candidate *)a;
+    const ai_hnsw_candidate *y = (const ai_hnsw_candidate *)b;
+    if (x->distance < y->distance) return -1;
+    if (x->distance > y->distance) return 1;
+    return (x->node->id < y->node->id) ? -1 : (x->node->id > y->node->id);
 }
 
-static void llm_model_cls_label (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns label of classifier output by index (<n_cls_out). Returns nullptr if no label provided
+// MARK: Statements
+
+static sqlite3_stmt *ai_hnsw_statement (ai_hnsw_vtab *vtab, sqlite3_stmt **stmt, const char *format) {
+    if (*stmt) {
+        sqlite3_reset(*stmt);
+        return *stmt;
+    }
     
-    int types[] = {SQLITE_INTEGER};
-    if (sqlite_sanity_function(context, "llm_model_cls_label", argc, argv, 1, types, true, false) == false) return;
+    // every statement is formatted with the schema and the table name
+    char *sql = sqlite3_mprintf(format, vtab->schema, vtab->name);
+    if (!sql) {
+        vtab->rc = SQLITE_NOMEM;
+        return NULL;
+    }
+    int rc = sqlite3_prepare_v3(vtab->db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        vtab->rc = rc;
+        sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        return NULL;
+    }
+    return *stmt;
+}
+
+static void ai_hnsw_statements_finalize (ai_hnsw_vtab *vtab) {
+    sqlite3_stmt **stmts[] = {&vtab->stmt_load, &vtab->stmt_insert, &vtab->stmt_update, &vtab->stmt_delete, &vtab->stmt_config, &vtab->stmt_version, &vtab->stmt_refs, &vtab->stmt_neighbors, &vtab->stmt_ref_insert, &vtab->stmt_ref_delete};
+    for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]); ++i) {
+        if (*stmts[i]) sqlite3_finalize(*stmts[i]);
+        *stmts[i] = NULL;
+    }
+}
+
+static int ai_hnsw_step (ai_hnsw_vtab *vtab, sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc == SQLITE_DONE) return SQLITE_OK;
+    return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+}
+
+static int ai_hnsw_config_write (ai_hnsw_vtab *vtab, const char *key, sqlite3_int64 value, bool is_null) {
+    sqlite3_stmt *stmt = ai_hnsw_statement(vtab, &vtab->stmt_config, "INSERT OR REPLACE INTO \"%w\".\"%w_config\" (key, value) VALUES (?1, ?2);");
+    if (!stmt) return SQLITE_ERROR;
     
-    int i = sqlite3_value_int(argv[0]);
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    const char *label = llama_model_cls_label(ai->model, i);
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    if (is_null) sqlite3_bind_null(stmt, 2);
+    else sqlite3_bind_int64(stmt, 2, value);
+    return ai_hnsw_step(vtab, stmt);
+}
 
-    if (label) sqlite3_result_text(context, label, -1, SQLITE_STATIC);
-    else sqlite3_result_null(context);
+// MARK: Node Cache
+
+static inline uint32_t ai_hnsw_slot (ai_hnsw_vtab *vtab, sqlite3_int64 id) {
+    return (uint32_t)ai_hnsw_mix((uint64_t)id) & (vtab->nslots - 1);
 }
 
-static void llm_model_desc (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Get a string describing the model type
+static ai_hnsw_node *ai_hnsw_cache_find (ai_hnsw_vtab *vtab, sqlite3_int64 id) {
+    if (vtab->nslots == 0) return NULL;
     
-    if (ai_model_check(context, true, false) == false) {
-        sqlite_context_result_error(context, SQLITE_MISUSE, "No model is currently set. Please call llm_model_load() before using this function.");
-        return;
+    for (uint32_t i = ai_hnsw_slot(vtab, id); vtab->slots[i]; i = (i + 1) & (vtab->nslots - 1)) {
+        if (vtab->slots[i]->id == id) return vtab->slots[i];
     }
+    return NULL;
+}
+
+static bool ai_hnsw_cache_add (ai_hnsw_vtab *vtab, ai_hnsw_node *node) {
+    // keep the load factor below 1/2
+    if ((vtab->nnodes + 1) * 2 > vtab->nslots) {
+        uint32_t nslots = (vtab->nslots) ? vtab->nslots * 2 : 1024;
+        ai_hnsw_node **slots = (ai_hnsw_node **)sqlite3_malloc64(sizeof(ai_hnsw_node *) * nslots);
+        if (!slots) return false;
+        memset(slots, 0, sizeof(ai_hnsw_node *) * nslots);
     
-    char buffer[4096];
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    int32_t n = llama_model_desc(ai->model, buffer, sizeof(buffer));
-    (n > 0) ? sqlite3_result_text(context, buffer, n, SQLITE_TRANSIENT) : sqlite3_result_null(context);
+        ai_hnsw_node **old = vtab->slots;
+        uint32_t nold = vtab->nslots;
+        vtab->slots = slots;
+        vtab->nslots = nslots;
+        for (uint32_t i = 0; i < nold; ++i) {
+            if (!old[i]) continue;
+            uint32_t j = ai_hnsw_slot(vtab, old[i]->id);
+            while (slots[j]) j = (j + 1) & (nslots - 1);
+            slots[j] = old[i];
+        }
+        sqlite3_free(old);
+    }
+    
+    uint32_t i = ai_hnsw_slot(vtab, node->id);
+    while (vtab->slots[i]) i = (i + 1) & (vtab->nslots - 1);
+    vtab->slots[i] = node;
+    vtab->nnodes++;
+    
+    node->prev = NULL;
+    node->next = vtab->lru_head;
+    if (vtab->lru_head) vtab->lru_head->prev = node;
+    else vtab->lru_tail = node;
+    vtab->lru_head = node;
+    vtab->cache_bytes += node->size;
+    return true;
 }
 
-static void llm_model_has_encoder (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns true if the model contains an encoder that requires llama_encode() call
-    llm_model_get_setting(context, argc, argv, AI_MODEL_HAS_ENCODER);
+static void ai_hnsw_lru_unlink (ai_hnsw_vtab *vtab, ai_hnsw_node *node) {
+    if (node->prev) node->prev->next = node->next;
+    else vtab->lru_head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else vtab->lru_tail = node->prev;
+    node->prev = node->next = NULL;
+}
+
+static void ai_hnsw_lru_touch (ai_hnsw_vtab *vtab, ai_hnsw_node *node) {
+    if (vtab->lru_head == node) return;
+    ai_hnsw_lru_unlink(vtab, node);
+    node->next = vtab->lru_head;
+    if (vtab->lru_head) vtab->lru_head->prev = node;
+    else vtab->lru_tail = node;
+    vtab->lru_head = node;
+}
+
+static void ai_hnsw_cache_remove (ai_hnsw_vtab *vtab, ai_hnsw_node *node) {
+    if (vtab->nslots == 0) return;
+    
+    uint32_t mask = vtab->nslots - 1;
+    uint32_t i = ai_hnsw_slot(vtab, node->id);
+    while (vtab->slots[i] && vtab->slots[i] != node) i = (i + 1) & mask;
+    if (!vtab->slots[i]) return;
+    
+    ai_hnsw_lru_unlink(vtab, node);
+    vtab->cache_bytes -= node->size;
+    
+    // backward shift deletion keeps every probe sequence intact without tombstones
+    vtab->slots[i] = NULL;
+    vtab->nnodes--;
+    for (uint32_t j = (i + 1) & mask; vtab->slots[j]; j = (j + 1) & mask) {
+        uint32_t home = ai_hnsw_slot(vtab, vtab->slots[j]->id);
+        bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            vtab->slots[i] = vtab->slots[j];
+            vtab->slots[j] = NULL;
+            i = j;
+        }
+    }
 }
 
-static void llm_model_has_decoder (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns true if the model contains a decoder that requires llama_decode() call
-    llm_model_get_setting(context, argc, argv, AI_MODEL_HAS_DECODER);
+static void ai_hnsw_cache_clear (ai_hnsw_vtab *vtab) {
+    for (uint32_t i = 0; i < vtab->nslots; ++i) {
+        if (vtab->slots[i]) sqlite3_free(vtab->slots[i]);
+    }
+    sqlite3_free(vtab->slots);
+    vtab->slots = NULL;
+    vtab->nslots = 0;
+    vtab->nnodes = 0;
+    vtab->ndirty = 0;
+    vtab->lru_head = vtab->lru_tail = NULL;
+    vtab->cache_bytes = 0;
 }
 
-static void llm_model_is_recurrent (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Returns true if the model is recurrent (like Mamba, RWKV, etc.)
-    llm_model_get_setting(context, argc, argv, AI_MODEL_IS_RECURRENT);
+// evict the least recently used nodes until the cache fits in the cache_size budget; node pointers are only held
+// during a single search or write, so this runs once they are done and never finds dirty nodes
+static void ai_hnsw_cache_trim (ai_hnsw_vtab *vtab) {
+    size_t budget = (size_t)vtab->options.cache_size * 1024 * 1024;
+    ai_hnsw_node *node = vtab->lru_tail;
+    while (node && vtab->cache_bytes > budget) {
+        ai_hnsw_node *prev = node->prev;
+        if (!node->dirty) {
+            ai_hnsw_cache_remove(vtab, node);
+            sqlite3_free(node);
+        }
+        node = prev;
+    }
 }
 
-static void llm_model_chat_template (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // Get the default chat template. Returns nullptr if not available
-    // If name is NULL, returns the default chat template
-    llm_model_get_setting(context, argc, argv, AI_MODEL_CHAT_TEMPLATE);
+static ai_hnsw_node *ai_hnsw_node_alloc (ai_hnsw_vtab *vtab, sqlite3_int64 id, int level) {
+    int nlinks = vtab->options.m * 2 + level * vtab->options.m;
+    size_t size = sizeof(ai_hnsw_node) + sizeof(sqlite3_int64) * nlinks + sizeof(int32_t) * (level + 1) + vtab->row_bytes;
+    
+    ai_hnsw_node *node = (ai_hnsw_node *)sqlite3_malloc64(size);
+    if (!node) return NULL;
+    memset(node, 0, size);
+    
+    node->id = id;
+    node->level = level;
+    node->size = size;
+    node->links = (sqlite3_int64 *)(node + 1);
+    node->counts = (int32_t *)(node->links + nlinks);
+    node->vector = (uint8_t *)(node->counts + level + 1);
+    return node;
 }
 
-// MARK: - Vision -
+// the neighbors blob stores the neighbor count of each level followed by the neighbor ids of each level
+static void *ai_hnsw_node_serialize (ai_hnsw_vtab *vtab, ai_hnsw_node *node, int *size) {
+    int total = 0;
+    for (int l = 0; l <= node->level; ++l) total += node->counts[l];
+    
+    *size = (int)(sizeof(int32_t) * (node->level + 1) + sizeof(sqlite3_int64) * total);
+    uint8_t *blob = (uint8_t *)sqlite3_malloc(*size);
+    if (!blob) return NULL;
+    
+    memcpy(blob, node->counts, sizeof(int32_t) * (node->level + 1));
+    uint8_t *p = blob + sizeof(int32_t) * (node->level + 1);
+    for (int l = 0; l <= node->level; ++l) {
+        memcpy(p, ai_hnsw_links(vtab, node, l), sizeof(sqlite3_int64) * node->counts[l]);
+        p += sizeof(sqlite3_int64) * node->counts[l];
+    }
+    return blob;
+}
 
-#define OPTION_KEY_VISION_USE_GPU           "use_gpu"
-#define OPTION_KEY_VISION_N_THREADS         "n_threads"
-#define OPTION_KEY_VISION_WARMUP            "warmup"
-#define OPTION_KEY_VISION_IMAGE_MIN_TOKENS  "image_min_tokens"
-#define OPTION_KEY_VISION_IMAGE_MAX_TOKENS  "image_max_tokens"
+static bool ai_hnsw_node_deserialize (ai_hnsw_vtab *vtab, ai_hnsw_node *node, const uint8_t *blob, int size) {
+    int header = (int)sizeof(int32_t) * (node->level + 1);
+    if (size < header) return false;
+    memcpy(node->counts, blob, header);
+    
+    const uint8_t *p = blob + header;
+    int remaining = size - header;
+    for (int l = 0; l <= node->level; ++l) {
+        int count = node->counts[l];
+        if (count < 0 || count > ai_hnsw_capacity(vtab, l) || remaining < (int)sizeof(sqlite3_int64) * count) return false;
+        memcpy(ai_hnsw_links(vtab, node, l), p, sizeof(sqlite3_int64) * count);
+        p += sizeof(sqlite3_int64) * count;
+        remaining -= (int)sizeof(sqlite3_int64) * count;
+    }
+    return true;
+}
 
-static bool llm_vision_options_callback (void *ctx, void *xdata, const char *key, int key_len, const char *value, int value_len) {
-    struct mtmd_context_params *params = (struct mtmd_context_params *)xdata;
-    char buffer[256];
-    int len = (value_len < (int)sizeof(buffer) - 1) ? value_len : (int)sizeof(buffer) - 1;
-    memcpy(buffer, value, len);
-    buffer[len] = '\0';
+static int ai_hnsw_id_compare (const void *a, const void *b) {
+    sqlite3_int64 x = *(const sqlite3_int64 *)a;
+    sqlite3_int64 y = *(const sqlite3_int64 *)b;
+    return (x > y) - (x < y);
+}
 
-    if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_USE_GPU)) params->use_gpu = (atoi(value) != 0);
-    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_N_THREADS)) params->n_threads = atoi(value);
-    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_WARMUP)) params->warmup = (atoi(value) != 0);
-    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_IMAGE_MIN_TOKENS)) params->image_min_tokens = atoi(value);
-    else if (KEY_MATCHES(key, key_len, OPTION_KEY_VISION_IMAGE_MAX_TOKENS)) params->image_max_tokens = atoi(value);
-    else if (KEY_MATCHES(key, key_len, OPTION_KEY_FLASH_ATTN_TYPE)) {
-        if (strcasecmp(buffer, "auto") == 0) params->flash_attn_type = LLAMA_FLASH_ATTN_TYPE_AUTO;
-        else if (strcasecmp(buffer, "disabled") == 0) params->flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
-        else if (strcasecmp(buffer, "enabled") == 0) params->flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+// sorted distinct ids linked by a neighbors blob at any level (ids must hold all the links of level), -1 if the blob is malformed
+static int ai_hnsw_targets (ai_hnsw_vtab *vtab, int level, const uint8_t *blob, int size, sqlite3_int64 *ids) {
+    int header = (int)sizeof(int32_t) * (level + 1);
+    if (size < header) return (size == 0) ? 0 : -1;
+    
+    int total = 0;
+    for (int l = 0; l <= level; ++l) {
+        int32_t count;
+        memcpy(&count, blob + l * sizeof(int32_t), sizeof(int32_t));
+        if (count < 0 || count > ai_hnsw_capacity(vtab, l)) return -1;
+        total += count;
     }
-    return true;
+    if (size != header + (int)sizeof(sqlite3_int64) * total) return -1;
+    if (total == 0) return 0;
+    
+    memcpy(ids, blob + header, sizeof(sqlite3_int64) * total);
+    qsort(ids, total, sizeof(sqlite3_int64), ai_hnsw_id_compare);
+    int n = 1;
+    for (int i = 1; i < total; ++i) {
+        if (ids[i] != ids[n - 1]) ids[n++] = ids[i];
+    }
+    return n;
 }
 
-static void llm_vision_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (llm_common_args_check(context, "llm_vision_load", argc, argv, false) == false) return;
+// update the reverse links of source from the old to the new neighbor lists (both blobs in the format of the nodes table)
+static int ai_hnsw_refs_write (ai_hnsw_vtab *vtab, sqlite3_int64 source, int level, const void *old_blob, int old_size, const void *new_blob, int new_size) {
+    int nlinks = vtab->options.m * 2 + level * vtab->options.m;
+    sqlite3_int64 *ids = (sqlite3_int64 *)sqlite3_malloc64(sizeof(sqlite3_int64) * nlinks * 2);
+    if (!ids) return SQLITE_NOMEM;
+    
+    sqlite3_int64 *old_ids = ids, *new_ids = ids + nlinks;
+    int nold = ai_hnsw_targets(vtab, level, (const uint8_t *)old_blob, old_size, old_ids);
+    int nnew = ai_hnsw_targets(vtab, level, (const uint8_t *)new_blob, new_size, new_ids);
+    if (nold < 0 || nnew < 0) {
+        sqlite3_free(ids);
+        return sqlite_vtab_set_error(&vtab->base, "ai_hnsw node %lld is corrupted", (long long)source);
+    }
+    
+    // merge of the two sorted lists: ids only in the old list are removed, ids only in the new list are added
+    int rc = SQLITE_OK;
+    int i = 0, j = 0;
+    while (rc == SQLITE_OK && (i < nold || j < nnew)) {
+        sqlite3_stmt *stmt;
+        sqlite3_int64 target;
+        if (j == nnew || (i < nold && old_ids[i] < new_ids[j])) {
+            target = old_ids[i++];
+            stmt = ai_hnsw_statement(vtab, &vtab->stmt_ref_delete, "DELETE FROM \"%w\".\"%w_refs\" WHERE target = ?1 AND source = ?2;");
+        } else if (i == nold || new_ids[j] < old_ids[i]) {
+            target = new_ids[j++];
+            stmt = ai_hnsw_statement(vtab, &vtab->stmt_ref_insert, "INSERT OR IGNORE INTO \"%w\".\"%w_refs\" (target, source) VALUES (?1, ?2);");
+        } else {
+            i++;
+            j++;
+            continue;
+        }
+        if (!stmt) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+        sqlite3_bind_int64(stmt, 1, target);
+        sqlite3_bind_int64(stmt, 2, source);
+        rc = ai_hnsw_step(vtab, stmt);
+    }
+    sqlite3_free(ids);
+    return rc;
+}
 
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (!ai->model) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "No model loaded. Call llm_model_load() before llm_vision_load().");
-        return;
+// fill the refs table of an index created before it existed
+static int ai_hnsw_refs_build (ai_hnsw_vtab *vtab) {
+    char *sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\".\"%w_refs\" (target INTEGER NOT NULL, source INTEGER NOT NULL, PRIMARY KEY (target, source)) WITHOUT ROWID;", vtab->schema, vtab->name);
+    int rc = (sql) ? sqlite3_exec(vtab->db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    
+    sql = sqlite3_mprintf("SELECT id, level, neighbors FROM \"%w\".\"%w_nodes\";", vtab->schema, vtab->name);
+    sqlite3_stmt *vm = NULL;
+    rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    
+    int step = SQLITE_DONE;
+    while (rc == SQLITE_OK && (step = sqlite3_step(vm)) == SQLITE_ROW) {
+        int level = sqlite3_column_int(vm, 1);
+        if (level < 0 || level > AI_HNSW_MAX_LEVEL) {
+            rc = sqlite_vtab_set_error(&vtab->base, "ai_hnsw node %lld is corrupted", (long long)sqlite3_column_int64(vm, 0));
+            break;
+        }
+        rc = ai_hnsw_refs_write(vtab, sqlite3_column_int64(vm, 0), level, NULL, 0, sqlite3_column_blob(vm, 2), sqlite3_column_bytes(vm, 2));
     }
+    if (rc == SQLITE_OK && step != SQLITE_DONE) rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    sqlite3_finalize(vm);
+    if (rc == SQLITE_OK) vtab->has_refs = true;
+    return rc;
+}
 
-    const char *path = (const char *)sqlite3_value_text(argv[0]);
-    const char *options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+// returns the node with the given id from the cache or the nodes table, NULL if it doesn't exist (links to deleted
+// nodes are skipped) or if an error occurred (vtab->rc is set)
+static ai_hnsw_node *ai_hnsw_node_get (ai_hnsw_vtab *vtab, sqlite3_int64 id) {
+    ai_hnsw_node *node = ai_hnsw_cache_find(vtab, id);
+    if (node) {
+        ai_hnsw_lru_touch(vtab, node);
+        return node;
+    }
+    
+    sqlite3_stmt *stmt = ai_hnsw_statement(vtab, &vtab->stmt_load, "SELECT level, vector, neighbors FROM \"%w\".\"%w_nodes\" WHERE id = ?1;");
+    if (!stmt) return NULL;
+    
+    sqlite3_bind_int64(stmt, 1, id);
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        if (rc != SQLITE_DONE) {
+            vtab->rc = rc;
+            sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        }
+        sqlite3_reset(stmt);
+        return NULL;
+    }
+    
+    int level = sqlite3_column_int(stmt, 0);
+    int bytes = sqlite3_column_bytes(stmt, 1);
+    if (level < 0 || level > AI_HNSW_MAX_LEVEL || bytes != vtab->row_bytes) {
+        vtab->rc = SQLITE_CORRUPT_VTAB;
+        sqlite_vtab_set_error(&vtab->base, "ai_hnsw node %lld is corrupted", (long long)id);
+        sqlite3_reset(stmt);
+        return NULL;
+    }
+    
+    node = ai_hnsw_node_alloc(vtab, id, level);
+    if (!node || !ai_hnsw_cache_add(vtab, node)) {
+        sqlite3_free(node);
+        vtab->rc = SQLITE_NOMEM;
+        sqlite3_reset(stmt);
+        return NULL;
+    }
+    memcpy(node->vector, sqlite3_column_blob(stmt, 1), bytes);
+    if (!ai_hnsw_node_deserialize(vtab, node, (const uint8_t *)sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2))) {
+        vtab->rc = SQLITE_CORRUPT_VTAB;
+        sqlite_vtab_set_error(&vtab->base, "ai_hnsw node %lld is corrupted", (long long)id);
+    }
+    sqlite3_reset(stmt);
+    return node;
+}
 
-    struct mtmd_context_params params = mtmd_context_params_default();
-    params.use_gpu = true;
-    params.n_threads = 4;
-    params.warmup = true;
+static bool ai_hnsw_node_touch (ai_hnsw_vtab *vtab, ai_hnsw_node *node) {
+    if (node->dirty) return true;
+    
+    if (vtab->ndirty == vtab->dirty_capacity) {
+        int capacity = (vtab->dirty_capacity) ? vtab->dirty_capacity * 2 : 64;
+        ai_hnsw_node **dirty = (ai_hnsw_node **)sqlite3_realloc64(vtab->dirty, sizeof(ai_hnsw_node *) * capacity);
+        if (!dirty) return false;
+        vtab->dirty = dirty;
+        vtab->dirty_capacity = capacity;
+    }
+    vtab->dirty[vtab->ndirty++] = node;
+    node->dirty = true;
+    return true;
+}
 
-    if (parse_keyvalue_string(ai, options, llm_vision_options_callback, &params) == false) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
-        return;
+// write the nodes changed by the current insert or delete to the nodes table
+static int ai_hnsw_flush (ai_hnsw_vtab *vtab) {
+    int rc = SQLITE_OK;
+    for (int i = 0; i < vtab->ndirty && rc == SQLITE_OK; ++i) {
+        ai_hnsw_node *node = vtab->dirty[i];
+        node->dirty = false;
+    
+        int size = 0;
+        void *neighbors = ai_hnsw_node_serialize(vtab, node, &size);
+        if (!neighbors) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+    
+        // the reverse links follow the difference between the stored and the new neighbor lists
+        if (node->inserted) {
+            rc = ai_hnsw_refs_write(vtab, node->id, node->level, NULL, 0, neighbors, size);
+        } else {
+            sqlite3_stmt *stmt = ai_hnsw_statement(vtab, &vtab->stmt_neighbors, "SELECT neighbors FROM \"%w\".\"%w_nodes\" WHERE id = ?1;");
+            if (stmt) {
+                sqlite3_bind_int64(stmt, 1, node->id);
+                int step = sqlite3_step(stmt);
+                if (step == SQLITE_ROW) rc = ai_hnsw_refs_write(vtab, node->id, node->level, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0), neighbors, size);
+                else if (step != SQLITE_DONE) rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+                sqlite3_reset(stmt);
+            } else {
+                rc = SQLITE_ERROR;
+            }
+        }
+        if (rc != SQLITE_OK) {
+            sqlite3_free(neighbors);
+            break;
+        }
+    
+        sqlite3_stmt *stmt;
+        if (node->inserted) {
+            stmt = ai_hnsw_statement(vtab, &vtab->stmt_insert, "INSERT INTO \"%w\".\"%w_nodes\" (id, level, vector, neighbors) VALUES (?1, ?2, ?3, ?4);");
+            if (stmt) {
+                sqlite3_bind_int64(stmt, 1, node->id);
+                sqlite3_bind_int(stmt, 2, node->level);
+                sqlite3_bind_blob(stmt, 3, node->vector, vtab->row_bytes, SQLITE_STATIC);
+                sqlite3_bind_blob(stmt, 4, neighbors, size, SQLITE_STATIC);
+            }
+        } else {
+            stmt = ai_hnsw_statement(vtab, &vtab->stmt_update, "UPDATE \"%w\".\"%w_nodes\" SET neighbors = ?2 WHERE id = ?1;");
+            if (stmt) {
+                sqlite3_bind_int64(stmt, 1, node->id);
+                sqlite3_bind_blob(stmt, 2, neighbors, size, SQLITE_STATIC);
+            }
+        }
+        rc = (stmt) ? ai_hnsw_step(vtab, stmt) : SQLITE_ERROR;
+        if (stmt) sqlite3_clear_bindings(stmt);
+        if (rc == SQLITE_OK) node->inserted = false;
+        sqlite3_free(neighbors);
     }
+    
+    // after an error the caller discards the whole cache
+    for (int i = 0; i < vtab->ndirty; ++i) vtab->dirty[i]->dirty = false;
+    vtab->ndirty = 0;
+    return rc;
+}
 
-    if (ai->vision) {
-        mtmd_free(ai->vision);
-        ai->vision = NULL;
+// reload the graph state when the index was changed by another connection (or after a rollback)
+static int ai_hnsw_sync (ai_hnsw_vtab *vtab) {
+    vtab->rc = SQLITE_OK;
+    sqlite3_stmt *stmt = ai_hnsw_statement(vtab, &vtab->stmt_version, "SELECT key, value FROM \"%w\".\"%w_config\" WHERE key IN ('version', 'entry', 'max_level');");
+    if (!stmt) return SQLITE_ERROR;
+    
+    sqlite3_int64 version = 0, entry = 0;
+    int max_level = 0;
+    bool has_entry = false;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *key = (const char *)sqlite3_column_text(stmt, 0);
+        if (!key) continue;
+        if (strcmp(key, "version") == 0) version = sqlite3_column_int64(stmt, 1);
+        else if (strcmp(key, "max_level") == 0) max_level = sqlite3_column_int(stmt, 1);
+        else if (strcmp(key, "entry") == 0 && sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+            entry = sqlite3_column_int64(stmt, 1);
+            has_entry = true;
+        }
     }
-
-    ai->vision = mtmd_init_from_file(path, ai->model, params);
-    if (!ai->vision) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to load vision model from: %s", path);
-        return;
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    
+    if (version != vtab->version) {
+        ai_hnsw_cache_clear(vtab);
+        vtab->version = version;
+        vtab->entry = entry;
+        vtab->max_level = max_level;
+        vtab->has_entry = has_entry;
     }
+    return SQLITE_OK;
 }
 
-static void llm_vision_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    if (ai->vision) {
-        mtmd_free(ai->vision);
-        ai->vision = NULL;
+// MARK: Graph
+
+// greedy descent from the entry point through the levels above level
+static ai_hnsw_node *ai_hnsw_descend (ai_hnsw_vtab *vtab, const void *query, vector_type query_type, ai_hnsw_node *ep, float *distance, int level) {
+    float d = ai_hnsw_query_distance(vtab, query, query_type, ep);
+    for (int l = vtab->max_level; l > level; --l) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            if (ep->level < l) break;
+            sqlite3_int64 *links = ai_hnsw_links(vtab, ep, l);
+            for (int i = 0; i < ep->counts[l]; ++i) {
+                ai_hnsw_node *n = ai_hnsw_node_get(vtab, links[i]);
+                if (!n || n->level < l) continue;
+                float dn = ai_hnsw_query_distance(vtab, query, query_type, n);
+                if (dn < d) {
+                    d = dn;
+                    ep = n;
+                    changed = true;
+                }
+            }
+        }
     }
+    *distance = d;
+    return ep;
 }
 
-// Helper: load bitmaps from sqlite3_value args (TEXT = file path, BLOB = raw data)
-static mtmd_bitmap **llm_vision_load_bitmaps (ai_context *ai, sqlite3_context *context,
-                                               sqlite3_value **images, int n_images) {
-    mtmd_bitmap **bitmaps = (mtmd_bitmap **)sqlite3_malloc64(sizeof(mtmd_bitmap *) * n_images);
-    if (!bitmaps) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-        return NULL;
+// best-first search of a single level starting from the entries, the ef nearest nodes are returned sorted by distance
+static int ai_hnsw_search_level (ai_hnsw_vtab *vtab, const void *query, vector_type query_type, ai_hnsw_candidate *entries, int nentries, int ef, int level, ai_hnsw_heap *results) {
+    if (++vtab->epoch == 0) {
+        // the epoch wrapped around, reset the marks
+        for (uint32_t i = 0; i < vtab->nslots; ++i) if (vtab->slots[i]) vtab->slots[i]->visited = 0;
+        vtab->epoch = 1;
     }
-    memset(bitmaps, 0, sizeof(mtmd_bitmap *) * n_images);
-
-    for (int i = 0; i < n_images; i++) {
-        int type = sqlite3_value_type(images[i]);
-        if (type == SQLITE_TEXT) {
-            const char *path = (const char *)sqlite3_value_text(images[i]);
-            bitmaps[i] = mtmd_helper_bitmap_init_from_file(ai->vision, path);
-        } else if (type == SQLITE_BLOB) {
-            const void *data = sqlite3_value_blob(images[i]);
-            int len = sqlite3_value_bytes(images[i]);
-            bitmaps[i] = mtmd_helper_bitmap_init_from_buf(ai->vision, (const unsigned char *)data, len);
+    
+    ai_hnsw_heap candidates = {.max = false};
+    results->count = 0;
+    results->max = true;
+    
+    int rc = SQLITE_OK;
+    for (int i = 0; i < nentries; ++i) {
+        entries[i].node->visited = vtab->epoch;
+        if (!ai_hnsw_heap_push(&candidates, entries[i].distance, entries[i].node) || !ai_hnsw_heap_push(results, entries[i].distance, entries[i].node)) {
+            rc = SQLITE_NOMEM;
+            goto cleanup;
         }
-        if (!bitmaps[i]) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to load image (argument %d)", i + 2);
-            for (int j = 0; j < i; j++) mtmd_bitmap_free(bitmaps[j]);
-            sqlite3_free(bitmaps);
-            return NULL;
+        if (results->count > ef) ai_hnsw_heap_pop(results);
+    }
+    
+    while (candidates.count > 0) {
+        ai_hnsw_candidate c = ai_hnsw_heap_pop(&candidates);
+        if (results->count >= ef && c.distance > results->items[0].distance) break;
+        if (c.node->level < level) continue;
+    
+        // loading a node can grow the cache but never moves the nodes already loaded
+        sqlite3_int64 *links = ai_hnsw_links(vtab, c.node, level);
+        for (int i = 0; i < c.node->counts[level]; ++i) {
+            ai_hnsw_node *n = ai_hnsw_node_get(vtab, links[i]);
+            if (!n) {
+                if (vtab->rc != SQLITE_OK) {
+                    rc = vtab->rc;
+                    goto cleanup;
+                }
+                continue;
+            }
+            if (n->visited == vtab->epoch || n->level < level) continue;
+            n->visited = vtab->epoch;
+    
+            float d = ai_hnsw_query_distance(vtab, query, query_type, n);
+            if (isnan(d)) continue;
+            if (results->count < ef || d < results->items[0].distance) {
+                if (!ai_hnsw_heap_push(&candidates, d, n) || !ai_hnsw_heap_push(results, d, n)) {
+                    rc = SQLITE_NOMEM;
+                    goto cleanup;
+                }
+                if (results->count > ef) ai_hnsw_heap_pop(results);
+            }
         }
     }
-    return bitmaps;
-}
+    
+    qsort(results->items, results->count, sizeof(ai_hnsw_candidate), ai_hnsw_candidate_compare);
 
-// Helper: build prompt text with <__media__> markers prepended for each image
-static char *llm_vision_build_prompt (const char *text, int32_t text_len, int n_images, int32_t *out_len) {
-    const char *marker = mtmd_default_marker();
-    size_t marker_len = strlen(marker);
-    size_t total = text_len + (marker_len + 1) * n_images + 1;
-    char *prompt = (char *)sqlite3_malloc64(total);
-    if (!prompt) return NULL;
+cleanup:
+    sqlite3_free(candidates.items);
+    return rc;
+}
 
-    char *p = prompt;
-    for (int i = 0; i < n_images; i++) {
-        memcpy(p, marker, marker_len);
-        p += marker_len;
-        *p++ = '\n';
+// neighbor selection heuristic: a candidate is kept only if it is nearer to the base than to any neighbor already
+// kept, so links spread in different directions; the pruned candidates fill the remaining slots
+static int ai_hnsw_select (ai_hnsw_vtab *vtab, ai_hnsw_candidate *candidates, int count, int capacity, sqlite3_int64 *links) {
+    if (count <= capacity) {
+        for (int i = 0; i < count; ++i) links[i] = candidates[i].node->id;
+        return count;
     }
-    memcpy(p, text, text_len);
-    p += text_len;
-    *p = '\0';
-    *out_len = (int32_t)(p - prompt);
-    return prompt;
+    
+    int chosen[AI_HNSW_MAX_M * 2];
+    int nchosen = 0;
+    for (int i = 0; i < count && nchosen < capacity; ++i) {
+        bool good = true;
+        for (int j = 0; j < nchosen && good; ++j) {
+            if (ai_hnsw_distance(vtab, candidates[i].node, candidates[chosen[j]].node) < candidates[i].distance) good = false;
+        }
+        if (good) chosen[nchosen++] = i;
+    }
+    
+    int nselected = 0;
+    for (int j = 0; j < nchosen; ++j) links[nselected++] = candidates[chosen[j]].node->id;
+    
+    // keep the pruned connections up to capacity (chosen is sorted)
+    for (int i = 0, j = 0; i < count && nselected < capacity; ++i) {
+        if (j < nchosen && chosen[j] == i) {
+            j++;
+            continue;
+        }
+        links[nselected++] = candidates[i].node->id;
+    }
+    return nselected;
 }
 
-static void llm_text_run_vision (sqlite3_context *context, const char *text, int32_t text_len,
-                                  sqlite3_value **images, int n_images) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    buffer_t buffer = {0};
-    bool buffer_initialized = false;
-    char *prompt_with_markers = NULL;
-    char *formatted_prompt = NULL;
-    mtmd_bitmap **bitmaps = NULL;
-    mtmd_input_chunks *chunks = NULL;
-
-    struct llama_context *ctx = ai->ctx;
-    if (!ctx) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "No context found. Please call llm_context_create() before using this function.");
-        return;
+// rebuild the neighbor list of node at level from the candidate ids
+static int ai_hnsw_relink (ai_hnsw_vtab *vtab, ai_hnsw_node *node, int level, const sqlite3_int64 *ids, int count) {
+    ai_hnsw_candidate *candidates = (ai_hnsw_candidate *)sqlite3_malloc64(sizeof(ai_hnsw_candidate) * (count + 1));
+    if (!candidates) return SQLITE_NOMEM;
+    
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        if (ids[i] == node->id) continue;
+        bool duplicated = false;
+        for (int j = 0; j < n && !duplicated; ++j) duplicated = (candidates[j].node->id == ids[i]);
+        if (duplicated) continue;
+    
+        ai_hnsw_node *other = ai_hnsw_node_get(vtab, ids[i]);
+        if (!other) {
+            if (vtab->rc != SQLITE_OK) {
+                sqlite3_free(candidates);
+                return vtab->rc;
+            }
+            continue;
+        }
+        if (other->level < level) continue;
+        candidates[n].node = other;
+        candidates[n].distance = ai_hnsw_distance(vtab, node, other);
+        n++;
     }
+    qsort(candidates, n, sizeof(ai_hnsw_candidate), ai_hnsw_candidate_compare);
+    
+    node->counts[level] = ai_hnsw_select(vtab, candidates, n, ai_hnsw_capacity(vtab, level), ai_hnsw_links(vtab, node, level));
+    sqlite3_free(candidates);
+    return ai_hnsw_node_touch(vtab, node) ? SQLITE_OK : SQLITE_NOMEM;
+}
 
-    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
-    if (!vocab) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to extract vocabulary from the model");
-        return;
+static int ai_hnsw_insert (ai_hnsw_vtab *vtab, sqlite3_int64 id, const void *vector) {
+    int level = ai_hnsw_random_level(vtab, id);
+    ai_hnsw_node *node = ai_hnsw_node_alloc(vtab, id, level);
+    if (!node) return SQLITE_NOMEM;
+    if (!ai_hnsw_cache_add(vtab, node)) {
+        sqlite3_free(node);
+        return SQLITE_NOMEM;
+    }
+    memcpy(node->vector, vector, vtab->row_bytes);
+    node->inserted = true;
+    if (!ai_hnsw_node_touch(vtab, node)) return SQLITE_NOMEM;
+    
+    ai_hnsw_node *ep = (vtab->has_entry) ? ai_hnsw_node_get(vtab, vtab->entry) : NULL;
+    if (!ep && vtab->rc != SQLITE_OK) return vtab->rc;
+    
+    int rc = SQLITE_OK;
+    ai_hnsw_heap results = {.max = true};
+    ai_hnsw_candidate *entries = NULL;
+    sqlite3_int64 *ids = NULL;
+    
+    if (ep) {
+        float distance;
+        ep = ai_hnsw_descend(vtab, node->vector, vtab->options.type, ep, &distance, level);
+        if (vtab->rc != SQLITE_OK) return vtab->rc;
+    
+        entries = (ai_hnsw_candidate *)sqlite3_malloc64(sizeof(ai_hnsw_candidate));
+        ids = (sqlite3_int64 *)sqlite3_malloc64(sizeof(sqlite3_int64) * (ai_hnsw_capacity(vtab, 0) + 1));
+        if (!entries || !ids) {
+            rc = SQLITE_NOMEM;
+            goto cleanup;
+        }
+        entries[0] = (ai_hnsw_candidate){.distance = distance, .node = ep};
+        int nentries = 1;
+        int entries_capacity = 1;
+    
+        int top = (level < vtab->max_level) ? level : vtab->max_level;
+        for (int l = top; l >= 0; --l) {
+            rc = ai_hnsw_search_level(vtab, node->vector, vtab->options.type, entries, nentries, vtab->options.ef_construction, l, &results);
+            if (rc != SQLITE_OK) goto cleanup;
+    
+            node->counts[l] = ai_hnsw_select(vtab, results.items, results.count, vtab->options.m, ai_hnsw_links(vtab, node, l));
+    
+            // add the reverse links, shrinking the neighbor lists that overflow
+            for (int i = 0; i < node->counts[l]; ++i) {
+                ai_hnsw_node *n = ai_hnsw_node_get(vtab, ai_hnsw_links(vtab, node, l)[i]);
+                if (!n) continue;
+    
+                int capacity = ai_hnsw_capacity(vtab, l);
+                sqlite3_int64 *links = ai_hnsw_links(vtab, n, l);
+                if (n->counts[l] < capacity) {
+                    links[n->counts[l]++] = id;
+                    if (!ai_hnsw_node_touch(vtab, n)) {
+                        rc = SQLITE_NOMEM;
+                        goto cleanup;
+                    }
+                    continue;
+                }
+                memcpy(ids, links, sizeof(sqlite3_int64) * n->counts[l]);
+                ids[n->counts[l]] = id;
+                rc = ai_hnsw_relink(vtab, n, l, ids, n->counts[l] + 1);
+                if (rc != SQLITE_OK) goto cleanup;
+            }
+    
+            // the nearest nodes of this level are the entry points of the next one
+            if (results.count == 0) break;
+            if (results.count > entries_capacity) {
+                ai_hnsw_candidate *tmp = (ai_hnsw_candidate *)sqlite3_realloc64(entries, sizeof(ai_hnsw_candidate) * results.count);
+                if (!tmp) {
+                    rc = SQLITE_NOMEM;
+                    goto cleanup;
+                }
+                entries = tmp;
+                entries_capacity = results.count;
+            }
+            memcpy(entries, results.items, sizeof(ai_hnsw_candidate) * results.count);
+            nentries = results.count;
+        }
+    }
+    
+    if (!ep || level > vtab->max_level) {
+        vtab->entry = id;
+        vtab->max_level = level;
+        vtab->has_entry = true;
     }
 
-    // clear KV cache
-    llama_memory_t memory = llama_get_memory(ctx);
-    if (memory) llama_memory_clear(memory, true);
+cleanup:
+    sqlite3_free(results.items);
+    sqlite3_free(entries);
+    sqlite3_free(ids);
+    return rc;
+}
 
-    // build prompt with media markers
-    int32_t prompt_total_len;
-    prompt_with_markers = llm_vision_build_prompt(text, text_len, n_images, &prompt_total_len);
-    if (!prompt_with_markers) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-        return;
+static bool ai_hnsw_links_to (ai_hnsw_vtab *vtab, ai_hnsw_node *node, int level, sqlite3_int64 id) {
+    if (node->level < level) return false;
+    
+    sqlite3_int64 *links = ai_hnsw_links(vtab, node, level);
+    for (int i = 0; i < node->counts[level]; ++i) {
+        if (links[i] == id) return true;
     }
+    return false;
+}
 
-    // wrap with chat template if available
-    const char *final_text = prompt_with_markers;
-    const char *chat_template = llama_model_chat_template(ai->model, NULL);
-    if (chat_template) {
-        llama_chat_message messages[] = {{ ROLE_USER, prompt_with_markers }};
-        int32_t formatted_len = llama_chat_apply_template(chat_template, messages, 1, true, NULL, 0);
-        if (formatted_len > 0) {
-            formatted_prompt = (char *)sqlite3_malloc64(formatted_len + 1);
-            if (formatted_prompt) {
-                llama_chat_apply_template(chat_template, messages, 1, true, formatted_prompt, formatted_len + 1);
-                formatted_prompt[formatted_len] = '\0';
-                final_text = formatted_prompt;
+// replace the link from n to the deleted node with the best of the remaining neighbors of both nodes
+static int ai_hnsw_unlink (ai_hnsw_vtab *vtab, ai_hnsw_node *n, ai_hnsw_node *node, int level, sqlite3_int64 *ids) {
+    int count = 0;
+    sqlite3_int64 *links = ai_hnsw_links(vtab, n, level);
+    for (int j = 0; j < n->counts[level]; ++j) if (links[j] != node->id) ids[count++] = links[j];
+    links = ai_hnsw_links(vtab, node, level);
+    for (int j = 0; j < node->counts[level]; ++j) if (links[j] != node->id) ids[count++] = links[j];
+    
+    return ai_hnsw_relink(vtab, n, level, ids, count);
+}
+
+static int ai_hnsw_delete (ai_hnsw_vtab *vtab, sqlite3_int64 id) {
+    ai_hnsw_node *node = ai_hnsw_node_get(vtab, id);
+    if (!node) return vtab->rc;
+    
+    int rc = SQLITE_OK;
+    int capacity = ai_hnsw_capacity(vtab, 0);
+    sqlite3_int64 *ids = (sqlite3_int64 *)sqlite3_malloc64(sizeof(sqlite3_int64) * capacity * 2);
+    if (!ids) return SQLITE_NOMEM;
+    
+    // reconnect each neighbor to the remaining neighbors of both nodes
+    for (int l = 0; l <= node->level && rc == SQLITE_OK; ++l) {
+        for (int i = 0; i < node->counts[l]; ++i) {
+            ai_hnsw_node *n = ai_hnsw_node_get(vtab, ai_hnsw_links(vtab, node, l)[i]);
+            if (!n) {
+                if ((rc = vtab->rc) != SQLITE_OK) break;
+                continue;
             }
+            if (n->level < l) continue;
+            rc = ai_hnsw_unlink(vtab, n, node, l, ids);
+            if (rc != SQLITE_OK) break;
         }
     }
-
-    // load bitmaps
-    bitmaps = llm_vision_load_bitmaps(ai, context, images, n_images);
-    if (!bitmaps) goto error;
-
-    // tokenize with mtmd
-    chunks = mtmd_input_chunks_init();
-    if (!chunks) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-        goto error;
+    
+    // links are not symmetric, the other nodes that point to the deleted one are read from the refs table
+    // (the pending writes are flushed after each change, so it matches the cached lists)
+    sqlite3_stmt *stmt = (rc == SQLITE_OK) ? ai_hnsw_statement(vtab, &vtab->stmt_refs, "SELECT source FROM \"%w\".\"%w_refs\" WHERE target = ?1;") : NULL;
+    if (rc == SQLITE_OK && !stmt) rc = SQLITE_ERROR;
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, id);
+        int step = SQLITE_DONE;
+        while (rc == SQLITE_OK && (step = sqlite3_step(stmt)) == SQLITE_ROW) {
+            ai_hnsw_node *n = ai_hnsw_node_get(vtab, sqlite3_column_int64(stmt, 0));
+            if (!n) {
+                rc = vtab->rc;
+                continue;
+            }
+            for (int l = 0; l <= n->level && l <= node->level && rc == SQLITE_OK; ++l) {
+                if (n != node && ai_hnsw_links_to(vtab, n, l, id)) rc = ai_hnsw_unlink(vtab, n, node, l, ids);
+            }
+        }
+        if (rc == SQLITE_OK && step != SQLITE_DONE) rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        sqlite3_reset(stmt);
+    }
+    sqlite3_free(ids);
+    if (rc != SQLITE_OK) return rc;
+    
+    // the links of the deleted node (the ones pointing to it are removed when the relinked nodes are flushed)
+    int size = 0;
+    void *neighbors = ai_hnsw_node_serialize(vtab, node, &size);
+    if (!neighbors) return SQLITE_NOMEM;
+    rc = ai_hnsw_refs_write(vtab, id, node->level, neighbors, size, NULL, 0);
+    sqlite3_free(neighbors);
+    if (rc != SQLITE_OK) return rc;
+    
+    stmt = ai_hnsw_statement(vtab, &vtab->stmt_delete, "DELETE FROM \"%w\".\"%w_nodes\" WHERE id = ?1;");
+    if (!stmt) return SQLITE_ERROR;
+    sqlite3_bind_int64(stmt, 1, id);
+    rc = ai_hnsw_step(vtab, stmt);
+    if (rc != SQLITE_OK) return rc;
+    
+    // drop the node from the pending writes and from the cache
+    for (int i = 0; i < vtab->ndirty; ++i) {
+        if (vtab->dirty[i] != node) continue;
+        vtab->dirty[i] = vtab->dirty[--vtab->ndirty];
+        break;
     }
+    ai_hnsw_cache_remove(vtab, node);
+    sqlite3_free(node);
+    
+    if (vtab->entry != id) return SQLITE_OK;
+    
+    // the new entry point is the node with the highest level
+    char *sql = sqlite3_mprintf("SELECT id, level FROM \"%w\".\"%w_nodes\" ORDER BY level DESC LIMIT 1;", vtab->schema, vtab->name);
+    if (!sql) return SQLITE_NOMEM;
+    sqlite3_stmt *vm = NULL;
+    rc = sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    
+    rc = sqlite3_step(vm);
+    vtab->has_entry = (rc == SQLITE_ROW);
+    vtab->entry = (rc == SQLITE_ROW) ? sqlite3_column_int64(vm, 0) : 0;
+    vtab->max_level = (rc == SQLITE_ROW) ? sqlite3_column_int(vm, 1) : 0;
+    rc = (rc == SQLITE_ROW || rc == SQLITE_DONE) ? SQLITE_OK : sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    sqlite3_finalize(vm);
+    return rc;
+}
 
-    mtmd_input_text input_text = { final_text, true, true };
-    int32_t rc = mtmd_tokenize(ai->vision, chunks, &input_text, (const mtmd_bitmap **)bitmaps, n_images);
-    if (rc != 0) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to tokenize multimodal input (error %d)", rc);
-        goto error;
+static int ai_hnsw_search (ai_hnsw_vtab *vtab, const void *query, vector_type query_type, int k, ai_hnsw_cursor *c) {
+    if (!vtab->has_entry) return SQLITE_OK;
+    
+    ai_hnsw_node *ep = ai_hnsw_node_get(vtab, vtab->entry);
+    if (!ep) return vtab->rc;
+    
+    float distance;
+    ep = ai_hnsw_descend(vtab, query, query_type, ep, &distance, 0);
+    if (vtab->rc != SQLITE_OK) return vtab->rc;
+    
+    ai_hnsw_candidate entry = {.distance = distance, .node = ep};
+    ai_hnsw_heap results = {.max = true};
+    int ef = (vtab->options.ef_search > k) ? vtab->options.ef_search : k;
+    int rc = ai_hnsw_search_level(vtab, query, query_type, &entry, 1, ef, 0, &results);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    int count = (results.count < k) ? results.count : k;
+    c->ids = (sqlite3_int64 *)sqlite3_malloc64(sizeof(sqlite3_int64) * (count + 1));
+    c->distances = (float *)sqlite3_malloc64(sizeof(float) * (count + 1));
+    if (!c->ids || !c->distances) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
     }
+    for (int i = 0; i < count; ++i) {
+        c->ids[i] = results.items[i].node->id;
+        c->distances[i] = results.items[i].distance;
+    }
+    c->count = count;
 
-    // eval chunks (vision encoder + text)
-    {
-        llama_pos n_past = 0;
-        int n_batch = (int)llama_n_batch(ctx);
-        rc = mtmd_helper_eval_chunks(ai->vision, ctx, chunks, n_past, 0, n_batch, true, &n_past);
-        if (rc != 0) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to evaluate multimodal prompt (error %d)", rc);
-            goto error;
+cleanup:
+    sqlite3_free(results.items);
+    ai_hnsw_cache_trim(vtab);
+    return rc;
+}
+
+// MARK: Module
+
+static int ai_hnsw_init (sqlite3 *db, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr, bool create) {
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(embedding, distance hidden, k hidden);");
+    if (rc != SQLITE_OK) return rc;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    
+    ai_hnsw_vtab *vtab = (ai_hnsw_vtab *)sqlite3_malloc(sizeof(ai_hnsw_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    
+    memset(vtab, 0, sizeof(ai_hnsw_vtab));
+    vtab->db = db;
+    vtab->schema = sqlite_strdup(argv[1]);
+    vtab->name = sqlite_strdup(argv[2]);
+    vtab->version = -1;
+    if (!vtab->schema || !vtab->name) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    
+    ai_hnsw_options *options = &vtab->options;
+    *options = (ai_hnsw_options){.type = VECTOR_TYPE_F32, .metric = VECTOR_METRIC_COSINE, .m = AI_HNSW_DEFAULT_M, .ef_construction = AI_HNSW_DEFAULT_EF_CONSTRUCTION, .ef_search = AI_HNSW_DEFAULT_EF_SEARCH, .cache_size = AI_HNSW_DEFAULT_CACHE_SIZE};
+    
+    if (create) {
+        // each module argument is a key=value pair
+        for (int i = 3; i < argc; ++i) {
+            if (!strchr(argv[i], '=') || !parse_keyvalue_string(NULL, argv[i], ai_hnsw_options_callback, options)) {
+                *pzErr = sqlite3_mprintf("ai_hnsw invalid option: %s", argv[i]);
+                rc = SQLITE_ERROR;
+                goto cleanup;
+            }
+        }
+    } else {
+        char *sql = sqlite3_mprintf("SELECT key, value FROM \"%w\".\"%w_config\";", vtab->schema, vtab->name);
+        sqlite3_stmt *vm = NULL;
+        rc = (sql) ? sqlite3_prepare_v2(db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        while (rc == SQLITE_OK && sqlite3_step(vm) == SQLITE_ROW) {
+            const char *key = (const char *)sqlite3_column_text(vm, 0);
+            int value = sqlite3_column_int(vm, 1);
+            if (!key) continue;
+            if (strcmp(key, OPTION_KEY_DIMENSION) == 0) options->dimension = value;
+            else if (strcmp(key, OPTION_KEY_EMBEDDING_TYPE) == 0) options->type = (vector_type)value;
+            else if (strcmp(key, OPTION_KEY_DISTANCE) == 0) options->metric = (vector_metric)value;
+            else if (strcmp(key, OPTION_KEY_M) == 0) options->m = value;
+            else if (strcmp(key, OPTION_KEY_EF_CONSTRUCTION) == 0) options->ef_construction = value;
+            else if (strcmp(key, OPTION_KEY_EF_SEARCH) == 0) options->ef_search = value;
+            else if (strcmp(key, OPTION_KEY_CACHE_SIZE) == 0) options->cache_size = value;
+        }
+        if (vm) sqlite3_finalize(vm);
+        if (rc != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            goto cleanup;
+        }
+        
+        // connecting must not write (the database can be read-only), a missing refs table is built by the first write
+        sql = sqlite3_mprintf("SELECT 1 FROM \"%w\".sqlite_master WHERE type = 'table' AND name = '%q_refs';", vtab->schema, vtab->name);
+        vm = NULL;
+        rc = (sql) ? sqlite3_prepare_v2(db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc == SQLITE_OK) vtab->has_refs = (sqlite3_step(vm) == SQLITE_ROW);
+        if (vm) sqlite3_finalize(vm);
+        if (rc != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            goto cleanup;
         }
     }
-
-    // initialize sampler
-    bool sampler_already_setup = (ai->sampler != NULL);
-    struct llama_sampler *sampler = llm_sampler_check(ai);
-    if (!sampler) goto error;
-    if (!sampler_already_setup) {
-        llama_sampler_chain_add(sampler, llama_sampler_init_penalties(64, 1.1, 0, 0));
-        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+    
+    if (options->dimension <= 0 || options->dimension > AI_HNSW_MAX_DIMENSION) {
+        *pzErr = sqlite3_mprintf("ai_hnsw requires a dimension between 1 and %d", AI_HNSW_MAX_DIMENSION);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->type < VECTOR_TYPE_F32 || options->type > VECTOR_TYPE_I8) {
+        *pzErr = sqlite3_mprintf("ai_hnsw invalid embedding_type");
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->metric < VECTOR_METRIC_COSINE || options->metric > VECTOR_METRIC_L2) {
+        *pzErr = sqlite3_mprintf("ai_hnsw invalid distance (expected cosine, dot or l2)");
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->m < 2 || options->m > AI_HNSW_MAX_M) {
+        *pzErr = sqlite3_mprintf("ai_hnsw m must be between 2 and %d", AI_HNSW_MAX_M);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->ef_construction < 1 || options->ef_construction > AI_HNSW_MAX_EF || options->ef_search < 1 || options->ef_search > AI_HNSW_MAX_EF) {
+        *pzErr = sqlite3_mprintf("ai_hnsw ef_construction and ef_search must be between 1 and %d", AI_HNSW_MAX_EF);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->cache_size < 0) {
+        *pzErr = sqlite3_mprintf("ai_hnsw cache_size must not be negative");
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    vtab->row_bytes = options->dimension * (int)vector_type_size(options->type);
+    vtab->level_mult = 1.0 / log((double)options->m);
+    
+    if (create) {
+        char *sql = sqlite3_mprintf("CREATE TABLE \"%w\".\"%w_nodes\" (id INTEGER PRIMARY KEY, level INTEGER NOT NULL, vector BLOB NOT NULL, neighbors BLOB NOT NULL);"
+                                    "CREATE INDEX \"%w\".\"%w_nodes_level\" ON \"%w_nodes\" (level);"
+                                    "CREATE TABLE \"%w\".\"%w_refs\" (target INTEGER NOT NULL, source INTEGER NOT NULL, PRIMARY KEY (target, source)) WITHOUT ROWID;"
+                                    "CREATE TABLE \"%w\".\"%w_config\" (key TEXT PRIMARY KEY, value) WITHOUT ROWID;"
+                                    "INSERT INTO \"%w\".\"%w_config\" (key, value) VALUES ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('version', 0), ('entry', NULL), ('max_level', 0);",
+                                    vtab->schema, vtab->name, vtab->schema, vtab->name, vtab->name, vtab->schema, vtab->name, vtab->schema, vtab->name, vtab->schema, vtab->name,
+                                    OPTION_KEY_DIMENSION, options->dimension, OPTION_KEY_EMBEDDING_TYPE, (int)options->type, OPTION_KEY_DISTANCE, (int)options->metric,
+                                    OPTION_KEY_M, options->m, OPTION_KEY_EF_CONSTRUCTION, options->ef_construction, OPTION_KEY_EF_SEARCH, options->ef_search,
+                                    OPTION_KEY_CACHE_SIZE, options->cache_size);
+        rc = (sql) ? sqlite3_exec(db, sql, NULL, NULL, pzErr) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto cleanup;
+        vtab->has_refs = true;
     }
+    
+    *ppVtab = (sqlite3_vtab *)vtab;
+    return SQLITE_OK;
 
-    // allocate output buffer
-    if (!buffer_create(&buffer, 0)) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-        goto error_sampler;
-    }
-    buffer_initialized = true;
+cleanup:
+    sqlite3_free(vtab->schema);
+    sqlite3_free(vtab->name);
+    sqlite3_free(vtab);
+    return rc;
+}
 
-    // generate tokens
-    {
-        int n_predict = (ai->options.n_predict > 0) ? ai->options.n_predict : 4096;
-        for (int i = 0; i < n_predict; i++) {
-            llama_token new_token_id = llama_sampler_sample(sampler, ctx, -1);
-            if (llama_vocab_is_eog(vocab, new_token_id)) break;
+static int ai_hnsw_create (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return ai_hnsw_init(db, argc, argv, ppVtab, pzErr, true);
+}
 
-            char buf[MAX_TOKEN_TEXT_LEN];
-            int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
-            if (n < 0) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert token to piece");
-                goto error_sampler;
-            }
+static int ai_hnsw_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return ai_hnsw_init(db, argc, argv, ppVtab, pzErr, false);
+}
 
-            if (!buffer_append(&buffer, buf, n, true)) {
-                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-                goto error_sampler;
-            }
+static int ai_hnsw_disconnect (sqlite3_vtab *pVtab) {
+    ai_hnsw_vtab *vtab = (ai_hnsw_vtab *)pVtab;
+    ai_hnsw_statements_finalize(vtab);
+    ai_hnsw_cache_clear(vtab);
+    sqlite3_free(vtab->dirty);
+    sqlite3_free(vtab->schema);
+    sqlite3_free(vtab->name);
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int ai_hnsw_destroy (sqlite3_vtab *pVtab) {
+    ai_hnsw_vtab *vtab = (ai_hnsw_vtab *)pVtab;
+    ai_hnsw_statements_finalize(vtab);
+    
+    char *sql = sqlite3_mprintf("DROP TABLE IF EXISTS \"%w\".\"%w_nodes\"; DROP TABLE IF EXISTS \"%w\".\"%w_refs\"; DROP TABLE IF EXISTS \"%w\".\"%w_config\";", vtab->schema, vtab->name, vtab->schema, vtab->name, vtab->schema, vtab->name);
+    int rc = (sql) ? sqlite3_exec(vtab->db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return rc;
+    
+    return ai_hnsw_disconnect(pVtab);
+}
 
-            struct llama_batch batch = llama_batch_get_one(&new_token_id, 1);
-            if (llama_decode(ctx, batch)) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to decode during generation");
-                goto error_sampler;
-            }
+static int ai_hnsw_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    int match = -1, k = -1, rowid = -1;
+    
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint *constraint = &pIdxInfo->aConstraint[i];
+        if (!constraint->usable) continue;
+        if (constraint->op == SQLITE_INDEX_CONSTRAINT_MATCH && constraint->iColumn == AI_HNSW_COLUMN_EMBEDDING) match = i;
+        else if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ && constraint->iColumn == AI_HNSW_COLUMN_K) k = i;
+        else if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ && constraint->iColumn == -1) rowid = i;
+    }
+    
+    if (match >= 0) {
+        // k is optional and defaults to AI_HNSW_DEFAULT_K
+        pIdxInfo->aConstraintUsage[match].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[match].omit = 1;
+        if (k >= 0) {
+            pIdxInfo->aConstraintUsage[k].argvIndex = 2;
+            pIdxInfo->aConstraintUsage[k].omit = 1;
+        }
+        if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == AI_HNSW_COLUMN_DISTANCE && !pIdxInfo->aOrderBy[0].desc) {
+            pIdxInfo->orderByConsumed = 1;
         }
+        pIdxInfo->idxNum = AI_HNSW_IDXNUM_MATCH;
+        pIdxInfo->estimatedCost = 100.0;
+        pIdxInfo->estimatedRows = AI_HNSW_DEFAULT_K;
+        return SQLITE_OK;
     }
+    
+    if (rowid >= 0) {
+        pIdxInfo->aConstraintUsage[rowid].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[rowid].omit = 1;
+        pIdxInfo->idxNum = AI_HNSW_IDXNUM_ROWID;
+        pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+        pIdxInfo->estimatedCost = 10.0;
+        pIdxInfo->estimatedRows = 1;
+        return SQLITE_OK;
+    }
+    
+    pIdxInfo->idxNum = AI_HNSW_IDXNUM_SCAN;
+    pIdxInfo->estimatedCost = 1000000.0;
+    return SQLITE_OK;
+}
 
-    // success
-    sqlite3_result_text(context, buffer.data, buffer.length, sqlite3_free);
-    for (int i = 0; i < n_images; i++) mtmd_bitmap_free(bitmaps[i]);
-    sqlite3_free(bitmaps);
-    mtmd_input_chunks_free(chunks);
-    sqlite3_free(prompt_with_markers);
-    sqlite3_free(formatted_prompt);
-    if (!sampler_already_setup) llama_sampler_free(sampler);
-    return;
+static int ai_hnsw_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_hnsw_cursor *c = (ai_hnsw_cursor *)sqlite3_malloc(sizeof(ai_hnsw_cursor));
+    if (!c) return SQLITE_NOMEM;
+    
+    memset(c, 0, sizeof(ai_hnsw_cursor));
+    c->vtab = (ai_hnsw_vtab *)pVtab;
+    
+    *ppCursor = (sqlite3_vtab_cursor *)c;
+    return SQLITE_OK;
+}
 
-error_sampler:
-    if (!sampler_already_setup && ai->sampler) {
-        llama_sampler_free(ai->sampler);
-        ai->sampler = NULL;
-    }
-error:
-    if (buffer_initialized) buffer_destroy(&buffer);
-    if (bitmaps) {
-        for (int i = 0; i < n_images; i++) if (bitmaps[i]) mtmd_bitmap_free(bitmaps[i]);
-        sqlite3_free(bitmaps);
-    }
-    if (chunks) mtmd_input_chunks_free(chunks);
-    sqlite3_free(prompt_with_markers);
-    sqlite3_free(formatted_prompt);
+static void ai_hnsw_cursor_reset (ai_hnsw_cursor *c) {
+    if (c->scan) sqlite3_finalize(c->scan);
+    sqlite3_free(c->ids);
+    sqlite3_free(c->distances);
+    c->scan = NULL;
+    c->ids = NULL;
+    c->distances = NULL;
+    c->count = 0;
+    c->index = 0;
+    c->eof = true;
 }
 
-// Vision-aware chat: non-streaming only
-static void llm_chat_respond_vision (sqlite3_context *context, ai_context *ai,
-                                      const char *user_prompt,
-                                      sqlite3_value **images, int n_images) {
-    mtmd_bitmap **bitmaps = NULL;
-    mtmd_input_chunks *chunks = NULL;
-    char *prompt_with_markers = NULL;
+static int ai_hnsw_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_hnsw_cursor *c = (ai_hnsw_cursor *)cur;
+    ai_hnsw_cursor_reset(c);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
 
-    const char *template = llama_model_chat_template(ai->model, NULL);
-    if (!template) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Template not available");
-        return;
+static int ai_hnsw_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_hnsw_cursor *c = (ai_hnsw_cursor *)cur;
+    if (!c->scan) {
+        c->eof = (++c->index >= c->count);
+        return SQLITE_OK;
     }
+    
+    int rc = sqlite3_step(c->scan);
+    c->eof = (rc != SQLITE_ROW);
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) return SQLITE_OK;
+    return sqlite_vtab_set_error(&c->vtab->base, "%s", sqlite3_errmsg(c->vtab->db));
+}
 
-    const struct llama_vocab *vocab = llama_model_get_vocab(ai->model);
-    if (!vocab) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Model vocab not available");
-        return;
+static int ai_hnsw_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_hnsw_cursor *c = (ai_hnsw_cursor *)cur;
+    return c->eof;
+}
+
+static int ai_hnsw_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_hnsw_cursor *c = (ai_hnsw_cursor *)cur;
+    ai_hnsw_vtab *vtab = c->vtab;
+    
+    if (iCol == AI_HNSW_COLUMN_EMBEDDING) {
+        if (c->scan) {
+            sqlite3_result_value(context, sqlite3_column_value(c->scan, 1));
+            return SQLITE_OK;
+        }
+        // nodes are looked up again, the cache could have been cleared by a write or trimmed since xFilter
+        ai_hnsw_node *node = ai_hnsw_node_get(vtab, c->ids[c->index]);
+        if (node) sqlite3_result_blob(context, node->vector, vtab->row_bytes, SQLITE_TRANSIENT);
+        return vtab->rc;
+    }
+    
+    if (iCol == AI_HNSW_COLUMN_DISTANCE && !c->scan && c->distances) {
+        sqlite3_result_double(context, (double)c->distances[c->index]);
     }
+    return SQLITE_OK;
+}
 
-    ai->chat.vocab = vocab;
-    ai->chat.template = template;
-    ai_messages *messages = &ai->chat.messages;
-    buffer_t *formatted = &ai->chat.formatted;
+static int ai_hnsw_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_hnsw_cursor *c = (ai_hnsw_cursor *)cur;
+    *pRowid = (c->scan) ? sqlite3_column_int64(c->scan, 0) : c->ids[c->index];
+    return SQLITE_OK;
+}
 
-    // build user prompt with markers
-    int32_t prompt_total_len;
-    prompt_with_markers = llm_vision_build_prompt(user_prompt, (int32_t)strlen(user_prompt), n_images, &prompt_total_len);
-    if (!prompt_with_markers) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-        return;
+static int ai_hnsw_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_hnsw_cursor *c = (ai_hnsw_cursor *)cur;
+    ai_hnsw_vtab *vtab = c->vtab;
+    ai_hnsw_cursor_reset(c);
+    
+    if (idxNum == AI_HNSW_IDXNUM_SCAN) {
+        char *sql = sqlite3_mprintf("SELECT id, vector FROM \"%w\".\"%w_nodes\" ORDER BY id;", vtab->schema, vtab->name);
+        int rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &c->scan, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        return ai_hnsw_cursor_next(cur);
     }
-
-    // append to message history (with markers in the text)
-    if (!llm_messages_append(messages, ROLE_USER, prompt_with_markers)) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to append message");
-        goto error;
+    
+    int rc = ai_hnsw_sync(vtab);
+    if (rc != SQLITE_OK) return rc;
+    
+    if (idxNum == AI_HNSW_IDXNUM_ROWID) {
+        ai_hnsw_node *node = ai_hnsw_node_get(vtab, sqlite3_value_int64(argv[0]));
+        if (!node) return vtab->rc;
+    
+        c->ids = (sqlite3_int64 *)sqlite3_malloc64(sizeof(sqlite3_int64));
+        if (!c->ids) return SQLITE_NOMEM;
+        c->ids[0] = node->id;
+        c->count = 1;
+        c->eof = false;
+        return SQLITE_OK;
     }
-
-    // skip empty system message if present
-    size_t messages_count = messages->count;
-    const llama_chat_message *messages_items = messages->items;
-    if (messages->count > 0) {
-        const llama_chat_message first = messages->items[0];
-        if (first.role == ROLE_SYSTEM && first.content[0] == '\0') {
-            messages_items = messages->items + 1;
-            messages_count = messages->count - 1;
+    
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        return sqlite_vtab_set_error(&vtab->base, "ai_hnsw MATCH expects a BLOB vector");
+    }
+    int k = AI_HNSW_DEFAULT_K;
+    if (argc >= 2) {
+        if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER || sqlite3_value_int64(argv[1]) <= 0 || sqlite3_value_int64(argv[1]) > AI_HNSW_MAX_EF) {
+            return sqlite_vtab_set_error(&vtab->base, "ai_hnsw k must be an INTEGER between 1 and %d", AI_HNSW_MAX_EF);
         }
+        k = sqlite3_value_int(argv[1]);
     }
-
-    // apply chat template
-    int32_t new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
-    if (new_len > formatted->capacity) {
-        if (!buffer_resize(formatted, new_len * 2)) goto error;
-        new_len = llama_chat_apply_template(template, messages_items, messages_count, true, formatted->data, formatted->capacity);
+    
+    // the query can also be a FLOAT32 vector of the same dimension
+    int query_bytes = sqlite3_value_bytes(argv[0]);
+    vector_type query_type, row_type;
+    int dimension = vector_resolve_dimension(query_bytes, vtab->row_bytes, vtab->options.type, &query_type, &row_type);
+    if (dimension != vtab->options.dimension || row_type != vtab->options.type) {
+        return sqlite_vtab_set_error(&vtab->base, "Query vector of %d bytes is not compatible with vectors of dimension %d and type %s", query_bytes, vtab->options.dimension, embedding_type_to_name((embedding_type)vtab->options.type));
     }
-    if (new_len < 0 || new_len > formatted->capacity) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to apply chat template");
-        goto error;
+    
+    rc = ai_hnsw_search(vtab, sqlite3_value_blob(argv[0]), query_type, k, c);
+    if (rc != SQLITE_OK) {
+        ai_hnsw_cursor_reset(c);
+        if (rc == SQLITE_NOMEM) return rc;
+        return (vtab->base.zErrMsg) ? rc : sqlite_vtab_set_error(&vtab->base, "ai_hnsw search failed (%d)", rc);
     }
+    c->eof = (c->count == 0);
+    return SQLITE_OK;
+}
 
-    // extract new prompt text
-    {
-        int32_t prompt_len = new_len - ai->chat.prev_len;
-        if (prompt_len <= 0) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Invalid prompt length");
-            goto error;
+static int ai_hnsw_update (sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid) {
+    ai_hnsw_vtab *vtab = (ai_hnsw_vtab *)pVtab;
+    
+    int rc = ai_hnsw_sync(vtab);
+    if (rc == SQLITE_OK && !vtab->has_refs) rc = ai_hnsw_refs_build(vtab);
+    if (rc != SQLITE_OK) return rc;
+    
+    sqlite3_int64 old_rowid = 0;
+    bool has_old = (sqlite3_value_type(argv[0]) != SQLITE_NULL);
+    if (has_old) old_rowid = sqlite3_value_int64(argv[0]);
+    
+    if (argc > 1) {
+        sqlite3_value *embedding = argv[2 + AI_HNSW_COLUMN_EMBEDDING];
+        if (sqlite3_value_type(embedding) != SQLITE_BLOB || sqlite3_value_bytes(embedding) != vtab->row_bytes) {
+            return sqlite_vtab_set_error(&vtab->base, "ai_hnsw embedding must be a BLOB of %d bytes (dimension %d, type %s)", vtab->row_bytes, vtab->options.dimension, embedding_type_to_name((embedding_type)vtab->options.type));
         }
-        int32_t current_len = (int32_t)sqlite3_msize(ai->chat.prompt);
-        if (current_len < prompt_len + 1) {
-            char *buf = (char *)sqlite3_malloc64(prompt_len + MIN_ALLOC_PROMPT);
-            if (!buf) {
-                sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-                goto error;
+    }
+    
+    // DELETE and UPDATE remove the old node first (an UPDATE re-inserts it)
+    if (has_old) {
+        rc = ai_hnsw_delete(vtab, old_rowid);
+        if (rc == SQLITE_OK) rc = ai_hnsw_flush(vtab);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
+    if (argc > 1) {
+        sqlite3_int64 rowid;
+        if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+            char *sql = sqlite3_mprintf("SELECT coalesce(max(id), 0) + 1 FROM \"%w\".\"%w_nodes\";", vtab->schema, vtab->name);
+            sqlite3_stmt *vm = NULL;
+            rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+            sqlite3_free(sql);
+            if (rc == SQLITE_OK) rc = (sqlite3_step(vm) == SQLITE_ROW) ? SQLITE_OK : SQLITE_ERROR;
+            rowid = (rc == SQLITE_OK) ? sqlite3_column_int64(vm, 0) : 0;
+            if (vm) sqlite3_finalize(vm);
+            if (rc != SQLITE_OK) goto cleanup;
+        } else {
+            rowid = sqlite3_value_int64(argv[1]);
+            if (!has_old || rowid != old_rowid) {
+                ai_hnsw_node *node = ai_hnsw_node_get(vtab, rowid);
+                if (node) {
+                    sqlite_vtab_set_error(&vtab->base, "UNIQUE constraint failed: %s.rowid", vtab->name);
+                    rc = SQLITE_CONSTRAINT;
+                    goto cleanup;
+                }
+                if ((rc = vtab->rc) != SQLITE_OK) goto cleanup;
             }
-            if (ai->chat.prompt) sqlite3_free(ai->chat.prompt);
-            ai->chat.prompt = buf;
         }
-        memcpy(ai->chat.prompt, formatted->data + ai->chat.prev_len, prompt_len);
-        ai->chat.prompt[prompt_len] = 0;
+    
+        rc = ai_hnsw_insert(vtab, rowid, sqlite3_value_blob(argv[2 + AI_HNSW_COLUMN_EMBEDDING]));
+        if (rc == SQLITE_OK) rc = ai_hnsw_flush(vtab);
+        if (rc != SQLITE_OK) goto cleanup;
+        *pRowid = rowid;
     }
+    
+    rc = ai_hnsw_config_write(vtab, "entry", vtab->entry, !vtab->has_entry);
+    if (rc == SQLITE_OK) rc = ai_hnsw_config_write(vtab, "max_level", vtab->max_level, false);
+    if (rc == SQLITE_OK) rc = ai_hnsw_config_write(vtab, "version", vtab->version + 1, false);
+    if (rc == SQLITE_OK) vtab->version++;
 
-    // load bitmaps
-    bitmaps = llm_vision_load_bitmaps(ai, context, images, n_images);
-    if (!bitmaps) goto error;
+cleanup:
+    if (rc != SQLITE_OK) {
+        // the statement is rolled back, the cache could contain changes that are not in the database anymore
+        vtab->ndirty = 0;
+        ai_hnsw_cache_clear(vtab);
+        vtab->version = -1;
+    } else {
+        ai_hnsw_cache_trim(vtab);
+    }
+    return rc;
+}
 
-    // tokenize the new prompt with mtmd
-    chunks = mtmd_input_chunks_init();
-    if (!chunks) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-        goto error;
+static int ai_hnsw_begin (sqlite3_vtab *pVtab) {
+    return SQLITE_OK;
+}
+
+static int ai_hnsw_rollback (sqlite3_vtab *pVtab) {
+    ai_hnsw_vtab *vtab = (ai_hnsw_vtab *)pVtab;
+    ai_hnsw_cache_clear(vtab);
+    vtab->version = -1;
+    return SQLITE_OK;
+}
+
+static int ai_hnsw_savepoint (sqlite3_vtab *pVtab, int iSavepoint) {
+    return SQLITE_OK;
+}
+
+static int ai_hnsw_rollback_to (sqlite3_vtab *pVtab, int iSavepoint) {
+    return ai_hnsw_rollback(pVtab);
+}
+
+static int ai_hnsw_rename (sqlite3_vtab *pVtab, const char *zNew) {
+    ai_hnsw_vtab *vtab = (ai_hnsw_vtab *)pVtab;
+    
+    char *name = sqlite_strdup(zNew);
+    if (!name) return SQLITE_NOMEM;
+    
+    char *sql = sqlite3_mprintf("ALTER TABLE \"%w\".\"%w_nodes\" RENAME TO \"%w_nodes\"; ALTER TABLE \"%w\".\"%w_config\" RENAME TO \"%w_config\";", vtab->schema, vtab->name, zNew, vtab->schema, vtab->name, zNew);
+    int rc = (sql) ? sqlite3_exec(vtab->db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc == SQLITE_OK && vtab->has_refs) {
+        sql = sqlite3_mprintf("ALTER TABLE \"%w\".\"%w_refs\" RENAME TO \"%w_refs\";", vtab->schema, vtab->name, zNew);
+        rc = (sql) ? sqlite3_exec(vtab->db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_free(name);
+        return rc;
     }
+    
+    // statements refer to the old table names
+    ai_hnsw_statements_finalize(vtab);
+    sqlite3_free(vtab->name);
+    vtab->name = name;
+    return SQLITE_OK;
+}
 
-    {
-        struct llama_context *ctx = ai->ctx;
-        bool is_first = (llama_memory_seq_pos_max(llama_get_memory(ctx), 0) == -1);
+static int ai_hnsw_shadow_name (const char *zName) {
+    return (strcmp(zName, "nodes") == 0 || strcmp(zName, "refs") == 0 || strcmp(zName, "config") == 0);
+}
+
+static sqlite3_module ai_hnsw = {
+  /* iVersion    */ 3,
+  /* xCreate     */ ai_hnsw_create,
+  /* xConnect    */ ai_hnsw_connect,
+  /* xBestIndex  */ ai_hnsw_best_index,
+  /* xDisconnect */ ai_hnsw_disconnect,
+  /* xDestroy    */ ai_hnsw_destroy,
+  /* xOpen       */ ai_hnsw_cursor_open,
+  /* xClose      */ ai_hnsw_cursor_close,
+  /* xFilter     */ ai_hnsw_filter,
+  /* xNext       */ ai_hnsw_cursor_next,
+  /* xEof        */ ai_hnsw_cursor_eof,
+  /* xColumn     */ ai_hnsw_cursor_column,
+  /* xRowid      */ ai_hnsw_cursor_rowid,
+  /* xUpdate     */ ai_hnsw_update,
+  /* xBegin      */ ai_hnsw_begin,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ ai_hnsw_rollback,
+  /* xFindMethod */ 0,
+  /* xRename     */ ai_hnsw_rename,
+  /* xSavepoint  */ ai_hnsw_savepoint,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ ai_hnsw_rollback_to,
+  /* xShadowName */ ai_hnsw_shadow_name,
+  /* xIntegrity  */ 0
+};
 
-        mtmd_input_text input_text = { ai->chat.prompt, is_first, true };
-        int32_t rc = mtmd_tokenize(ai->vision, chunks, &input_text, (const mtmd_bitmap **)bitmaps, n_images);
-        if (rc != 0) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to tokenize multimodal input (error %d)", rc);
-            goto error;
-        }
+// MARK: - IVF-PQ Index Virtual Table -
+
+// inverted file index with product quantization: a coarse k-means quantizer splits the vectors into lists and the
+// residual of each vector from its list centroid is encoded with one byte per subvector (the index of the nearest
+// codeword of that subvector). Queries scan the codes of the nearest lists with asymmetric distance computation
+// (per-list lookup tables of query-to-codeword distances) and re-rank the best candidates on the original vectors,
+// which stay on disk: only the codes (and rowids) of the probed lists are cached in memory
+
+#define AI_IVFPQ_COLUMN_EMBEDDING               0
+#define AI_IVFPQ_COLUMN_DISTANCE                1
+#define AI_IVFPQ_COLUMN_K                       2
+#define AI_IVFPQ_COLUMN_COMMAND                 3
+
+#define AI_IVFPQ_IDXNUM_SCAN                    0
+#define AI_IVFPQ_IDXNUM_ROWID                   1
+#define AI_IVFPQ_IDXNUM_MATCH                   2
+
+#define AI_IVFPQ_CODEWORDS                      256
+#define AI_IVFPQ_DEFAULT_LISTS                  256
+#define AI_IVFPQ_DEFAULT_PROBES                 8
+#define AI_IVFPQ_DEFAULT_RERANK                 4
+#define AI_IVFPQ_DEFAULT_K                      10
+#define AI_IVFPQ_MAX_LISTS                      65536
+#define AI_IVFPQ_MAX_DIMENSION                  AI_HNSW_MAX_DIMENSION
+#define AI_IVFPQ_MAX_SUBVECTORS                 256
+#define AI_IVFPQ_MAX_K                          AI_TOPK_MAX_K
+#define AI_IVFPQ_KMEANS_ITERATIONS              12
+#define AI_IVFPQ_ENCODE_BATCH                   1024
+
+#define OPTION_KEY_LISTS                        "lists"
+#define OPTION_KEY_SUBVECTORS                   "subvectors"
+#define OPTION_KEY_PROBES                       "probes"
+#define OPTION_KEY_RERANK                       "rerank"
+#define OPTION_KEY_TRAIN_SIZE                   "train_size"
 
-        llama_pos n_past = is_first ? 0 : llama_memory_seq_pos_max(llama_get_memory(ctx), 0) + 1;
-        int n_batch = (int)llama_n_batch(ctx);
-        rc = mtmd_helper_eval_chunks(ai->vision, ctx, chunks, n_past, 0, n_batch, true, &n_past);
-        if (rc != 0) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Failed to evaluate multimodal prompt (error %d)", rc);
-            goto error;
-        }
+typedef struct {
+    int                         dimension;
+    vector_type                 type;
+    vector_metric               metric;
+    int                         lists;
+    int                         subvectors;
+    int                         probes;
+    int                         rerank;
+    int                         train_size;
+} ai_ivfpq_options;
 
-        // sample tokens
-        struct llama_sampler *sampler = ai->sampler;
-        if (!sampler) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Sampler not initialized");
-            goto error;
-        }
+typedef struct {
+    sqlite3_int64               *ids;
+    uint8_t                     *codes;             // count * subvectors bytes
+    int                         count;
+    bool                        loaded;
+} ai_ivfpq_list;
 
-        bool is_eog = false;
-        while (!is_eog) {
-            llama_token token_id = llama_sampler_sample(sampler, ctx, -1);
-            if (llama_vocab_is_eog(vocab, token_id)) break;
+typedef struct {
+    sqlite3_vtab                base;               // Base class - must be first
+    sqlite3                     *db;
+    char                        *schema;
+    char                        *name;
+    
+    ai_ivfpq_options            options;
+    int                         row_bytes;
+    int                         subdim;             // elements per subvector
+    
+    // trained quantizers, NULL until the index is trained
+    float                       *coarse;            // lists * dimension
+    float                       *codebooks;         // subvectors * AI_IVFPQ_CODEWORDS * subdim
+    float                       *transposed;        // coarse centroids and codewords stored dimension-major
+    float                       *norms;             // squared norms of the coarse centroids and of the codewords
+    float                       *scratch;           // distances from a vector to the centroids
+    ai_ivfpq_list               *cache;             // codes of each list, loaded on demand
+    sqlite3_int64               version;
+    
+    sqlite3_stmt                *stmt_list;
+    sqlite3_stmt                *stmt_vector;
+    sqlite3_stmt                *stmt_version;
+    sqlite3_stmt                *stmt_insert;
+    sqlite3_stmt                *stmt_code;
+    sqlite3_stmt                *stmt_lookup;
+    sqlite3_stmt                *stmt_delete_code;
+    sqlite3_stmt                *stmt_delete_vector;
+    sqlite3_stmt                *stmt_assign;
+    sqlite3_stmt                *stmt_bump;
+} ai_ivfpq_vtab;
 
-            char tok[MAX_TOKEN_TEXT_LEN];
-            int32_t n = llama_token_to_piece(vocab, token_id, tok, MAX_TOKEN_TEXT_LEN, 0, true);
-            if (n < 0) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert token to string");
-                goto error;
-            }
+typedef struct {
+    sqlite3_vtab_cursor         base;               // Base class - must be first
+    ai_ivfpq_vtab               *vtab;
+    
+    ai_topk_item                *items;
+    int                         count;
+    int                         index;
+    sqlite3_stmt                *scan;              // full scans and rowid lookups read the vectors table directly
+    bool                        eof;
+} ai_ivfpq_cursor;
+
+static bool ai_ivfpq_options_callback (void *ctx, void *xdata, const char *key, int key_len, const char *value, int value_len) {
+    ai_ivfpq_options *options = (ai_ivfpq_options *)xdata;
+    
+    // sanity check (ignore malformed key/value)
+    if (!key || key_len == 0) return true;
+    if (!value || value_len == 0) return true;
+    
+    // convert value to c-string
+    char buffer[256] = {0};
+    size_t len = (value_len > (int)sizeof(buffer)-1) ? sizeof(buffer)-1 : (size_t)value_len;
+    memcpy(buffer, value, len);
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_DIMENSION)) {
+        options->dimension = (int)strtol(buffer, NULL, 0);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_EMBEDDING_TYPE)) {
+        options->type = (vector_type)embedding_name_to_type(buffer);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_DISTANCE)) {
+        options->metric = vector_name_to_metric(buffer);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_LISTS)) {
+        options->lists = (int)strtol(buffer, NULL, 0);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_SUBVECTORS)) {
+        options->subvectors = (int)strtol(buffer, NULL, 0);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_PROBES)) {
+        options->probes = (int)strtol(buffer, NULL, 0);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_RERANK)) {
+        options->rerank = (int)strtol(buffer, NULL, 0);
+        return true;
+    }
+    
+    if (KEY_MATCHES(key, key_len, OPTION_KEY_TRAIN_SIZE)) {
+        options->train_size = (int)strtol(buffer, NULL, 0);
+        return true;
+    }
+    
+    return true;
+}
 
-            if (!buffer_append(&ai->chat.response, tok, n, true)) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to grow response buffer");
-                goto error;
-            }
+// MARK: Quantizers
 
-            struct llama_batch batch = llama_batch_get_one(&token_id, 1);
-            if (llama_decode(ctx, batch)) {
-                sqlite_context_result_error(context, SQLITE_ERROR, "Failed to decode during generation");
-                goto error;
-            }
-        }
+// vectors are quantized as FLOAT32, normalized for the cosine distance so that L2 on the residuals ranks them by cosine
+static void ai_ivfpq_prepare (ai_ivfpq_vtab *vtab, const void *src, vector_type type, float *dest) {
+    int n = vtab->options.dimension;
+    vector_to_f32(src, type, dest, n);
+    if (vtab->options.metric == VECTOR_METRIC_COSINE) {
+        float norm = sqrtf(vector_f32_sumsq(dest, n));
+        if (norm > 0.0f) vector_f32_scale(dest, dest, n, 1.0f / norm);
     }
+}
 
-    // save response
-    if (!llm_chat_save_response(ai, messages, template)) goto error;
-
-    // return full response
-    sqlite3_result_text(context, ai->chat.response.data, -1, SQLITE_TRANSIENT);
+// centroids are stored dimension-major with their squared norms, so that the distances from a vector to all of them
+// are computed by vectorizable axpy loops instead of one small kernel call per centroid
+static void ai_ivfpq_transpose (const float *centroids, int k, int dim, float *transposed, float *norms) {
+    for (int c = 0; c < k; ++c) {
+        const float *centroid = centroids + (size_t)c * dim;
+        norms[c] = vector_f32_sumsq(centroid, dim);
+        for (int d = 0; d < dim; ++d) transposed[(size_t)d * k + c] = centroid[d];
+    }
+}
 
-    // cleanup
-    for (int i = 0; i < n_images; i++) mtmd_bitmap_free(bitmaps[i]);
-    sqlite3_free(bitmaps);
-    mtmd_input_chunks_free(chunks);
-    sqlite3_free(prompt_with_markers);
-    return;
+// squared distances from x to the k centroids (their negative dot products with x when norms is NULL)
+static void ai_ivfpq_distances (const float *x, const float *transposed, const float *norms, int k, int dim, float *distances) {
+    float bias = (norms) ? vector_f32_sumsq(x, dim) : 0.0f;
+    float mult = (norms) ? -2.0f : -1.0f;
+    for (int c = 0; c < k; ++c) distances[c] = (norms) ? norms[c] + bias : 0.0f;
+    for (int d = 0; d < dim; ++d) {
+        float v = mult * x[d];
+        const float *row = transposed + (size_t)d * k;
+        for (int c = 0; c < k; ++c) distances[c] += v * row[c];
+    }
+}
 
-error:
-    if (bitmaps) {
-        for (int i = 0; i < n_images; i++) if (bitmaps[i]) mtmd_bitmap_free(bitmaps[i]);
-        sqlite3_free(bitmaps);
+static int ai_ivfpq_argmin (const float *distances, int k) {
+    int best = 0;
+    for (int c = 1; c < k; ++c) {
+        if (distances[c] < distances[best]) best = c;
     }
-    if (chunks) mtmd_input_chunks_free(chunks);
-    sqlite3_free(prompt_with_markers);
+    return best;
 }
 
-// MARK: - Audio -
+static inline uint64_t ai_ivfpq_random (uint64_t *state) {
+    *state = ai_hnsw_mix(*state);
+    return *state;
+}
 
-static bool audio_process_check_arguments (sqlite3_context *context, const char *function_name, int argc, sqlite3_value **argv, bool check_audio_model) {
-    // sanity check arguments
-    if (argc == 1) {
-        int type = sqlite3_value_type(argv[0]);
-        if (type != SQLITE_TEXT && type != SQLITE_BLOB) {
-            return sqlite_context_result_error(context, SQLITE_ERROR, "Function '%s' expects the first argument to be TEXT or BLOB.", function_name);
+// k-means++ seeding followed by Lloyd iterations, empty clusters are re-seeded with a random point; assign receives
+// the index of the centroid nearest to each point
+static bool ai_ivfpq_kmeans (const float *data, int n, int dim, int k, uint64_t seed, float *centroids, int *assign) {
+    float *mindist = (float *)sqlite3_malloc64(sizeof(float) * n);
+    float *sums = (float *)sqlite3_malloc64(sizeof(float) * (size_t)k * dim);
+    float *transposed = (float *)sqlite3_malloc64(sizeof(float) * (size_t)k * dim);
+    float *norms = (float *)sqlite3_malloc64(sizeof(float) * k);
+    float *distances = (float *)sqlite3_malloc64(sizeof(float) * k);
+    int *counts = (int *)sqlite3_malloc64(sizeof(int) * k);
+    bool result = (mindist && sums && transposed && norms && distances && counts);
+    if (!result) goto cleanup;
+    
+    uint64_t state = seed;
+    memcpy(centroids, data + (size_t)(ai_ivfpq_random(&state) % n) * dim, sizeof(float) * dim);
+    for (int i = 0; i < n; ++i) mindist[i] = vector_f32_l2sq(data + (size_t)i * dim, centroids, dim);
+    
+    for (int c = 1; c < k; ++c) {
+        double total = 0.0;
+        for (int i = 0; i < n; ++i) total += mindist[i];
+        
+        // pick the next centroid with probability proportional to the squared distance from the nearest one
+        int pick = (int)(ai_ivfpq_random(&state) % n);
+        if (total > 0.0) {
+            double target = (double)(ai_ivfpq_random(&state) >> 11) * (1.0 / 9007199254740992.0) * total;
+            for (int i = 0; i < n; ++i) {
+                target -= mindist[i];
+                if (target <= 0.0) {
+                    pick = i;
+                    break;
+                }
+            }
         }
         
-        int types[] = {type};
-        return sqlite_sanity_function(context, function_name, argc, argv, 1, types, false, check_audio_model);
-    } else if (argc == 2) {
-        int type = sqlite3_value_type(argv[0]);
-        if (type != SQLITE_TEXT && type != SQLITE_BLOB) {
-            return sqlite_context_result_error(context, SQLITE_ERROR, "Function '%s' expects the first argument to be TEXT or BLOB.", function_name);
+        float *centroid = centroids + (size_t)c * dim;
+        memcpy(centroid, data + (size_t)pick * dim, sizeof(float) * dim);
+        for (int i = 0; i < n; ++i) {
+            float d = vector_f32_l2sq(data + (size_t)i * dim, centroid, dim);
+            if (d < mindist[i]) mindist[i] = d;
+        }
+    }
+    
+    for (int i = 0; i < n; ++i) assign[i] = -1;
+    for (int iteration = 0; ; ++iteration) {
+        int changed = 0;
+        ai_ivfpq_transpose(centroids, k, dim, transposed, norms);
+        for (int i = 0; i < n; ++i) {
+            ai_ivfpq_distances(data + (size_t)i * dim, transposed, norms, k, dim, distances);
+            int c = ai_ivfpq_argmin(distances, k);
+            if (c != assign[i]) changed++;
+            assign[i] = c;
         }
+        // stop with the assignments matching the centroids
+        if (changed == 0 || iteration == AI_IVFPQ_KMEANS_ITERATIONS) break;
         
-        int types[] = {type, SQLITE_TEXT};
-        return sqlite_sanity_function(context, function_name, argc, argv, 2, types, false, check_audio_model);
+        memset(sums, 0, sizeof(float) * (size_t)k * dim);
+        memset(counts, 0, sizeof(int) * k);
+        for (int i = 0; i < n; ++i) {
+            float *sum = sums + (size_t)assign[i] * dim;
+            const float *x = data + (size_t)i * dim;
+            for (int d = 0; d < dim; ++d) sum[d] += x[d];
+            counts[assign[i]]++;
+        }
+        for (int c = 0; c < k; ++c) {
+            float *centroid = centroids + (size_t)c * dim;
+            if (counts[c] == 0) {
+                memcpy(centroid, data + (size_t)(ai_ivfpq_random(&state) % n) * dim, sizeof(float) * dim);
+                continue;
+            }
+            vector_f32_scale(sums + (size_t)c * dim, centroid, dim, 1.0f / (float)counts[c]);
+        }
     }
     
-    return sqlite_context_result_error(context, SQLITE_ERROR, "Function '%s' expects 1 or 2 arguments, but %d were provided.", function_name, argc);
+cleanup:
+    sqlite3_free(mindist);
+    sqlite3_free(sums);
+    sqlite3_free(transposed);
+    sqlite3_free(norms);
+    sqlite3_free(distances);
+    sqlite3_free(counts);
+    return result;
+}
+
+// transposed copies of the quantizers used to encode and to build the lookup tables
+static bool ai_ivfpq_setup (ai_ivfpq_vtab *vtab) {
+    int lists = vtab->options.lists;
+    int dim = vtab->options.dimension;
+    int m = vtab->options.subvectors;
+    int nscratch = (lists > AI_IVFPQ_CODEWORDS) ? lists : AI_IVFPQ_CODEWORDS;
+    
+    vtab->transposed = (float *)sqlite3_malloc64(sizeof(float) * ((size_t)lists * dim + (size_t)m * AI_IVFPQ_CODEWORDS * vtab->subdim));
+    vtab->norms = (float *)sqlite3_malloc64(sizeof(float) * ((size_t)lists + (size_t)m * AI_IVFPQ_CODEWORDS));
+    vtab->scratch = (float *)sqlite3_malloc64(sizeof(float) * nscratch);
+    if (!vtab->transposed || !vtab->norms || !vtab->scratch) return false;
+    
+    ai_ivfpq_transpose(vtab->coarse, lists, dim, vtab->transposed, vtab->norms);
+    for (int j = 0; j < m; ++j) {
+        size_t offset = (size_t)j * AI_IVFPQ_CODEWORDS;
+        ai_ivfpq_transpose(vtab->codebooks + offset * vtab->subdim, AI_IVFPQ_CODEWORDS, vtab->subdim, vtab->transposed + (size_t)lists * dim + offset * vtab->subdim, vtab->norms + lists + offset);
+    }
+    return true;
 }
 
-// detect audio format from file extension
-static int audio_detect_format_from_path (const char *path) {
-    if (!path) return 0;
-    const char *dot = strrchr(path, '.');
-    if (!dot) return 0;
-    if (strcasecmp(dot, ".wav") == 0) return 1;
-    if (strcasecmp(dot, ".mp3") == 0) return 2;
-    if (strcasecmp(dot, ".flac") == 0) return 3;
-    return 0;
+// distances from the j-th subvector x to the codewords of the j-th codebook (negative dot products if dot)
+static inline void ai_ivfpq_codeword_distances (ai_ivfpq_vtab *vtab, int j, const float *x, bool dot, float *distances) {
+    size_t offset = (size_t)j * AI_IVFPQ_CODEWORDS;
+    const float *transposed = vtab->transposed + (size_t)vtab->options.lists * vtab->options.dimension + offset * vtab->subdim;
+    ai_ivfpq_distances(x, transposed, (dot) ? NULL : vtab->norms + vtab->options.lists + offset, AI_IVFPQ_CODEWORDS, vtab->subdim, distances);
 }
 
-// detect audio format from blob header (magic bytes)
-static int audio_detect_format_from_blob (const void *data, size_t size) {
-    if (!data || size < 4) return 0;
-    const uint8_t *bytes = (const uint8_t *)data;
+// assigns x (prepared) to a list and encodes its residual, x is overwritten with the residual
+static int ai_ivfpq_encode (ai_ivfpq_vtab *vtab, float *x, uint8_t *code) {
+    int dim = vtab->options.dimension;
+    ai_ivfpq_distances(x, vtab->transposed, vtab->norms, vtab->options.lists, dim, vtab->scratch);
+    int list = ai_ivfpq_argmin(vtab->scratch, vtab->options.lists);
+    
+    const float *centroid = vtab->coarse + (size_t)list * dim;
+    for (int d = 0; d < dim; ++d) x[d] -= centroid[d];
+    
+    for (int j = 0; j < vtab->options.subvectors; ++j) {
+        ai_ivfpq_codeword_distances(vtab, j, x + (size_t)j * vtab->subdim, false, vtab->scratch);
+        code[j] = (uint8_t)ai_ivfpq_argmin(vtab->scratch, AI_IVFPQ_CODEWORDS);
+    }
+    return list;
+}
 
-    // WAV: starts with "RIFF"
-    if (bytes[0] == 'R' && bytes[1] == 'I' && bytes[2] == 'F' && bytes[3] == 'F') return 1;
+// MARK: Storage
 
-    // MP3: starts with ID3 tag or MPEG sync word
-    if (bytes[0] == 'I' && bytes[1] == 'D' && bytes[2] == '3') return 2;
-    if (bytes[0] == 0xFF && (bytes[1] & 0xE0) == 0xE0) return 2;
+static sqlite3_stmt *ai_ivfpq_statement (ai_ivfpq_vtab *vtab, sqlite3_stmt **stmt, const char *format) {
+    if (*stmt) {
+        sqlite3_reset(*stmt);
+        return *stmt;
+    }
+    
+    // every statement is formatted with the schema and the table name
+    char *sql = sqlite3_mprintf(format, vtab->schema, vtab->name);
+    if (!sql) return NULL;
+    int rc = sqlite3_prepare_v3(vtab->db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        return NULL;
+    }
+    return *stmt;
+}
 
-    // FLAC: starts with "fLaC"
-    if (bytes[0] == 'f' && bytes[1] == 'L' && bytes[2] == 'a' && bytes[3] == 'C') return 3;
+static void ai_ivfpq_statements_finalize (ai_ivfpq_vtab *vtab) {
+    sqlite3_stmt **stmts[] = {&vtab->stmt_list, &vtab->stmt_vector, &vtab->stmt_version, &vtab->stmt_insert, &vtab->stmt_code,
+                              &vtab->stmt_lookup, &vtab->stmt_delete_code, &vtab->stmt_delete_vector, &vtab->stmt_assign, &vtab->stmt_bump};
+    for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]); ++i) {
+        if (*stmts[i]) sqlite3_finalize(*stmts[i]);
+        *stmts[i] = NULL;
+    }
+}
 
-    return 0;
+static int ai_ivfpq_step (ai_ivfpq_vtab *vtab, sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc == SQLITE_DONE) return SQLITE_OK;
+    return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
 }
 
-// convert multi-channel audio to mono by averaging channels, then resample to target_rate
-static float *audio_convert_to_mono_16khz (const float *src, uint64_t num_samples, uint32_t sample_rate, uint32_t channels, int *out_samples) {
-    // step 1: downmix to mono
-    uint64_t mono_count = num_samples; // num_samples is per-channel frame count
-    float *mono = NULL;
+static int ai_ivfpq_exec (ai_ivfpq_vtab *vtab, const char *sql) {
+    int rc = (sql) ? sqlite3_exec(vtab->db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    if (rc != SQLITE_OK && rc != SQLITE_NOMEM) sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    return rc;
+}
 
-    if (channels == 1) {
-        // already mono — just reference (we'll copy during resampling)
-        mono = (float *)src;
-    } else {
-        mono = (float *)sqlite3_malloc64(mono_count * sizeof(float));
-        if (!mono) return NULL;
-        for (uint64_t i = 0; i < mono_count; i++) {
-            float sum = 0.0f;
-            for (uint32_t c = 0; c < channels; c++) {
-                sum += src[i * channels + c];
+static void ai_ivfpq_list_drop (ai_ivfpq_list *list) {
+    sqlite3_free(list->ids);
+    sqlite3_free(list->codes);
+    memset(list, 0, sizeof(ai_ivfpq_list));
+}
+
+static void ai_ivfpq_reset (ai_ivfpq_vtab *vtab) {
+    if (vtab->cache) {
+        for (int i = 0; i < vtab->options.lists; ++i) ai_ivfpq_list_drop(&vtab->cache[i]);
+    }
+    sqlite3_free(vtab->cache);
+    sqlite3_free(vtab->coarse);
+    sqlite3_free(vtab->codebooks);
+    sqlite3_free(vtab->transposed);
+    sqlite3_free(vtab->norms);
+    sqlite3_free(vtab->scratch);
+    vtab->cache = NULL;
+    vtab->coarse = NULL;
+    vtab->codebooks = NULL;
+    vtab->transposed = NULL;
+    vtab->norms = NULL;
+    vtab->scratch = NULL;
+}
+
+static int ai_ivfpq_load_list (ai_ivfpq_vtab *vtab, int index) {
+    ai_ivfpq_list *list = &vtab->cache[index];
+    if (list->loaded) return SQLITE_OK;
+    
+    sqlite3_stmt *stmt = ai_ivfpq_statement(vtab, &vtab->stmt_list, "SELECT id, code FROM \"%w\".\"%w_codes\" WHERE list = ?1;");
+    if (!stmt) return SQLITE_ERROR;
+    sqlite3_bind_int(stmt, 1, index);
+    
+    int m = vtab->options.subvectors;
+    int capacity = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 1) != m) continue;
+        if (list->count == capacity) {
+            capacity = (capacity) ? capacity * 2 : 256;
+            sqlite3_int64 *ids = (sqlite3_int64 *)sqlite3_realloc64(list->ids, sizeof(sqlite3_int64) * capacity);
+            if (ids) list->ids = ids;
+            uint8_t *codes = (uint8_t *)sqlite3_realloc64(list->codes, (size_t)capacity * m);
+            if (codes) list->codes = codes;
+            if (!ids || !codes) {
+                sqlite3_reset(stmt);
+                ai_ivfpq_list_drop(list);
+                return SQLITE_NOMEM;
             }
-            mono[i] = sum / channels;
         }
+        list->ids[list->count] = sqlite3_column_int64(stmt, 0);
+        memcpy(list->codes + (size_t)list->count * m, sqlite3_column_blob(stmt, 1), m);
+        list->count++;
     }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) {
+        ai_ivfpq_list_drop(list);
+        return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    }
+    list->loaded = true;
+    return SQLITE_OK;
+}
 
-    // step 2: resample to WHISPER_SAMPLE_RATE (16000 Hz) if needed
-    if (sample_rate == WHISPER_SAMPLE_RATE) {
-        if (mono == src) {
-            // need to copy so caller can free
-            float *copy = (float *)sqlite3_malloc64(mono_count * sizeof(float));
-            if (!copy) return NULL;
-            memcpy(copy, src, mono_count * sizeof(float));
-            mono = copy;
+// reload the quantizers when the index was trained or changed by another connection (or after a rollback)
+static int ai_ivfpq_sync (ai_ivfpq_vtab *vtab) {
+    sqlite3_stmt *stmt = ai_ivfpq_statement(vtab, &vtab->stmt_version, "SELECT value FROM \"%w\".\"%w_config\" WHERE key = 'version';");
+    if (!stmt) return SQLITE_ERROR;
+    
+    int rc = sqlite3_step(stmt);
+    sqlite3_int64 version = (rc == SQLITE_ROW) ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    if (version == vtab->version) return SQLITE_OK;
+    
+    ai_ivfpq_reset(vtab);
+    vtab->version = version;
+    
+    char *sql = sqlite3_mprintf("SELECT key, value FROM \"%w\".\"%w_config\" WHERE key IN ('coarse', 'codebooks');", vtab->schema, vtab->name);
+    sqlite3_stmt *vm = NULL;
+    rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return (rc == SQLITE_NOMEM) ? rc : sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    
+    size_t coarse_size = sizeof(float) * (size_t)vtab->options.lists * vtab->options.dimension;
+    size_t codebooks_size = sizeof(float) * (size_t)vtab->options.subvectors * AI_IVFPQ_CODEWORDS * vtab->subdim;
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        const char *key = (const char *)sqlite3_column_text(vm, 0);
+        size_t size = (size_t)sqlite3_column_bytes(vm, 1);
+        bool is_coarse = (key && strcmp(key, "coarse") == 0);
+        if (size == 0 || size != (is_coarse ? coarse_size : codebooks_size)) continue;
+    
+        float *data = (float *)sqlite3_malloc64(size);
+        if (!data) {
+            rc = SQLITE_NOMEM;
+            break;
         }
-        *out_samples = (int)mono_count;
-        return mono;
+        memcpy(data, sqlite3_column_blob(vm, 1), size);
+        if (is_coarse) vtab->coarse = data;
+        else vtab->codebooks = data;
+    }
+    sqlite3_finalize(vm);
+    if (rc != SQLITE_DONE) {
+        ai_ivfpq_reset(vtab);
+        vtab->version = -1;
+        return (rc == SQLITE_NOMEM) ? rc : sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    }
+    
+    // an index is trained when both quantizers are stored
+    if (vtab->coarse && vtab->codebooks) {
+        vtab->cache = (ai_ivfpq_list *)sqlite3_malloc64(sizeof(ai_ivfpq_list) * vtab->options.lists);
+        if (!vtab->cache || !ai_ivfpq_setup(vtab)) {
+            ai_ivfpq_reset(vtab);
+            vtab->version = -1;
+            return SQLITE_NOMEM;
+        }
+        memset(vtab->cache, 0, sizeof(ai_ivfpq_list) * vtab->options.lists);
+    } else {
+        ai_ivfpq_reset(vtab);
     }
+    return SQLITE_OK;
+}
 
-    // linear interpolation resampling
-    double ratio = (double)WHISPER_SAMPLE_RATE / (double)sample_rate;
-    int64_t out_count = (int64_t)(mono_count * ratio) + 1;
-    float *resampled = (float *)sqlite3_malloc64(out_count * sizeof(float));
-    if (!resampled) {
-        if (mono != src) sqlite3_free(mono);
-        return NULL;
-    }
+static int ai_ivfpq_bump_version (ai_ivfpq_vtab *vtab) {
+    sqlite3_stmt *stmt = ai_ivfpq_statement(vtab, &vtab->stmt_bump, "UPDATE \"%w\".\"%w_config\" SET value = value + 1 WHERE key = 'version';");
+    if (!stmt) return SQLITE_ERROR;
+    
+    int rc = ai_ivfpq_step(vtab, stmt);
+    if (rc == SQLITE_OK) vtab->version++;
+    return rc;
+}
 
-    for (int64_t i = 0; i < out_count; i++) {
-        double src_idx = i / ratio;
-        int64_t idx0 = (int64_t)src_idx;
-        double frac = src_idx - idx0;
-        if (idx0 >= (int64_t)mono_count - 1) {
-            resampled[i] = mono[mono_count - 1];
-        } else {
-            resampled[i] = (float)(mono[idx0] * (1.0 - frac) + mono[idx0 + 1] * frac);
+// MARK: Training
+
+static int ai_ivfpq_train (ai_ivfpq_vtab *vtab) {
+    int dim = vtab->options.dimension;
+    int m = vtab->options.subvectors;
+    int subdim = vtab->subdim;
+    int minimum = (vtab->options.lists > AI_IVFPQ_CODEWORDS) ? vtab->options.lists : AI_IVFPQ_CODEWORDS;
+    
+    float *sample = NULL, *coarse = NULL, *codebooks = NULL, *subsample = NULL, *x = NULL;
+    int *assign = NULL;
+    uint8_t *code = NULL;
+    sqlite3_stmt *vm = NULL;
+    int rc = SQLITE_OK;
+    int n = 0;
+    
+    // uniform training sample drawn with reservoir sampling in a single pass over the vectors, in rowid order so that
+    // neither a sort of the whole table nor more than train_size vectors in memory are needed
+    char *sql = sqlite3_mprintf("SELECT vector FROM \"%w\".\"%w_vectors\";", vtab->schema, vtab->name);
+    rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    sample = (float *)sqlite3_malloc64(sizeof(float) * (size_t)vtab->options.train_size * dim);
+    if (!sample) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    uint64_t state;
+    sqlite3_randomness(sizeof(state), &state);
+    sqlite3_int64 seen = 0;
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(vm, 0) != vtab->row_bytes) continue;
+        sqlite3_int64 slot = seen++;
+        if (slot >= vtab->options.train_size) {
+            state += 0x9E3779B97F4A7C15ULL;
+            slot = (sqlite3_int64)(ai_hnsw_mix(state) % (uint64_t)seen);
+            if (slot >= vtab->options.train_size) continue;
+        }
+        ai_ivfpq_prepare(vtab, sqlite3_column_blob(vm, 0), vtab->options.type, sample + (size_t)slot * dim);
+    }
+    n = (seen < vtab->options.train_size) ? (int)seen : vtab->options.train_size;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    if (rc != SQLITE_DONE) goto cleanup;
+    rc = SQLITE_OK;
+    
+    if (n < minimum) {
+        rc = sqlite_vtab_set_error(&vtab->base, "ai_ivfpq training needs at least %d vectors (found %d)", minimum, n);
+        goto cleanup;
+    }
+    
+    // coarse quantizer, then one codebook for each subvector of the residuals
+    coarse = (float *)sqlite3_malloc64(sizeof(float) * (size_t)vtab->options.lists * dim);
+    codebooks = (float *)sqlite3_malloc64(sizeof(float) * (size_t)m * AI_IVFPQ_CODEWORDS * subdim);
+    subsample = (float *)sqlite3_malloc64(sizeof(float) * (size_t)n * subdim);
+    assign = (int *)sqlite3_malloc64(sizeof(int) * n);
+    if (!coarse || !codebooks || !subsample || !assign || !ai_ivfpq_kmeans(sample, n, dim, vtab->options.lists, 0x1F2E3D4C5B6A7988ULL, coarse, assign)) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    for (int i = 0; i < n; ++i) {
+        float *v = sample + (size_t)i * dim;
+        const float *centroid = coarse + (size_t)assign[i] * dim;
+        for (int d = 0; d < dim; ++d) v[d] -= centroid[d];
+    }
+    for (int j = 0; j < m; ++j) {
+        for (int i = 0; i < n; ++i) memcpy(subsample + (size_t)i * subdim, sample + (size_t)i * dim + (size_t)j * subdim, sizeof(float) * subdim);
+        if (!ai_ivfpq_kmeans(subsample, n, subdim, AI_IVFPQ_CODEWORDS, 0x8899AABBCCDDEEFFULL + j, codebooks + (size_t)j * AI_IVFPQ_CODEWORDS * subdim, assign)) {
+            rc = SQLITE_NOMEM;
+            goto cleanup;
+        }
+    }
+    sqlite3_free(sample);
+    sqlite3_free(subsample);
+    sample = subsample = NULL;
+    
+    // store the quantizers
+    sql = sqlite3_mprintf("INSERT OR REPLACE INTO \"%w\".\"%w_config\" (key, value) VALUES ('coarse', ?1), ('codebooks', ?2);", vtab->schema, vtab->name);
+    rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
+    sqlite3_bind_blob64(vm, 1, coarse, sizeof(float) * (sqlite3_uint64)vtab->options.lists * dim, SQLITE_STATIC);
+    sqlite3_bind_blob64(vm, 2, codebooks, sizeof(float) * (sqlite3_uint64)m * AI_IVFPQ_CODEWORDS * subdim, SQLITE_STATIC);
+    rc = sqlite3_step(vm);
+    sqlite3_finalize(vm);
+    vm = NULL;
+    if (rc != SQLITE_DONE) goto cleanup;
+    
+    ai_ivfpq_reset(vtab);
+    vtab->coarse = coarse;
+    vtab->codebooks = codebooks;
+    coarse = codebooks = NULL;
+    if (!ai_ivfpq_setup(vtab)) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    
+    // encode every vector again, in batches of rowids so that the vectors table isn't changed while it is read
+    sql = sqlite3_mprintf("DELETE FROM \"%w\".\"%w_codes\";", vtab->schema, vtab->name);
+    rc = ai_ivfpq_exec(vtab, sql);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    sql = sqlite3_mprintf("SELECT id, vector FROM \"%w\".\"%w_vectors\" WHERE id > ?1 ORDER BY id LIMIT %d;", vtab->schema, vtab->name, AI_IVFPQ_ENCODE_BATCH);
+    rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    x = (float *)sqlite3_malloc64(sizeof(float) * (size_t)AI_IVFPQ_ENCODE_BATCH * dim);
+    code = (uint8_t *)sqlite3_malloc64((size_t)AI_IVFPQ_ENCODE_BATCH * m);
+    sqlite3_int64 *ids = (sqlite3_int64 *)sqlite3_malloc64(sizeof(sqlite3_int64) * AI_IVFPQ_ENCODE_BATCH);
+    int *lists = (int *)sqlite3_malloc64(sizeof(int) * AI_IVFPQ_ENCODE_BATCH);
+    if (!x || !code || !ids || !lists) {
+        sqlite3_free(ids);
+        sqlite3_free(lists);
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    
+    sqlite3_int64 last = INT64_MIN;
+    for (;;) {
+        int count = 0;
+        sqlite3_bind_int64(vm, 1, last);
+        while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+            last = sqlite3_column_int64(vm, 0);
+            if (sqlite3_column_bytes(vm, 1) != vtab->row_bytes) continue;
+            ids[count] = last;
+            float *v = x + (size_t)count * dim;
+            ai_ivfpq_prepare(vtab, sqlite3_column_blob(vm, 1), vtab->options.type, v);
+            lists[count] = ai_ivfpq_encode(vtab, v, code + (size_t)count * m);
+            count++;
+        }
+        sqlite3_reset(vm);
+        if (rc != SQLITE_DONE) break;
+        rc = SQLITE_OK;
+    
+        for (int i = 0; i < count && rc == SQLITE_OK; ++i) {
+            sqlite3_stmt *stmt = ai_ivfpq_statement(vtab, &vtab->stmt_code, "INSERT INTO \"%w\".\"%w_codes\" (list, id, code) VALUES (?1, ?2, ?3);");
+            if (!stmt) {
+                rc = SQLITE_ERROR;
+                break;
+            }
+            sqlite3_bind_int(stmt, 1, lists[i]);
+            sqlite3_bind_int64(stmt, 2, ids[i]);
+            sqlite3_bind_blob(stmt, 3, code + (size_t)i * m, m, SQLITE_STATIC);
+            rc = ai_ivfpq_step(vtab, stmt);
+            if (rc != SQLITE_OK) break;
+    
+            stmt = ai_ivfpq_statement(vtab, &vtab->stmt_assign, "UPDATE \"%w\".\"%w_vectors\" SET list = ?2 WHERE id = ?1;");
+            if (!stmt) {
+                rc = SQLITE_ERROR;
+                break;
+            }
+            sqlite3_bind_int64(stmt, 1, ids[i]);
+            sqlite3_bind_int(stmt, 2, lists[i]);
+            rc = ai_ivfpq_step(vtab, stmt);
         }
+        if (rc != SQLITE_OK || count < AI_IVFPQ_ENCODE_BATCH) break;
     }
+    sqlite3_free(ids);
+    sqlite3_free(lists);
+    
+    if (rc == SQLITE_OK) rc = ai_ivfpq_bump_version(vtab);
 
-    if (mono != src) sqlite3_free(mono);
-    *out_samples = (int)out_count;
-    return resampled;
+cleanup:
+    if (rc != SQLITE_OK && !vtab->base.zErrMsg) sqlite_vtab_set_error(&vtab->base, "ai_ivfpq training failed: %s", (rc == SQLITE_NOMEM) ? "out of memory" : sqlite3_errmsg(vtab->db));
+    if (vm) sqlite3_finalize(vm);
+    sqlite3_free(sample);
+    sqlite3_free(subsample);
+    sqlite3_free(assign);
+    sqlite3_free(coarse);
+    sqlite3_free(codebooks);
+    sqlite3_free(x);
+    sqlite3_free(code);
+    
+    // the cache is rebuilt from the database (and reflects the rollback if the statement fails)
+    ai_ivfpq_reset(vtab);
+    vtab->version = -1;
+    return (rc == SQLITE_OK || rc == SQLITE_NOMEM) ? rc : SQLITE_ERROR;
 }
 
-static void audio_model_transcribe (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    if (audio_process_check_arguments(context, "audio_model_transcribe", argc, argv, true) == false) return;
+// MARK: Search
 
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    float *pcm_buffer = NULL;
-    uint64_t num_samples = 0;
-    uint32_t sample_rate = 0;
-    uint32_t channels = 0;
+static int ai_ivfpq_read_vector (ai_ivfpq_vtab *vtab, sqlite3_int64 id, const void **vector) {
+    sqlite3_stmt *stmt = ai_ivfpq_statement(vtab, &vtab->stmt_vector, "SELECT vector FROM \"%w\".\"%w_vectors\" WHERE id = ?1;");
+    if (!stmt) return SQLITE_ERROR;
+    
+    sqlite3_bind_int64(stmt, 1, id);
+    int rc = sqlite3_step(stmt);
+    *vector = (rc == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == vtab->row_bytes) ? sqlite3_column_blob(stmt, 0) : NULL;
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) return SQLITE_OK;
+    return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+}
 
-    if (sqlite3_value_type(argv[0]) == SQLITE_TEXT) {
-        const char *path = (const char *)sqlite3_value_text(argv[0]);
-        int format = audio_detect_format_from_path(path);
-        switch (format) {
-            case 1: pcm_buffer = audio_wav_file2pcm(path, &num_samples, &sample_rate, &channels); break;
-            case 2: pcm_buffer = audio_mp3_file2pcm(path, &num_samples, &sample_rate, &channels); break;
-            case 3: pcm_buffer = audio_flac_file2pcm(path, &num_samples, &sample_rate, &channels); break;
-            default:
-                sqlite_context_result_error(context, SQLITE_ERROR, "Unsupported audio format for file '%s'. Supported: .wav, .mp3, .flac", path);
-                return;
+// exact search, used until the index is trained
+static int ai_ivfpq_search_flat (ai_ivfpq_vtab *vtab, const void *query, vector_type query_type, ai_topk_heap *heap) {
+    char *sql = sqlite3_mprintf("SELECT id, vector FROM \"%w\".\"%w_vectors\";", vtab->schema, vtab->name);
+    sqlite3_stmt *vm = NULL;
+    int rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return (rc == SQLITE_NOMEM) ? rc : sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+    
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(vm, 1) != vtab->row_bytes) continue;
+        float distance = vector_distance(query, query_type, sqlite3_column_blob(vm, 1), vtab->options.type, vtab->options.dimension, vtab->options.metric);
+        ai_topk_heap_push(heap, sqlite3_column_int64(vm, 0), distance);
+    }
+    sqlite3_finalize(vm);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+}
+
+// approximate distance of the ADC score, in the units of the metric (used when re-ranking is disabled)
+static float ai_ivfpq_adc_distance (ai_ivfpq_vtab *vtab, float score) {
+    switch (vtab->options.metric) {
+        case VECTOR_METRIC_COSINE: return score * 0.5f;         // |a - b|^2 = 2 - 2cos for unit vectors
+        case VECTOR_METRIC_L2: return sqrtf((score > 0.0f) ? score : 0.0f);
+        case VECTOR_METRIC_DOT: return score;
+    }
+    return score;
+}
+
+static int ai_ivfpq_search (ai_ivfpq_vtab *vtab, const void *query, vector_type query_type, int k, ai_topk_heap *heap) {
+    int dim = vtab->options.dimension;
+    int m = vtab->options.subvectors;
+    int subdim = vtab->subdim;
+    int nlists = vtab->options.lists;
+    int probes = (vtab->options.probes < nlists) ? vtab->options.probes : nlists;
+    int ncandidates = (vtab->options.rerank > 0) ? k * vtab->options.rerank : k;
+    if (ncandidates > AI_IVFPQ_MAX_K) ncandidates = AI_IVFPQ_MAX_K;
+    bool dot = (vtab->options.metric == VECTOR_METRIC_DOT);
+    
+    float *q = (float *)sqlite3_malloc64(sizeof(float) * dim * 2);
+    float *table = (float *)sqlite3_malloc64(sizeof(float) * (size_t)m * AI_IVFPQ_CODEWORDS);
+    ai_topk_heap nearest = {.items = (ai_topk_item *)sqlite3_malloc64(sizeof(ai_topk_item) * probes), .capacity = probes};
+    ai_topk_heap candidates = {.items = (ai_topk_item *)sqlite3_malloc64(sizeof(ai_topk_item) * ncandidates), .capacity = ncandidates};
+    int rc = SQLITE_OK;
+    if (!q || !table || !nearest.items || !candidates.items) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    float *residual = q + dim;
+    ai_ivfpq_prepare(vtab, query, query_type, q);
+    
+    // lists to probe: nearest centroids (largest inner product for the dot distance)
+    ai_ivfpq_distances(q, vtab->transposed, (dot) ? NULL : vtab->norms, nlists, dim, vtab->scratch);
+    for (int c = 0; c < nlists; ++c) ai_topk_heap_push(&nearest, c, vtab->scratch[c]);
+    qsort(nearest.items, nearest.count, sizeof(ai_topk_item), ai_topk_item_compare);
+    
+    // with the dot distance the lookup table doesn't depend on the list: -q.(c + r) = -q.c - sum(q_j.r_j)
+    if (dot) {
+        for (int j = 0; j < m; ++j) ai_ivfpq_codeword_distances(vtab, j, q + (size_t)j * subdim, true, table + (size_t)j * AI_IVFPQ_CODEWORDS);
+    }
+    
+    for (int p = 0; p < nearest.count; ++p) {
+        int list_index = (int)nearest.items[p].rowid;
+        rc = ai_ivfpq_load_list(vtab, list_index);
+        if (rc != SQLITE_OK) goto cleanup;
+        ai_ivfpq_list *list = &vtab->cache[list_index];
+        if (list->count == 0) continue;
+    
+        float bias = 0.0f;
+        if (dot) {
+            bias = nearest.items[p].distance;
+        } else {
+            // squared distances between the residual of the query and every codeword
+            const float *centroid = vtab->coarse + (size_t)list_index * dim;
+            for (int d = 0; d < dim; ++d) residual[d] = q[d] - centroid[d];
+            for (int j = 0; j < m; ++j) ai_ivfpq_codeword_distances(vtab, j, residual + (size_t)j * subdim, false, table + (size_t)j * AI_IVFPQ_CODEWORDS);
         }
-        if (!pcm_buffer) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Unable to decode audio file '%s'", path);
-            return;
+    
+        const uint8_t *code = list->codes;
+        for (int i = 0; i < list->count; ++i, code += m) {
+            float score = bias;
+            for (int j = 0; j < m; ++j) score += table[j * AI_IVFPQ_CODEWORDS + code[j]];
+            ai_topk_heap_push(&candidates, list->ids[i], score);
+        }
+    }
+    
+    if (vtab->options.rerank <= 0) {
+        for (int i = 0; i < candidates.count; ++i) ai_topk_heap_push(heap, candidates.items[i].rowid, ai_ivfpq_adc_distance(vtab, candidates.items[i].distance));
+        goto cleanup;
+    }
+    
+    // re-rank the candidates with the exact distance on the original vectors
+    for (int i = 0; i < candidates.count; ++i) {
+        const void *vector = NULL;
+        rc = ai_ivfpq_read_vector(vtab, candidates.items[i].rowid, &vector);
+        if (rc != SQLITE_OK) goto cleanup;
+        if (!vector) continue;
+        float distance = vector_distance(query, query_type, vector, vtab->options.type, dim, vtab->options.metric);
+        ai_topk_heap_push(heap, candidates.items[i].rowid, distance);
+    }
+    if (vtab->stmt_vector) sqlite3_reset(vtab->stmt_vector);
+
+cleanup:
+    sqlite3_free(q);
+    sqlite3_free(table);
+    sqlite3_free(nearest.items);
+    sqlite3_free(candidates.items);
+    return rc;
+}
+
+// MARK: Module
+
+static int ai_ivfpq_init (sqlite3 *db, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr, bool create) {
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(embedding, distance hidden, k hidden, command hidden);");
+    if (rc != SQLITE_OK) return rc;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    
+    ai_ivfpq_vtab *vtab = (ai_ivfpq_vtab *)sqlite3_malloc(sizeof(ai_ivfpq_vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    
+    memset(vtab, 0, sizeof(ai_ivfpq_vtab));
+    vtab->db = db;
+    vtab->schema = sqlite_strdup(argv[1]);
+    vtab->name = sqlite_strdup(argv[2]);
+    vtab->version = -1;
+    if (!vtab->schema || !vtab->name) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    
+    ai_ivfpq_options *options = &vtab->options;
+    *options = (ai_ivfpq_options){.type = VECTOR_TYPE_F32, .metric = VECTOR_METRIC_COSINE, .lists = AI_IVFPQ_DEFAULT_LISTS, .probes = AI_IVFPQ_DEFAULT_PROBES, .rerank = AI_IVFPQ_DEFAULT_RERANK};
+    
+    if (create) {
+        // each module argument is a key=value pair
+        for (int i = 3; i < argc; ++i) {
+            parse_keyvalue_string(NULL, argv[i], ai_ivfpq_options_callback, options);
         }
     } else {
-        const void *data = sqlite3_value_blob(argv[0]);
-        size_t data_size = (size_t)sqlite3_value_bytes(argv[0]);
-        int format = audio_detect_format_from_blob(data, data_size);
-        switch (format) {
-            case 1: pcm_buffer = audio_wav_mem2pcm(data, data_size, &num_samples, &sample_rate, &channels); break;
-            case 2: pcm_buffer = audio_mp3_mem2pcm(data, data_size, &num_samples, &sample_rate, &channels); break;
-            case 3: pcm_buffer = audio_flac_mem2pcm(data, data_size, &num_samples, &sample_rate, &channels); break;
-            default:
-                sqlite_context_result_error(context, SQLITE_ERROR, "Unsupported audio format in BLOB. Supported: WAV, MP3, FLAC");
-                return;
+        char *sql = sqlite3_mprintf("SELECT key, value FROM \"%w\".\"%w_config\" WHERE typeof(value) = 'integer';", vtab->schema, vtab->name);
+        sqlite3_stmt *vm = NULL;
+        rc = (sql) ? sqlite3_prepare_v2(db, sql, -1, &vm, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        while (rc == SQLITE_OK && sqlite3_step(vm) == SQLITE_ROW) {
+            const char *key = (const char *)sqlite3_column_text(vm, 0);
+            int value = sqlite3_column_int(vm, 1);
+            if (!key) continue;
+            if (strcmp(key, OPTION_KEY_DIMENSION) == 0) options->dimension = value;
+            else if (strcmp(key, OPTION_KEY_EMBEDDING_TYPE) == 0) options->type = (vector_type)value;
+            else if (strcmp(key, OPTION_KEY_DISTANCE) == 0) options->metric = (vector_metric)value;
+            else if (strcmp(key, OPTION_KEY_LISTS) == 0) options->lists = value;
+            else if (strcmp(key, OPTION_KEY_SUBVECTORS) == 0) options->subvectors = value;
+            else if (strcmp(key, OPTION_KEY_PROBES) == 0) options->probes = value;
+            else if (strcmp(key, OPTION_KEY_RERANK) == 0) options->rerank = value;
+            else if (strcmp(key, OPTION_KEY_TRAIN_SIZE) == 0) options->train_size = value;
         }
-        if (!pcm_buffer) {
-            sqlite_context_result_error(context, SQLITE_ERROR, "Unable to decode audio BLOB");
-            return;
+        if (vm) sqlite3_finalize(vm);
+        if (rc != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+            goto cleanup;
+        }
+    }
+    
+    if (options->dimension <= 0 || options->dimension > AI_IVFPQ_MAX_DIMENSION) {
+        *pzErr = sqlite3_mprintf("ai_ivfpq requires a dimension between 1 and %d", AI_IVFPQ_MAX_DIMENSION);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->type < VECTOR_TYPE_F32 || options->type > VECTOR_TYPE_I8) {
+        *pzErr = sqlite3_mprintf("ai_ivfpq invalid embedding_type");
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->metric < VECTOR_METRIC_COSINE || options->metric > VECTOR_METRIC_L2) {
+        *pzErr = sqlite3_mprintf("ai_ivfpq invalid distance (expected cosine, dot or l2)");
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->subvectors == 0) {
+        // the largest divisor of the dimension up to 64 that leaves at least 8 elements per subvector
+        options->subvectors = 1;
+        for (int m = 64; m > 1; --m) {
+            if (options->dimension % m == 0 && options->dimension / m >= 8) {
+                options->subvectors = m;
+                break;
+            }
         }
     }
+    if (options->subvectors < 1 || options->subvectors > AI_IVFPQ_MAX_SUBVECTORS || options->dimension % options->subvectors != 0) {
+        *pzErr = sqlite3_mprintf("ai_ivfpq subvectors must divide the dimension (max %d)", AI_IVFPQ_MAX_SUBVECTORS);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->lists < 1 || options->lists > AI_IVFPQ_MAX_LISTS || options->probes < 1) {
+        *pzErr = sqlite3_mprintf("ai_ivfpq lists must be between 1 and %d and probes at least 1", AI_IVFPQ_MAX_LISTS);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    if (options->rerank < 0) options->rerank = 0;
+    if (options->train_size <= 0) options->train_size = 32 * ((options->lists > AI_IVFPQ_CODEWORDS) ? options->lists : AI_IVFPQ_CODEWORDS);
+    vtab->row_bytes = options->dimension * (int)vector_type_size(options->type);
+    vtab->subdim = options->dimension / options->subvectors;
+    
+    if (create) {
+        char *sql = sqlite3_mprintf("CREATE TABLE \"%w\".\"%w_vectors\" (id INTEGER PRIMARY KEY, list INTEGER, vector BLOB NOT NULL);"
+                                    "CREATE TABLE \"%w\".\"%w_codes\" (list INTEGER NOT NULL, id INTEGER NOT NULL, code BLOB NOT NULL, PRIMARY KEY (list, id)) WITHOUT ROWID;"
+                                    "CREATE TABLE \"%w\".\"%w_config\" (key TEXT PRIMARY KEY, value) WITHOUT ROWID;"
+                                    "INSERT INTO \"%w\".\"%w_config\" (key, value) VALUES ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('%q', %d), ('version', 0);",
+                                    vtab->schema, vtab->name, vtab->schema, vtab->name, vtab->schema, vtab->name, vtab->schema, vtab->name,
+                                    OPTION_KEY_DIMENSION, options->dimension, OPTION_KEY_EMBEDDING_TYPE, (int)options->type, OPTION_KEY_DISTANCE, (int)options->metric,
+                                    OPTION_KEY_LISTS, options->lists, OPTION_KEY_SUBVECTORS, options->subvectors, OPTION_KEY_PROBES, options->probes,
+                                    OPTION_KEY_RERANK, options->rerank, OPTION_KEY_TRAIN_SIZE, options->train_size);
+        rc = (sql) ? sqlite3_exec(db, sql, NULL, NULL, pzErr) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
+    *ppVtab = (sqlite3_vtab *)vtab;
+    return SQLITE_OK;
 
-    // convert to mono 16kHz as required by whisper
-    int whisper_samples = 0;
-    float *whisper_pcm = audio_convert_to_mono_16khz(pcm_buffer, num_samples, sample_rate, channels, &whisper_samples);
-    sqlite3_free(pcm_buffer); // allocated via miniaudio's sqlite3_malloc wrapper
+cleanup:
+    sqlite3_free(vtab->schema);
+    sqlite3_free(vtab->name);
+    sqlite3_free(vtab);
+    return rc;
+}
 
-    if (!whisper_pcm || whisper_samples <= 0) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Failed to convert audio to mono 16kHz PCM");
-        return;
-    }
+static int ai_ivfpq_create (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return ai_ivfpq_init(db, argc, argv, ppVtab, pzErr, true);
+}
 
-    // parse transcription options
-    struct whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-    params.print_special = false;
-    params.print_progress = false;
-    params.print_realtime = false;
-    params.print_timestamps = false;
+static int ai_ivfpq_connect (sqlite3 *db, void *pAux, int argc, const char *const *argv, sqlite3_vtab **ppVtab, char **pzErr) {
+    return ai_ivfpq_init(db, argc, argv, ppVtab, pzErr, false);
+}
 
-    // save default pointers so we can tell which ones we allocated
-    const char *default_language = params.language;
-    const char *default_initial_prompt = params.initial_prompt;
-    const char *default_suppress_regex = params.suppress_regex;
+static int ai_ivfpq_disconnect (sqlite3_vtab *pVtab) {
+    ai_ivfpq_vtab *vtab = (ai_ivfpq_vtab *)pVtab;
+    ai_ivfpq_statements_finalize(vtab);
+    ai_ivfpq_reset(vtab);
+    sqlite3_free(vtab->schema);
+    sqlite3_free(vtab->name);
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
 
-    const char *options = (argc >= 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
-    if (parse_keyvalue_string(ai, options, whisper_full_params_options_callback, &params) == false) {
-        sqlite3_free(whisper_pcm);
-        if (params.language != default_language) sqlite3_free((void *)params.language);
-        if (params.initial_prompt != default_initial_prompt) sqlite3_free((void *)params.initial_prompt);
-        if (params.suppress_regex != default_suppress_regex) sqlite3_free((void *)params.suppress_regex);
-        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", options);
-        return;
+static int ai_ivfpq_destroy (sqlite3_vtab *pVtab) {
+    ai_ivfpq_vtab *vtab = (ai_ivfpq_vtab *)pVtab;
+    ai_ivfpq_statements_finalize(vtab);
+    
+    char *sql = sqlite3_mprintf("DROP TABLE IF EXISTS \"%w\".\"%w_vectors\"; DROP TABLE IF EXISTS \"%w\".\"%w_codes\"; DROP TABLE IF EXISTS \"%w\".\"%w_config\";",
+                                vtab->schema, vtab->name, vtab->schema, vtab->name, vtab->schema, vtab->name);
+    int rc = (sql) ? sqlite3_exec(vtab->db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return rc;
+    
+    return ai_ivfpq_disconnect(pVtab);
+}
+
+static int ai_ivfpq_best_index (sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+    int match = -1, k = -1, rowid = -1;
+    
+    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint *constraint = &pIdxInfo->aConstraint[i];
+        if (!constraint->usable) continue;
+        if (constraint->op == SQLITE_INDEX_CONSTRAINT_MATCH && constraint->iColumn == AI_IVFPQ_COLUMN_EMBEDDING) match = i;
+        else if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ && constraint->iColumn == AI_IVFPQ_COLUMN_K) k = i;
+        else if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ && constraint->iColumn == -1) rowid = i;
+    }
+    
+    if (match >= 0) {
+        // k is optional and defaults to AI_IVFPQ_DEFAULT_K
+        pIdxInfo->aConstraintUsage[match].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[match].omit = 1;
+        if (k >= 0) {
+            pIdxInfo->aConstraintUsage[k].argvIndex = 2;
+            pIdxInfo->aConstraintUsage[k].omit = 1;
+        }
+        if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == AI_IVFPQ_COLUMN_DISTANCE && !pIdxInfo->aOrderBy[0].desc) {
+            pIdxInfo->orderByConsumed = 1;
+        }
+        pIdxInfo->idxNum = AI_IVFPQ_IDXNUM_MATCH;
+        pIdxInfo->estimatedCost = 1000.0;
+        pIdxInfo->estimatedRows = AI_IVFPQ_DEFAULT_K;
+        return SQLITE_OK;
+    }
+    
+    if (rowid >= 0) {
+        pIdxInfo->aConstraintUsage[rowid].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[rowid].omit = 1;
+        pIdxInfo->idxNum = AI_IVFPQ_IDXNUM_ROWID;
+        pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+        pIdxInfo->estimatedCost = 10.0;
+        pIdxInfo->estimatedRows = 1;
+        return SQLITE_OK;
     }
+    
+    pIdxInfo->idxNum = AI_IVFPQ_IDXNUM_SCAN;
+    pIdxInfo->estimatedCost = 1000000.0;
+    return SQLITE_OK;
+}
 
-    // run whisper inference
-    int rc = whisper_full(ai->whisper, params, whisper_pcm, whisper_samples);
-    sqlite3_free(whisper_pcm);
+static int ai_ivfpq_cursor_open (sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
+    ai_ivfpq_cursor *c = (ai_ivfpq_cursor *)sqlite3_malloc(sizeof(ai_ivfpq_cursor));
+    if (!c) return SQLITE_NOMEM;
+    
+    memset(c, 0, sizeof(ai_ivfpq_cursor));
+    c->vtab = (ai_ivfpq_vtab *)pVtab;
+    
+    *ppCursor = (sqlite3_vtab_cursor *)c;
+    return SQLITE_OK;
+}
 
-    // free allocated option strings (only those we allocated via sqlite_strdup)
-    if (params.language != default_language) sqlite3_free((void *)params.language);
-    if (params.initial_prompt != default_initial_prompt) sqlite3_free((void *)params.initial_prompt);
-    if (params.suppress_regex != default_suppress_regex) sqlite3_free((void *)params.suppress_regex);
+static void ai_ivfpq_cursor_reset (ai_ivfpq_cursor *c) {
+    if (c->scan) sqlite3_finalize(c->scan);
+    sqlite3_free(c->items);
+    c->scan = NULL;
+    c->items = NULL;
+    c->count = 0;
+    c->index = 0;
+    c->eof = true;
+}
 
-    if (rc != 0) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Whisper transcription failed (error code %d)", rc);
-        return;
-    }
+static int ai_ivfpq_cursor_close (sqlite3_vtab_cursor *cur) {
+    ai_ivfpq_cursor *c = (ai_ivfpq_cursor *)cur;
+    ai_ivfpq_cursor_reset(c);
+    sqlite3_free(c);
+    return SQLITE_OK;
+}
 
-    // collect all segments into a single result
-    int n_segments = whisper_full_n_segments(ai->whisper);
-    if (n_segments == 0) {
-        sqlite3_result_text(context, "", 0, SQLITE_STATIC);
-        return;
+static int ai_ivfpq_cursor_next (sqlite3_vtab_cursor *cur) {
+    ai_ivfpq_cursor *c = (ai_ivfpq_cursor *)cur;
+    if (!c->scan) {
+        c->eof = (++c->index >= c->count);
+        return SQLITE_OK;
     }
+    
+    int rc = sqlite3_step(c->scan);
+    c->eof = (rc != SQLITE_ROW);
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) return SQLITE_OK;
+    return sqlite_vtab_set_error(&c->vtab->base, "%s", sqlite3_errmsg(c->vtab->db));
+}
 
-    if (n_segments == 1) {
-        const char *text = whisper_full_get_segment_text(ai->whisper, 0);
-        sqlite3_result_text(context, text, -1, SQLITE_TRANSIENT);
-        return;
-    }
+static int ai_ivfpq_cursor_eof (sqlite3_vtab_cursor *cur) {
+    ai_ivfpq_cursor *c = (ai_ivfpq_cursor *)cur;
+    return c->eof;
+}
 
-    // multiple segments — concatenate
-    buffer_t result = {0};
-    if (!buffer_create(&result, 4096)) {
-        sqlite_context_result_error(context, SQLITE_NOMEM, "Out of memory");
-        return;
+static int ai_ivfpq_cursor_column (sqlite3_vtab_cursor *cur, sqlite3_context *context, int iCol) {
+    ai_ivfpq_cursor *c = (ai_ivfpq_cursor *)cur;
+    ai_ivfpq_vtab *vtab = c->vtab;
+    
+    if (iCol == AI_IVFPQ_COLUMN_EMBEDDING) {
+        if (c->scan) {
+            sqlite3_result_value(context, sqlite3_column_value(c->scan, 1));
+            return SQLITE_OK;
+        }
+        const void *vector = NULL;
+        int rc = ai_ivfpq_read_vector(vtab, c->items[c->index].rowid, &vector);
+        if (vector) sqlite3_result_blob(context, vector, vtab->row_bytes, SQLITE_TRANSIENT);
+        if (vtab->stmt_vector) sqlite3_reset(vtab->stmt_vector);
+        return rc;
+    }
+    
+    if (iCol == AI_IVFPQ_COLUMN_DISTANCE && !c->scan) {
+        sqlite3_result_double(context, (double)c->items[c->index].distance);
     }
+    return SQLITE_OK;
+}
 
-    for (int i = 0; i < n_segments; i++) {
-        const char *seg_text = whisper_full_get_segment_text(ai->whisper, i);
-        if (seg_text) {
-            buffer_append(&result, seg_text, (uint32_t)strlen(seg_text), false);
+static int ai_ivfpq_cursor_rowid (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+    ai_ivfpq_cursor *c = (ai_ivfpq_cursor *)cur;
+    *pRowid = (c->scan) ? sqlite3_column_int64(c->scan, 0) : c->items[c->index].rowid;
+    return SQLITE_OK;
+}
+
+static int ai_ivfpq_filter (sqlite3_vtab_cursor *cur, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    ai_ivfpq_cursor *c = (ai_ivfpq_cursor *)cur;
+    ai_ivfpq_vtab *vtab = c->vtab;
+    ai_ivfpq_cursor_reset(c);
+    
+    if (idxNum != AI_IVFPQ_IDXNUM_MATCH) {
+        const char *where = (idxNum == AI_IVFPQ_IDXNUM_ROWID) ? " WHERE id = ?1" : "";
+        char *sql = sqlite3_mprintf("SELECT id, vector FROM \"%w\".\"%w_vectors\"%s ORDER BY id;", vtab->schema, vtab->name, where);
+        int rc = (sql) ? sqlite3_prepare_v2(vtab->db, sql, -1, &c->scan, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) return sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        if (idxNum == AI_IVFPQ_IDXNUM_ROWID) sqlite3_bind_value(c->scan, 1, argv[0]);
+        return ai_ivfpq_cursor_next(cur);
+    }
+    
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        return sqlite_vtab_set_error(&vtab->base, "ai_ivfpq MATCH expects a BLOB vector");
+    }
+    int k = AI_IVFPQ_DEFAULT_K;
+    if (argc >= 2) {
+        if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER || sqlite3_value_int64(argv[1]) <= 0 || sqlite3_value_int64(argv[1]) > AI_IVFPQ_MAX_K) {
+            return sqlite_vtab_set_error(&vtab->base, "ai_ivfpq k must be an INTEGER between 1 and %d", AI_IVFPQ_MAX_K);
         }
+        k = sqlite3_value_int(argv[1]);
     }
-
-    sqlite3_result_text(context, result.data, result.length, sqlite3_free);
+    
+    // the query can also be a FLOAT32 vector of the same dimension
+    int query_bytes = sqlite3_value_bytes(argv[0]);
+    vector_type query_type, row_type;
+    int dimension = vector_resolve_dimension(query_bytes, vtab->row_bytes, vtab->options.type, &query_type, &row_type);
+    if (dimension != vtab->options.dimension || row_type != vtab->options.type) {
+        return sqlite_vtab_set_error(&vtab->base, "Query vector of %d bytes is not compatible with vectors of dimension %d and type %s", query_bytes, vtab->options.dimension, embedding_type_to_name((embedding_type)vtab->options.type));
+    }
+    
+    int rc = ai_ivfpq_sync(vtab);
+    if (rc != SQLITE_OK) return rc;
+    
+    ai_topk_heap heap = {.items = (ai_topk_item *)sqlite3_malloc64(sizeof(ai_topk_item) * k), .capacity = k};
+    if (!heap.items) return SQLITE_NOMEM;
+    
+    const void *query = sqlite3_value_blob(argv[0]);
+    rc = (vtab->cache) ? ai_ivfpq_search(vtab, query, query_type, k, &heap) : ai_ivfpq_search_flat(vtab, query, query_type, &heap);
+    if (rc != SQLITE_OK) {
+        sqlite3_free(heap.items);
+        return rc;
+    }
+    
+    qsort(heap.items, heap.count, sizeof(ai_topk_item), ai_topk_item_compare);
+    c->items = heap.items;
+    c->count = heap.count;
+    c->eof = (c->count == 0);
+    return SQLITE_OK;
 }
 
-static void audio_model_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    // sanity check arguments
-    if (llm_common_args_check(context, "audio_model_load", argc, argv, false) == false) return;
+static int ai_ivfpq_update (sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid) {
+    ai_ivfpq_vtab *vtab = (ai_ivfpq_vtab *)pVtab;
     
-    const char *model_path = (const char *)sqlite3_value_text(argv[0]);
-    const char *model_options = (argc == 2) ? (const char *)sqlite3_value_text(argv[1]) : NULL;
+    int rc = ai_ivfpq_sync(vtab);
+    if (rc != SQLITE_OK) return rc;
     
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    struct whisper_context_params ctx_params = whisper_context_default_params();
-    if (parse_keyvalue_string(ai, model_options, whisper_model_options_callback, &ctx_params) == false) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "An error occurred while parsing options (%s)", model_options);
-        return;
+    // INSERT INTO index(command) VALUES ('train')
+    if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL && sqlite3_value_type(argv[2 + AI_IVFPQ_COLUMN_COMMAND]) != SQLITE_NULL) {
+        const char *command = (const char *)sqlite3_value_text(argv[2 + AI_IVFPQ_COLUMN_COMMAND]);
+        if (command && strcasecmp(command, "train") == 0) return ai_ivfpq_train(vtab);
+        return sqlite_vtab_set_error(&vtab->base, "Unknown ai_ivfpq command '%s'", command ? command : "");
     }
     
-    struct whisper_context *whisper = whisper_init_from_file_with_params(model_path, ctx_params);
-    if (!whisper) {
-        sqlite_context_result_error(context, SQLITE_ERROR, "Unable to load audio model from file %s", model_path);
-        return;
+    if (argc > 1) {
+        sqlite3_value *embedding = argv[2 + AI_IVFPQ_COLUMN_EMBEDDING];
+        if (sqlite3_value_type(embedding) != SQLITE_BLOB || sqlite3_value_bytes(embedding) != vtab->row_bytes) {
+            return sqlite_vtab_set_error(&vtab->base, "ai_ivfpq embedding must be a BLOB of %d bytes (dimension %d, type %s)", vtab->row_bytes, vtab->options.dimension, embedding_type_to_name((embedding_type)vtab->options.type));
+        }
     }
     
-    ai_cleanup((void *)ai, false, true);
-    ai->whisper = whisper;
+    // DELETE and UPDATE remove the old vector and its code first
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        sqlite3_int64 rowid = sqlite3_value_int64(argv[0]);
+        sqlite3_stmt *stmt = ai_ivfpq_statement(vtab, &vtab->stmt_lookup, "SELECT list FROM \"%w\".\"%w_vectors\" WHERE id = ?1;");
+        if (!stmt) {
+            rc = SQLITE_ERROR;
+            goto cleanup;
+        }
+        sqlite3_bind_int64(stmt, 1, rowid);
+        int list = -1;
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) list = sqlite3_column_int(stmt, 0);
+        rc = (rc == SQLITE_ROW || rc == SQLITE_DONE) ? SQLITE_OK : sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_OK) goto cleanup;
+        
+        stmt = ai_ivfpq_statement(vtab, &vtab->stmt_delete_code, "DELETE FROM \"%w\".\"%w_codes\" WHERE list = ?1 AND id = ?2;");
+        if (!stmt) {
+            rc = SQLITE_ERROR;
+            goto cleanup;
+        }
+        sqlite3_bind_int(stmt, 1, list);
+        sqlite3_bind_int64(stmt, 2, rowid);
+        rc = ai_ivfpq_step(vtab, stmt);
+        if (rc != SQLITE_OK) goto cleanup;
+        
+        stmt = ai_ivfpq_statement(vtab, &vtab->stmt_delete_vector, "DELETE FROM \"%w\".\"%w_vectors\" WHERE id = ?1;");
+        if (!stmt) {
+            rc = SQLITE_ERROR;
+            goto cleanup;
+        }
+        sqlite3_bind_int64(stmt, 1, rowid);
+        rc = ai_ivfpq_step(vtab, stmt);
+        if (rc != SQLITE_OK) goto cleanup;
+        
+        // the cached list is reloaded by the next query
+        if (vtab->cache && list >= 0 && list < vtab->options.lists) ai_ivfpq_list_drop(&vtab->cache[list]);
+    }
+    
+    if (argc > 1) {
+        const void *vector = sqlite3_value_blob(argv[2 + AI_IVFPQ_COLUMN_EMBEDDING]);
+        int list = -1;
+        uint8_t code[AI_IVFPQ_MAX_SUBVECTORS];
+        if (vtab->cache) {
+            float *x = (float *)sqlite3_malloc64(sizeof(float) * vtab->options.dimension);
+            if (!x) {
+                rc = SQLITE_NOMEM;
+                goto cleanup;
+            }
+            ai_ivfpq_prepare(vtab, vector, vtab->options.type, x);
+            list = ai_ivfpq_encode(vtab, x, code);
+            sqlite3_free(x);
+        }
+    
+        sqlite3_stmt *stmt = ai_ivfpq_statement(vtab, &vtab->stmt_insert, "INSERT INTO \"%w\".\"%w_vectors\" (id, list, vector) VALUES (?1, ?2, ?3);");
+        if (!stmt) {
+            rc = SQLITE_ERROR;
+            goto cleanup;
+        }
+        sqlite3_bind_value(stmt, 1, argv[1]);
+        if (list >= 0) sqlite3_bind_int(stmt, 2, list);
+        else sqlite3_bind_null(stmt, 2);
+        sqlite3_bind_blob(stmt, 3, vector, vtab->row_bytes, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (rc != SQLITE_DONE) {
+            rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+            goto cleanup;
+        }
+        *pRowid = sqlite3_last_insert_rowid(vtab->db);
+    
+        if (list >= 0) {
+            stmt = ai_ivfpq_statement(vtab, &vtab->stmt_code, "INSERT INTO \"%w\".\"%w_codes\" (list, id, code) VALUES (?1, ?2, ?3);");
+            if (!stmt) {
+                rc = SQLITE_ERROR;
+                goto cleanup;
+            }
+            sqlite3_bind_int(stmt, 1, list);
+            sqlite3_bind_int64(stmt, 2, *pRowid);
+            sqlite3_bind_blob(stmt, 3, code, vtab->options.subvectors, SQLITE_STATIC);
+            rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (rc != SQLITE_DONE) {
+                rc = sqlite_vtab_set_error(&vtab->base, "%s", sqlite3_errmsg(vtab->db));
+                goto cleanup;
+            }
+            ai_ivfpq_list_drop(&vtab->cache[list]);
+        }
+    }
+    
+    rc = ai_ivfpq_bump_version(vtab);
+
+cleanup:
+    if (rc != SQLITE_OK) {
+        // the statement is rolled back, reload everything on the next access
+        ai_ivfpq_reset(vtab);
+        vtab->version = -1;
+    }
+    return rc;
 }
 
-static void audio_model_free (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    ai_context *ai = (ai_context *)sqlite3_user_data(context);
-    ai_cleanup((void *)ai, false, true);
+static int ai_ivfpq_begin (sqlite3_vtab *pVtab) {
+    return SQLITE_OK;
+}
+
+static int ai_ivfpq_rollback (sqlite3_vtab *pVtab) {
+    ai_ivfpq_vtab *vtab = (ai_ivfpq_vtab *)pVtab;
+    ai_ivfpq_reset(vtab);
+    vtab->version = -1;
+    return SQLITE_OK;
+}
+
+static int ai_ivfpq_savepoint (sqlite3_vtab *pVtab, int iSavepoint) {
+    return SQLITE_OK;
+}
+
+static int ai_ivfpq_rollback_to (sqlite3_vtab *pVtab, int iSavepoint) {
+    return ai_ivfpq_rollback(pVtab);
+}
+
+static int ai_ivfpq_rename (sqlite3_vtab *pVtab, const char *zNew) {
+    ai_ivfpq_vtab *vtab = (ai_ivfpq_vtab *)pVtab;
+    
+    char *name = sqlite_strdup(zNew);
+    if (!name) return SQLITE_NOMEM;
+    
+    char *sql = sqlite3_mprintf("ALTER TABLE \"%w\".\"%w_vectors\" RENAME TO \"%w_vectors\"; ALTER TABLE \"%w\".\"%w_codes\" RENAME TO \"%w_codes\"; ALTER TABLE \"%w\".\"%w_config\" RENAME TO \"%w_config\";",
+                                vtab->schema, vtab->name, zNew, vtab->schema, vtab->name, zNew, vtab->schema, vtab->name, zNew);
+    int rc = (sql) ? sqlite3_exec(vtab->db, sql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        sqlite3_free(name);
+        return rc;
+    }
+    
+    // statements refer to the old table names
+    ai_ivfpq_statements_finalize(vtab);
+    sqlite3_free(vtab->name);
+    vtab->name = name;
+    return SQLITE_OK;
 }
 
+static int ai_ivfpq_shadow_name (const char *zName) {
+    return (strcmp(zName, "vectors") == 0 || strcmp(zName, "codes") == 0 || strcmp(zName, "config") == 0);
+}
+
+static sqlite3_module ai_ivfpq = {
+  /* iVersion    */ 3,
+  /* xCreate     */ ai_ivfpq_create,
+  /* xConnect    */ ai_ivfpq_connect,
+  /* xBestIndex  */ ai_ivfpq_best_index,
+  /* xDisconnect */ ai_ivfpq_disconnect,
+  /* xDestroy    */ ai_ivfpq_destroy,
+  /* xOpen       */ ai_ivfpq_cursor_open,
+  /* xClose      */ ai_ivfpq_cursor_close,
+  /* xFilter     */ ai_ivfpq_filter,
+  /* xNext       */ ai_ivfpq_cursor_next,
+  /* xEof        */ ai_ivfpq_cursor_eof,
+  /* xColumn     */ ai_ivfpq_cursor_column,
+  /* xRowid      */ ai_ivfpq_cursor_rowid,
+  /* xUpdate     */ ai_ivfpq_update,
+  /* xBegin      */ ai_ivfpq_begin,
+  /* xSync       */ 0,
+  /* xCommit     */ 0,
+  /* xRollback   */ ai_ivfpq_rollback,
+  /* xFindMethod */ 0,
+  /* xRename     */ ai_ivfpq_rename,
+  /* xSavepoint  */ ai_ivfpq_savepoint,
+  /* xRelease    */ 0,
+  /* xRollbackTo */ ai_ivfpq_rollback_to,
+  /* xShadowName */ ai_ivfpq_shadow_name,
+  /* xIntegrity  */ 0
+};
+
 // MARK: - AI -
 
 static void ai_log_info (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -3693,6 +12720,7 @@ SQLITE_AI_API int sqlite3_ai_init (sqlite3 *db, char **pzErrMsg, const sqlite3_a
     static bool once = false;
     if (once == false) {
         llama_backend_init();
+        vector_init();
         once = true;
     }
     
@@ -3727,6 +12755,15 @@ SQLITE_AI_API int sqlite3_ai_init (sqlite3 *db, char **pzErrMsg, const sqlite3_a
     rc = sqlite3_create_function(db, "llm_model_free", 0, SQLITE_UTF8, ctx, llm_model_free, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
+    rc = sqlite3_create_function(db, "llm_draft_model_load", 1, SQLITE_UTF8, ctx, llm_draft_model_load, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_draft_model_load", 2, SQLITE_UTF8, ctx, llm_draft_model_load, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_draft_model_free", 0, SQLITE_UTF8, ctx, llm_draft_model_free, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
     rc = sqlite3_create_function(db, "llm_context_create", 1, SQLITE_UTF8, ctx, llm_context_create, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
@@ -3823,12 +12860,69 @@ SQLITE_AI_API int sqlite3_ai_init (sqlite3 *db, char **pzErrMsg, const sqlite3_a
     rc = sqlite3_create_function(db, "llm_embed_generate", 2, SQLITE_UTF8, ctx, llm_embed_generate, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
+    rc = sqlite3_create_function(db, "llm_rerank", 2, SQLITE_UTF8, ctx, llm_rerank, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_rerank", 3, SQLITE_UTF8, ctx, llm_rerank, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_classify", 2, SQLITE_UTF8, ctx, llm_classify, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_classify", 3, SQLITE_UTF8, ctx, llm_classify, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_score", 2, SQLITE_UTF8, ctx, llm_score, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_score", 3, SQLITE_UTF8, ctx, llm_score, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "llm_embed_generate_batch", &llm_embed_generate_batch, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "llm_embed_each", &llm_embed_each, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "llm_rerank_batch", &llm_rerank_batch, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "llm_embed_chunks", &llm_embed_chunks, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "llm_score_batch", &llm_score_batch, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
     rc = sqlite3_create_function(db, "llm_token_count", 1, SQLITE_UTF8, ctx, llm_token_count, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
+    rc = sqlite3_create_function(db, "llm_prefix_register", 2, SQLITE_UTF8, ctx, llm_prefix_register, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_prefix_free", 0, SQLITE_UTF8, ctx, llm_prefix_free, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_prefix_free", 1, SQLITE_UTF8, ctx, llm_prefix_free, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
     rc = sqlite3_create_function(db, "llm_text_generate", -1, SQLITE_UTF8, ctx, llm_text_generate, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
+    rc = sqlite3_create_function(db, "llm_job_submit", 2, SQLITE_UTF8, ctx, llm_job_submit, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_job_submit", 3, SQLITE_UTF8, ctx, llm_job_submit, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_job_result", 1, SQLITE_UTF8, ctx, llm_job_result, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "ai_embed_column", 3, SQLITE_UTF8, ctx, ai_embed_column, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "ai_embed_column", 4, SQLITE_UTF8, ctx, ai_embed_column, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
     rc = sqlite3_create_function(db, "llm_chat_create", 0, SQLITE_UTF8, ctx, llm_chat_create, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
@@ -3844,6 +12938,9 @@ SQLITE_AI_API int sqlite3_ai_init (sqlite3 *db, char **pzErrMsg, const sqlite3_a
     rc = sqlite3_create_function(db, "llm_chat_save", 2, SQLITE_UTF8, ctx, llm_chat_save, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
+    rc = sqlite3_create_function(db, "llm_chat_save", 3, SQLITE_UTF8, ctx, llm_chat_save, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
     rc = sqlite3_create_function(db, "llm_chat_restore", 1, SQLITE_UTF8, ctx, llm_chat_restore, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
     
@@ -3859,6 +12956,24 @@ SQLITE_AI_API int sqlite3_ai_init (sqlite3 *db, char **pzErrMsg, const sqlite3_a
     rc = sqlite3_create_module(db, "llm_chat", &llm_chat, ctx);
     if (rc != SQLITE_OK) goto cleanup;
     
+    rc = sqlite3_create_function(db, "llm_chat_session_create", 0, SQLITE_UTF8, ctx, llm_chat_session_create, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_chat_session_create", 1, SQLITE_UTF8, ctx, llm_chat_session_create, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_chat_session_respond", 2, SQLITE_UTF8, ctx, llm_chat_session_respond, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_chat_session_free", 0, SQLITE_UTF8, ctx, llm_chat_session_free, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "llm_chat_session_free", 1, SQLITE_UTF8, ctx, llm_chat_session_free, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "llm_chat_session_respond_batch", &llm_chat_session_respond_batch, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
     rc = sqlite3_create_function(db, "llm_model_n_params", 0, SQLITE_UTF8, ctx, llm_model_n_params, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
 
@@ -3932,6 +13047,25 @@ SQLITE_AI_API int sqlite3_ai_init (sqlite3 *db, char **pzErrMsg, const sqlite3_a
 
     rc = sqlite3_create_function(db, "audio_model_transcribe", 2, SQLITE_UTF8, ctx, audio_model_transcribe, NULL, NULL);
     if (rc != SQLITE_OK) goto cleanup;
+    
+    // VECTOR
+    rc = sqlite3_create_function(db, "ai_vector_distance", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, ctx, ai_vector_distance, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "ai_vector_distance", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, ctx, ai_vector_distance, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_function(db, "ai_vector_distance", 4, SQLITE_UTF8 | SQLITE_DETERMINISTIC, ctx, ai_vector_distance, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "ai_vector_topk", &ai_vector_topk, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "ai_hnsw", &ai_hnsw, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_create_module(db, "ai_ivfpq", &ai_ivfpq, ctx);
+    if (rc != SQLITE_OK) goto cleanup;
      
 cleanup:
     return rc;
@@ -426,6 +426,50 @@ char *ai_uuid_v7_string (char value[UUID_STR_MAXLEN], bool dash_format) {
     return ai_uuid_v7_stringify(uuid, value, dash_format);
 }
 
+// MARK: - System -
+
+int ai_cpu_count (void) {
+    #ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+    #else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    #endif
+    return (count > 0) ? count : 1;
+}
+
+// absolute path of path with the symbolic links resolved (a missing file is resolved through its directory), NULL on error
+char *ai_path_canonical (const char *path) {
+    #ifdef _WIN32
+    char *full = _fullpath(NULL, path, 0);
+    char *result = (full) ? sqlite_strdup(full) : NULL;
+    free(full);
+    return result;
+    #else
+    char *full = realpath(path, NULL);
+    if (full) {
+        char *result = sqlite_strdup(full);
+        free(full);
+        return result;
+    }
+    
+    // the file can be missing (removed after the model was loaded)
+    const char *slash = strrchr(path, '/');
+    char *dir = (slash) ? sqlite3_mprintf("%.*s", (slash == path) ? 1 : (int)(slash - path), path) : sqlite3_mprintf(".");
+    if (!dir) return NULL;
+    full = realpath(dir, NULL);
+    sqlite3_free(dir);
+    if (!full) return NULL;
+    
+    const char *name = (slash) ? slash + 1 : path;
+    size_t len = strlen(full);
+    char *result = sqlite3_mprintf("%s%s%s", full, (len > 0 && full[len - 1] == '/') ? "" : "/", name);
+    free(full);
+    return result;
+    #endif
+}
+
 // MARK: - Audio -
 
 float *audio_wav_file2pcm (const char *wav_path, uint64_t *num_samples, uint32_t *sample_rate, uint32_t *channels) {
@@ -47,6 +47,8 @@ void buffer_reset (buffer_t *b);
 void buffer_destroy (buffer_t *b);
 
 char *ai_uuid_v7_string (char value[UUID_STR_MAXLEN], bool dash_format);
+int   ai_cpu_count (void);
+char *ai_path_canonical (const char *path);
 
 float *audio_wav_file2pcm (const char *wav_path, uint64_t *num_samples, uint32_t *sample_rate, uint32_t *channels);
 float *audio_wav_mem2pcm (const void *data, size_t data_size, uint64_t *num_samples, uint32_t *sample_rate, uint32_t *channels);
@@ -0,0 +1,848 @@
+//
+//  vector.c
+//  sqliteai
+//
+
+#include "vector.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define VECTOR_X86                              1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define VECTOR_NEON                             1
+#include <arm_neon.h>
+#endif
+
+typedef struct {
+    const char  *name;
+    float       (*f32_sumsq)(const float *src, int n);
+    void        (*f32_scale)(const float *src, float *dest, int n, float scale);
+    void        (*f32_to_f16)(const float *src, uint16_t *dest, int n, float scale);
+    void        (*f32_to_bf16)(const float *src, uint16_t *dest, int n, float scale);
+    void        (*f32_to_i8)(const float *src, int8_t *dest, int n, float scale, float mult, float bias, float lo, float hi);
+    void        (*f32_to_u8)(const float *src, uint8_t *dest, int n, float scale, float mult, float bias, float lo, float hi);
+    float       (*f32_dot)(const float *a, const float *b, int n);
+    float       (*f32_l2sq)(const float *a, const float *b, int n);
+    void        (*f16_to_f32)(const uint16_t *src, float *dest, int n);
+    void        (*bf16_to_f32)(const uint16_t *src, float *dest, int n);
+    void        (*i8_to_f32)(const int8_t *src, float *dest, int n, float scale, float bias);
+    void        (*u8_to_f32)(const uint8_t *src, float *dest, int n, float scale, float bias);
+} vector_kernels;
+
+// MARK: - Scalar -
+
+static inline float vector_clamp (float v, float lo, float hi) {
+    if (!(v >= lo)) return lo;      // also catches NaN
+    if (v > hi) return hi;
+    return v;
+}
+
+static float vector_f32_sumsq_scalar (const float *src, int n) {
+    float sum = 0.0f;
+
+    // loop unrolled by 4
+    int i = 0;
+    for (; i + 3 < n; i += 4) {
+        sum += src[i] * src[i] + src[i + 1] * src[i + 1] + src[i + 2] * src[i + 2] + src[i + 3] * src[i + 3];
+    }
+    for (; i < n; ++i) {
+        sum += src[i] * src[i];
+    }
+
+    return sum;
+}
+
+static void vector_f32_scale_scalar (const float *src, float *dest, int n, float scale) {
+    for (int i = 0; i < n; ++i) dest[i] = src[i] * scale;
+}
+
+static void vector_f32_to_f16_scalar (const float *src, uint16_t *dest, int n, float scale) {
+    for (int i = 0; i < n; ++i) dest[i] = float32_to_float16(src[i] * scale);
+}
+
+static void vector_f32_to_bf16_scalar (const float *src, uint16_t *dest, int n, float scale) {
+    for (int i = 0; i < n; ++i) dest[i] = float32_to_bfloat16(src[i] * scale);
+}
+
+static void vector_f32_to_i8_scalar (const float *src, int8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    for (int i = 0; i < n; ++i) dest[i] = (int8_t)lrintf(vector_clamp(src[i] * scale * mult + bias, lo, hi));
+}
+
+static void vector_f32_to_u8_scalar (const float *src, uint8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    for (int i = 0; i < n; ++i) dest[i] = (uint8_t)lrintf(vector_clamp(src[i] * scale * mult + bias, lo, hi));
+}
+
+static float vector_f32_dot_scalar (const float *a, const float *b, int n) {
+    float sum = 0.0f;
+    
+    // loop unrolled by 4
+    int i = 0;
+    for (; i + 3 < n; i += 4) {
+        sum += a[i] * b[i] + a[i + 1] * b[i + 1] + a[i + 2] * b[i + 2] + a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    
+    return sum;
+}
+
+static float vector_f32_l2sq_scalar (const float *a, const float *b, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static void vector_f16_to_f32_scalar (const uint16_t *src, float *dest, int n) {
+    for (int i = 0; i < n; ++i) dest[i] = float16_to_float32(src[i]);
+}
+
+static void vector_bf16_to_f32_scalar (const uint16_t *src, float *dest, int n) {
+    for (int i = 0; i < n; ++i) dest[i] = bfloat16_to_float32(src[i]);
+}
+
+static void vector_i8_to_f32_scalar (const int8_t *src, float *dest, int n, float scale, float bias) {
+    for (int i = 0; i < n; ++i) dest[i] = ((float)src[i] - bias) * scale;
+}
+
+static void vector_u8_to_f32_scalar (const uint8_t *src, float *dest, int n, float scale, float bias) {
+    for (int i = 0; i < n; ++i) dest[i] = ((float)src[i] - bias) * scale;
+}
+
+static const vector_kernels vector_kernels_scalar = {
+    "scalar",
+    vector_f32_sumsq_scalar,
+    vector_f32_scale_scalar,
+    vector_f32_to_f16_scalar,
+    vector_f32_to_bf16_scalar,
+    vector_f32_to_i8_scalar,
+    vector_f32_to_u8_scalar,
+    vector_f32_dot_scalar,
+    vector_f32_l2sq_scalar,
+    vector_f16_to_f32_scalar,
+    vector_bf16_to_f32_scalar,
+    vector_i8_to_f32_scalar,
+    vector_u8_to_f32_scalar
+};
+
+// MARK: - AVX2 -
+
+#if VECTOR_X86
+#define VECTOR_AVX2_TARGET                      __attribute__((target("avx2,fma,f16c")))
+
+VECTOR_AVX2_TARGET static inline float vector_hsum256 (__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+    return _mm_cvtss_f32(lo);
+}
+
+VECTOR_AVX2_TARGET static float vector_f32_sumsq_avx2 (const float *src, int n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m256 a = _mm256_loadu_ps(src + i);
+        __m256 b = _mm256_loadu_ps(src + i + 8);
+        acc0 = _mm256_fmadd_ps(a, a, acc0);
+        acc1 = _mm256_fmadd_ps(b, b, acc1);
+    }
+    for (; i + 7 < n; i += 8) {
+        __m256 a = _mm256_loadu_ps(src + i);
+        acc0 = _mm256_fmadd_ps(a, a, acc0);
+    }
+    float sum = vector_hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += src[i] * src[i];
+    return sum;
+}
+
+VECTOR_AVX2_TARGET static void vector_f32_scale_avx2 (const float *src, float *dest, int n, float scale) {
+    __m256 s = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(dest + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), s));
+    }
+    for (; i < n; ++i) dest[i] = src[i] * scale;
+}
+
+VECTOR_AVX2_TARGET static void vector_f32_to_f16_avx2 (const float *src, uint16_t *dest, int n, float scale) {
+    __m256 s = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_mul_ps(_mm256_loadu_ps(src + i), s), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(dest + i), h);
+    }
+    for (; i < n; ++i) dest[i] = float32_to_float16(src[i] * scale);
+}
+
+VECTOR_AVX2_TARGET static inline __m256i vector_bf16_round_avx2 (__m256 v) {
+    __m256i x = _mm256_castps_si256(v);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(1));
+    __m256i rnd = _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF));
+    return _mm256_srli_epi32(_mm256_add_epi32(x, rnd), 16);
+}
+
+VECTOR_AVX2_TARGET static void vector_f32_to_bf16_avx2 (const float *src, uint16_t *dest, int n, float scale) {
+    __m256 s = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m256i a = vector_bf16_round_avx2(_mm256_mul_ps(_mm256_loadu_ps(src + i), s));
+        __m256i b = vector_bf16_round_avx2(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), s));
+        // packus works on 128-bit lanes, restore element order afterwards
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dest + i), p);
+    }
+    for (; i < n; ++i) dest[i] = float32_to_bfloat16(src[i] * scale);
+}
+
+// scale, clamp and round 32 floats into 4 vectors of int32 (values are already in the destination range)
+VECTOR_AVX2_TARGET static inline void vector_quantize32_avx2 (const float *src, __m256 s, __m256 m, __m256 b, __m256 lo, __m256 hi, __m256i out[4]) {
+    for (int k = 0; k < 4; ++k) {
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(src + k * 8), s), m), b);
+        v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);    // max_ps returns lo when v is NaN
+        out[k] = _mm256_cvtps_epi32(v);                 // round to nearest even
+    }
+}
+
+VECTOR_AVX2_TARGET static void vector_f32_to_i8_avx2 (const float *src, int8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    __m256 vs = _mm256_set1_ps(scale), vm = _mm256_set1_ps(mult), vb = _mm256_set1_ps(bias);
+    __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);
+    const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 31 < n; i += 32) {
+        __m256i q[4];
+        vector_quantize32_avx2(src + i, vs, vm, vb, vlo, vhi, q);
+        __m256i ab = _mm256_packs_epi32(q[0], q[1]);
+        __m256i cd = _mm256_packs_epi32(q[2], q[3]);
+        __m256i r = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(ab, cd), perm);
+        _mm256_storeu_si256((__m256i *)(dest + i), r);
+    }
+    vector_f32_to_i8_scalar(src + i, dest + i, n - i, scale, mult, bias, lo, hi);
+}
+
+VECTOR_AVX2_TARGET static void vector_f32_to_u8_avx2 (const float *src, uint8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    __m256 vs = _mm256_set1_ps(scale), vm = _mm256_set1_ps(mult), vb = _mm256_set1_ps(bias);
+    __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);
+    const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for (; i + 31 < n; i += 32) {
+        __m256i q[4];
+        vector_quantize32_avx2(src + i, vs, vm, vb, vlo, vhi, q);
+        __m256i ab = _mm256_packs_epi32(q[0], q[1]);
+        __m256i cd = _mm256_packs_epi32(q[2], q[3]);
+        __m256i r = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), perm);
+        _mm256_storeu_si256((__m256i *)(dest + i), r);
+    }
+    vector_f32_to_u8_scalar(src + i, dest + i, n - i, scale, mult, bias, lo, hi);
+}
+
+VECTOR_AVX2_TARGET static float vector_f32_dot_avx2 (const float *a, const float *b, int n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 7 < n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float sum = vector_hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+VECTOR_AVX2_TARGET static float vector_f32_l2sq_avx2 (const float *a, const float *b, int n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 7 < n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    float sum = vector_hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+VECTOR_AVX2_TARGET static void vector_f16_to_f32_avx2 (const uint16_t *src, float *dest, int n) {
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(dest + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+    }
+    for (; i < n; ++i) dest[i] = float16_to_float32(src[i]);
+}
+
+VECTOR_AVX2_TARGET static void vector_bf16_to_f32_avx2 (const uint16_t *src, float *dest, int n) {
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+        _mm256_storeu_ps(dest + i, _mm256_castsi256_ps(_mm256_slli_epi32(x, 16)));
+    }
+    for (; i < n; ++i) dest[i] = bfloat16_to_float32(src[i]);
+}
+
+VECTOR_AVX2_TARGET static void vector_i8_to_f32_avx2 (const int8_t *src, float *dest, int n, float scale, float bias) {
+    __m256 s = _mm256_set1_ps(scale), b = _mm256_set1_ps(bias);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(src + i))));
+        _mm256_storeu_ps(dest + i, _mm256_mul_ps(_mm256_sub_ps(v, b), s));
+    }
+    vector_i8_to_f32_scalar(src + i, dest + i, n - i, scale, bias);
+}
+
+VECTOR_AVX2_TARGET static void vector_u8_to_f32_avx2 (const uint8_t *src, float *dest, int n, float scale, float bias) {
+    __m256 s = _mm256_set1_ps(scale), b = _mm256_set1_ps(bias);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i))));
+        _mm256_storeu_ps(dest + i, _mm256_mul_ps(_mm256_sub_ps(v, b), s));
+    }
+    vector_u8_to_f32_scalar(src + i, dest + i, n - i, scale, bias);
+}
+
+static const vector_kernels vector_kernels_avx2 = {
+    "avx2",
+    vector_f32_sumsq_avx2,
+    vector_f32_scale_avx2,
+    vector_f32_to_f16_avx2,
+    vector_f32_to_bf16_avx2,
+    vector_f32_to_i8_avx2,
+    vector_f32_to_u8_avx2,
+    vector_f32_dot_avx2,
+    vector_f32_l2sq_avx2,
+    vector_f16_to_f32_avx2,
+    vector_bf16_to_f32_avx2,
+    vector_i8_to_f32_avx2,
+    vector_u8_to_f32_avx2
+};
+
+// MARK: - AVX-512 -
+
+#define VECTOR_AVX512_TARGET                    __attribute__((target("avx512f,avx2,fma,f16c")))
+
+VECTOR_AVX512_TARGET static float vector_f32_sumsq_avx512 (const float *src, int n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 31 < n; i += 32) {
+        __m512 a = _mm512_loadu_ps(src + i);
+        __m512 b = _mm512_loadu_ps(src + i + 16);
+        acc0 = _mm512_fmadd_ps(a, a, acc0);
+        acc1 = _mm512_fmadd_ps(b, b, acc1);
+    }
+    if (i + 15 < n) {
+        __m512 a = _mm512_loadu_ps(src + i);
+        acc0 = _mm512_fmadd_ps(a, a, acc0);
+        i += 16;
+    }
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += src[i] * src[i];
+    return sum;
+}
+
+VECTOR_AVX512_TARGET static void vector_f32_scale_avx512 (const float *src, float *dest, int n, float scale) {
+    __m512 s = _mm512_set1_ps(scale);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        _mm512_storeu_ps(dest + i, _mm512_mul_ps(_mm512_loadu_ps(src + i), s));
+    }
+    for (; i < n; ++i) dest[i] = src[i] * scale;
+}
+
+VECTOR_AVX512_TARGET static void vector_f32_to_f16_avx512 (const float *src, uint16_t *dest, int n, float scale) {
+    __m512 s = _mm512_set1_ps(scale);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m256i h = _mm512_cvtps_ph(_mm512_mul_ps(_mm512_loadu_ps(src + i), s), _MM_FROUND_TO_NEAREST_INT);
+        _mm256_storeu_si256((__m256i *)(dest + i), h);
+    }
+    for (; i < n; ++i) dest[i] = float32_to_float16(src[i] * scale);
+}
+
+VECTOR_AVX512_TARGET static void vector_f32_to_bf16_avx512 (const float *src, uint16_t *dest, int n, float scale) {
+    __m512 s = _mm512_set1_ps(scale);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i bias = _mm512_set1_epi32(0x7FFF);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m512i x = _mm512_castps_si512(_mm512_mul_ps(_mm512_loadu_ps(src + i), s));
+        __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(x, 16), one);
+        __m512i r = _mm512_srli_epi32(_mm512_add_epi32(x, _mm512_add_epi32(lsb, bias)), 16);
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm512_cvtepi32_epi16(r));
+    }
+    for (; i < n; ++i) dest[i] = float32_to_bfloat16(src[i] * scale);
+}
+
+// scale, clamp and round 16 floats into int32 (values are already in the destination range so truncating narrows are exact)
+VECTOR_AVX512_TARGET static inline __m512i vector_quantize16_avx512 (const float *src, __m512 s, __m512 m, __m512 b, __m512 lo, __m512 hi) {
+    __m512 v = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(_mm512_loadu_ps(src), s), m), b);
+    v = _mm512_min_ps(_mm512_max_ps(v, lo), hi);        // max_ps returns lo when v is NaN
+    return _mm512_cvtps_epi32(v);                       // round to nearest even
+}
+
+VECTOR_AVX512_TARGET static void vector_f32_to_i8_avx512 (const float *src, int8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    __m512 vs = _mm512_set1_ps(scale), vm = _mm512_set1_ps(mult), vb = _mm512_set1_ps(bias);
+    __m512 vlo = _mm512_set1_ps(lo), vhi = _mm512_set1_ps(hi);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m512i q = vector_quantize16_avx512(src + i, vs, vm, vb, vlo, vhi);
+        _mm_storeu_si128((__m128i *)(dest + i), _mm512_cvtepi32_epi8(q));
+    }
+    vector_f32_to_i8_scalar(src + i, dest + i, n - i, scale, mult, bias, lo, hi);
+}
+
+VECTOR_AVX512_TARGET static void vector_f32_to_u8_avx512 (const float *src, uint8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    __m512 vs = _mm512_set1_ps(scale), vm = _mm512_set1_ps(mult), vb = _mm512_set1_ps(bias);
+    __m512 vlo = _mm512_set1_ps(lo), vhi = _mm512_set1_ps(hi);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m512i q = vector_quantize16_avx512(src + i, vs, vm, vb, vlo, vhi);
+        _mm_storeu_si128((__m128i *)(dest + i), _mm512_cvtepi32_epi8(q));
+    }
+    vector_f32_to_u8_scalar(src + i, dest + i, n - i, scale, mult, bias, lo, hi);
+}
+
+VECTOR_AVX512_TARGET static float vector_f32_dot_avx512 (const float *a, const float *b, int n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 31 < n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    if (i + 15 < n) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        i += 16;
+    }
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+VECTOR_AVX512_TARGET static float vector_f32_l2sq_avx512 (const float *a, const float *b, int n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 31 < n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    if (i + 15 < n) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+        i += 16;
+    }
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+VECTOR_AVX512_TARGET static void vector_f16_to_f32_avx512 (const uint16_t *src, float *dest, int n) {
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        _mm512_storeu_ps(dest + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(src + i))));
+    }
+    for (; i < n; ++i) dest[i] = float16_to_float32(src[i]);
+}
+
+VECTOR_AVX512_TARGET static void vector_bf16_to_f32_avx512 (const uint16_t *src, float *dest, int n) {
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m512i x = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(src + i)));
+        _mm512_storeu_ps(dest + i, _mm512_castsi512_ps(_mm512_slli_epi32(x, 16)));
+    }
+    for (; i < n; ++i) dest[i] = bfloat16_to_float32(src[i]);
+}
+
+VECTOR_AVX512_TARGET static void vector_i8_to_f32_avx512 (const int8_t *src, float *dest, int n, float scale, float bias) {
+    __m512 s = _mm512_set1_ps(scale), b = _mm512_set1_ps(bias);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m512 v = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(src + i))));
+        _mm512_storeu_ps(dest + i, _mm512_mul_ps(_mm512_sub_ps(v, b), s));
+    }
+    vector_i8_to_f32_scalar(src + i, dest + i, n - i, scale, bias);
+}
+
+VECTOR_AVX512_TARGET static void vector_u8_to_f32_avx512 (const uint8_t *src, float *dest, int n, float scale, float bias) {
+    __m512 s = _mm512_set1_ps(scale), b = _mm512_set1_ps(bias);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        __m512 v = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(src + i))));
+        _mm512_storeu_ps(dest + i, _mm512_mul_ps(_mm512_sub_ps(v, b), s));
+    }
+    vector_u8_to_f32_scalar(src + i, dest + i, n - i, scale, bias);
+}
+
+static const vector_kernels vector_kernels_avx512 = {
+    "avx512",
+    vector_f32_sumsq_avx512,
+    vector_f32_scale_avx512,
+    vector_f32_to_f16_avx512,
+    vector_f32_to_bf16_avx512,
+    vector_f32_to_i8_avx512,
+    vector_f32_to_u8_avx512,
+    vector_f32_dot_avx512,
+    vector_f32_l2sq_avx512,
+    vector_f16_to_f32_avx512,
+    vector_bf16_to_f32_avx512,
+    vector_i8_to_f32_avx512,
+    vector_u8_to_f32_avx512
+};
+#endif
+
+// MARK: - NEON -
+
+#if VECTOR_NEON
+static float vector_f32_sumsq_neon (const float *src, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        float32x4_t a = vld1q_f32(src + i);
+        float32x4_t b = vld1q_f32(src + i + 4);
+        acc0 = vfmaq_f32(acc0, a, a);
+        acc1 = vfmaq_f32(acc1, b, b);
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; ++i) sum += src[i] * src[i];
+    return sum;
+}
+
+static void vector_f32_scale_neon (const float *src, float *dest, int n, float scale) {
+    int i = 0;
+    for (; i + 3 < n; i += 4) {
+        vst1q_f32(dest + i, vmulq_n_f32(vld1q_f32(src + i), scale));
+    }
+    for (; i < n; ++i) dest[i] = src[i] * scale;
+}
+
+static void vector_f32_to_f16_neon (const float *src, uint16_t *dest, int n, float scale) {
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        float16x4_t a = vcvt_f16_f32(vmulq_n_f32(vld1q_f32(src + i), scale));
+        float16x4_t b = vcvt_f16_f32(vmulq_n_f32(vld1q_f32(src + i + 4), scale));
+        vst1q_u16(dest + i, vreinterpretq_u16_f16(vcombine_f16(a, b)));
+    }
+    for (; i < n; ++i) dest[i] = float32_to_float16(src[i] * scale);
+}
+
+static void vector_f32_to_bf16_neon (const float *src, uint16_t *dest, int n, float scale) {
+    const uint32x4_t one = vdupq_n_u32(1);
+    const uint32x4_t bias = vdupq_n_u32(0x7FFF);
+    int i = 0;
+    for (; i + 3 < n; i += 4) {
+        uint32x4_t x = vreinterpretq_u32_f32(vmulq_n_f32(vld1q_f32(src + i), scale));
+        uint32x4_t lsb = vandq_u32(vshrq_n_u32(x, 16), one);
+        vst1_u16(dest + i, vshrn_n_u32(vaddq_u32(x, vaddq_u32(lsb, bias)), 16));
+    }
+    for (; i < n; ++i) dest[i] = float32_to_bfloat16(src[i] * scale);
+}
+
+// scale, clamp and round 8 floats into int16 (values are already in the destination range)
+static inline int16x8_t vector_quantize8_neon (const float *src, float scale, float32x4_t m, float32x4_t b, float32x4_t lo, float32x4_t hi) {
+    float32x4_t v0 = vaddq_f32(vmulq_f32(vmulq_n_f32(vld1q_f32(src), scale), m), b);
+    float32x4_t v1 = vaddq_f32(vmulq_f32(vmulq_n_f32(vld1q_f32(src + 4), scale), m), b);
+    v0 = vminnmq_f32(vmaxnmq_f32(v0, lo), hi);          // maxnm returns lo when v is NaN
+    v1 = vminnmq_f32(vmaxnmq_f32(v1, lo), hi);
+    return vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(v0)), vqmovn_s32(vcvtnq_s32_f32(v1)));
+}
+
+static void vector_f32_to_i8_neon (const float *src, int8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    float32x4_t vm = vdupq_n_f32(mult), vb = vdupq_n_f32(bias), vlo = vdupq_n_f32(lo), vhi = vdupq_n_f32(hi);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        int16x8_t a = vector_quantize8_neon(src + i, scale, vm, vb, vlo, vhi);
+        int16x8_t b = vector_quantize8_neon(src + i + 8, scale, vm, vb, vlo, vhi);
+        vst1q_s8(dest + i, vcombine_s8(vqmovn_s16(a), vqmovn_s16(b)));
+    }
+    vector_f32_to_i8_scalar(src + i, dest + i, n - i, scale, mult, bias, lo, hi);
+}
+
+static void vector_f32_to_u8_neon (const float *src, uint8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    float32x4_t vm = vdupq_n_f32(mult), vb = vdupq_n_f32(bias), vlo = vdupq_n_f32(lo), vhi = vdupq_n_f32(hi);
+    int i = 0;
+    for (; i + 15 < n; i += 16) {
+        int16x8_t a = vector_quantize8_neon(src + i, scale, vm, vb, vlo, vhi);
+        int16x8_t b = vector_quantize8_neon(src + i + 8, scale, vm, vb, vlo, vhi);
+        vst1q_u8(dest + i, vcombine_u8(vqmovun_s16(a), vqmovun_s16(b)));
+    }
+    vector_f32_to_u8_scalar(src + i, dest + i, n - i, scale, mult, bias, lo, hi);
+}
+
+static float vector_f32_dot_neon (const float *a, const float *b, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+static float vector_f32_l2sq_neon (const float *a, const float *b, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc0 = vfmaq_f32(acc0, d0, d0);
+        acc1 = vfmaq_f32(acc1, d1, d1);
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < n; ++i) sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+static void vector_f16_to_f32_neon (const uint16_t *src, float *dest, int n) {
+    int i = 0;
+    for (; i + 3 < n; i += 4) {
+        vst1q_f32(dest + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+    }
+    for (; i < n; ++i) dest[i] = float16_to_float32(src[i]);
+}
+
+static void vector_bf16_to_f32_neon (const uint16_t *src, float *dest, int n) {
+    int i = 0;
+    for (; i + 3 < n; i += 4) {
+        vst1q_f32(dest + i, vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(src + i), 16)));
+    }
+    for (; i < n; ++i) dest[i] = bfloat16_to_float32(src[i]);
+}
+
+static void vector_i8_to_f32_neon (const int8_t *src, float *dest, int n, float scale, float bias) {
+    float32x4_t b = vdupq_n_f32(bias);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        int16x8_t x = vmovl_s8(vld1_s8(src + i));
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+        vst1q_f32(dest + i, vmulq_n_f32(vsubq_f32(lo, b), scale));
+        vst1q_f32(dest + i + 4, vmulq_n_f32(vsubq_f32(hi, b), scale));
+    }
+    vector_i8_to_f32_scalar(src + i, dest + i, n - i, scale, bias);
+}
+
+static void vector_u8_to_f32_neon (const uint8_t *src, float *dest, int n, float scale, float bias) {
+    float32x4_t b = vdupq_n_f32(bias);
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        uint16x8_t x = vmovl_u8(vld1_u8(src + i));
+        float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(x)));
+        float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(x)));
+        vst1q_f32(dest + i, vmulq_n_f32(vsubq_f32(lo, b), scale));
+        vst1q_f32(dest + i + 4, vmulq_n_f32(vsubq_f32(hi, b), scale));
+    }
+    vector_u8_to_f32_scalar(src + i, dest + i, n - i, scale, bias);
+}
+
+static const vector_kernels vector_kernels_neon = {
+    "neon",
+    vector_f32_sumsq_neon,
+    vector_f32_scale_neon,
+    vector_f32_to_f16_neon,
+    vector_f32_to_bf16_neon,
+    vector_f32_to_i8_neon,
+    vector_f32_to_u8_neon,
+    vector_f32_dot_neon,
+    vector_f32_l2sq_neon,
+    vector_f16_to_f32_neon,
+    vector_bf16_to_f32_neon,
+    vector_i8_to_f32_neon,
+    vector_u8_to_f32_neon
+};
+#endif
+
+// MARK: - Dispatch -
+
+static const vector_kernels *kernels = &vector_kernels_scalar;
+
+#if VECTOR_X86
+static bool vector_cpu_supports (const vector_kernels *k) {
+    if (k == &vector_kernels_scalar) return true;
+    
+    // both SIMD backends convert f16 with F16C, which is a separate CPUID bit (ECX 29 of leaf 1)
+    // and is not implied by AVX2 or AVX-512F on every CPU or hypervisor
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_F16C)) return false;
+    
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma")) return false;
+    if (k == &vector_kernels_avx512) return __builtin_cpu_supports("avx512f");
+    return (k == &vector_kernels_avx2);
+}
+#endif
+
+void vector_init (void) {
+    #if VECTOR_X86
+    if (vector_cpu_supports(&vector_kernels_avx512)) {
+        kernels = &vector_kernels_avx512;
+    } else if (vector_cpu_supports(&vector_kernels_avx2)) {
+        kernels = &vector_kernels_avx2;
+    }
+    #elif VECTOR_NEON
+    kernels = &vector_kernels_neon;
+    #endif
+}
+
+const char *vector_backend (void) {
+    return kernels->name;
+}
+
+float vector_f32_sumsq (const float *src, int n) {
+    return kernels->f32_sumsq(src, n);
+}
+
+void vector_f32_scale (const float *src, float *dest, int n, float scale) {
+    kernels->f32_scale(src, dest, n, scale);
+}
+
+void vector_f32_to_f16 (const float *src, uint16_t *dest, int n, float scale) {
+    kernels->f32_to_f16(src, dest, n, scale);
+}
+
+void vector_f32_to_bf16 (const float *src, uint16_t *dest, int n, float scale) {
+    kernels->f32_to_bf16(src, dest, n, scale);
+}
+
+void vector_f32_to_i8 (const float *src, int8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    kernels->f32_to_i8(src, dest, n, scale, mult, bias, lo, hi);
+}
+
+void vector_f32_to_u8 (const float *src, uint8_t *dest, int n, float scale, float mult, float bias, float lo, float hi) {
+    kernels->f32_to_u8(src, dest, n, scale, mult, bias, lo, hi);
+}
+
+float vector_f32_dot (const float *a, const float *b, int n) {
+    return kernels->f32_dot(a, b, n);
+}
+
+float vector_f32_l2sq (const float *a, const float *b, int n) {
+    return kernels->f32_l2sq(a, b, n);
+}
+
+#define VECTOR_BLOCK_SIZE                       256
+
+static void vector_to_f32_aligned (const void *src, vector_type type, float *dest, int n) {
+    switch (type) {
+        case VECTOR_TYPE_F32:
+            memcpy(dest, src, (size_t)n * sizeof(float));
+            break;
+        case VECTOR_TYPE_F16:
+            kernels->f16_to_f32((const uint16_t *)src, dest, n);
+            break;
+        case VECTOR_TYPE_BF16:
+            kernels->bf16_to_f32((const uint16_t *)src, dest, n);
+            break;
+        case VECTOR_TYPE_U8:
+            // zero-point 128, [1, 255] mapped back to [-1, 1] (only normalized embeddings are quantized with these parameters)
+            kernels->u8_to_f32((const uint8_t *)src, dest, n, 1.0f / 127.0f, 128.0f);
+            break;
+        case VECTOR_TYPE_I8:
+            kernels->i8_to_f32((const int8_t *)src, dest, n, 1.0f / 127.0f, 0.0f);
+            break;
+    }
+}
+
+// src usually is a BLOB returned by SQLite, which has no alignment guarantee:
+// 16-bit elements at an odd address are copied (block by block) into an aligned buffer before the conversion
+void vector_to_f32 (const void *src, vector_type type, float *dest, int n) {
+    bool is_16bit = (type == VECTOR_TYPE_F16 || type == VECTOR_TYPE_BF16);
+    if (!is_16bit || ((uintptr_t)src % sizeof(uint16_t)) == 0) {
+        vector_to_f32_aligned(src, type, dest, n);
+        return;
+    }
+    
+    uint16_t buffer[VECTOR_BLOCK_SIZE];
+    for (int i = 0; i < n; i += VECTOR_BLOCK_SIZE) {
+        int len = (n - i < VECTOR_BLOCK_SIZE) ? n - i : VECTOR_BLOCK_SIZE;
+        memcpy(buffer, (const uint16_t *)src + i, (size_t)len * sizeof(uint16_t));
+        vector_to_f32_aligned(buffer, type, dest + i, len);
+    }
+}
+
+size_t vector_type_size (vector_type type) {
+    switch (type) {
+        case VECTOR_TYPE_F32: return sizeof(float);
+        case VECTOR_TYPE_F16: return sizeof(uint16_t);
+        case VECTOR_TYPE_BF16: return sizeof(uint16_t);
+        case VECTOR_TYPE_U8: return sizeof(uint8_t);
+        case VECTOR_TYPE_I8: return sizeof(int8_t);
+    }
+    return 0;
+}
+
+// MARK: - Distance -
+
+// f32 view of the elements [offset, offset+n) of src: aligned f32 vectors are used in place, the other ones are copied
+// (or dequantized) into buffer
+static const float *vector_block (const void *src, vector_type type, int offset, int n, float *buffer) {
+    const uint8_t *p = (const uint8_t *)src + (size_t)offset * vector_type_size(type);
+    if (type == VECTOR_TYPE_F32 && ((uintptr_t)p % sizeof(float)) == 0) return (const float *)p;
+    vector_to_f32(p, type, buffer, n);
+    return buffer;
+}
+
+float vector_distance (const void *a, vector_type ta, const void *b, vector_type tb, int n, vector_metric metric) {
+    float abuffer[VECTOR_BLOCK_SIZE];
+    float bbuffer[VECTOR_BLOCK_SIZE];
+    float dot = 0.0f, aa = 0.0f, bb = 0.0f, l2 = 0.0f;
+    
+    // quantized vectors are converted block by block so that both operands stay in L1
+    for (int i = 0; i < n; i += VECTOR_BLOCK_SIZE) {
+        int len = (n - i < VECTOR_BLOCK_SIZE) ? n - i : VECTOR_BLOCK_SIZE;
+        const float *x = vector_block(a, ta, i, len, abuffer);
+        const float *y = vector_block(b, tb, i, len, bbuffer);
+        
+        switch (metric) {
+            case VECTOR_METRIC_COSINE:
+                dot += kernels->f32_dot(x, y, len);
+                aa += kernels->f32_sumsq(x, len);
+                bb += kernels->f32_sumsq(y, len);
+                break;
+            case VECTOR_METRIC_DOT:
+                dot += kernels->f32_dot(x, y, len);
+                break;
+            case VECTOR_METRIC_L2:
+                l2 += kernels->f32_l2sq(x, y, len);
+                break;
+        }
+    }
+    
+    switch (metric) {
+        case VECTOR_METRIC_COSINE:
+            if (aa <= 0.0f || bb <= 0.0f) return 1.0f;
+            return 1.0f - dot / (sqrtf(aa) * sqrtf(bb));
+        case VECTOR_METRIC_DOT:
+            return -dot;
+        case VECTOR_METRIC_L2:
+            return sqrtf(l2);
+    }
+    return 0.0f;
+}
@@ -0,0 +1,140 @@
+//
+//  vector.h
+//  sqliteai
+//
+
+#ifndef __SQLITEAI_VECTOR__
+#define __SQLITEAI_VECTOR__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "fp16/fp16.h"
+
+// MARK: - NUMERICS -
+// typedef uint16_t bfloat16_t;    // don't typedef to bfloat16_t to avoid mix with <arm_neon.h>’s native bfloat16_t
+
+// float <-> uint32_t bit casts
+static inline uint32_t f32_to_bits (float f) {
+    #if defined(HAVE_BUILTIN_BIT_CAST)
+    return __builtin_bit_cast(uint32_t, f);
+    #else
+    union { float f; uint32_t u; } v = { .f = f };
+    return v.u;
+    #endif
+}
+
+static inline float bits_to_f32 (uint32_t u) {
+    #if defined(HAVE_BUILTIN_BIT_CAST)
+    return __builtin_bit_cast(float, u);
+    #else
+    union { uint32_t u; float f; } v = { .u = u };
+    return v.f;
+    #endif
+}
+
+#if 0
+// bfloat16 (stored as uint16_t) -> float32, and back (RNE)
+static inline bool bfloat16_is_nan (uint16_t h) {      /* exp==0xFF && frac!=0 */
+    return ((h & 0x7F80u) == 0x7F80u) && ((h & 0x007Fu) != 0);
+}
+static inline bool bfloat16_is_inf (uint16_t h) {      /* exp==0xFF && frac==0 */
+    return ((h & 0x7F80u) == 0x7F80u) && ((h & 0x007Fu) == 0);
+}
+static inline bool bfloat16_is_zero (uint16_t h) {     /* ±0 */
+    return (h & 0x7FFFu) == 0;
+}
+static inline int bfloat16_sign (uint16_t h) {
+    return (h >> 15) & 1;
+}
+#endif
+
+static inline float bfloat16_to_float32 (uint16_t bf) {
+    return bits_to_f32((uint32_t)bf << 16);
+}
+static inline uint16_t float32_to_bfloat16 (float f) {
+    uint32_t x = f32_to_bits(f);
+    uint32_t lsb = (x >> 16) & 1u;      /* ties-to-even */
+    uint32_t rnd = 0x7FFFu + lsb;
+    return (uint16_t)((x + rnd) >> 16);
+}
+
+#if 0
+// ---- float16 (binary16) classifiers (work on raw uint16_t bits)
+static inline bool f16_is_nan (uint16_t h) {      /* exp==0x1F && frac!=0 */
+    return ( (h & 0x7C00u) == 0x7C00u ) && ((h & 0x03FFu) != 0);
+}
+static inline bool f16_is_inf (uint16_t h) {      /* exp==0x1F && frac==0 */
+    return ( (h & 0x7C00u) == 0x7C00u ) && ((h & 0x03FFu) == 0);
+}
+static inline int  f16_sign (uint16_t h) {
+    return (h >> 15) & 1;
+}
+static inline bool f16_is_zero (uint16_t h) {     /* ±0 */
+    return (h & 0x7FFFu) == 0;
+}
+#endif
+
+static inline uint16_t float32_to_float16 (float f) {
+    return fp16_ieee_from_fp32_value(f);
+}
+static inline float float16_to_float32 (uint16_t h) {
+    return fp16_ieee_to_fp32_value(h);
+}
+
+// MARK: - TYPES -
+
+// element types of the vectors (same values as the embedding_type option)
+typedef enum {
+    VECTOR_TYPE_F32 = 1,
+    VECTOR_TYPE_F16,
+    VECTOR_TYPE_BF16,
+    VECTOR_TYPE_U8,
+    VECTOR_TYPE_I8
+} vector_type;
+
+typedef enum {
+    VECTOR_METRIC_COSINE = 1,                   // 1 - cosine similarity
+    VECTOR_METRIC_DOT,                          // negative dot product (smaller is closer)
+    VECTOR_METRIC_L2                            // euclidean distance
+} vector_metric;
+
+size_t vector_type_size (vector_type type);
+
+// MARK: - KERNELS -
+// kernels are selected once at runtime (vector_init) according to the instruction sets supported by the CPU:
+// AVX-512F, AVX2+FMA+F16C on x86 and NEON on arm64, with a portable scalar fallback
+
+void vector_init (void);
+const char *vector_backend (void);
+
+// sum of squares of src
+float vector_f32_sumsq (const float *src, int n);
+
+// dest[i] = src[i] * scale
+void vector_f32_scale (const float *src, float *dest, int n, float scale);
+
+// dest[i] = half/bfloat16(src[i] * scale), rounded to nearest even
+void vector_f32_to_f16 (const float *src, uint16_t *dest, int n, float scale);
+void vector_f32_to_bf16 (const float *src, uint16_t *dest, int n, float scale);
+
+// dest[i] = rint(clamp(src[i] * scale * mult + bias, lo, hi)), NaN is mapped to lo
+void vector_f32_to_i8 (const float *src, int8_t *dest, int n, float scale, float mult, float bias, float lo, float hi);
+void vector_f32_to_u8 (const float *src, uint8_t *dest, int n, float scale, float mult, float bias, float lo, float hi);
+
+// dot product and squared euclidean distance of a and b
+float vector_f32_dot (const float *a, const float *b, int n);
+float vector_f32_l2sq (const float *a, const float *b, int n);
+
+// dest[i] = float(src[i]), INT8 and UINT8 elements are dequantized as produced by normalized embeddings (scale 127, UINT8 zero-point 128):
+// the raw values produced with normalize_embedding=0 carry no quantization parameters and must be stored as a float type instead
+// src does not need to be aligned (it can point directly into a BLOB)
+void vector_to_f32 (const void *src, vector_type type, float *dest, int n);
+
+// MARK: - DISTANCE -
+
+// distance between a and b, both of n elements: the types can differ (a FLOAT32 query scored against quantized rows)
+// the caller must check that both buffers hold exactly n elements, no alignment is required
+float vector_distance (const void *a, vector_type ta, const void *b, vector_type tb, int n, vector_metric metric);
+
+#endif
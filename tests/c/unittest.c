@@ -1,12 +1,18 @@
 #include "sqlite3.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef SQLITEAI_LOAD_FROM_SOURCES
 #include "sqlite-ai.h"
+#else
+// the SIMD kernel tables are private to vector.c, so the kernels are compiled into the test directly
+#include <math.h>
+#include "vector.c"
 #endif
 
 // Just a lightweight model to use for testing
@@ -43,9 +49,9 @@ static int expect_error_contains(const char *err_msg, const char *needle) {
     return 0;
 }
 
-static int open_db_and_load(const test_env *env, sqlite3 **out_db) {
+static int open_path_and_load(const test_env *env, const char *path, sqlite3 **out_db) {
     sqlite3 *db = NULL;
-    int rc = sqlite3_open(":memory:", &db);
+    int rc = sqlite3_open(path, &db);
     if (rc != SQLITE_OK) {
         fprintf(stderr, "sqlite3_open failed: %s\n", db ? sqlite3_errmsg(db) : "unknown error");
         if (db) sqlite3_close(db);
@@ -69,6 +75,10 @@ static int open_db_and_load(const test_env *env, sqlite3 **out_db) {
     return SQLITE_OK;
 }
 
+static int open_db_and_load(const test_env *env, sqlite3 **out_db) {
+    return open_path_and_load(env, ":memory:", out_db);
+}
+
 // ---------------------------------------------------------------------
 // Helper utilities
 // ---------------------------------------------------------------------
@@ -731,6 +741,136 @@ fail:
     return 1;
 }
 
+static int copy_file(const char *src, const char *dst) {
+    FILE *in = fopen(src, "rb");
+    if (!in) return 1;
+    FILE *out = fopen(dst, "wb");
+    if (!out) {
+        fclose(in);
+        return 1;
+    }
+    char buffer[1 << 16];
+    size_t n;
+    int rc = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            rc = 1;
+            break;
+        }
+    }
+    if (ferror(in)) rc = 1;
+    fclose(in);
+    if (fclose(out) != 0) rc = 1;
+    return rc;
+}
+
+static int test_llm_model_shared(const test_env *env) {
+    // the model is loaded from a copy that is removed after the first load: the other loads succeed only if they share the weights
+    const char *path = "llm_model_shared_test.gguf";
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    if (copy_file(model, path) != 0) {
+        fprintf(stderr, "Unable to copy %s to %s\n", model, path);
+        remove(path);
+        return 1;
+    }
+
+    sqlite3 *db1 = NULL;
+    sqlite3 *db2 = NULL;
+    if (open_db_and_load(env, &db1) != SQLITE_OK) goto fail;
+    if (open_db_and_load(env, &db2) != SQLITE_OK) goto fail;
+
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", path);
+    if (exec_expect_ok(env, db1, sqlbuf) != 0) goto fail;
+    remove(path);
+
+    // models are shared by canonical path, so a different spelling of the same path finds the loaded weights
+    char relative[512];
+    snprintf(relative, sizeof(relative), "SELECT llm_model_load('./%s');", path);
+    if (exec_expect_ok(env, db2, relative) != 0) goto fail;
+
+    // both connections use the same weights, freeing the model in one of them must not affect the other
+    if (exec_expect_ok(env, db1, "SELECT llm_model_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db2, "SELECT llm_context_create('context_size=256');") != 0) goto fail;
+    int tokens = 0;
+    if (select_single_int(env, db2, "SELECT llm_token_count('shared model');", &tokens) != 0) goto fail;
+    if (tokens <= 0) {
+        fprintf(stderr, "Expected tokens from the shared model, got %d\n", tokens);
+        goto fail;
+    }
+
+    // closing a connection releases its reference too
+    if (exec_expect_ok(env, db1, sqlbuf) != 0) goto fail;
+    sqlite3_close(db1);
+    db1 = NULL;
+    if (select_single_int(env, db2, "SELECT llm_token_count('shared model');", &tokens) != 0) goto fail;
+
+    // once the last reference is released the weights are freed, so the removed file can't be loaded anymore
+    if (exec_expect_ok(env, db2, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db2, "SELECT llm_model_free();") != 0) goto fail;
+    if (exec_expect_error(env, db2, sqlbuf, "Unable to load model") != 0) goto fail;
+    sqlite3_close(db2);
+    return assert_sqlite_memory_clean("llm_model_shared", env);
+
+fail:
+    if (db1) sqlite3_close(db1);
+    if (db2) sqlite3_close(db2);
+    remove(path);
+    return 1;
+}
+
+static int test_llm_context_pool(const test_env *env) {
+    sqlite3 *db1 = NULL;
+    sqlite3 *db2 = NULL;
+    if (open_db_and_load(env, &db1) != SQLITE_OK) return 1;
+    if (open_db_and_load(env, &db2) != SQLITE_OK) goto fail;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db1, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db2, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db1, "SELECT llm_context_create_embedding('embedding_type=FLOAT32,context_pool=2');") != 0) goto fail;
+    if (exec_expect_ok(env, db2, "SELECT llm_context_create_embedding('embedding_type=FLOAT32,context_pool=2');") != 0) goto fail;
+
+    // contexts are checked out only during the call
+    if (exec_expect_ok(env, db1, "CREATE TABLE v AS SELECT llm_embed_generate('pooled context') AS embedding;") != 0) goto fail;
+    int value = -1;
+    if (select_single_int(env, db1, "SELECT llm_context_used();", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected no context checked out between calls, got %d used tokens\n", value);
+        goto fail;
+    }
+
+    // the other connection gets a context of the same pool and the same embedding
+    if (exec_expect_ok(env, db2, "CREATE TABLE v AS SELECT llm_embed_generate('pooled context') AS embedding;") != 0) goto fail;
+    if (exec_expect_ok(env, db1, "SELECT llm_context_free();") != 0) goto fail;
+    if (select_single_int(env, db2, "SELECT length(embedding) = llm_model_n_embd() * 4 FROM v;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected a FLOAT32 embedding from the pooled context\n");
+        goto fail;
+    }
+
+    // the size and the token count don't need a context checked out
+    if (select_single_int(env, db2, "SELECT llm_context_size() > 0 AND llm_token_count('pooled context') > 0;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected the context size and the token count from a pooled connection\n");
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db2, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db1, "SELECT llm_model_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db2, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db1);
+    sqlite3_close(db2);
+    return assert_sqlite_memory_clean("llm_context_pool", env);
+
+fail:
+    if (db1) sqlite3_close(db1);
+    if (db2) sqlite3_close(db2);
+    return 1;
+}
+
 static int test_ai_logging_table(const test_env *env) {
     sqlite3 *db = NULL;
     if (open_db_and_load(env, &db) != SQLITE_OK) {
@@ -976,200 +1116,1430 @@ fail:
     return 1;
 }
 
-static int query_chat_response(const test_env *env, sqlite3 *db, const char *question, char *response, size_t response_len) {
-    char sqlbuf[512];
-    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_respond('%s');", question);
-    return exec_query_text(env, db, sqlbuf, response, response_len);
-}
-
-static int test_chat_system_prompt_new_chat(const test_env *env) {
+// Test that llm_embed_generate_batch returns one embedding per input (NULL for NULL/empty inputs) in input order
+static int test_llm_embed_generate_batch(const test_env *env) {
     sqlite3 *db = NULL;
-    bool model_loaded = false;
-    bool context_created = false;
-    bool chat_created = false;
-    int status = 1;
-
-    if (open_db_and_load(env, &db) != SQLITE_OK) {
-        goto done;
-    }
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
 
     const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
     char sqlbuf[512];
     snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
-    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
-    model_loaded = true;
-
-    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=1000');") != 0) goto done;
-    context_created = true;
-
-    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto done;
-    chat_created = true;
-
-    const char *system_prompt = "Always reply with lowercase answers.";
-    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", system_prompt);
-    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32');") != 0) goto fail;
 
-    bool is_null = false;
-    char buffer[4096];
-    if (query_system_prompt(env, db, buffer, sizeof(buffer), &is_null) != 0) goto done;
-    if (is_null || strcmp(buffer, system_prompt) != 0) {
-        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected '%s' but got: %s\n", system_prompt, buffer);
-        goto done;
+    int rows = 0;
+    if (exec_select_rows(env, db, "SELECT id, embedding FROM llm_embed_generate_batch('[\"first text\", \"second text\", null, \"\", \"third text\"]');", &rows) != 0) goto fail;
+    if (rows != 5) {
+        fprintf(stderr, "Expected 5 rows from llm_embed_generate_batch, got %d\n", rows);
+        goto fail;
     }
 
-    if (exec_expect_ok(env, db, "SELECT llm_chat_save();") != 0) goto done;
-
-    ai_chat_message_row rows[4];
-    int count = 0;
-    if (fetch_ai_chat_messages(env, db, rows, 4, &count) != 0) goto done;
-    if (count != 1) {
-        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected 1 message row, got %d\n", count);
-        goto done;
+    int value = 0;
+    if (select_single_int(env, db, "SELECT count(*) FROM llm_embed_generate_batch('[\"first text\", \"second text\", null, \"\", \"third text\"]') WHERE embedding IS NOT NULL AND length(embedding) = length(llm_embed_generate('first text'));", &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 non NULL embeddings, got %d\n", value);
+        goto fail;
     }
-    if (strcmp(rows[0].role, "system") != 0) {
-        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected system role, got %s\n", rows[0].role);
-        goto done;
+
+    // each batched embedding is byte-equal to the one computed alone
+    if (select_single_int(env, db, "SELECT count(*) FROM json_each('[\"first text\", \"second text\", \"third text\"]') j "
+                                   "JOIN llm_embed_generate_batch('[\"first text\", \"second text\", \"third text\"]') b ON b.id = j.key "
+                                   "WHERE b.embedding = llm_embed_generate(j.value);", &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 batched embeddings equal to llm_embed_generate, got %d\n", value);
+        goto fail;
     }
-    if (strcmp(rows[0].content, system_prompt) != 0) {
-        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected content '%s' but got '%s'\n", system_prompt, rows[0].content);
-        goto done;
+
+    if (select_single_int(env, db, "SELECT group_concat(id, '') = '01234' FROM llm_embed_generate_batch('[\"a\", \"b\", null, \"c\", \"d\"]');", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected rows in input order\n");
+        goto fail;
     }
 
-    status = 0;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_embed_generate_batch('not json');", "malformed JSON") != 0) goto fail;
 
-done:
-    if (chat_created) exec_expect_ok(env, db, "SELECT llm_chat_free();");
-    if (context_created) exec_expect_ok(env, db, "SELECT llm_context_free();");
-    if (model_loaded) exec_expect_ok(env, db, "SELECT llm_model_free();");
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_embed_generate_batch", env);
+
+fail:
     if (db) sqlite3_close(db);
-    if (status == 0) status = assert_sqlite_memory_clean("llm_context_size_errors", env);
-    return status;
+    return 1;
 }
 
-static int test_chat_system_prompt_replace_previous_prompt(const test_env *env) {
+// Test that llm_rerank and llm_rerank_batch require a rank pooling context and that embeddings reject it
+// (the test model has no classification head, scores are not checked)
+static int test_llm_rerank(const test_env *env) {
     sqlite3 *db = NULL;
-    bool model_loaded = false;
-    bool context_created = false;
-    bool chat_created = false;
-    int status = 1;
-
-    if (open_db_and_load(env, &db) != SQLITE_OK) {
-        goto done;
-    }
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
 
     const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
     char sqlbuf[512];
     snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
-    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
-    model_loaded = true;
-
-    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=1000');") != 0) goto done;
-    context_created = true;
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding();") != 0) goto fail;
+
+    if (exec_expect_error(env, db, "SELECT llm_rerank('query', 'document');", "pooling_type=rank") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_rerank_batch('query', '[\"first\", \"second\"]');", "pooling_type=rank") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_rerank_batch('', '[\"first\"]');", "non empty query") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT llm_rerank('query');", "expects 2 or 3 arguments") != 0) goto fail;
+
+    // views call llm_rerank like the other model functions (the view reaches the pooling check)
+    if (exec_expect_ok(env, db, "CREATE VIEW reranked AS SELECT llm_rerank('query', 'document') AS score;") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT score FROM reranked;", "pooling_type=rank") != 0) goto fail;
+    if (exec_expect_ok(env, db, "DROP VIEW reranked;") != 0) goto fail;
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT llm_rerank('query', NULL) IS NULL;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected NULL score for a NULL document\n");
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "SELECT llm_embed_generate('still an embedding context');") != 0) goto fail;
 
-    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto done;
-    chat_created = true;
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_rerank", env);
 
-    const char *first_prompt = "Always confirm questions.";
-    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", first_prompt);
-    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
 
-    const char *replacement_prompt = "Always decline questions.";
-    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", replacement_prompt);
-    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+// Test that llm_embed_each streams (id, embedding) rows from a source query
+static int test_llm_embed_each(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
 
-    bool is_null = false;
-    char buffer[4096];
-    if (query_system_prompt(env, db, buffer, sizeof(buffer), &is_null) != 0) goto done;
-    if (is_null || strcmp(buffer, replacement_prompt) != 0) {
-        fprintf(stderr, "[test_chat_system_prompt_replace_previous_prompt] expected '%s' but got: %s\n", replacement_prompt, buffer);
-        goto done;
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=INT8');") != 0) goto fail;
+
+    // more rows than n_seq_max so that several groups are decoded
+    if (exec_expect_ok(env, db, "CREATE TABLE docs(id INTEGER PRIMARY KEY, body TEXT);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 100) "
+                                "INSERT INTO docs(id, body) SELECT i, CASE WHEN i % 10 = 0 THEN NULL ELSE 'document number ' || i END FROM n;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE TABLE doc_vectors(id INTEGER PRIMARY KEY, embedding BLOB);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO doc_vectors(id, embedding) SELECT id, embedding FROM llm_embed_each('SELECT id, body FROM docs ORDER BY id');") != 0) goto fail;
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT count(*) FROM doc_vectors;", &value) != 0) goto fail;
+    if (value != 100) {
+        fprintf(stderr, "Expected 100 rows from llm_embed_each, got %d\n", value);
+        goto fail;
     }
-
-    if (exec_expect_ok(env, db, "SELECT llm_chat_save();") != 0) goto done;
-
-    ai_chat_message_row rows[4];
-    int count = 0;
-    if (fetch_ai_chat_messages(env, db, rows, 4, &count) != 0) goto done;
-    if (count != 1) {
-        fprintf(stderr, "[test_chat_system_prompt_replace_previous_prompt] expected 1 message row, got %d\n", count);
-        goto done;
+    if (select_single_int(env, db, "SELECT count(*) FROM doc_vectors WHERE embedding IS NULL;", &value) != 0) goto fail;
+    if (value != 10) {
+        fprintf(stderr, "Expected 10 NULL embeddings, got %d\n", value);
+        goto fail;
     }
-    if (strcmp(rows[0].content, replacement_prompt) != 0) {
-        fprintf(stderr, "[test_chat_system_prompt_replace_previous_prompt] expected '%s' but got '%s'\n", replacement_prompt, rows[0].content);
-        goto done;
+    if (select_single_int(env, db, "SELECT count(DISTINCT length(embedding)) FROM doc_vectors WHERE embedding IS NOT NULL;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected embeddings of the same size, got %d sizes\n", value);
+        goto fail;
     }
 
-    status = 0;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_embed_each('SELECT body FROM docs');", "(id, text)") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_embed_each('DELETE FROM docs');", "read-only") != 0) goto fail;
 
-done:
-    if (chat_created) exec_expect_ok(env, db, "SELECT llm_chat_free();");
-    if (context_created) exec_expect_ok(env, db, "SELECT llm_context_free();");
-    if (model_loaded) exec_expect_ok(env, db, "SELECT llm_model_free();");
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_embed_each", env);
+
+fail:
     if (db) sqlite3_close(db);
-    if (status == 0) status = assert_sqlite_memory_clean("llm_context_size_errors", env);
-    return status;
+    return 1;
 }
 
-static int test_chat_system_prompt_after_first_response(const test_env *env) {
+static int test_llm_embed_cache(const test_env *env) {
     sqlite3 *db = NULL;
-    bool model_loaded = false;
-    bool context_created = false;
-    bool chat_created = false;
-    int status = 1;
-
-    if (open_db_and_load(env, &db) != SQLITE_OK) {
-        goto done;
-    }
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
 
     const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
     char sqlbuf[512];
     snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
-    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
-    model_loaded = true;
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32,embedding_cache=2,embedding_cache_table=1');") != 0) goto fail;
 
-    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=1000');") != 0) goto done;
-    context_created = true;
+    int value = 0;
+    if (select_single_int(env, db, "SELECT llm_embed_generate('cached text') = llm_embed_generate('cached text');", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected identical embeddings from the cache\n");
+        goto fail;
+    }
 
-    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto done;
-    chat_created = true;
+    // evict 'cached text' from the memory tier, the table still returns the same embedding
+    if (exec_expect_ok(env, db, "SELECT llm_embed_generate('second text'), llm_embed_generate('third text');") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM ai_embed_cache;", &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 rows in ai_embed_cache, got %d\n", value);
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "CREATE TABLE first_embedding AS SELECT llm_embed_generate('cached text') AS embedding;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "DELETE FROM ai_embed_cache;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT embedding = llm_embed_generate('cached text', 'embedding_cache=0') FROM first_embedding;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected the cached embedding to match a freshly computed one\n");
+        goto fail;
+    }
 
-    const char *user_question = "Reply to this ping.";
-    char response[4096];
-    if (query_chat_response(env, db, user_question, response, sizeof(response)) != 0) goto done;
-    if (response[0] == '\0') {
-        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected model response for '%s'\n", user_question);
-        goto done;
+    // options are part of the key
+    if (select_single_int(env, db, "SELECT length(llm_embed_generate('cached text', 'embedding_type=INT8'));", &value) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_embed_generate('cached text', 'embedding_type=FLOAT32');") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM ai_embed_cache;", &value) != 0) goto fail;
+    if (value != 2) {
+        fprintf(stderr, "Expected 2 rows in ai_embed_cache, got %d\n", value);
+        goto fail;
     }
 
-    const char *system_prompt = "Only answer with short confirmations.";
-    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", system_prompt);
-    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_embed_cache", env);
 
-    bool is_null = false;
-    char buffer[4096];
-    if (query_system_prompt(env, db, buffer, sizeof(buffer), &is_null) != 0) goto done;
-    if (is_null || strcmp(buffer, system_prompt) != 0) {
-        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected '%s' but got: %s\n", system_prompt, buffer);
-        goto done;
-    }
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
 
-    if (exec_expect_ok(env, db, "SELECT llm_chat_save();") != 0) goto done;
+static int test_llm_embed_constant_args(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
 
-    ai_chat_message_row rows[8];
-    int count = 0;
-    if (fetch_ai_chat_messages(env, db, rows, 8, &count) != 0) goto done;
-    if (count < 3) {
-        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected at least 3 rows, got %d\n", count);
-        goto done;
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32');") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "CREATE TABLE rows(id INTEGER PRIMARY KEY, body TEXT);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE TABLE many(id INTEGER PRIMARY KEY);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 200) "
+                                "INSERT INTO rows(id, body) SELECT i, 'row ' || i FROM n;") != 0) goto fail;
+
+    // constant arguments: the query embedding and the options are computed once and reused for every row, so embedding
+    // a constant for 2000 rows costs much less than embedding 200 different texts
+    if (exec_expect_ok(env, db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 2000) "
+                                "INSERT INTO many(id) SELECT i FROM n;") != 0) goto fail;
+    int value = 0;
+    clock_t start = clock();
+    if (select_single_int(env, db, "SELECT count(DISTINCT llm_embed_generate('user query')) FROM many;", &value) != 0) goto fail;
+    clock_t constant_time = clock() - start;
+    if (value != 1) {
+        fprintf(stderr, "Expected a single distinct embedding for a constant argument, got %d\n", value);
+        goto fail;
     }
-    if (!(rows[0].id < rows[1].id && rows[1].id < rows[2].id)) {
-        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected ascending ids but found %d, %d, %d\n",
-                rows[0].id, rows[1].id, rows[2].id);
-        goto done;
+    start = clock();
+    if (select_single_int(env, db, "SELECT count(DISTINCT llm_embed_generate(body)) FROM rows;", &value) != 0) goto fail;
+    clock_t varying_time = clock() - start;
+    if (constant_time * 10 > varying_time) {
+        fprintf(stderr, "Expected a single forward pass for a constant argument (%ld clocks for 2000 rows, %ld for 200 texts)\n", (long)constant_time, (long)varying_time);
+        goto fail;
     }
-    if (strcmp(rows[0].role, "system") != 0 || strcmp(rows[0].content, system_prompt) != 0) {
-        fprintf(stderr, "[test_chat_system_prompt_after_first_response] system row mismatch (%s, %s)\n", rows[0].role, rows[0].content);
-        goto done;
+    if (select_single_int(env, db, "SELECT count(*) FROM rows WHERE length(llm_embed_generate('user query', 'embedding_type=INT8')) = llm_model_n_embd();", &value) != 0) goto fail;
+    if (value != 200) {
+        fprintf(stderr, "Expected 200 INT8 embeddings, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(DISTINCT llm_token_count('user query')) FROM rows;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected a single distinct token count, got %d\n", value);
+        goto fail;
+    }
+
+    // the model functions can be used in triggers and views
+    if (exec_expect_ok(env, db, "CREATE TABLE docs(body TEXT, embedding BLOB, n_tokens INTEGER);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE TRIGGER docs_embed AFTER INSERT ON docs BEGIN UPDATE docs SET embedding = llm_embed_generate(NEW.body, 'embedding_type=FLOAT32'), n_tokens = llm_token_count(NEW.body) WHERE rowid = NEW.rowid; END;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO docs(body) VALUES ('embedded by a trigger');") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE VIEW docs_view AS SELECT llm_embed_generate(body, 'embedding_type=FLOAT32') AS embedding FROM docs;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM docs JOIN docs_view v ON v.embedding = docs.embedding WHERE docs.n_tokens > 0;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected the embedding written by the trigger to match the view, got %d rows\n", value);
+        goto fail;
+    }
+
+    // non constant arguments are still evaluated for each row
+    if (select_single_int(env, db, "SELECT count(DISTINCT llm_embed_generate(body, 'embedding_type=FLOAT32')) FROM rows WHERE id <= 5;", &value) != 0) goto fail;
+    if (value != 5) {
+        fprintf(stderr, "Expected 5 distinct embeddings, got %d\n", value);
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_embed_constant_args", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+static int test_llm_embed_long_input(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('context_size=64,embedding_type=FLOAT32');") != 0) goto fail;
+
+    // two texts much longer than the context that differ only at the end
+    if (exec_expect_ok(env, db, "CREATE TABLE docs(id INTEGER PRIMARY KEY, body TEXT);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO docs(id, body) VALUES "
+                                "(1, replace(hex(zeroblob(60)), '00', 'alpha beta ') || 'the end is about cats'), "
+                                "(2, replace(hex(zeroblob(60)), '00', 'alpha beta ') || 'the end is about ships');") != 0) goto fail;
+
+    // truncation only sees the shared beginning
+    int value = 0;
+    if (select_single_int(env, db, "SELECT llm_embed_generate((SELECT body FROM docs WHERE id = 1)) = llm_embed_generate((SELECT body FROM docs WHERE id = 2));", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected identical truncated embeddings\n");
+        goto fail;
+    }
+
+    // windows cover the whole text
+    if (select_single_int(env, db, "SELECT llm_embed_generate((SELECT body FROM docs WHERE id = 1), 'long_input=window') = llm_embed_generate((SELECT body FROM docs WHERE id = 2), 'long_input=window');", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected different windowed embeddings\n");
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT length(llm_embed_generate((SELECT body FROM docs WHERE id = 1), 'long_input=window,window_overlap=16')) = llm_model_n_embd() * 4;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected a full size windowed embedding\n");
+        goto fail;
+    }
+
+    // the batched path produces the same vectors as the scalar one
+    if (select_single_int(env, db, "SELECT count(*) FROM llm_embed_each('SELECT id, body FROM docs', 'long_input=window') e JOIN docs d ON d.id = e.id "
+                                   "WHERE e.embedding = llm_embed_generate(d.body, 'long_input=window');", &value) != 0) goto fail;
+    if (value != 2) {
+        fprintf(stderr, "Expected 2 matching windowed embeddings, got %d\n", value);
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_embed_long_input", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+static int test_llm_embed_workers(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32,n_seq_max=4');") != 0) goto fail;
+
+    // enough rows (with a NULL one) for several groups in flight
+    if (exec_expect_ok(env, db, "CREATE TABLE docs(id INTEGER PRIMARY KEY, body TEXT);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 40) "
+                                "INSERT INTO docs(id, body) SELECT i, 'document number ' || i || ' is about topic ' || (i % 7) FROM n;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "UPDATE docs SET body = NULL WHERE id = 17;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE TABLE serial AS SELECT id, embedding FROM llm_embed_each('SELECT id, body FROM docs ORDER BY id');") != 0) goto fail;
+
+    // workers return the same rows in the same order
+    if (exec_expect_ok(env, db, "CREATE TABLE parallel AS SELECT rowid AS position, id, embedding FROM llm_embed_each('SELECT id, body FROM docs ORDER BY id', 'embedding_workers=3');") != 0) goto fail;
+    int value = 0;
+    if (select_single_int(env, db, "SELECT count(*) FROM parallel p JOIN serial s ON s.id = p.id WHERE p.id = p.position + 1 AND p.embedding IS s.embedding;", &value) != 0) goto fail;
+    if (value != 40) {
+        fprintf(stderr, "Expected 40 matching embeddings, got %d\n", value);
+        goto fail;
+    }
+
+    // a single worker decodes while the cursor reads the next rows
+    if (select_single_int(env, db, "SELECT count(*) FROM llm_embed_each('SELECT id, body FROM docs ORDER BY id', 'embedding_workers=1') p JOIN serial s ON s.id = p.id WHERE p.embedding IS s.embedding;", &value) != 0) goto fail;
+    if (value != 40) {
+        fprintf(stderr, "Expected 40 matching embeddings from a single worker, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM llm_embed_generate_batch(json_array('a', 'b', 'c'), 'embedding_workers=2') WHERE embedding = llm_embed_generate(json_extract(json_array('a', 'b', 'c'), '$[' || id || ']'));", &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 matching batch embeddings, got %d\n", value);
+        goto fail;
+    }
+
+    // statement interrupted while groups are still in flight
+    if (select_single_int(env, db, "SELECT count(*) FROM (SELECT id FROM llm_embed_each('SELECT id, body FROM docs', 'embedding_workers=2') LIMIT 3);", &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 rows, got %d\n", value);
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_embed_workers", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+static int test_llm_job_queue(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    if (exec_expect_error(env, db, "SELECT llm_job_submit('translate', 'hello');", "Unknown job kind") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT llm_job_submit('embed', 'hello');", "No model loaded") != 0) goto fail;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32,job_threads=2');") != 0) goto fail;
+
+    // submission returns at once, results are polled
+    if (exec_expect_ok(env, db, "CREATE TABLE submitted AS SELECT value AS input, llm_job_submit('embed', value) AS job FROM json_each('[\"first job\", \"second job\", \"third job\"]');") != 0) goto fail;
+    int value = 0;
+    for (int i = 0; i < 3000; ++i) {
+        if (select_single_int(env, db, "SELECT count(*) FROM submitted WHERE llm_job_result(job) IS NOT NULL;", &value) != 0) goto fail;
+        if (value == 3) break;
+        sqlite3_sleep(10);
+    }
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 finished jobs, got %d\n", value);
+        goto fail;
+    }
+
+    // results match the synchronous function and land in ai_jobs
+    if (select_single_int(env, db, "SELECT count(*) FROM submitted s JOIN ai_jobs j ON j.id = s.job WHERE j.status = 'done' AND j.result = llm_embed_generate(s.input) AND llm_job_result(s.job) = j.result;", &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 matching job results, got %d\n", value);
+        goto fail;
+    }
+    if (exec_expect_error(env, db, "SELECT llm_job_result(12345);", "not found") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT llm_job_submit('generate', 'hello', 'prefix=intro');", "registered prefixes") != 0) goto fail;
+
+    // results are not written inside a transaction: a job rolled back with its submission is forgotten
+    int job = 0;
+    if (exec_expect_ok(env, db, "BEGIN;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT llm_job_submit('embed', 'rolled back job');", &job) != 0) goto fail;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_job_result(%d) IS NOT NULL;", job);
+    for (int i = 0; i < 3000; ++i) {
+        if (select_single_int(env, db, sqlbuf, &value) != 0) goto fail;
+        if (value == 1) break;
+        sqlite3_sleep(10);
+    }
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT count(*) FROM ai_jobs WHERE id = %d AND status = 'queued';", job);
+    if (select_single_int(env, db, sqlbuf, &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected the job result not to be written inside the transaction\n");
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "ROLLBACK;") != 0) goto fail;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_job_result(%d);", job);
+    if (exec_expect_error(env, db, sqlbuf, "not found") != 0) goto fail;
+
+    // closing the connection waits for the running jobs
+    if (exec_expect_ok(env, db, "SELECT llm_job_submit('embed', 'left behind');") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_job_queue", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+static int test_llm_job_file(const test_env *env) {
+    const char *path = "llm_job_file_test.db";
+    remove(path);
+
+    sqlite3 *db = NULL;
+    sqlite3 *other = NULL;
+    if (open_path_and_load(env, path, &db) != SQLITE_OK) return 1;
+    if (open_path_and_load(env, path, &other) != SQLITE_OK) goto fail;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32');") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE TABLE log(x);") != 0) goto fail;
+
+    // workers don't write to the database, so the writes of the application never get SQLITE_BUSY while jobs run
+    if (exec_expect_ok(env, db, "CREATE TABLE submitted AS SELECT value AS input, llm_job_submit('embed', value) AS job FROM json_each('[\"first job\", \"second job\", \"third job\"]');") != 0) goto fail;
+    int value = 0;
+    for (int i = 0; i < 3000; ++i) {
+        if (exec_expect_ok(env, other, "INSERT INTO log VALUES (1);") != 0) goto fail;
+        if (select_single_int(env, db, "SELECT count(*) FROM submitted WHERE llm_job_result(job) IS NOT NULL;", &value) != 0) goto fail;
+        if (value == 3) break;
+        sqlite3_sleep(10);
+    }
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 finished jobs, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, other, "SELECT count(*) FROM ai_jobs WHERE status = 'done';", &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "Expected 3 jobs done in ai_jobs, got %d\n", value);
+        goto fail;
+    }
+
+    // closing the connection stores the finished jobs and cancels the queued ones
+    if (exec_expect_ok(env, db, "SELECT llm_job_submit('embed', 'left behind ' || value) FROM json_each('[1, 2, 3, 4, 5, 6, 7, 8]');") != 0) goto fail;
+    sqlite3_close(db);
+    db = NULL;
+    if (select_single_int(env, other, "SELECT count(*) FROM ai_jobs WHERE status IN ('queued', 'running');", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected no job left queued after close, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, other, "SELECT count(*) FROM ai_jobs WHERE (status = 'done' AND result IS NOT NULL) OR (status = 'cancelled' AND error IS NOT NULL);", &value) != 0) goto fail;
+    if (value != 11) {
+        fprintf(stderr, "Expected 11 finished or cancelled jobs, got %d\n", value);
+        goto fail;
+    }
+
+    sqlite3_close(other);
+    remove(path);
+    return assert_sqlite_memory_clean("llm_job_file", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    if (other) sqlite3_close(other);
+    remove(path);
+    return 1;
+}
+
+static int test_ai_embed_column(const test_env *env) {
+    const char *path = "ai_embed_column_test.db";
+    remove(path);
+
+    sqlite3 *db = NULL;
+    sqlite3 *db2 = NULL;
+    if (open_path_and_load(env, path, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32');") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "CREATE TABLE docs(id INTEGER PRIMARY KEY, body TEXT, embedding BLOB);") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT ai_embed_column('docs', 'body', 'missing');", "missing") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO docs(id, body) VALUES (1, 'existing row'), (2, 'another existing row'), (3, NULL);") != 0) goto fail;
+
+    // existing rows without an embedding are queued by the registration
+    int value = 0;
+    if (select_single_int(env, db, "SELECT ai_embed_column('docs', 'body', 'embedding');", &value) != 0) goto fail;
+    if (value != 2) {
+        fprintf(stderr, "Expected 2 backfilled rows, got %d\n", value);
+        goto fail;
+    }
+
+    // a second connection registers the same column, the two workers claim different batches
+    if (open_path_and_load(env, path, &db2) != SQLITE_OK) goto fail;
+    if (exec_expect_ok(env, db2, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db2, "SELECT llm_context_create_embedding('embedding_type=FLOAT32');") != 0) goto fail;
+    if (exec_expect_ok(env, db2, "SELECT ai_embed_column('docs', 'body', 'embedding');") != 0) goto fail;
+
+    // application writes only queue rowids
+    if (exec_expect_ok(env, db, "INSERT INTO docs(id, body) VALUES (4, 'new row'), (5, 'another new row');") != 0) goto fail;
+    if (exec_expect_ok(env, db, "UPDATE docs SET body = 'changed row' WHERE id = 1;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "WITH RECURSIVE n(i) AS (SELECT 10 UNION ALL SELECT i + 1 FROM n WHERE i < 49) "
+                                "INSERT INTO docs(id, body) SELECT i, 'bulk row ' || i FROM n;") != 0) goto fail;
+
+    for (int i = 0; i < 3000; ++i) {
+        if (select_single_int(env, db, "SELECT (SELECT count(*) FROM ai_embed_queue) + (SELECT count(*) FROM docs WHERE body IS NOT NULL AND embedding IS NULL);", &value) != 0) goto fail;
+        if (value == 0) break;
+        sqlite3_sleep(10);
+    }
+    if (value != 0) {
+        fprintf(stderr, "Expected an empty embedding queue, %d rows pending\n", value);
+        goto fail;
+    }
+
+    if (select_single_int(env, db, "SELECT count(*) FROM docs WHERE embedding = llm_embed_generate(body);", &value) != 0) goto fail;
+    if (value != 44) {
+        fprintf(stderr, "Expected 44 up to date embeddings, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM ai_embed_columns WHERE tbl = 'docs' AND vec_col = 'embedding' AND error IS NULL;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected a registered column without errors\n");
+        goto fail;
+    }
+
+    sqlite3_close(db2);
+    sqlite3_close(db);
+    remove(path);
+    return assert_sqlite_memory_clean("ai_embed_column", env);
+
+fail:
+    if (db2) sqlite3_close(db2);
+    if (db) sqlite3_close(db);
+    remove(path);
+    return 1;
+}
+
+static int test_llm_embed_chunks(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+
+    // late chunking needs the token embeddings
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32');") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_embed_chunks('some text', 8, 2);", "pooling_type=token") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32,pooling_type=token');") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_embed_chunks('some text', 8, 8);", "overlap") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "CREATE TABLE doc(body TEXT);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO doc(body) VALUES ('The quick brown fox jumps over the lazy dog. The dog sleeps all day long while the fox runs in the woods looking for food.');") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE TABLE chunks AS SELECT c.* FROM doc, llm_embed_chunks(doc.body, 8, 2) c;") != 0) goto fail;
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT count(*) > 1 AND count(*) = count(DISTINCT embedding) FROM chunks;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected several distinct chunk embeddings\n");
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM chunks WHERE length(embedding) != llm_model_n_embd() * 4 OR n_tokens < 1 OR n_tokens > 8 OR start_offset >= end_offset;", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected valid chunks, got %d invalid rows\n", value);
+        goto fail;
+    }
+
+    // chunks cover the text from the first to the last byte
+    if (select_single_int(env, db, "SELECT min(start_offset) = 0 AND max(end_offset) = (SELECT length(CAST(body AS BLOB)) FROM doc) FROM chunks;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected chunks covering the whole text\n");
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_embed_chunks", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+#ifndef SQLITEAI_LOAD_FROM_SOURCES
+static int vector_kernel_sum_close(const char *backend, const char *what, int n, float expected, float actual, float magnitude) {
+    // SIMD reductions use several accumulators, so the summation order (not the result) differs from scalar
+    float tolerance = 1e-5f * magnitude + 1e-6f;
+    if (fabsf(expected - actual) <= tolerance) return 0;
+    fprintf(stderr, "%s %s (n=%d): expected %.9g, got %.9g\n", backend, what, n, expected, actual);
+    return 1;
+}
+
+static int vector_kernels_compare(const vector_kernels *k, const float *a, const float *b, int n) {
+    const vector_kernels *s = &vector_kernels_scalar;
+    uint16_t h1[1100], h2[1100];
+    int8_t i1[1100], i2[1100];
+    uint8_t u1[1100], u2[1100];
+    float f1[1100], f2[1100];
+
+    float magnitude = 0.0f;
+    for (int i = 0; i < n; ++i) magnitude += fabsf(a[i]) * (fabsf(a[i]) + fabsf(b[i]));
+    if (vector_kernel_sum_close(k->name, "sumsq", n, s->f32_sumsq(a, n), k->f32_sumsq(a, n), magnitude)) return 1;
+    if (vector_kernel_sum_close(k->name, "dot", n, s->f32_dot(a, b, n), k->f32_dot(a, b, n), magnitude)) return 1;
+    magnitude = 0.0f;
+    for (int i = 0; i < n; ++i) magnitude += (a[i] - b[i]) * (a[i] - b[i]);
+    if (vector_kernel_sum_close(k->name, "l2sq", n, s->f32_l2sq(a, b, n), k->f32_l2sq(a, b, n), magnitude)) return 1;
+
+    // element-wise kernels must produce the same bits as the scalar reference, tail included
+    s->f32_scale(a, f1, n, 0.37f);
+    k->f32_scale(a, f2, n, 0.37f);
+    if (memcmp(f1, f2, n * sizeof(float)) != 0) goto mismatch_scale;
+    s->f32_to_f16(a, h1, n, 0.37f);
+    k->f32_to_f16(a, h2, n, 0.37f);
+    if (memcmp(h1, h2, n * sizeof(uint16_t)) != 0) goto mismatch_f16;
+    s->f16_to_f32(h1, f1, n);
+    k->f16_to_f32(h1, f2, n);
+    if (memcmp(f1, f2, n * sizeof(float)) != 0) goto mismatch_f16;
+    s->f32_to_bf16(a, h1, n, 0.37f);
+    k->f32_to_bf16(a, h2, n, 0.37f);
+    if (memcmp(h1, h2, n * sizeof(uint16_t)) != 0) goto mismatch_bf16;
+    s->bf16_to_f32(h1, f1, n);
+    k->bf16_to_f32(h1, f2, n);
+    if (memcmp(f1, f2, n * sizeof(float)) != 0) goto mismatch_bf16;
+
+    // the same parameters used by ai_vector_quantize, inputs go past [-1, 1] to exercise the clamp
+    s->f32_to_i8(a, i1, n, 1.0f, 127.0f, 0.0f, -127.0f, 127.0f);
+    k->f32_to_i8(a, i2, n, 1.0f, 127.0f, 0.0f, -127.0f, 127.0f);
+    s->f32_to_u8(a, u1, n, 1.0f, 127.0f, 128.0f, 1.0f, 255.0f);
+    k->f32_to_u8(a, u2, n, 1.0f, 127.0f, 128.0f, 1.0f, 255.0f);
+    for (int i = 0; i < n; ++i) {
+        // a compiler may contract x * mult + bias into an FMA in one build and not the other,
+        // which can move a value sitting exactly on a .5 boundary by one step
+        if (abs(i1[i] - i2[i]) > 1 || abs(u1[i] - u2[i]) > 1) goto mismatch_int8;
+    }
+    s->i8_to_f32(i1, f1, n, 1.0f / 127.0f, 0.0f);
+    k->i8_to_f32(i1, f2, n, 1.0f / 127.0f, 0.0f);
+    if (memcmp(f1, f2, n * sizeof(float)) != 0) goto mismatch_int8;
+    s->u8_to_f32(u1, f1, n, 1.0f / 127.0f, 128.0f);
+    k->u8_to_f32(u1, f2, n, 1.0f / 127.0f, 128.0f);
+    if (memcmp(f1, f2, n * sizeof(float)) != 0) goto mismatch_int8;
+    return 0;
+
+mismatch_scale:
+    fprintf(stderr, "%s f32_scale (n=%d) differs from scalar\n", k->name, n);
+    return 1;
+mismatch_f16:
+    fprintf(stderr, "%s f16 conversion (n=%d) differs from scalar\n", k->name, n);
+    return 1;
+mismatch_bf16:
+    fprintf(stderr, "%s bf16 conversion (n=%d) differs from scalar\n", k->name, n);
+    return 1;
+mismatch_int8:
+    fprintf(stderr, "%s int8/uint8 conversion (n=%d) differs from scalar\n", k->name, n);
+    return 1;
+}
+#endif
+
+static int test_vector_kernels_equivalence(const test_env *env) {
+#ifdef SQLITEAI_LOAD_FROM_SOURCES
+    (void)env;
+    return 0;
+#else
+    const vector_kernels *backends[4];
+    int nbackends = 0;
+    #if VECTOR_X86
+    if (vector_cpu_supports(&vector_kernels_avx2)) backends[nbackends++] = &vector_kernels_avx2;
+    if (vector_cpu_supports(&vector_kernels_avx512)) backends[nbackends++] = &vector_kernels_avx512;
+    #elif VECTOR_NEON
+    backends[nbackends++] = &vector_kernels_neon;
+    #endif
+    if (nbackends == 0) {
+        if (env->verbose) printf("no SIMD backend available on this CPU\n");
+        return 0;
+    }
+
+    // deterministic values in [-1.5, 1.5], with a few special cases up front
+    float a[1100], b[1100];
+    uint32_t seed = 0x9e3779b9u;
+    for (int i = 0; i < 1100; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        a[i] = ((float)(seed >> 8) / (float)(1u << 24)) * 3.0f - 1.5f;
+        seed = seed * 1664525u + 1013904223u;
+        b[i] = ((float)(seed >> 8) / (float)(1u << 24)) * 3.0f - 1.5f;
+    }
+    a[0] = 0.0f; a[1] = -0.0f; a[2] = 1.0f; a[3] = -1.0f; a[4] = 65504.0f; a[5] = 1e-8f;
+
+    // every length up to several vector widths (so each tail size 0..15 is covered) plus long vectors
+    static const int long_lengths[] = {255, 256, 257, 1000, 1023, 1024, 1100};
+    for (int k = 0; k < nbackends; ++k) {
+        for (int n = 0; n <= 70; ++n) {
+            if (vector_kernels_compare(backends[k], a, b, n) != 0) return 1;
+            // misaligned start, the kernels must not assume aligned input
+            if (n > 0 && vector_kernels_compare(backends[k], a + 1, b + 3, n - 1) != 0) return 1;
+        }
+        for (size_t i = 0; i < sizeof(long_lengths) / sizeof(long_lengths[0]); ++i) {
+            if (vector_kernels_compare(backends[k], a, b, long_lengths[i]) != 0) return 1;
+        }
+        if (env->verbose) printf("%s kernels match scalar\n", backends[k]->name);
+    }
+
+    // BLOBs have no alignment guarantee: misaligned operands must give the same distance as aligned ones
+    vector_init();
+    static const vector_type types[] = {VECTOR_TYPE_F32, VECTOR_TYPE_F16, VECTOR_TYPE_BF16, VECTOR_TYPE_I8};
+    static float aligned_storage[1100];
+    static uint8_t unaligned[1100 * sizeof(float) + 1];
+    uint8_t *aligned = (uint8_t *)aligned_storage;
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); ++t) {
+        size_t bytes = 0;
+        switch (types[t]) {
+            case VECTOR_TYPE_F32: memcpy(aligned, b, sizeof(b)); bytes = sizeof(b); break;
+            case VECTOR_TYPE_F16: vector_f32_to_f16(b, (uint16_t *)aligned, 1100, 1.0f); bytes = 1100 * sizeof(uint16_t); break;
+            case VECTOR_TYPE_BF16: vector_f32_to_bf16(b, (uint16_t *)aligned, 1100, 1.0f); bytes = 1100 * sizeof(uint16_t); break;
+            default: vector_f32_to_i8(b, (int8_t *)aligned, 1100, 1.0f, 127.0f, 0.0f, -127.0f, 127.0f); bytes = 1100; break;
+        }
+        memcpy(unaligned + 1, aligned, bytes);
+        for (vector_metric metric = VECTOR_METRIC_COSINE; metric <= VECTOR_METRIC_L2; ++metric) {
+            float expected = vector_distance(a, VECTOR_TYPE_F32, aligned, types[t], 1037, metric);
+            float actual = vector_distance(a, VECTOR_TYPE_F32, unaligned + 1, types[t], 1037, metric);
+            if (expected != actual) {
+                fprintf(stderr, "misaligned %d vector (metric %d): expected %.9g, got %.9g\n", (int)types[t], (int)metric, expected, actual);
+                return 1;
+            }
+        }
+    }
+    return 0;
+#endif
+}
+
+static int test_ai_vector_distance(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    // [1, 2] and [3, 4] as FLOAT32 little endian
+    int value = 0;
+    if (select_single_int(env, db, "SELECT ai_vector_distance(X'0000803F00000040', X'0000404000008040', 'dot');", &value) != 0) goto fail;
+    if (value != -11) {
+        fprintf(stderr, "Expected a dot distance of -11, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT round(ai_vector_distance(X'0000803F00000040', X'0000404000008040', 'l2') * 1000);", &value) != 0) goto fail;
+    if (value != 2828) {
+        fprintf(stderr, "Expected a l2 distance of 2.828, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT round(ai_vector_distance(X'0000803F00000000', X'000000000000803F') * 1000);", &value) != 0) goto fail;
+    if (value != 1000) {
+        fprintf(stderr, "Expected a cosine distance of 1 for orthogonal vectors, got %d\n", value);
+        goto fail;
+    }
+
+    // asymmetric scoring: FLOAT32 [1, 0] against INT8 [127, 0] and UINT8 [255, 128]
+    if (select_single_int(env, db, "SELECT round(ai_vector_distance(X'0000803F00000000', X'7F00', 'l2', 'INT8') * 1000);", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected a l2 distance of 0 against INT8, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT round(ai_vector_distance(X'FF80', X'0000803F00000000', 'l2', 'UINT8') * 1000);", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected a l2 distance of 0 against UINT8, got %d\n", value);
+        goto fail;
+    }
+
+    // long vectors exercise the SIMD paths and the block conversion
+    if (select_single_int(env, db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 1000) "
+                                   "SELECT ai_vector_distance(v, v, 'dot', 'UINT8') FROM (SELECT unhex(group_concat('FF', '')) AS v FROM n);", &value) != 0) goto fail;
+    if (value != -1000) {
+        fprintf(stderr, "Expected a dot distance of -1000, got %d\n", value);
+        goto fail;
+    }
+
+    if (select_single_int(env, db, "SELECT ai_vector_distance(NULL, X'00') IS NULL;", &value) != 0 || value != 1) goto fail;
+    if (exec_expect_error(env, db, "SELECT ai_vector_distance(X'0000803F', X'0000803F00000000');", "not compatible") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT ai_vector_distance(X'0000803F', X'0000803F', 'manhattan');", "Invalid distance") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT ai_vector_distance(X'00', X'00', 'l2', 'INT4');", "Invalid vector type") != 0) goto fail;
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("ai_vector_distance", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+static int test_ai_vector_topk(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    // 3-dimensional INT8 vectors (and a NULL one, skipped by the scan)
+    if (exec_expect_ok(env, db, "CREATE TABLE vecs(id INTEGER PRIMARY KEY, v BLOB);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 20000) "
+                                "INSERT INTO vecs(id, v) SELECT i, unhex(printf('%02X%02X%02X', i % 251, (i * 7) % 253, (i * 13) % 127)) FROM n;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO vecs(id, v) VALUES (20001, NULL);") != 0) goto fail;
+
+    // FLOAT32 query [1, 0, 0] scored against the INT8 rows, compared with a full sort
+    char expected[512], actual[512];
+    if (exec_query_text(env, db, "SELECT group_concat(id) FROM (SELECT id FROM vecs WHERE v IS NOT NULL "
+                                 "ORDER BY ai_vector_distance(X'0000803F0000000000000000', v, 'l2', 'INT8'), id LIMIT 25);", expected, sizeof(expected)) != 0) goto fail;
+    const char *threads[] = {"threads=1", "threads=4"};
+    for (int i = 0; i < 2; ++i) {
+        char sql[512];
+        snprintf(sql, sizeof(sql), "SELECT group_concat(id) FROM ai_vector_topk('vecs', 'v', X'0000803F0000000000000000', 25, 'distance=l2,embedding_type=INT8,%s');", threads[i]);
+        if (exec_query_text(env, db, sql, actual, sizeof(actual)) != 0) goto fail;
+        if (strcmp(expected, actual) != 0) {
+            fprintf(stderr, "ai_vector_topk (%s) returned %s, expected %s\n", threads[i], actual, expected);
+            goto fail;
+        }
+    }
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT count(*) FROM ai_vector_topk('vecs', 'v', X'7F0000', 100000, 'distance=cosine,embedding_type=INT8');", &value) != 0) goto fail;
+    if (value != 20000) {
+        fprintf(stderr, "Expected 20000 rows from ai_vector_topk, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT (SELECT distance FROM ai_vector_topk('vecs', 'v', X'7F0000', 1, 'embedding_type=INT8')) = "
+                                   "(SELECT min(ai_vector_distance(X'7F0000', v, 'cosine', 'INT8')) FROM vecs);", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected the nearest vector in ai_vector_topk results\n");
+        goto fail;
+    }
+
+    if (exec_expect_error(env, db, "SELECT * FROM ai_vector_topk('vecs', 'v', X'7F00', 10, 'embedding_type=INT8');", "not compatible") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM ai_vector_topk('vecs', 'v', X'7F0000', 0, 'embedding_type=INT8');", "k must be") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM ai_vector_topk('missing', 'v', X'7F0000', 10);", "no such table") != 0) goto fail;
+
+    // tables of an attached database are read with the schema option (the scan and the BLOB reads use the same schema)
+    if (exec_expect_ok(env, db, "ATTACH DATABASE ':memory:' AS aux;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE TABLE aux.vecs(id INTEGER PRIMARY KEY, v BLOB);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO aux.vecs(id, v) VALUES (1, X'7F0000'), (2, X'007F00');") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT group_concat(id) = '2,1' FROM ai_vector_topk('vecs', 'v', X'007F00', 5, 'embedding_type=INT8,schema=aux,threads=4');", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected the rows of aux.vecs from ai_vector_topk\n");
+        goto fail;
+    }
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("ai_vector_topk", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+static void hnsw_test_vector(uint64_t seed, int8_t *v, int n) {
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (int i = 0; i < n; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        v[i] = (int8_t)((int)(x % 255) - 127);
+    }
+}
+
+// sum over queries of the HNSW results that are within the exact k-th distance
+static int hnsw_test_recall(sqlite3 *db, const char *table, int nqueries, int k, int *found) {
+    char sql[1024];
+    snprintf(sql, sizeof(sql), "SELECT count(*) FROM \"%s\" WHERE embedding MATCH ?1 AND k = %d AND distance <= "
+                               "(SELECT max(distance) FROM ai_vector_topk('%s_nodes', 'vector', ?1, %d, 'distance=l2,embedding_type=INT8'));", table, k, table, k);
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare recall query: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    *found = 0;
+    for (int q = 0; q < nqueries; ++q) {
+        int8_t query[16];
+        hnsw_test_vector(1000000 + q, query, 16);
+        sqlite3_bind_blob(stmt, 1, query, sizeof(query), SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            fprintf(stderr, "Recall query failed: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return 1;
+        }
+        *found += sqlite3_column_int(stmt, 0);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static int test_ai_hnsw(const test_env *env) {
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    if (exec_expect_error(env, db, "CREATE VIRTUAL TABLE bad USING ai_hnsw(embedding_type=INT8);", "requires a dimension") != 0) goto fail;
+    if (exec_expect_error(env, db, "CREATE VIRTUAL TABLE bad USING ai_hnsw(dimension=16, bogus=1);", "invalid option") != 0) goto fail;
+    if (exec_expect_error(env, db, "CREATE VIRTUAL TABLE bad USING ai_hnsw(dimension=sixteen);", "invalid option") != 0) goto fail;
+    if (exec_expect_error(env, db, "CREATE VIRTUAL TABLE bad USING ai_hnsw(dimension=16, m);", "invalid option") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE VIRTUAL TABLE idx USING ai_hnsw(dimension=16, embedding_type=INT8, distance=l2, m=8, ef_construction=64, ef_search=64);") != 0) goto fail;
+
+    // 3000 random 16-dimensional INT8 vectors
+    if (exec_expect_ok(env, db, "BEGIN;") != 0) goto fail;
+    if (sqlite3_prepare_v2(db, "INSERT INTO idx(rowid, embedding) VALUES (?1, ?2);", -1, &stmt, NULL) != SQLITE_OK) goto fail;
+    for (int i = 1; i <= 3000; ++i) {
+        int8_t v[16];
+        hnsw_test_vector(i, v, 16);
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_blob(stmt, 2, v, sizeof(v), SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "ai_hnsw insert failed: %s\n", sqlite3_errmsg(db));
+            goto fail;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (exec_expect_ok(env, db, "COMMIT;") != 0) goto fail;
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT count(*) FROM idx;", &value) != 0) goto fail;
+    if (value != 3000) {
+        fprintf(stderr, "Expected 3000 rows in ai_hnsw, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM idx WHERE embedding MATCH (SELECT vector FROM idx_nodes WHERE id = 42) AND k = 25;", &value) != 0) goto fail;
+    if (value != 25) {
+        fprintf(stderr, "Expected 25 rows from ai_hnsw, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT rowid FROM idx WHERE embedding MATCH (SELECT embedding FROM idx WHERE rowid = 42) AND k = 1;", &value) != 0) goto fail;
+    if (value != 42) {
+        fprintf(stderr, "Expected rowid 42 as nearest to itself, got %d\n", value);
+        goto fail;
+    }
+
+    // recall@10 against the exact search
+    int found = 0;
+    if (hnsw_test_recall(db, "idx", 20, 10, &found) != 0) goto fail;
+    if (found < 190) {
+        fprintf(stderr, "ai_hnsw recall too low: %d/200\n", found);
+        goto fail;
+    }
+
+    // deleted nodes are never returned and the graph stays connected
+    if (exec_expect_ok(env, db, "DELETE FROM idx WHERE rowid % 3 = 0;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM idx;", &value) != 0) goto fail;
+    if (value != 2000) {
+        fprintf(stderr, "Expected 2000 rows after delete, got %d\n", value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM idx WHERE embedding MATCH (SELECT embedding FROM idx WHERE rowid = 1) AND k = 100 AND rowid % 3 = 0;", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Deleted rows returned by ai_hnsw\n");
+        goto fail;
+    }
+    if (hnsw_test_recall(db, "idx", 20, 10, &found) != 0) goto fail;
+    if (found < 190) {
+        fprintf(stderr, "ai_hnsw recall after delete too low: %d/200\n", found);
+        goto fail;
+    }
+
+    // no neighbor list keeps a link to a deleted node (the blob is the count of each level followed by the ids),
+    // and the refs table holds exactly one row for each distinct link
+    int nrefs = 0;
+    if (sqlite3_prepare_v2(db, "SELECT level, neighbors FROM idx_nodes;", -1, &stmt, NULL) != SQLITE_OK) goto fail;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int levels = sqlite3_column_int(stmt, 0) + 1;
+        const unsigned char *blob = (const unsigned char *)sqlite3_column_blob(stmt, 1);
+        int bytes = sqlite3_column_bytes(stmt, 1);
+        int total = 0;
+        for (int l = 0; l < levels; ++l) {
+            int32_t count;
+            memcpy(&count, blob + l * sizeof(int32_t), sizeof(int32_t));
+            total += count;
+        }
+        if (bytes != (int)(levels * sizeof(int32_t) + total * sizeof(sqlite3_int64))) {
+            fprintf(stderr, "Malformed ai_hnsw neighbors blob\n");
+            goto fail;
+        }
+        for (int i = 0; i < total; ++i) {
+            sqlite3_int64 link;
+            memcpy(&link, blob + levels * sizeof(int32_t) + i * sizeof(sqlite3_int64), sizeof(link));
+            if (link % 3 == 0) {
+                fprintf(stderr, "ai_hnsw kept a link to deleted node %lld\n", (long long)link);
+                goto fail;
+            }
+            bool duplicated = false;
+            for (int j = 0; j < i && !duplicated; ++j) {
+                sqlite3_int64 other;
+                memcpy(&other, blob + levels * sizeof(int32_t) + j * sizeof(sqlite3_int64), sizeof(other));
+                duplicated = (other == link);
+            }
+            if (!duplicated) nrefs++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (select_single_int(env, db, "SELECT count(*) FROM idx_refs;", &value) != 0) goto fail;
+    if (value != nrefs) {
+        fprintf(stderr, "Expected %d ai_hnsw reverse links, got %d\n", nrefs, value);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM idx_refs WHERE target % 3 = 0 OR source % 3 = 0;", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "ai_hnsw kept %d reverse links of deleted nodes\n", value);
+        goto fail;
+    }
+
+    // with no cache budget every node is evicted after each statement and loaded again from the nodes table
+    if (exec_expect_ok(env, db, "CREATE VIRTUAL TABLE idx0 USING ai_hnsw(dimension=16, embedding_type=INT8, distance=l2, m=8, ef_construction=64, ef_search=64, cache_size=0);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO idx0(rowid, embedding) SELECT id, vector FROM idx_nodes;") != 0) goto fail;
+    if (hnsw_test_recall(db, "idx0", 20, 10, &found) != 0) goto fail;
+    if (found < 190) {
+        fprintf(stderr, "ai_hnsw recall without cache too low: %d/200\n", found);
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "DROP TABLE idx0;") != 0) goto fail;
+
+    // rolled back inserts are discarded from the cached graph
+    if (exec_expect_ok(env, db, "BEGIN;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO idx(rowid, embedding) VALUES (99999, X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F');") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT rowid FROM idx WHERE embedding MATCH X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F' AND k = 1;", &value) != 0) goto fail;
+    if (value != 99999) {
+        fprintf(stderr, "Expected rowid 99999 inside the transaction, got %d\n", value);
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "ROLLBACK;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT rowid FROM idx WHERE embedding MATCH X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F' AND k = 1;", &value) != 0) goto fail;
+    if (value == 99999) {
+        fprintf(stderr, "Rolled back row returned by ai_hnsw\n");
+        goto fail;
+    }
+
+    // updates move the node
+    if (exec_expect_ok(env, db, "UPDATE idx SET embedding = X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F' WHERE rowid = 1;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT rowid FROM idx WHERE embedding MATCH X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F' AND k = 1;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected updated rowid 1, got %d\n", value);
+        goto fail;
+    }
+
+    if (exec_expect_error(env, db, "INSERT INTO idx(rowid, embedding) VALUES (5000, X'7F00');", "must be a BLOB") != 0) goto fail;
+    if (exec_expect_error(env, db, "INSERT INTO idx(rowid, embedding) VALUES (2, X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F');", "UNIQUE constraint") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM idx WHERE embedding MATCH X'7F00';", "not compatible") != 0) goto fail;
+
+    // the graph lives in the shadow tables, which follow the virtual table
+    if (exec_expect_ok(env, db, "ALTER TABLE idx RENAME TO idx2;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT rowid FROM idx2 WHERE embedding MATCH X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F' AND k = 1;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "Expected rowid 1 after rename, got %d\n", value);
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "DROP TABLE idx2;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM sqlite_master WHERE name LIKE 'idx%';", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected the ai_hnsw shadow tables to be dropped\n");
+        goto fail;
+    }
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("ai_hnsw", env);
+
+fail:
+    if (stmt) sqlite3_finalize(stmt);
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+// sum over queries of the IVF-PQ results that are within the exact k-th distance
+static int ivfpq_test_recall(sqlite3 *db, const char *table, int nqueries, int k, int *found) {
+    char sql[1024];
+    snprintf(sql, sizeof(sql), "SELECT count(*) FROM \"%s\" WHERE embedding MATCH ?1 AND k = %d AND distance <= "
+                               "(SELECT max(distance) FROM ai_vector_topk('%s_vectors', 'vector', ?1, %d, 'distance=l2,embedding_type=INT8'));", table, k, table, k);
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare recall query: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    *found = 0;
+    for (int q = 0; q < nqueries; ++q) {
+        int8_t query[16];
+        hnsw_test_vector(1000000 + q, query, 16);
+        sqlite3_bind_blob(stmt, 1, query, sizeof(query), SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            fprintf(stderr, "Recall query failed: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return 1;
+        }
+        *found += sqlite3_column_int(stmt, 0);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static int test_ai_ivfpq(const test_env *env) {
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    if (exec_expect_error(env, db, "CREATE VIRTUAL TABLE bad USING ai_ivfpq(dimension=16, subvectors=5);", "must divide") != 0) goto fail;
+    if (exec_expect_ok(env, db, "CREATE VIRTUAL TABLE idx USING ai_ivfpq(dimension=16, embedding_type=INT8, distance=l2, lists=16, subvectors=4, probes=8, rerank=4);") != 0) goto fail;
+
+    // training needs at least 256 vectors (one for each codeword)
+    if (exec_expect_ok(env, db, "INSERT INTO idx(rowid, embedding) VALUES (1, X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F');") != 0) goto fail;
+    if (exec_expect_error(env, db, "INSERT INTO idx(command) VALUES ('train');", "needs at least") != 0) goto fail;
+    if (exec_expect_error(env, db, "INSERT INTO idx(command) VALUES ('optimize');", "Unknown ai_ivfpq command") != 0) goto fail;
+    if (exec_expect_ok(env, db, "DELETE FROM idx;") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "BEGIN;") != 0) goto fail;
+    if (sqlite3_prepare_v2(db, "INSERT INTO idx(rowid, embedding) VALUES (?1, ?2);", -1, &stmt, NULL) != SQLITE_OK) goto fail;
+    for (int i = 1; i <= 3000; ++i) {
+        int8_t v[16];
+        hnsw_test_vector(i, v, 16);
+        sqlite3_bind_int(stmt, 1, i);
+        sqlite3_bind_blob(stmt, 2, v, sizeof(v), SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "ai_ivfpq insert failed: %s\n", sqlite3_errmsg(db));
+            goto fail;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+    if (exec_expect_ok(env, db, "COMMIT;") != 0) goto fail;
+
+    // until the index is trained queries are exact
+    int found = 0;
+    if (ivfpq_test_recall(db, "idx", 20, 10, &found) != 0) goto fail;
+    if (found != 200) {
+        fprintf(stderr, "ai_ivfpq exact search returned %d/200\n", found);
+        goto fail;
+    }
+
+    int value = 0;
+    if (exec_expect_ok(env, db, "INSERT INTO idx(command) VALUES ('train');") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM idx_codes WHERE length(code) = 4;", &value) != 0) goto fail;
+    if (value != 3000) {
+        fprintf(stderr, "Expected 3000 codes of 4 bytes, got %d\n", value);
+        goto fail;
+    }
+    if (ivfpq_test_recall(db, "idx", 20, 10, &found) != 0) goto fail;
+    if (found < 170) {
+        fprintf(stderr, "ai_ivfpq recall too low: %d/200\n", found);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM idx_vectors WHERE list IS NULL;", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected every vector assigned to a list, %d are not\n", value);
+        goto fail;
+    }
+
+    // a training sample smaller than the index is drawn uniformly from all the vectors
+    if (exec_expect_ok(env, db, "CREATE VIRTUAL TABLE idx_sampled USING ai_ivfpq(dimension=16, embedding_type=INT8, distance=l2, lists=16, subvectors=4, probes=8, rerank=4, train_size=600);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO idx_sampled(rowid, embedding) SELECT id, vector FROM idx_vectors;") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO idx_sampled(command) VALUES ('train');") != 0) goto fail;
+    if (ivfpq_test_recall(db, "idx_sampled", 20, 10, &found) != 0) goto fail;
+    if (found < 160) {
+        fprintf(stderr, "ai_ivfpq recall with a sampled training set too low: %d/200\n", found);
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "DROP TABLE idx_sampled;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM idx WHERE embedding MATCH (SELECT embedding FROM idx WHERE rowid = 42) AND k = 25;", &value) != 0) goto fail;
+    if (value != 25) {
+        fprintf(stderr, "Expected 25 rows from ai_ivfpq, got %d\n", value);
+        goto fail;
+    }
+
+    // vectors inserted after training are encoded with the trained codebooks
+    if (exec_expect_ok(env, db, "INSERT INTO idx(rowid, embedding) VALUES (5000, X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F');") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT rowid FROM idx WHERE embedding MATCH X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F' AND k = 1;", &value) != 0) goto fail;
+    if (value != 5000) {
+        fprintf(stderr, "Expected rowid 5000, got %d\n", value);
+        goto fail;
+    }
+    if (exec_expect_ok(env, db, "DELETE FROM idx WHERE rowid = 5000;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM idx WHERE embedding MATCH X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F' AND k = 100 AND rowid = 5000;", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Deleted row returned by ai_ivfpq\n");
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT count(*) FROM idx_codes;", &value) != 0) goto fail;
+    if (value != 3000) {
+        fprintf(stderr, "Expected 3000 codes after delete, got %d\n", value);
+        goto fail;
+    }
+
+    if (exec_expect_error(env, db, "INSERT INTO idx(rowid, embedding) VALUES (1, X'7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F7F');", "UNIQUE constraint") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM idx WHERE embedding MATCH X'7F00';", "not compatible") != 0) goto fail;
+    if (exec_expect_ok(env, db, "DROP TABLE idx;") != 0) goto fail;
+    if (select_single_int(env, db, "SELECT count(*) FROM sqlite_master WHERE name LIKE 'idx%';", &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "Expected the ai_ivfpq shadow tables to be dropped\n");
+        goto fail;
+    }
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("ai_ivfpq", env);
+
+fail:
+    if (stmt) sqlite3_finalize(stmt);
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+static int query_chat_response(const test_env *env, sqlite3 *db, const char *question, char *response, size_t response_len) {
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_respond('%s');", question);
+    return exec_query_text(env, db, sqlbuf, response, response_len);
+}
+
+static int test_chat_system_prompt_new_chat(const test_env *env) {
+    sqlite3 *db = NULL;
+    bool model_loaded = false;
+    bool context_created = false;
+    bool chat_created = false;
+    int status = 1;
+
+    if (open_db_and_load(env, &db) != SQLITE_OK) {
+        goto done;
+    }
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+    model_loaded = true;
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=1000');") != 0) goto done;
+    context_created = true;
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto done;
+    chat_created = true;
+
+    const char *system_prompt = "Always reply with lowercase answers.";
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", system_prompt);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+
+    bool is_null = false;
+    char buffer[4096];
+    if (query_system_prompt(env, db, buffer, sizeof(buffer), &is_null) != 0) goto done;
+    if (is_null || strcmp(buffer, system_prompt) != 0) {
+        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected '%s' but got: %s\n", system_prompt, buffer);
+        goto done;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_save();") != 0) goto done;
+
+    ai_chat_message_row rows[4];
+    int count = 0;
+    if (fetch_ai_chat_messages(env, db, rows, 4, &count) != 0) goto done;
+    if (count != 1) {
+        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected 1 message row, got %d\n", count);
+        goto done;
+    }
+    if (strcmp(rows[0].role, "system") != 0) {
+        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected system role, got %s\n", rows[0].role);
+        goto done;
+    }
+    if (strcmp(rows[0].content, system_prompt) != 0) {
+        fprintf(stderr, "[test_chat_system_prompt_new_chat] expected content '%s' but got '%s'\n", system_prompt, rows[0].content);
+        goto done;
+    }
+
+    status = 0;
+
+done:
+    if (chat_created) exec_expect_ok(env, db, "SELECT llm_chat_free();");
+    if (context_created) exec_expect_ok(env, db, "SELECT llm_context_free();");
+    if (model_loaded) exec_expect_ok(env, db, "SELECT llm_model_free();");
+    if (db) sqlite3_close(db);
+    if (status == 0) status = assert_sqlite_memory_clean("llm_context_size_errors", env);
+    return status;
+}
+
+static int test_chat_system_prompt_replace_previous_prompt(const test_env *env) {
+    sqlite3 *db = NULL;
+    bool model_loaded = false;
+    bool context_created = false;
+    bool chat_created = false;
+    int status = 1;
+
+    if (open_db_and_load(env, &db) != SQLITE_OK) {
+        goto done;
+    }
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+    model_loaded = true;
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=1000');") != 0) goto done;
+    context_created = true;
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto done;
+    chat_created = true;
+
+    const char *first_prompt = "Always confirm questions.";
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", first_prompt);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+
+    const char *replacement_prompt = "Always decline questions.";
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", replacement_prompt);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+
+    bool is_null = false;
+    char buffer[4096];
+    if (query_system_prompt(env, db, buffer, sizeof(buffer), &is_null) != 0) goto done;
+    if (is_null || strcmp(buffer, replacement_prompt) != 0) {
+        fprintf(stderr, "[test_chat_system_prompt_replace_previous_prompt] expected '%s' but got: %s\n", replacement_prompt, buffer);
+        goto done;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_save();") != 0) goto done;
+
+    ai_chat_message_row rows[4];
+    int count = 0;
+    if (fetch_ai_chat_messages(env, db, rows, 4, &count) != 0) goto done;
+    if (count != 1) {
+        fprintf(stderr, "[test_chat_system_prompt_replace_previous_prompt] expected 1 message row, got %d\n", count);
+        goto done;
+    }
+    if (strcmp(rows[0].content, replacement_prompt) != 0) {
+        fprintf(stderr, "[test_chat_system_prompt_replace_previous_prompt] expected '%s' but got '%s'\n", replacement_prompt, rows[0].content);
+        goto done;
+    }
+
+    status = 0;
+
+done:
+    if (chat_created) exec_expect_ok(env, db, "SELECT llm_chat_free();");
+    if (context_created) exec_expect_ok(env, db, "SELECT llm_context_free();");
+    if (model_loaded) exec_expect_ok(env, db, "SELECT llm_model_free();");
+    if (db) sqlite3_close(db);
+    if (status == 0) status = assert_sqlite_memory_clean("llm_context_size_errors", env);
+    return status;
+}
+
+static int test_chat_system_prompt_after_first_response(const test_env *env) {
+    sqlite3 *db = NULL;
+    bool model_loaded = false;
+    bool context_created = false;
+    bool chat_created = false;
+    int status = 1;
+
+    if (open_db_and_load(env, &db) != SQLITE_OK) {
+        goto done;
+    }
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+    model_loaded = true;
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=1000');") != 0) goto done;
+    context_created = true;
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto done;
+    chat_created = true;
+
+    const char *user_question = "Reply to this ping.";
+    char response[4096];
+    if (query_chat_response(env, db, user_question, response, sizeof(response)) != 0) goto done;
+    if (response[0] == '\0') {
+        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected model response for '%s'\n", user_question);
+        goto done;
+    }
+
+    const char *system_prompt = "Only answer with short confirmations.";
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_system_prompt('%s');", system_prompt);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto done;
+
+    bool is_null = false;
+    char buffer[4096];
+    if (query_system_prompt(env, db, buffer, sizeof(buffer), &is_null) != 0) goto done;
+    if (is_null || strcmp(buffer, system_prompt) != 0) {
+        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected '%s' but got: %s\n", system_prompt, buffer);
+        goto done;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_save();") != 0) goto done;
+
+    ai_chat_message_row rows[8];
+    int count = 0;
+    if (fetch_ai_chat_messages(env, db, rows, 8, &count) != 0) goto done;
+    if (count < 3) {
+        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected at least 3 rows, got %d\n", count);
+        goto done;
+    }
+    if (!(rows[0].id < rows[1].id && rows[1].id < rows[2].id)) {
+        fprintf(stderr, "[test_chat_system_prompt_after_first_response] expected ascending ids but found %d, %d, %d\n",
+                rows[0].id, rows[1].id, rows[2].id);
+        goto done;
+    }
+    if (strcmp(rows[0].role, "system") != 0 || strcmp(rows[0].content, system_prompt) != 0) {
+        fprintf(stderr, "[test_chat_system_prompt_after_first_response] system row mismatch (%s, %s)\n", rows[0].role, rows[0].content);
+        goto done;
     }
     if (strcmp(rows[1].role, "user") != 0 || strcmp(rows[1].content, user_question) != 0) {
         fprintf(stderr, "[test_chat_system_prompt_after_first_response] user row mismatch (%s, %s)\n", rows[1].role, rows[1].content);
@@ -1366,6 +2736,117 @@ fail:
     return 1;
 }
 
+// Test that llm_chat_save(..., 1) stores the KV state and llm_chat_restore continues from it
+static int test_chat_save_restore_kv_state(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=1000');") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_chat_respond('Hi');") != 0) goto fail;
+
+    char uuid[128] = {0};
+    if (exec_query_text(env, db, "SELECT llm_chat_save('State Chat', NULL, 1);", uuid, sizeof(uuid)) != 0) goto fail;
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT count(*) FROM ai_chat_state WHERE n_tokens > 0 AND length(state) > 0;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "[chat_save_restore_kv_state] expected 1 state snapshot, got %d\n", value);
+        goto fail;
+    }
+
+    // restore in a fresh chat and continue the conversation from the snapshot
+    if (exec_expect_ok(env, db, "SELECT llm_chat_free();") != 0) goto fail;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_restore('%s');", uuid);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_chat_respond('And now?');") != 0) goto fail;
+
+    // saving again without kv_state removes the stale snapshot
+    char uuid2[128] = {0};
+    if (exec_query_text(env, db, "SELECT llm_chat_save('State Chat');", uuid2, sizeof(uuid2)) != 0) goto fail;
+    if (strcmp(uuid, uuid2) != 0) {
+        fprintf(stderr, "[chat_save_restore_kv_state] restored chat saved with a new UUID (%s, %s)\n", uuid, uuid2);
+        goto fail;
+    }
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT count(*) FROM ai_chat_state s JOIN ai_chat_history h ON s.chat_id = h.id WHERE h.uuid = '%s';", uuid);
+    if (select_single_int(env, db, sqlbuf, &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "[chat_save_restore_kv_state] expected no state snapshot, got %d\n", value);
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("chat_save_restore_kv_state", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+// Test that chat sessions keep independent conversations and are decoded together
+static int test_chat_sessions_batch(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create('context_size=2048,n_seq_max=3,kv_unified=1,n_predict=32');") != 0) goto fail;
+
+    char uuid1[128] = {0};
+    char uuid2[128] = {0};
+    if (exec_query_text(env, db, "SELECT llm_chat_session_create('Be concise.');", uuid1, sizeof(uuid1)) != 0) goto fail;
+    if (exec_query_text(env, db, "SELECT llm_chat_session_create();", uuid2, sizeof(uuid2)) != 0) goto fail;
+
+    // sequence 0 is reserved, so n_seq_max=3 allows two sessions
+    if (exec_expect_error(env, db, "SELECT llm_chat_session_create();", "No free sequence") != 0) goto fail;
+
+    int value = 0;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT count(*) FROM llm_chat_session_respond_batch('{\"%s\": \"Hi\", \"%s\": \"Name a color.\"}') WHERE response IS NOT NULL;", uuid1, uuid2);
+    if (select_single_int(env, db, sqlbuf, &value) != 0) goto fail;
+    if (value != 2) {
+        fprintf(stderr, "[chat_sessions_batch] expected 2 responses, got %d\n", value);
+        goto fail;
+    }
+
+    // a prompt that does not fit fails the whole call, the session prepared before it is rolled back and keeps working
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT * FROM llm_chat_session_respond_batch(json_object('%s', 'Hi again', '%s', replace(hex(zeroblob(3000)), '00', 'word ')));", uuid1, uuid2);
+    if (exec_expect_error(env, db, sqlbuf, "Context size exceeded") != 0) goto fail;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_session_respond('%s', 'Hi again');", uuid1);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+
+    // second turn of a single session continues its own conversation
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_session_respond('%s', 'And another one?');", uuid2);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT * FROM llm_chat_session_respond_batch('{\"missing\": \"Hi\"}');", "not found") != 0) goto fail;
+
+    // a freed session releases its sequence
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_chat_session_free('%s');", uuid1);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_chat_session_create();") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "SELECT llm_chat_session_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("chat_sessions_batch", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
 // Test that llm_chat_system_prompt(NULL) clears the system prompt
 static int test_chat_system_prompt_clear(const test_env *env) {
     sqlite3 *db = NULL;
@@ -1570,6 +3051,291 @@ fail:
     return 1;
 }
 
+// Test that reusing the KV cache of the prompt prefix shared with the previous call does not change the output
+static int test_text_generate_prefix_reuse(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_textgen('context_size=2048,n_predict=16');") != 0) goto fail;
+
+    const char *first_sql = "SELECT llm_text_generate('Classify the sentiment of the following review as positive or negative. Review: I loved this movie.');";
+    const char *second_sql = "SELECT llm_text_generate('Classify the sentiment of the following review as positive or negative. Review: What a waste of time.');";
+
+    char first[4096] = {0};
+    char second[4096] = {0};
+    char again[4096] = {0};
+    if (exec_query_text(env, db, first_sql, first, sizeof(first)) != 0) goto fail;
+    if (exec_query_text(env, db, second_sql, second, sizeof(second)) != 0) goto fail;
+    if (exec_query_text(env, db, first_sql, again, sizeof(again)) != 0) goto fail;
+    if (strcmp(first, again) != 0) {
+        fprintf(stderr, "[text_generate_prefix_reuse] output changed when reusing the prefix:\n%s\n---\n%s\n", first, again);
+        goto fail;
+    }
+
+    // same prompt twice in a row (only the last prompt token is decoded again)
+    if (exec_query_text(env, db, first_sql, again, sizeof(again)) != 0) goto fail;
+    if (strcmp(first, again) != 0) {
+        fprintf(stderr, "[text_generate_prefix_reuse] output changed when repeating the prompt:\n%s\n---\n%s\n", first, again);
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("text_generate_prefix_reuse", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+// Test that a registered prefix produces the same output as the full prompt
+static int test_text_generate_named_prefix(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_textgen('context_size=2048,n_predict=16');") != 0) goto fail;
+
+    int n_tokens = 0;
+    if (select_single_int(env, db, "SELECT llm_prefix_register('sentiment', 'Classify the sentiment of the following review as positive or negative. Review: ');", &n_tokens) != 0) goto fail;
+    if (n_tokens <= 0) {
+        fprintf(stderr, "[text_generate_named_prefix] expected a positive token count, got %d\n", n_tokens);
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT llm_prefix_register('other', 'Translate the following sentence to French: ');", &n_tokens) != 0) goto fail;
+
+    char expected[4096] = {0};
+    char result[4096] = {0};
+    if (exec_query_text(env, db, "SELECT llm_text_generate('Classify the sentiment of the following review as positive or negative. Review: I loved this movie.');", expected, sizeof(expected)) != 0) goto fail;
+    if (exec_query_text(env, db, "SELECT llm_text_generate('Good morning.', 'prefix=other');", result, sizeof(result)) != 0) goto fail;
+    if (exec_query_text(env, db, "SELECT llm_text_generate('I loved this movie.', 'prefix=sentiment');", result, sizeof(result)) != 0) goto fail;
+    if (strcmp(expected, result) != 0) {
+        fprintf(stderr, "[text_generate_named_prefix] output differs from the full prompt:\n%s\n---\n%s\n", expected, result);
+        goto fail;
+    }
+
+    if (exec_expect_error(env, db, "SELECT llm_text_generate('Hello', 'prefix=missing');", "not found") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_prefix_free('sentiment');") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT llm_text_generate('I loved this movie.', 'prefix=sentiment');", "not found") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_prefix_free();") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("text_generate_named_prefix", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+// Test that speculative decoding with a draft model produces the same output of plain decoding
+static int test_text_generate_speculative(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+
+    // the draft model requires the main model
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_draft_model_load('%s');", model);
+    if (exec_expect_error(env, db, sqlbuf, "llm_model_load") != 0) goto fail;
+
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_draft_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_textgen('context_size=2048,n_predict=32');") != 0) goto fail;
+
+    char plain[4096] = {0};
+    char speculative[4096] = {0};
+    if (exec_query_text(env, db, "SELECT llm_text_generate('Write a short list of three fruits.', 'speculative=0');", plain, sizeof(plain)) != 0) goto fail;
+    if (exec_query_text(env, db, "SELECT llm_text_generate('Write a short list of three fruits.', 'speculative=4');", speculative, sizeof(speculative)) != 0) goto fail;
+    if (strcmp(plain, speculative) != 0) {
+        fprintf(stderr, "[text_generate_speculative] output changed with speculative decoding:\n%s\n---\n%s\n", plain, speculative);
+        goto fail;
+    }
+
+    // chat continues to work with speculative decoding enabled
+    if (exec_expect_ok(env, db, "SELECT llm_chat_create();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_chat_respond('Hi');") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_chat_respond('And now?');") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_chat_free();") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "SELECT llm_draft_model_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("text_generate_speculative", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+// Test that prompt lookup decoding produces the same output of plain decoding
+static int test_text_generate_lookup_decoding(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_textgen('context_size=2048,n_predict=48');") != 0) goto fail;
+
+    const char *prompt = "Repeat exactly the following sentence: the quick brown fox jumps over the lazy dog near the river bank.";
+    char plain[4096] = {0};
+    char lookup[4096] = {0};
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_text_generate('%s', 'lookup_decoding=0');", prompt);
+    if (exec_query_text(env, db, sqlbuf, plain, sizeof(plain)) != 0) goto fail;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_text_generate('%s', 'lookup_decoding=1');", prompt);
+    if (exec_query_text(env, db, sqlbuf, lookup, sizeof(lookup)) != 0) goto fail;
+    if (strcmp(plain, lookup) != 0) {
+        fprintf(stderr, "[text_generate_lookup_decoding] output changed with lookup decoding:\n%s\n---\n%s\n", plain, lookup);
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("text_generate_lookup_decoding", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+// Test that llm_score and llm_score_batch return consistent log-probabilities (batched continuations match the scalar function)
+static int test_llm_score(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[1024];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_textgen('context_size=2048,n_seq_max=4');") != 0) goto fail;
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT llm_score('The capital of France is', ' Paris') < 0;", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "[llm_score] expected a negative log-probability\n");
+        goto fail;
+    }
+    if (select_single_int(env, db, "SELECT llm_score('The capital of France is', ' Paris') = llm_score('The capital of France is', ' Paris');", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "[llm_score] expected the same score for the same input\n");
+        goto fail;
+    }
+
+    // more continuations than free sequences, one of them NULL
+    const char *batch = "FROM llm_score_batch('The capital of France is', json_array(' Paris', ' a large city on the Seine river', NULL, ' Rome', ' Paris, of course', ' not known'))";
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT count(*) %s WHERE logprob IS NOT NULL AND length(token_logprobs) = 4 * n_tokens AND abs(mean_logprob * n_tokens - logprob) < 1e-3;", batch);
+    if (select_single_int(env, db, sqlbuf, &value) != 0) goto fail;
+    if (value != 5) {
+        fprintf(stderr, "[llm_score] expected 5 scored continuations, got %d\n", value);
+        goto fail;
+    }
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT count(*) %s WHERE logprob IS NOT NULL AND abs(logprob - llm_score('The capital of France is', value)) > 0.05 * abs(logprob) + 0.01;", "FROM (SELECT s.logprob, j.value FROM llm_score_batch('The capital of France is', json_array(' Paris', ' a large city on the Seine river', NULL, ' Rome', ' Paris, of course', ' not known')) AS s JOIN json_each(json_array(' Paris', ' a large city on the Seine river', NULL, ' Rome', ' Paris, of course', ' not known')) AS j ON j.key = s.id)");
+    if (select_single_int(env, db, sqlbuf, &value) != 0) goto fail;
+    if (value != 0) {
+        fprintf(stderr, "[llm_score] %d batched scores differ from llm_score\n", value);
+        goto fail;
+    }
+
+    // perplexity of a text without prompt
+    if (select_single_int(env, db, "SELECT mean_logprob < 0 FROM llm_score_batch('', json_array('The quick brown fox jumps over the lazy dog.'));", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "[llm_score] expected a negative mean log-probability\n");
+        goto fail;
+    }
+
+    if (exec_expect_error(env, db, "SELECT * FROM llm_score_batch('prompt', 'not json');", "malformed JSON") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_score", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
+// Test that llm_classify returns one of the labels (single and multi-token labels), in a statement over many rows too
+static int test_llm_classify(const test_env *env) {
+    sqlite3 *db = NULL;
+    if (open_db_and_load(env, &db) != SQLITE_OK) return 1;
+
+    const char *model = env->model_path ? env->model_path : DEFAULT_MODEL_PATH;
+    char sqlbuf[512];
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_model_load('%s');", model);
+    if (exec_expect_ok(env, db, sqlbuf) != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_context_create_textgen('context_size=2048,n_seq_max=4');") != 0) goto fail;
+
+    int value = 0;
+    if (select_single_int(env, db, "SELECT llm_classify('Is the sky blue? Answer yes or no.', '[\"yes\", \"no\"]') IN ('yes', 'no');", &value) != 0) goto fail;
+    if (value != 1) {
+        fprintf(stderr, "[llm_classify] expected one of the labels\n");
+        goto fail;
+    }
+
+    // more multi-token labels than free sequences, so that several decodes are needed
+    const char *labels = "'[\"positive review\", \"negative review\", \"neutral review\", \"not a review at all\", \"spam\"]'";
+    char result[256] = {0};
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_classify('Classify this review: I loved this movie.', %s);", labels);
+    if (exec_query_text(env, db, sqlbuf, result, sizeof(result)) != 0) goto fail;
+    char again[256] = {0};
+    if (exec_query_text(env, db, sqlbuf, again, sizeof(again)) != 0) goto fail;
+    if (strcmp(result, again) != 0 || strstr(labels, result) == NULL) {
+        fprintf(stderr, "[llm_classify] unexpected or unstable label: %s / %s\n", result, again);
+        goto fail;
+    }
+
+    if (exec_expect_ok(env, db, "CREATE TABLE reviews(id INTEGER PRIMARY KEY, body TEXT);") != 0) goto fail;
+    if (exec_expect_ok(env, db, "INSERT INTO reviews(body) VALUES ('Great food.'), ('Terrible service.'), (NULL), ('It was fine.');") != 0) goto fail;
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT count(*) FROM (SELECT llm_classify('Classify this review: ' || body, %s) AS label FROM reviews) WHERE label IS NOT NULL;", labels);
+    if (select_single_int(env, db, sqlbuf, &value) != 0) goto fail;
+    if (value != 3) {
+        fprintf(stderr, "[llm_classify] expected 3 labels, got %d\n", value);
+        goto fail;
+    }
+
+    // text longer than the context is cut before the end of the template, which still asks for the answer
+    snprintf(sqlbuf, sizeof(sqlbuf), "SELECT llm_classify('Classify this review: ' || replace(hex(zeroblob(2000)), '00', 'great movie, ') || 'I loved it.', %s);", labels);
+    if (exec_query_text(env, db, sqlbuf, result, sizeof(result)) != 0) goto fail;
+    if (strstr(labels, result) == NULL) {
+        fprintf(stderr, "[llm_classify] unexpected label for a long text: %s\n", result);
+        goto fail;
+    }
+
+    if (exec_expect_error(env, db, "SELECT llm_classify('text', '[]');", "JSON array") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT llm_classify('text', '[1, 2]');", "JSON array") != 0) goto fail;
+    if (exec_expect_error(env, db, "SELECT llm_classify('text', '{\"a\": \"b\"}');", "JSON array") != 0) goto fail;
+
+    if (exec_expect_ok(env, db, "SELECT llm_context_free();") != 0) goto fail;
+    if (exec_expect_ok(env, db, "SELECT llm_model_free();") != 0) goto fail;
+    sqlite3_close(db);
+    return assert_sqlite_memory_clean("llm_classify", env);
+
+fail:
+    if (db) sqlite3_close(db);
+    return 1;
+}
+
 // ---------------------------------------------------------------------
 // Audio / Whisper tests
 // ---------------------------------------------------------------------
@@ -1932,12 +3698,30 @@ static const test_case TESTS[] = {
     {"dual_connection_roles", test_dual_connection_roles},
     {"concurrent_connections_independent", test_concurrent_connections_independent},
     {"llm_model_load_error_recovery", test_llm_model_load_error_recovery},
+    {"llm_model_shared", test_llm_model_shared},
+    {"llm_context_pool", test_llm_context_pool},
     {"ai_logging_table", test_ai_logging_table},
     {"llm_embed_input_too_large", test_llm_embed_input_too_large},
     {"llm_embed_nctx_exceeds_train", test_llm_embed_nctx_exceeds_train},
     {"llm_embed_max_tokens_limit", test_llm_embed_max_tokens_limit},
     {"llm_embed_repeated_calls", test_llm_embed_repeated_calls},
     {"llm_embed_empty_input", test_llm_embed_empty_input},
+    {"llm_embed_generate_batch", test_llm_embed_generate_batch},
+    {"llm_embed_each", test_llm_embed_each},
+    {"llm_rerank", test_llm_rerank},
+    {"llm_embed_cache", test_llm_embed_cache},
+    {"llm_embed_constant_args", test_llm_embed_constant_args},
+    {"llm_embed_long_input", test_llm_embed_long_input},
+    {"llm_embed_workers", test_llm_embed_workers},
+    {"llm_embed_chunks", test_llm_embed_chunks},
+    {"llm_job_queue", test_llm_job_queue},
+    {"llm_job_file", test_llm_job_file},
+    {"ai_embed_column", test_ai_embed_column},
+    {"vector_kernels_equivalence", test_vector_kernels_equivalence},
+    {"ai_vector_distance", test_ai_vector_distance},
+    {"ai_vector_topk", test_ai_vector_topk},
+    {"ai_hnsw", test_ai_hnsw},
+    {"ai_ivfpq", test_ai_ivfpq},
     {"chat_system_prompt_new_chat", test_chat_system_prompt_new_chat},
     {"chat_system_prompt_replace_previous_prompt", test_chat_system_prompt_replace_previous_prompt},
     {"chat_system_prompt_after_first_response", test_chat_system_prompt_after_first_response},
@@ -1945,12 +3729,20 @@ static const test_case TESTS[] = {
     {"chat_recreate_after_conversation", test_chat_recreate_after_conversation},
     {"chat_vtab_multi_turn", test_chat_vtab_multi_turn},
     {"chat_save_restore_roundtrip", test_chat_save_restore_roundtrip},
+    {"chat_save_restore_kv_state", test_chat_save_restore_kv_state},
+    {"chat_sessions_batch", test_chat_sessions_batch},
     {"chat_system_prompt_clear", test_chat_system_prompt_clear},
     {"text_generate_with_eog", test_text_generate_with_eog},
     {"chat_double_free", test_chat_double_free},
     {"chat_respond_auto_init", test_chat_respond_auto_init},
     {"chat_save_with_metadata", test_chat_save_with_metadata},
     {"text_generate_default_limit", test_text_generate_default_limit},
+    {"text_generate_prefix_reuse", test_text_generate_prefix_reuse},
+    {"text_generate_named_prefix", test_text_generate_named_prefix},
+    {"text_generate_speculative", test_text_generate_speculative},
+    {"text_generate_lookup_decoding", test_text_generate_lookup_decoding},
+    {"llm_classify", test_llm_classify},
+    {"llm_score", test_llm_score},
     {"llm_chat_double_save", test_llm_chat_double_save},
     // Audio / Whisper tests
     {"audio_transcribe_no_model", test_audio_transcribe_no_model},